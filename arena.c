@@ -0,0 +1,74 @@
+/**
+ * @file arena.c
+ *
+ * Implementation of the per-thread request arena.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK (256 * 1024) // the size of a thread's reusable chunk, room for a whole read
+
+// struct heading a chunk of arena memory
+typedef struct arena_chunk {
+  struct arena_chunk *next; // the chunk allocated before this one
+  size_t size;              // the usable bytes after the header
+  size_t used;              // the bytes handed out so far
+  char pad[8];              // keeps the data 16-byte aligned
+} arena_chunk_t;
+
+static __thread arena_chunk_t *arena = NULL; // the newest chunk, the base chunk last
+
+// Allocates a chunk with room for at least size bytes in front of next.
+static arena_chunk_t *arena_chunk(size_t size, arena_chunk_t *next) {
+  arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+  assert(chunk != NULL);
+
+  chunk->next = next;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+// Bumps the newest chunk, adding an overflow chunk when it is full.
+void *arena_alloc(size_t size) {
+  size = (size + 15) & ~(size_t) 15;
+
+  if (arena == NULL) {
+    arena = arena_chunk(ARENA_CHUNK, NULL);
+  }
+
+  if (arena->used + size > arena->size) {
+    arena = arena_chunk(size > ARENA_CHUNK ? size : ARENA_CHUNK, arena);
+  }
+
+  void *mem = (char *) (arena + 1) + arena->used;
+  arena->used += size;
+  return mem;
+}
+
+// Copies len characters of the string into the arena.
+char *arena_strndup(const char *str, size_t len) {
+  char *copy = arena_alloc(len + 1);
+  memcpy(copy, str, len);
+  copy[len] = 0;
+  return copy;
+}
+
+// Frees the overflow chunks and empties the base chunk.
+void arena_reset() {
+  if (arena == NULL) {
+    return;
+  }
+
+  while (arena->next != NULL) {
+    arena_chunk_t *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+
+  arena->used = 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file arena.h
+ *
+ * A per-thread bump allocator for temporaries that live until the end of
+ * the current FUSE request.
+ *
+ * Each thread keeps one chunk of memory that is reused for every request,
+ * so steady-state requests make no heap allocations; a request that
+ * outgrows the chunk gets overflow chunks, which are freed when the arena
+ * is reset.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Allocate memory from the calling thread's arena.
+ *
+ * @param size The number of bytes to allocate.
+ *
+ * @return The (16-byte aligned) memory, valid until the next arena_reset.
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * Copy part of a string into the calling thread's arena.
+ *
+ * @param str The string to copy.
+ * @param len The number of characters to copy.
+ *
+ * @return The NUL-terminated copy, valid until the next arena_reset.
+ */
+char *arena_strndup(const char *str, size_t len);
+
+/**
+ * Release everything allocated from the calling thread's arena.
+ * nufs_ll calls this at the end of each of its requests.
+ */
+void arena_reset();
+
+#endif
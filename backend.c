@@ -0,0 +1,148 @@
+/**
+ * @file backend.c
+ *
+ * Implementation of the image backends.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+// Opens or creates the image file with the given extra flags.
+static int file_open_flags(const char *path, int flags, int *fd, int64_t *size) {
+  *fd = open(path, O_CREAT | O_RDWR | flags, 0644);
+  if (*fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(*fd, &st) != 0) {
+    close(*fd);
+    return -1;
+  }
+  *size = st.st_size;
+  return 0;
+}
+
+// Opens the image file through the page cache.
+static int file_open(const char *path, int *fd, int64_t *size) {
+  return file_open_flags(path, 0, fd, size);
+}
+
+// Opens the image file around the page cache. Every transfer is whole
+// blocks to and from the page-aligned window, as O_DIRECT requires.
+static int direct_open(const char *path, int *fd, int64_t *size) {
+  return file_open_flags(path, O_DIRECT, fd, size);
+}
+
+static int file_resize(int fd, int64_t size) {
+  return ftruncate(fd, size);
+}
+
+static int file_read(int fd, void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t rv = pread(fd, buf, len, offset);
+    if (rv == 0 || (rv == -1 && errno != EINTR)) {
+      return -1;
+    }
+    if (rv > 0) {
+      buf = (char *) buf + rv;
+      len -= rv;
+      offset += rv;
+    }
+  }
+  return 0;
+}
+
+static int file_write(int fd, const void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t rv = pwrite(fd, buf, len, offset);
+    if (rv == 0 || (rv == -1 && errno != EINTR)) {
+      return -1;
+    }
+    if (rv > 0) {
+      buf = (const char *) buf + rv;
+      len -= rv;
+      offset += rv;
+    }
+  }
+  return 0;
+}
+
+static int file_sync(int fd) {
+  return fdatasync(fd);
+}
+
+static void file_close(int fd) {
+  close(fd);
+}
+
+// Starts every image empty, without touching the file.
+static int memory_open(const char *path, int *fd, int64_t *size) {
+  (void) path;
+  *fd = -1;
+  *size = 0;
+  return 0;
+}
+
+static int memory_resize(int fd, int64_t size) {
+  (void) fd;
+  (void) size;
+  return 0;
+}
+
+// Never called, as the image is never read back.
+static int memory_read(int fd, void *buf, size_t len, off_t offset) {
+  (void) fd;
+  (void) offset;
+  memset(buf, 0, len);
+  return 0;
+}
+
+static int memory_write(int fd, const void *buf, size_t len, off_t offset) {
+  (void) fd;
+  (void) buf;
+  (void) len;
+  (void) offset;
+  return 0;
+}
+
+static int memory_sync(int fd) {
+  (void) fd;
+  return 0;
+}
+
+static void memory_close(int fd) {
+  (void) fd;
+}
+
+static const backend_t backends[] = {
+  [BACKEND_MMAP] = {"mmap", 1, file_open, file_resize, file_read, file_write,
+                    file_sync, file_close},
+  [BACKEND_PREAD] = {"pread", 0, file_open, file_resize, file_read, file_write,
+                     file_sync, file_close},
+  [BACKEND_DIRECT] = {"direct", 0, direct_open, file_resize, file_read, file_write,
+                      file_sync, file_close},
+  [BACKEND_MEMORY] = {"memory", 0, memory_open, memory_resize, memory_read,
+                      memory_write, memory_sync, memory_close},
+};
+
+// Get the operations of the given backend.
+const backend_t *backend_get(backend_kind_t kind) {
+  return &backends[kind];
+}
+
+// Look a backend up by its name.
+int backend_find(const char *name) {
+  for (int kind = 0; kind < (int) (sizeof(backends) / sizeof(backends[0])); kind++) {
+    if (strcmp(backends[kind].name, name) == 0) {
+      return kind;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file backend.h
+ *
+ * The ways a disk image can be stored, each a table of operations.
+ *
+ * The blocks of the image are always reached through the address window
+ * of blocks.c. A mapped backend (mmap) backs the window with the image
+ * file itself, so the kernel moves pages between the two. Every other
+ * backend leaves the window as anonymous memory, which blocks.c fills
+ * from the backend when the image is opened and writes back to it
+ * explicitly: pread/pwrite through the page cache, the same with O_DIRECT
+ * so the page cache is bypassed, or nothing at all for an image that only
+ * lives in memory.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// the backends an image can be opened with
+typedef enum backend_kind {
+  BACKEND_MMAP,   // the image file is mapped (the default)
+  BACKEND_PREAD,  // the image is read and written with pread and pwrite
+  BACKEND_DIRECT, // the same, with O_DIRECT
+  BACKEND_MEMORY, // the image lives in memory and is never stored
+} backend_kind_t;
+
+// struct holding the operations of a backend; all but open take the
+// descriptor open returned, and return 0 on success or -1 on failure
+typedef struct backend {
+  const char *name; // the name of the backend, as in backend=name
+  int mapped;       // 1 if the window maps the image file itself
+  int (*open)(const char *path, int *fd, int64_t *size); // opens or creates the image
+  int (*resize)(int fd, int64_t size);                    // sets the size of the image
+  int (*read)(int fd, void *buf, size_t len, off_t offset);
+  int (*write)(int fd, const void *buf, size_t len, off_t offset);
+  int (*sync)(int fd); // makes everything written durable
+  void (*close)(int fd);
+} backend_t;
+
+/**
+ * Get the operations of the given backend.
+ *
+ * @param kind The backend.
+ *
+ * @return The backend's operations.
+ */
+const backend_t *backend_get(backend_kind_t kind);
+
+/**
+ * Look a backend up by its name.
+ *
+ * @param name The name: mmap, pread, direct or memory.
+ *
+ * @return The backend, -1 if there is none by that name.
+ */
+int backend_find(const char *name);
+
+#endif
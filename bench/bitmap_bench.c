@@ -0,0 +1,142 @@
+/**
+ * @file bitmap_bench.c
+ *
+ * Microbenchmark for block allocation on a 90%-full million-block bitmap.
+ *
+ * Compares the original bit-at-a-time first-fit search against the word
+ * scanning first-fit and next-fit searches, the contiguous run search, and
+ * the same searches through the hierarchical free-space summary.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../bitmap.h"
+#include "../summary.h"
+
+#define BITS (1024 * 1024) // a million-block bitmap
+#define ALLOCS 10000       // allocations per strategy
+#define GROUP_BITS (4096 * 8) // bits per summarized group
+
+static uint64_t full[BITS / 64];
+static uint64_t work[BITS / 64];
+static summary_t sum;
+
+// Returns the current time in nanoseconds.
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The allocator as it was: walk the bitmap one bit at a time from the start.
+static int alloc_bitwise(void *bm, int *cursor, int n) {
+  for (int ii = 0; ii < BITS; ii++) {
+    if (!bitmap_get(bm, ii)) {
+      bitmap_put(bm, ii, 1);
+      return ii;
+    }
+  }
+  return -1;
+}
+
+// First-fit, scanning 64 bits at a time from the start.
+static int alloc_first_fit(void *bm, int *cursor, int n) {
+  int bit = bitmap_find_free(bm, 0, BITS);
+  if (bit != -1) {
+    bitmap_put(bm, bit, 1);
+  }
+  return bit;
+}
+
+// Next-fit, scanning 64 bits at a time from the previous allocation.
+static int alloc_next_fit(void *bm, int *cursor, int n) {
+  int bit = bitmap_find_free(bm, *cursor, BITS);
+  if (bit == -1) {
+    bit = bitmap_find_free(bm, 0, BITS);
+  }
+  if (bit != -1) {
+    bitmap_put(bm, bit, 1);
+    *cursor = bit + 1;
+  }
+  return bit;
+}
+
+// Next-fit search for a run of n free bits.
+static int alloc_run(void *bm, int *cursor, int n) {
+  int bit = bitmap_find_run(bm, *cursor, BITS, n);
+  if (bit == -1) {
+    bit = bitmap_find_run(bm, 0, BITS, n);
+  }
+  if (bit != -1) {
+    bitmap_put_range(bm, bit, n, 1);
+    *cursor = bit + n;
+  }
+  return bit;
+}
+
+// Returns the bitmap of the given group of the working copy.
+static void *work_group(int group) {
+  return (char *) work + group * (GROUP_BITS / 8);
+}
+
+// Next-fit search for a run of n free bits through the summary.
+static int alloc_summary(void *bm, int *cursor, int n) {
+  int64_t bit = summary_find(&sum, *cursor, n);
+  if (bit != -1) {
+    bitmap_put_range(bm, bit, n, 1);
+    summary_update(&sum, bit, n, 1);
+    *cursor = bit + n;
+  }
+  return bit;
+}
+
+// Times ALLOCS allocations with the given strategy on a fresh copy of
+// the 90%-full bitmap.
+static void run(const char *name, int (*alloc)(void *, int *, int), int n) {
+  memcpy(work, full, sizeof(full));
+  summary_free(&sum);
+  summary_init(&sum, work_group);
+  summary_resize(&sum, BITS);
+  int cursor = 0;
+  int done = 0;
+
+  double start = now_ns();
+  for (int ii = 0; ii < ALLOCS; ii++) {
+    if (alloc(work, &cursor, n) != -1) {
+      done++;
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  printf("%-22s %8d allocs %12.1f ns/alloc\n", name, done, elapsed / ALLOCS);
+}
+
+int main(int argc, char **argv) {
+  // fill 90% of the bitmap at random, in short runs like real files
+  srand(42);
+  int set = 0;
+  while (set < BITS / 10 * 9) {
+    int bit = rand() % BITS;
+    int len = 1 + rand() % 16;
+    for (int ii = bit; ii < bit + len && ii < BITS; ii++) {
+      if (!bitmap_get(full, ii)) {
+        bitmap_put(full, ii, 1);
+        set++;
+      }
+    }
+  }
+
+  printf("bitmap: %d bits, %d set (%.0f%% full)\n", BITS, set, 100.0 * set / BITS);
+  run("bit-at-a-time", alloc_bitwise, 1);
+  run("word first-fit", alloc_first_fit, 1);
+  run("word next-fit", alloc_next_fit, 1);
+  run("next-fit run of 4", alloc_run, 4);
+  run("next-fit run of 8", alloc_run, 8);
+  run("summary next-fit", alloc_summary, 1);
+  run("summary run of 8", alloc_summary, 8);
+  run("summary run of 64", alloc_summary, 64);
+  return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file dir_bench.c
+ *
+ * Benchmark for a single large directory: creates a million files in one
+ * directory, then stats every one of them by name.
+ *
+ * Runs against the storage layer directly (no FUSE) and reports the mean
+ * cost per operation for each batch of 100K, which stays flat as the
+ * directory grows.
+ *
+ * Usage: bench/dir_bench [image] [count]
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../storage.h"
+#include "../directory.h"
+#include "../dcache.h"
+#include "../inode.h"
+#include "../journal.h"
+
+#define BATCH 100000 // operations per reported batch
+
+// Returns the current time in nanoseconds.
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Creates a file named after ii in the directory, as storage_mknod does.
+static void create(int dir_inum, int ii) {
+  char name[DIR_NAME_LENGTH];
+  snprintf(name, sizeof(name), "file%07d", ii);
+
+  journal_begin();
+  inode_write_lock(dir_inum);
+  int inum = alloc_inode();
+  assert(inum != -1);
+  inode_t *inode = get_inode(inum);
+  journal_dirty(inode, sizeof(inode_t));
+  inode->refs = 1;
+  inode->mode = 0100644;
+
+  int rv = directory_put(dir_inum, name, inum);
+  assert(rv == 0);
+  inode_unlock(dir_inum);
+  journal_end();
+}
+
+// Looks up the file named after ii in the directory and stats it.
+static void stat_one(int dir_inum, int ii) {
+  char name[DIR_NAME_LENGTH];
+  snprintf(name, sizeof(name), "file%07d", ii);
+
+  inode_read_lock(dir_inum);
+  int inum = directory_lookup(dir_inum, name);
+  inode_unlock(dir_inum);
+  assert(inum != -1);
+
+  struct stat st;
+  inode_t *inode = get_inode(inum);
+  st.st_ino = inum;
+  st.st_mode = inode->mode;
+  st.st_size = inode->size;
+  assert(S_ISREG(st.st_mode));
+}
+
+// Runs op over [0, count) and prints the mean time of each batch.
+static void run(const char *label, int dir_inum, int count, void (*op)(int, int)) {
+  double total = now_ns();
+
+  for (int first = 0; first < count; first += BATCH) {
+    int last = first + BATCH < count ? first + BATCH : count;
+
+    double start = now_ns();
+    for (int ii = first; ii < last; ii++) {
+      op(dir_inum, ii);
+    }
+    double ns = (now_ns() - start) / (last - first);
+
+    printf("%-6s %8d .. %8d  %8.0f ns/op\n", label, first, last, ns);
+  }
+
+  printf("%-6s total %.2f s\n\n", label, (now_ns() - total) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = argc > 1 ? argv[1] : "bench.nufs";
+  int count = argc > 2 ? atoi(argv[2]) : 1000000;
+
+  unlink(image);
+  int rv = storage_init(image);
+  assert(rv == 0);
+
+  rv = directory_init("/big", 040755);
+  assert(rv == 0);
+  int dir_inum = tree_lookup("/big");
+
+  run("create", dir_inum, count, create);
+
+  // start the lookups cold, so they go through the on-disk index
+  dcache_clear();
+  run("stat", dir_inum, count, stat_one);
+
+  printf("directory size %ld bytes\n", (long) get_inode(dir_inum)->size);
+  unlink(image);
+  return 0;
+}
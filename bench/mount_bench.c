@@ -0,0 +1,518 @@
+/**
+ * @file mount_bench.c
+ *
+ * Benchmark of a mounted file system, through the kernel.
+ *
+ * Runs a fixed set of workloads with a number of threads in a directory
+ * of any file system: storms of small file creates, stats and deletes,
+ * sequential reads and writes of 4K to 1M, random 4K reads and writes,
+ * the extraction of a generated tree as tar would do it, a parallel find
+ * over that tree and its removal. Every operation is timed on its own,
+ * and the results are printed as JSON, one object per workload with its
+ * throughput and tail latencies. Runs are reproducible: the random
+ * offsets and the generated tree depend only on the thread number.
+ *
+ * bench/mount_bench.sh runs it on a fresh nufs mount and on tmpfs.
+ *
+ * Usage: bench/mount_bench [-t threads] [-n files] [-S file_mb]
+ *                          [-r random_ops] [-w fanout] [-l label] dir
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_LENGTH 4096   // the longest path the benchmark builds
+#define MAX_IO (1 << 20)   // the largest read or write
+#define TREE_DEPTH 3       // the levels of directories of the generated tree
+#define TREE_FILES 8       // the files in each directory of the generated tree
+
+// struct holding the shape of the benchmark
+typedef struct bench_config {
+  const char *dir;   // the directory the workloads run in
+  const char *label; // the name of the run, copied to the output
+  int threads;       // the threads running each workload
+  int files;         // the files each thread creates, stats and deletes
+  int file_mb;       // the megabytes of each thread's data file
+  int random_ops;    // the random reads and writes of each thread
+  int fanout;        // the subdirectories of each directory of the tree
+} bench_config_t;
+
+static bench_config_t config = {NULL, "run", 4, 2000, 64, 4096, 4};
+
+// struct of one thread's samples
+typedef struct worker {
+  pthread_t thread;
+  int id;         // the thread number, from 0
+  uint64_t *ns;   // the latency of each operation
+  int count;      // the samples taken
+  int capacity;   // the samples ns holds
+  int64_t bytes;  // the bytes read or written
+  char *buf;      // MAX_IO bytes to read into and write from
+} worker_t;
+
+static worker_t *workers;
+static pthread_barrier_t start_barrier;
+static void (*workload)(worker_t *); // the workload being run
+static int io_size;                  // the size of each sequential read or write
+static int first_result = 1;
+
+// Returns the current time in nanoseconds.
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Stops the benchmark if a system call failed.
+static void check(int rv, const char *what, const char *path) {
+  if (rv == -1) {
+    fprintf(stderr, "mount_bench: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+  }
+}
+
+// Records the latency of an operation that started at start.
+static void sample(worker_t *w, uint64_t start) {
+  uint64_t ns = now_ns() - start;
+  if (w->count == w->capacity) {
+    w->capacity = w->capacity == 0 ? 4096 : w->capacity * 2;
+    w->ns = realloc(w->ns, sizeof(uint64_t) * w->capacity);
+    assert(w->ns != NULL);
+  }
+  w->ns[w->count++] = ns;
+}
+
+// Orders latencies, for qsort.
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Returns the latency under which the given fraction of the sorted samples fall.
+static uint64_t percentile(const uint64_t *ns, int n, double fraction) {
+  int at = (int) (fraction * n + 0.5) - 1;
+  if (at < 0) {
+    at = 0;
+  }
+  if (at >= n) {
+    at = n - 1;
+  }
+  return n > 0 ? ns[at] : 0;
+}
+
+// Merges the samples of every thread and prints the JSON object of the workload.
+static void report(const char *op, uint64_t wall_ns) {
+  int n = 0;
+  int64_t bytes = 0;
+  for (int ii = 0; ii < config.threads; ii++) {
+    n += workers[ii].count;
+    bytes += workers[ii].bytes;
+  }
+
+  uint64_t *ns = malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+  assert(ns != NULL);
+  uint64_t total = 0;
+  int at = 0;
+  for (int ii = 0; ii < config.threads; ii++) {
+    for (int jj = 0; jj < workers[ii].count; jj++) {
+      total += workers[ii].ns[jj];
+      ns[at++] = workers[ii].ns[jj];
+    }
+    workers[ii].count = 0;
+    workers[ii].bytes = 0;
+  }
+  qsort(ns, n, sizeof(uint64_t), cmp_u64);
+
+  double wall = wall_ns / 1e9;
+  printf("%s\n    {\"op\": \"%s\", \"count\": %d, \"wall_ns\": %lu, \"ops_per_sec\": %.1f, "
+         "\"mean_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu",
+         first_result ? "" : ",", op, n, wall_ns, n / wall, n > 0 ? total / n : 0,
+         percentile(ns, n, 0.50), percentile(ns, n, 0.99), percentile(ns, n, 0.999),
+         percentile(ns, n, 1.0));
+  if (bytes > 0) {
+    printf(", \"mb_per_sec\": %.1f", bytes / (double) (1 << 20) / wall);
+  }
+  printf("}");
+  fflush(stdout);
+
+  first_result = 0;
+  free(ns);
+}
+
+// Runs the workload of one thread once every thread is ready.
+static void *worker_main(void *arg) {
+  worker_t *w = (worker_t *) arg;
+  pthread_barrier_wait(&start_barrier);
+  workload(w);
+  pthread_barrier_wait(&start_barrier);
+  return NULL;
+}
+
+// Runs fn in every thread at once and reports it.
+static void run(const char *op, void (*fn)(worker_t *)) {
+  workload = fn;
+  for (int ii = 0; ii < config.threads; ii++) {
+    int rv = pthread_create(&workers[ii].thread, NULL, worker_main, &workers[ii]);
+    assert(rv == 0);
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  uint64_t start = now_ns();
+  pthread_barrier_wait(&start_barrier);
+  uint64_t wall = now_ns() - start;
+
+  for (int ii = 0; ii < config.threads; ii++) {
+    pthread_join(workers[ii].thread, NULL);
+  }
+  report(op, wall);
+}
+
+// Writes the path of the thread's own directory, plus a suffix, into buf.
+static void thread_path(char *buf, worker_t *w, const char *suffix) {
+  snprintf(buf, PATH_LENGTH, "%s/t%d%s", config.dir, w->id, suffix);
+}
+
+static void do_create(worker_t *w) {
+  char path[PATH_LENGTH];
+  for (int ii = 0; ii < config.files; ii++) {
+    snprintf(path, sizeof(path), "%s/t%d/f%d", config.dir, w->id, ii);
+    uint64_t start = now_ns();
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    check(fd, "create", path);
+    close(fd);
+    sample(w, start);
+  }
+}
+
+static void do_stat(worker_t *w) {
+  char path[PATH_LENGTH];
+  struct stat st;
+  for (int ii = 0; ii < config.files; ii++) {
+    snprintf(path, sizeof(path), "%s/t%d/f%d", config.dir, w->id, ii);
+    uint64_t start = now_ns();
+    check(stat(path, &st), "stat", path);
+    sample(w, start);
+  }
+}
+
+static void do_delete(worker_t *w) {
+  char path[PATH_LENGTH];
+  for (int ii = 0; ii < config.files; ii++) {
+    snprintf(path, sizeof(path), "%s/t%d/f%d", config.dir, w->id, ii);
+    uint64_t start = now_ns();
+    check(unlink(path), "unlink", path);
+    sample(w, start);
+  }
+}
+
+static void do_seq_write(worker_t *w) {
+  char path[PATH_LENGTH];
+  thread_path(path, w, "/data");
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  check(fd, "open", path);
+
+  int64_t size = (int64_t) config.file_mb << 20;
+  for (int64_t done = 0; done < size; done += io_size) {
+    uint64_t start = now_ns();
+    ssize_t rv = write(fd, w->buf, io_size);
+    check(rv == io_size ? 0 : -1, "write", path);
+    sample(w, start);
+    w->bytes += rv;
+  }
+  close(fd);
+}
+
+static void do_seq_read(worker_t *w) {
+  char path[PATH_LENGTH];
+  thread_path(path, w, "/data");
+  int fd = open(path, O_RDONLY);
+  check(fd, "open", path);
+
+  while (1) {
+    uint64_t start = now_ns();
+    ssize_t rv = read(fd, w->buf, io_size);
+    check(rv, "read", path);
+    if (rv == 0) {
+      break;
+    }
+    sample(w, start);
+    w->bytes += rv;
+  }
+  close(fd);
+}
+
+// Reads or writes 4K blocks of the data file at offsets drawn from a seed
+// that depends only on the thread.
+static void random_io(worker_t *w, int writing) {
+  char path[PATH_LENGTH];
+  thread_path(path, w, "/data");
+  int fd = open(path, writing ? O_WRONLY : O_RDONLY);
+  check(fd, "open", path);
+
+  unsigned seed = w->id + 1;
+  int64_t blocks = ((int64_t) config.file_mb << 20) / 4096;
+  for (int ii = 0; ii < config.random_ops; ii++) {
+    off_t offset = (off_t) (rand_r(&seed) % blocks) * 4096;
+    uint64_t start = now_ns();
+    ssize_t rv = writing ? pwrite(fd, w->buf, 4096, offset) : pread(fd, w->buf, 4096, offset);
+    check(rv == 4096 ? 0 : -1, writing ? "pwrite" : "pread", path);
+    sample(w, start);
+    w->bytes += rv;
+  }
+  close(fd);
+}
+
+static void do_rand_write(worker_t *w) {
+  random_io(w, 1);
+}
+
+static void do_rand_read(worker_t *w) {
+  random_io(w, 0);
+}
+
+// Extracts one directory of the generated tree and everything below it,
+// as tar does: each file is created, written, given its times and closed.
+static void untar_dir(worker_t *w, const char *dir, int level, unsigned *seed) {
+  static const int sizes[] = {512, 1024, 2048, 4096, 8192, 16384, 65536};
+  char path[PATH_LENGTH];
+
+  uint64_t start = now_ns();
+  check(mkdir(dir, 0755), "mkdir", dir);
+  sample(w, start);
+
+  for (int ii = 0; ii < TREE_FILES; ii++) {
+    snprintf(path, sizeof(path), "%s/file%d.c", dir, ii);
+    int size = sizes[rand_r(seed) % (sizeof(sizes) / sizeof(sizes[0]))];
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+
+    start = now_ns();
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    check(fd, "create", path);
+    check(write(fd, w->buf, size) == size ? 0 : -1, "write", path);
+    check(futimens(fd, times), "futimens", path);
+    close(fd);
+    sample(w, start);
+    w->bytes += size;
+  }
+
+  if (level < TREE_DEPTH) {
+    for (int ii = 0; ii < config.fanout; ii++) {
+      snprintf(path, sizeof(path), "%s/dir%d", dir, ii);
+      untar_dir(w, path, level + 1, seed);
+    }
+  }
+}
+
+static void do_untar(worker_t *w) {
+  char path[PATH_LENGTH];
+  thread_path(path, w, "/tree");
+  unsigned seed = w->id + 1;
+  untar_dir(w, path, 0, &seed);
+}
+
+static char **find_stack;   // the directories left to read
+static int find_top = 0;    // the directories on the stack
+static int find_capacity = 0;
+static int find_busy = 0;   // the threads reading a directory
+static pthread_mutex_t find_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t find_cond = PTHREAD_COND_INITIALIZER;
+
+// Adds a directory for some thread to read.
+static void find_push(char *path) {
+  pthread_mutex_lock(&find_lock);
+  if (find_top == find_capacity) {
+    find_capacity = find_capacity == 0 ? 256 : find_capacity * 2;
+    find_stack = realloc(find_stack, sizeof(char *) * find_capacity);
+    assert(find_stack != NULL);
+  }
+  find_stack[find_top++] = path;
+  pthread_cond_signal(&find_cond);
+  pthread_mutex_unlock(&find_lock);
+}
+
+// Takes a directory to read, or returns NULL once the walk is over.
+static char *find_pop() {
+  pthread_mutex_lock(&find_lock);
+  while (find_top == 0 && find_busy > 0) {
+    pthread_cond_wait(&find_cond, &find_lock);
+  }
+  char *path = NULL;
+  if (find_top > 0) {
+    path = find_stack[--find_top];
+    find_busy++;
+  } else {
+    pthread_cond_broadcast(&find_cond);
+  }
+  pthread_mutex_unlock(&find_lock);
+  return path;
+}
+
+// Marks a directory as read.
+static void find_done() {
+  pthread_mutex_lock(&find_lock);
+  if (--find_busy == 0 && find_top == 0) {
+    pthread_cond_broadcast(&find_cond);
+  }
+  pthread_mutex_unlock(&find_lock);
+}
+
+// Walks every thread's tree, sharing the directories out among the
+// threads as find would with one walker per thread. Times each lstat.
+static void do_find(worker_t *w) {
+  char *dir;
+  while ((dir = find_pop()) != NULL) {
+    DIR *d = opendir(dir);
+    check(d == NULL ? -1 : 0, "opendir", dir);
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+
+      char *path = malloc(PATH_LENGTH);
+      assert(path != NULL);
+      snprintf(path, PATH_LENGTH, "%s/%s", dir, ent->d_name);
+      struct stat st;
+      uint64_t start = now_ns();
+      check(lstat(path, &st), "lstat", path);
+      sample(w, start);
+
+      if (S_ISDIR(st.st_mode)) {
+        find_push(path);
+      } else {
+        free(path);
+      }
+    }
+
+    closedir(d);
+    free(dir);
+    find_done();
+  }
+}
+
+// Removes a directory and everything below it, timing each unlink and rmdir.
+static void remove_tree(worker_t *w, const char *dir) {
+  DIR *d = opendir(dir);
+  check(d == NULL ? -1 : 0, "opendir", dir);
+
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    char path[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    struct stat st;
+    check(lstat(path, &st), "lstat", path);
+    if (S_ISDIR(st.st_mode)) {
+      remove_tree(w, path);
+    } else {
+      uint64_t start = now_ns();
+      check(unlink(path), "unlink", path);
+      sample(w, start);
+    }
+  }
+  closedir(d);
+
+  uint64_t start = now_ns();
+  check(rmdir(dir), "rmdir", dir);
+  sample(w, start);
+}
+
+static void do_remove(worker_t *w) {
+  char path[PATH_LENGTH];
+  thread_path(path, w, "");
+  remove_tree(w, path);
+}
+
+// Parses the command line into config.
+static void parse_args(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:S:r:w:l:")) != -1) {
+    switch (opt) {
+    case 't': config.threads = atoi(optarg); break;
+    case 'n': config.files = atoi(optarg); break;
+    case 'S': config.file_mb = atoi(optarg); break;
+    case 'r': config.random_ops = atoi(optarg); break;
+    case 'w': config.fanout = atoi(optarg); break;
+    case 'l': config.label = optarg; break;
+    default: break;
+    }
+  }
+
+  if (optind != argc - 1 || config.threads < 1 || config.files < 1 || config.file_mb < 1 ||
+      config.random_ops < 1 || config.fanout < 1) {
+    fprintf(stderr, "usage: %s [-t threads] [-n files] [-S file_mb] [-r random_ops] "
+                    "[-w fanout] [-l label] dir\n", argv[0]);
+    exit(1);
+  }
+  config.dir = argv[optind];
+}
+
+int main(int argc, char *argv[]) {
+  parse_args(argc, argv);
+
+  workers = calloc(config.threads, sizeof(worker_t));
+  assert(workers != NULL);
+  for (int ii = 0; ii < config.threads; ii++) {
+    workers[ii].id = ii;
+    workers[ii].buf = malloc(MAX_IO);
+    assert(workers[ii].buf != NULL);
+    memset(workers[ii].buf, 'a' + ii % 26, MAX_IO);
+
+    char path[PATH_LENGTH];
+    thread_path(path, &workers[ii], "");
+    check(mkdir(path, 0755), "mkdir", path);
+  }
+  pthread_barrier_init(&start_barrier, NULL, config.threads + 1);
+
+  printf("{\n  \"label\": \"%s\",\n  \"config\": {\"threads\": %d, \"files\": %d, \"file_mb\": %d, "
+         "\"random_ops\": %d, \"fanout\": %d},\n  \"results\": [",
+         config.label, config.threads, config.files, config.file_mb, config.random_ops,
+         config.fanout);
+
+  run("create", do_create);
+  run("stat", do_stat);
+  run("delete", do_delete);
+
+  static const struct { int size; const char *write; const char *read; } seq[] = {
+    {4096, "seq_write_4k", "seq_read_4k"},
+    {65536, "seq_write_64k", "seq_read_64k"},
+    {MAX_IO, "seq_write_1m", "seq_read_1m"},
+  };
+  for (int ii = 0; ii < sizeof(seq) / sizeof(seq[0]); ii++) {
+    io_size = seq[ii].size;
+    run(seq[ii].write, do_seq_write);
+    run(seq[ii].read, do_seq_read);
+  }
+  run("rand_write_4k", do_rand_write);
+  run("rand_read_4k", do_rand_read);
+
+  run("untar", do_untar);
+  for (int ii = 0; ii < config.threads; ii++) {
+    char *path = malloc(PATH_LENGTH);
+    assert(path != NULL);
+    thread_path(path, &workers[ii], "/tree");
+    find_push(path);
+  }
+  run("find", do_find);
+  run("remove_tree", do_remove);
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
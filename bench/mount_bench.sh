@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Runs bench/mount_bench on a fresh nufs mount, then on tmpfs as a
+# baseline, and prints both results as one JSON object.
+#
+# Usage: bench/mount_bench.sh [threads] [mount_bench options...]
+# Set TMPFS to pick the tmpfs directory (default /dev/shm) and NUFS_OPTS
+# to pass options to nufs, e.g. NUFS_OPTS="-o durability=every-op".
+
+set -e
+
+THREADS=${1:-4}
+[ $# -gt 0 ] && shift
+MNT=mnt
+IMAGE=bench.nufs
+BASELINE=${TMPFS:-/dev/shm}/nufs-bench.$$
+
+cleanup() {
+  fusermount -u $MNT 2>/dev/null || true
+  rm -rf $BASELINE
+}
+trap cleanup EXIT
+
+mkdir -p $MNT
+rm -f $IMAGE
+./nufs $NUFS_OPTS $MNT $IMAGE > /dev/null
+
+# wait for the mount to come up
+tries=0
+until mountpoint -q $MNT; do
+  tries=$((tries + 1))
+  if [ $tries -gt 50 ]; then
+    echo "mount_bench.sh: nufs did not mount on $MNT" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+echo '{"nufs":'
+./bench/mount_bench -t $THREADS -l nufs "$@" $MNT
+fusermount -u $MNT
+rm -f $IMAGE
+
+mkdir -p $BASELINE
+echo ',"tmpfs":'
+./bench/mount_bench -t $THREADS -l tmpfs "$@" $BASELINE
+echo '}'
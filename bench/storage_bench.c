@@ -0,0 +1,555 @@
+/**
+ * @file storage_bench.c
+ *
+ * Microbenchmark of the storage layer, without FUSE.
+ *
+ * Builds a tree of directories, then times each kind of operation over
+ * it: mknod, stat, deep path lookups, directory listings, small and
+ * large reads and writes, rename and unlink. Large reads are also timed
+ * replying through a pipe the way FUSE front ends do, copied out of the
+ * storage layer (pipe_read) or spliced from the image (pipe_splice).
+ * Between the large reads and the renames the image is closed, dropped
+ * from the page cache and mounted again, and the mount, stats and a
+ * large read are timed cold. Every operation is timed on its own, and the
+ * results are printed as JSON, one object per kind of operation with its
+ * rate, percentiles, CPU time and page faults, so runs can be compared.
+ *
+ * The image is mapped as nufs's mount options would map it: -a sets the
+ * advice (normal, random or sequential), -H asks for huge pages, -P sets
+ * what is prefaulted at mount (none, metadata or all) and -R the
+ * kilobytes read ahead of sequential reads. -b picks the backend the
+ * image is stored with (mmap, pread, direct or memory); a memory image is
+ * lost when closed, so it skips the cold phases. -c sets the megabytes the
+ * buffer cache of a pread or direct image holds, and the cache's hits,
+ * misses and evictions over the whole run are printed after the results.
+ *
+ * Usage: bench/storage_bench [-i image] [-n files] [-d depth] [-w fanout]
+ *                            [-D deep] [-s small_bytes] [-l large_mb]
+ *                            [-p prefill_mb] [-r repeats] [-a advice] [-H]
+ *                            [-P prefault] [-R readahead_kb] [-b backend]
+ *                            [-c cache_mb]
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../blocks.h"
+#include "../dcache.h"
+#include "../directory.h"
+#include "../stats.h"
+#include "../storage.h"
+
+#define PATH_LENGTH 4096 // the longest path the benchmark builds
+#define LARGE_CHUNK (1024 * 1024) // bytes per large read or write
+
+// struct holding the shape of the benchmark
+typedef struct bench_config {
+  const char *image; // the image file, deleted before and after
+  int files;         // the files spread over the leaf directories
+  int depth;         // the levels of directories above the files
+  int fanout;        // the subdirectories of each directory
+  int deep;          // the depth of the chain timed by lookup_deep
+  int small;         // the bytes of each small read and write
+  int large_mb;      // the megabytes of the large file
+  int prefill_mb;    // the megabytes written before the benchmark starts
+  int repeats;       // the lookups of the deep chain
+  int advice;        // the blocks_advice_t of the image
+  int hugepages;     // 1 to ask for huge pages
+  int prefault;      // the storage_prefault_t at mount
+  int readahead_kb;  // the kilobytes read ahead of sequential reads
+  int backend;       // the backend_kind_t the image is stored with
+  int cache_mb;      // the megabytes of the buffer cache of an unmapped image
+} bench_config_t;
+
+static bench_config_t config = {"bench.nufs", 10000, 3, 8, 32, 4096, 64, 0, 10000,
+                                ADVICE_NORMAL, 0, PREFAULT_NONE, 0, BACKEND_MMAP, 256};
+
+static const char *advice_names[] = {"normal", "random", "sequential"};
+static const char *prefault_names[] = {"none", "metadata", "all"};
+
+static uint64_t *samples; // the latency of each operation of the current kind
+static int nsamples;
+static int first_result = 1;
+
+// Returns the current time in nanoseconds.
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Orders latencies, for qsort.
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Returns the latency under which the given fraction of the sorted samples fall.
+static uint64_t percentile(double fraction) {
+  int at = (int) (fraction * nsamples + 0.5) - 1;
+  if (at < 0) {
+    at = 0;
+  }
+  if (at >= nsamples) {
+    at = nsamples - 1;
+  }
+  return samples[at];
+}
+
+// struct of what the process has used: page faults and CPU time
+typedef struct bench_usage {
+  long minflt;     // minor page faults
+  long majflt;     // major page faults
+  uint64_t cpu_ns; // user and system time
+} bench_usage_t;
+
+// Returns what the process has used since used was taken.
+static bench_usage_t usage_since(bench_usage_t used) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  bench_usage_t now = {usage.ru_minflt, usage.ru_majflt,
+                       (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull +
+                       (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull};
+  return (bench_usage_t) {now.minflt - used.minflt, now.majflt - used.majflt,
+                          now.cpu_ns - used.cpu_ns};
+}
+
+// Prints the JSON object for the samples of one kind of operation. bytes
+// is the data each operation moved, 0 for metadata operations; used is
+// what the operations used.
+static void report(const char *op, uint64_t wall_ns, int64_t bytes, bench_usage_t used) {
+  qsort(samples, nsamples, sizeof(uint64_t), cmp_u64);
+
+  uint64_t total = 0;
+  for (int ii = 0; ii < nsamples; ii++) {
+    total += samples[ii];
+  }
+
+  printf("%s\n    {\"op\": \"%s\", \"count\": %d, \"ops_per_sec\": %.1f, \"mean_ns\": %lu, "
+         "\"p50_ns\": %lu, \"p99_ns\": %lu, \"max_ns\": %lu",
+         first_result ? "" : ",", op, nsamples, nsamples / (wall_ns / 1e9),
+         nsamples > 0 ? total / nsamples : 0, percentile(0.50), percentile(0.99),
+         percentile(1.0));
+  if (bytes > 0) {
+    printf(", \"mb_per_sec\": %.1f", (double) bytes * nsamples / (1 << 20) / (wall_ns / 1e9));
+    printf(", \"cpu_ms_per_gb\": %.1f", used.cpu_ns / 1e6 / ((double) bytes * nsamples / (1 << 30)));
+  }
+  printf(", \"cpu_ms\": %.1f, \"minor_faults\": %ld, \"major_faults\": %ld}",
+         used.cpu_ns / 1e6, used.minflt, used.majflt);
+
+  first_result = 0;
+  nsamples = 0;
+}
+
+// Times one call of op(ii) for each ii in [0, count) and reports them.
+static void run(const char *op, int count, int64_t bytes, void (*fn)(int)) {
+  bench_usage_t used = usage_since((bench_usage_t) {0, 0, 0});
+  uint64_t wall = now_ns();
+  for (int ii = 0; ii < count; ii++) {
+    uint64_t start = now_ns();
+    fn(ii);
+    samples[nsamples++] = now_ns() - start;
+    arena_reset();
+  }
+  uint64_t elapsed = now_ns() - wall;
+  report(op, elapsed, bytes, usage_since(used));
+}
+
+// Writes the path of leaf directory leaf into buf, returning its length.
+static int leaf_path(char *buf, int leaf) {
+  int len = 0;
+  for (int level = config.depth - 1; level >= 0; level--) {
+    int digit = leaf;
+    for (int ii = 0; ii < level; ii++) {
+      digit /= config.fanout;
+    }
+    len += sprintf(buf + len, "/d%d", digit % config.fanout);
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+// Returns the number of leaf directories.
+static int leaves() {
+  int n = 1;
+  for (int ii = 0; ii < config.depth; ii++) {
+    n *= config.fanout;
+  }
+  return n;
+}
+
+// Writes the path of file ii into buf, with the given suffix.
+static void file_path(char *buf, int ii, const char *suffix) {
+  int len = leaf_path(buf, ii % leaves());
+  sprintf(buf + len, "/f%d%s", ii, suffix);
+}
+
+static storage_file_t **handles; // an open handle on every file
+static char *small_buf;
+static char *large_buf;
+static char deep_path[PATH_LENGTH];
+
+static void op_mknod(int ii) {
+  char path[PATH_LENGTH];
+  file_path(path, ii, "");
+  int rv = storage_mknod(path, 0100644);
+  assert(rv == 0);
+}
+
+static void op_stat(int ii) {
+  char path[PATH_LENGTH];
+  struct stat st;
+  file_path(path, ii, "");
+  int rv = storage_stat(path, &st);
+  assert(rv == 0);
+}
+
+static void op_lookup_deep(int ii) {
+  int inum = tree_lookup(deep_path);
+  assert(inum != -1);
+}
+
+// Counts the entries directory_iterate hands out.
+static int count_entry(void *arg, const char *name, int inum, off_t cursor) {
+  (*(int *) arg)++;
+  return 0;
+}
+
+static void op_readdir(int ii) {
+  char path[PATH_LENGTH];
+  leaf_path(path, ii);
+  int entries = 0;
+  directory_iterate(tree_lookup(path), 0, count_entry, &entries);
+  assert(entries > 0 || config.files < leaves());
+}
+
+static void op_small_write(int ii) {
+  int rv = storage_write_ino(handles[ii]->inum, small_buf, config.small, 0, &handles[ii]->cursor);
+  assert(rv == config.small);
+}
+
+static void op_small_read(int ii) {
+  int rv = storage_read_ino(handles[ii]->inum, small_buf, config.small, 0, &handles[ii]->cursor);
+  assert(rv == config.small);
+}
+
+static void op_large_write(int ii) {
+  int rv = storage_write_ino(handles[0]->inum, large_buf, LARGE_CHUNK, (off_t) ii * LARGE_CHUNK,
+                             &handles[0]->cursor);
+  assert(rv == LARGE_CHUNK);
+}
+
+static void op_large_read(int ii) {
+  int rv = storage_read_ino(handles[0]->inum, large_buf, LARGE_CHUNK, (off_t) ii * LARGE_CHUNK,
+                            &handles[0]->cursor);
+  assert(rv == LARGE_CHUNK);
+}
+
+// the pipe large reads are replied through and where it is drained to,
+// standing in for /dev/fuse
+static int reply_pipe[2];
+static int reply_null;
+
+// Drains len bytes from the reply pipe.
+static void reply_drain(size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(reply_pipe[0], NULL, reply_null, NULL, len, 0);
+    assert(n > 0);
+    len -= n;
+  }
+}
+
+// Reads a chunk into the buffer and writes it to the pipe, as a read
+// without splicing replies.
+static void op_pipe_read(int ii) {
+  op_large_read(ii);
+  for (size_t done = 0; done < LARGE_CHUNK;) {
+    ssize_t n = write(reply_pipe[1], large_buf + done, LARGE_CHUNK - done);
+    assert(n > 0);
+    done += n;
+  }
+  reply_drain(LARGE_CHUNK);
+}
+
+// Splices the segments of a read into the pipe, as libfuse replies with
+// a buffer vector.
+static int send_splice(void *arg, const storage_segment_t *segs, int count) {
+  size_t total = 0;
+  for (int ii = 0; ii < count; ii++) {
+    for (size_t done = 0; done < segs[ii].len;) {
+      ssize_t n;
+      if (segs[ii].mem != NULL) {
+        struct iovec iov = {(void *) (segs[ii].mem + done), segs[ii].len - done};
+        n = vmsplice(reply_pipe[1], &iov, 1, 0);
+      } else {
+        loff_t pos = segs[ii].pos + done;
+        n = splice(segs[ii].fd, &pos, reply_pipe[1], NULL, segs[ii].len - done, 0);
+      }
+      assert(n > 0);
+      done += n;
+    }
+    total += segs[ii].len;
+  }
+
+  reply_drain(total);
+  return total;
+}
+
+static void op_pipe_splice(int ii) {
+  int rv = storage_read_send(handles[0]->inum, LARGE_CHUNK, (off_t) ii * LARGE_CHUNK,
+                             &handles[0]->cursor, send_splice, NULL);
+  assert(rv == LARGE_CHUNK);
+}
+
+static void op_rename(int ii) {
+  char from[PATH_LENGTH];
+  char to[PATH_LENGTH];
+  file_path(from, ii, "");
+  file_path(to, ii, ".renamed");
+  int rv = storage_rename(from, to);
+  assert(rv == 0);
+}
+
+static void op_unlink(int ii) {
+  char path[PATH_LENGTH];
+  file_path(path, ii, ".renamed");
+  int rv = storage_unlink(path);
+  assert(rv == 0);
+}
+
+// Mounts the image and maps it as configured.
+static void op_mount(int ii) {
+  int rv = storage_init(config.image);
+  assert(rv == 0);
+  blocks_set_advice(config.advice, config.hugepages);
+  storage_prefault(config.prefault);
+}
+
+// Closes the image and drops it from the page cache, so the next mount
+// starts cold.
+static void unmount_cold() {
+  storage_flush_buffers();
+  blocks_free();
+
+  int fd = open(config.image, O_RDONLY);
+  assert(fd != -1);
+  int rv = fsync(fd);
+  assert(rv == 0);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Makes every directory of the tree, and the deep chain.
+static void make_tree() {
+  char path[PATH_LENGTH];
+  int n = 1;
+  for (int level = 1; level <= config.depth; level++) {
+    n *= config.fanout;
+    for (int dir = 0; dir < n; dir++) {
+      // the first level directories of leaf dir * fanout^(depth-level)
+      int leaf = dir;
+      for (int ii = level; ii < config.depth; ii++) {
+        leaf *= config.fanout;
+      }
+      int len = leaf_path(path, leaf);
+      // cut the path after its first level components
+      int seen = 0;
+      for (int at = 0; at <= len; at++) {
+        if (path[at] == '/' || path[at] == '\0') {
+          if (seen++ == level) {
+            path[at] = '\0';
+            break;
+          }
+        }
+      }
+      int rv = directory_init(path, 040755);
+      assert(rv == 0);
+      arena_reset();
+    }
+  }
+
+  int len = 0;
+  for (int level = 0; level < config.deep; level++) {
+    len += sprintf(deep_path + len, "/deep%d", level);
+    int rv = directory_init(deep_path, 040755);
+    assert(rv == 0);
+    arena_reset();
+  }
+}
+
+// Fills the image with a file of the given size, so the benchmark runs
+// on an image that is not empty.
+static void prefill(int mb) {
+  int rv = storage_mknod("/prefill", 0100644);
+  assert(rv == 0);
+  for (int ii = 0; ii < mb; ii++) {
+    rv = storage_write("/prefill", large_buf, LARGE_CHUNK, (off_t) ii * LARGE_CHUNK);
+    assert(rv == LARGE_CHUNK);
+    arena_reset();
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-i image] [-n files] [-d depth] [-w fanout] [-D deep] "
+                  "[-s small_bytes] [-l large_mb] [-p prefill_mb] [-r repeats] "
+                  "[-a normal|random|sequential] [-H] [-P none|metadata|all] "
+                  "[-R readahead_kb] [-b mmap|pread|direct|memory] [-c cache_mb]\n", prog);
+  exit(1);
+}
+
+// Returns the index of name among the n names, exiting if it is not one.
+static int parse_name(const char *name, const char **names, int n) {
+  for (int ii = 0; ii < n; ii++) {
+    if (strcmp(name, names[ii]) == 0) {
+      return ii;
+    }
+  }
+
+  fprintf(stderr, "unknown value: %s\n", name);
+  exit(1);
+}
+
+// Parses the command line into config.
+static void parse_args(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:d:w:D:s:l:p:r:a:HP:R:b:c:")) != -1) {
+    switch (opt) {
+    case 'i': config.image = optarg; break;
+    case 'n': config.files = atoi(optarg); break;
+    case 'd': config.depth = atoi(optarg); break;
+    case 'w': config.fanout = atoi(optarg); break;
+    case 'D': config.deep = atoi(optarg); break;
+    case 's': config.small = atoi(optarg); break;
+    case 'l': config.large_mb = atoi(optarg); break;
+    case 'p': config.prefill_mb = atoi(optarg); break;
+    case 'r': config.repeats = atoi(optarg); break;
+    case 'a': config.advice = parse_name(optarg, advice_names, 3); break;
+    case 'H': config.hugepages = 1; break;
+    case 'P': config.prefault = parse_name(optarg, prefault_names, 3); break;
+    case 'R': config.readahead_kb = atoi(optarg); break;
+    case 'b':
+      config.backend = backend_find(optarg);
+      if (config.backend == -1) {
+        fprintf(stderr, "unknown value: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'c': config.cache_mb = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  assert(config.files > 0 && config.depth >= 1 && config.fanout >= 1 && config.deep >= 1);
+  assert(config.small > 0 && config.large_mb > 0 && config.repeats > 0 && config.readahead_kb >= 0);
+  assert(config.cache_mb >= 0);
+}
+
+int main(int argc, char *argv[]) {
+  parse_args(argc, argv);
+
+  int most = config.files;
+  most = most > leaves() ? most : leaves();
+  most = most > config.repeats ? most : config.repeats;
+  most = most > config.large_mb ? most : config.large_mb;
+  samples = malloc(sizeof(uint64_t) * most);
+  handles = malloc(sizeof(storage_file_t *) * config.files);
+  small_buf = malloc(config.small);
+  large_buf = malloc(LARGE_CHUNK);
+  assert(samples != NULL && handles != NULL && small_buf != NULL && large_buf != NULL);
+  memset(small_buf, 's', config.small);
+  memset(large_buf, 'l', LARGE_CHUNK);
+
+  unlink(config.image);
+  blocks_set_backend(config.backend);
+  blocks_set_cache((int64_t) config.cache_mb << 20);
+  storage_set_readahead((int64_t) config.readahead_kb * 1024);
+  op_mount(0);
+  prefill(config.prefill_mb);
+  make_tree();
+
+  printf("{\n  \"config\": {\"files\": %d, \"depth\": %d, \"fanout\": %d, \"deep\": %d, "
+         "\"small_bytes\": %d, \"large_mb\": %d, \"prefill_mb\": %d, \"repeats\": %d, "
+         "\"advice\": \"%s\", \"hugepages\": %d, \"prefault\": \"%s\", \"readahead_kb\": %d, "
+         "\"backend\": \"%s\", \"cache_mb\": %d},\n"
+         "  \"results\": [",
+         config.files, config.depth, config.fanout, config.deep, config.small,
+         config.large_mb, config.prefill_mb, config.repeats, advice_names[config.advice],
+         config.hugepages, prefault_names[config.prefault], config.readahead_kb,
+         backend_get(config.backend)->name, config.cache_mb);
+
+  run("mknod", config.files, 0, op_mknod);
+  run("stat", config.files, 0, op_stat);
+  dcache_clear(); // the first lookup walks the directories, the rest hit the cache
+  run("lookup_deep", config.repeats, 0, op_lookup_deep);
+  run("readdir", leaves(), 0, op_readdir);
+
+  for (int ii = 0; ii < config.files; ii++) {
+    char path[PATH_LENGTH];
+    file_path(path, ii, "");
+    handles[ii] = storage_open(path);
+    assert(handles[ii] != NULL);
+    arena_reset();
+  }
+  run("small_write", config.files, config.small, op_small_write);
+  run("small_read", config.files, config.small, op_small_read);
+  run("large_write", config.large_mb, LARGE_CHUNK, op_large_write);
+  run("large_read", config.large_mb, LARGE_CHUNK, op_large_read);
+
+  // a reply has to fit in the pipe, as it is drained only once written
+  int rv = pipe(reply_pipe);
+  reply_null = open("/dev/null", O_WRONLY);
+  if (rv == 0 && reply_null != -1 && fcntl(reply_pipe[1], F_SETPIPE_SZ, LARGE_CHUNK) >= LARGE_CHUNK) {
+    run("pipe_read", config.large_mb, LARGE_CHUNK, op_pipe_read);
+    run("pipe_splice", config.large_mb, LARGE_CHUNK, op_pipe_splice);
+  }
+  close(reply_pipe[0]);
+  close(reply_pipe[1]);
+  close(reply_null);
+
+  for (int ii = 0; ii < config.files; ii++) {
+    storage_release(handles[ii]);
+  }
+
+  if (config.backend != BACKEND_MEMORY) {
+    unmount_cold();
+    run("cold_mount", 1, 0, op_mount);
+    run("cold_stat", config.files, 0, op_stat);
+    char path[PATH_LENGTH];
+    file_path(path, 0, "");
+    handles[0] = storage_open(path);
+    assert(handles[0] != NULL);
+    arena_reset();
+    run("cold_large_read", config.large_mb, LARGE_CHUNK, op_large_read);
+    storage_release(handles[0]);
+  }
+
+  run("rename", config.files, 0, op_rename);
+  run("unlink", config.files, 0, op_unlink);
+
+  int64_t hits = stats_counter(STATS_CACHE_HITS);
+  int64_t misses = stats_counter(STATS_CACHE_MISSES);
+  printf("\n  ],\n  \"cache\": {\"hits\": %ld, \"misses\": %ld, \"hit_rate\": %.4f, "
+         "\"readahead\": %ld, \"evictions\": %ld},\n",
+         (long) hits, (long) misses, hits + misses > 0 ? (double) hits / (hits + misses) : 0.0,
+         (long) stats_counter(STATS_CACHE_READAHEAD), (long) stats_counter(STATS_CACHE_EVICTIONS));
+  printf("  \"image_bytes\": %ld\n}\n", (long) blocks_count() * BLOCK_SIZE);
+
+  blocks_free();
+  unlink(config.image);
+  return 0;
+}
@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "bitmap.h"
 
 #define nth_bit_mask(n) (1 << (n))
@@ -21,16 +25,146 @@ int bitmap_get(void *bm, int i) {
 }
 
 // Set the given bit in the bitmap to the given value.
+// The update is atomic, so threads may flip different bits of the same byte.
 void bitmap_put(void *bm, int i, int v) {
   uint8_t *base = (uint8_t *) bm;
 
-  long bit_mask = nth_bit_mask(bit_index(i));
+  uint8_t bit_mask = nth_bit_mask(bit_index(i));
 
   if (v) {
-    base[byte_index(i)] |= bit_mask;
+    __atomic_fetch_or(&base[byte_index(i)], bit_mask, __ATOMIC_RELAXED);
   } else {
     bit_mask = ~bit_mask;
-    base[byte_index(i)] &= bit_mask;
+    __atomic_fetch_and(&base[byte_index(i)], bit_mask, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns the index of the first word at or after w that is not all ones.
+static int skip_full_words(const uint64_t *words, int w, int nwords) {
+  while (w < nwords && words[w] == ~0ULL) {
+    w++;
+  }
+  return w;
+}
+
+#ifdef __x86_64__
+// Same as skip_full_words, but tests four words per instruction.
+__attribute__((target("avx2")))
+static int skip_full_words_avx2(const uint64_t *words, int w, int nwords) {
+  const __m256i ones = _mm256_set1_epi64x(-1);
+
+  while (w + 4 <= nwords) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (words + w));
+    if (!_mm256_testc_si256(v, ones)) {
+      break;
+    }
+    w += 4;
+  }
+
+  return skip_full_words(words, w, nwords);
+}
+#endif
+
+static int (*skip_full)(const uint64_t *, int, int) = skip_full_words;
+
+// Picks the AVX2 word skipper when the CPU supports it.
+__attribute__((constructor))
+static void bitmap_init_simd() {
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("avx2")) {
+    skip_full = skip_full_words_avx2;
+  }
+#endif
+}
+
+// Find the first clear bit at or after start.
+int bitmap_find_free(void *bm, int start, int size) {
+  const uint64_t *words = (const uint64_t *) bm;
+  int nwords = (size + 63) / 64;
+  int w = start / 64;
+
+  if (start >= size) {
+    return -1;
+  }
+
+  // ignore the bits before start in the first word
+  uint64_t word = ~words[w] & (~0ULL << (start % 64));
+
+  while (word == 0) {
+    w = skip_full(words, w + 1, nwords);
+    if (w >= nwords) {
+      return -1;
+    }
+    word = ~words[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(word);
+  return i < size ? i : -1;
+}
+
+// Returns the index of the first set bit at or after start, or size if
+// there is none.
+static int bitmap_find_set(const uint64_t *words, int start, int size) {
+  int nwords = (size + 63) / 64;
+  int w = start / 64;
+
+  if (start >= size) {
+    return size;
+  }
+
+  uint64_t word = words[w] & (~0ULL << (start % 64));
+
+  while (word == 0) {
+    if (++w >= nwords) {
+      return size;
+    }
+    word = words[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(word);
+  return i < size ? i : size;
+}
+
+// Find the first run of n clear bits at or after start.
+int bitmap_find_run(void *bm, int start, int size, int n) {
+  const uint64_t *words = (const uint64_t *) bm;
+
+  while (start < size) {
+    int first = bitmap_find_free(bm, start, size);
+    if (first == -1) {
+      return -1;
+    }
+
+    // the run ends at the next set bit
+    int end = bitmap_find_set(words, first, size);
+    if (end - first >= n) {
+      return first;
+    }
+
+    start = end;
+  }
+
+  return -1;
+}
+
+// Set n bits starting at i to the given value, a word at a time.
+// Like bitmap_put, each word is updated atomically.
+void bitmap_put_range(void *bm, int i, int n, int v) {
+  uint64_t *words = (uint64_t *) bm;
+
+  while (n > 0) {
+    int bit = i % 64;
+    int len = 64 - bit < n ? 64 - bit : n;
+    uint64_t mask = (len == 64 ? ~0ULL : ((1ULL << len) - 1)) << bit;
+
+    if (v) {
+      __atomic_fetch_or(&words[i / 64], mask, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_and(&words[i / 64], ~mask, __ATOMIC_RELAXED);
+    }
+
+    i += len;
+    n -= len;
   }
 }
 
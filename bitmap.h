@@ -26,6 +26,41 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit at or after start. The bitmap is scanned a
+ * 64-bit word at a time, skipping full words with AVX2 where available.
+ * Bitmaps must be 8-byte aligned and are read as little-endian words.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start The bit index to start searching from.
+ * @param size The number of bits in the bitmap.
+ *
+ * @return The index of the first clear bit, -1 if every bit is set.
+ */
+int bitmap_find_free(void *bm, int start, int size);
+
+/**
+ * Find the first run of n clear bits at or after start.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start The bit index to start searching from.
+ * @param size The number of bits in the bitmap.
+ * @param n The length of the run.
+ *
+ * @return The index of the first bit of the run, -1 if there is none.
+ */
+int bitmap_find_run(void *bm, int start, int size, int n);
+
+/**
+ * Set n bits starting at the given bit to the given value.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param i The first bit index.
+ * @param n The number of bits.
+ * @param v Value the bits should be set to (0 or 1).
+ */
+void bitmap_put_range(void *bm, int i, int n, int v);
+
 /**
  * Pretty-print a bitmap. 
  *
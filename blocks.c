@@ -10,8 +10,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,21 +21,80 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "cache.h"
+#include "journal.h"
+#include "stats.h"
+#include "summary.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+const int BLOCKS_PER_GROUP = 4096 * 8; // one bitmap block per 32K blocks (128MB)
+const int64_t NUFS_SIZE = 4096 * 256; // = 1MB, the image grows from there
+const int64_t NUFS_MAX_SIZE = (int64_t) 1 << 40; // = 1TB of address space
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+const uint32_t NUFS_MAGIC = 0x4e554653; // "NUFS"
+
+// the image never grows by more than this many blocks (1GB) at once
+static const bnum_t GROW_MAX_BLOCKS = 256 * 1024;
+
+#define BLOCKS_BOUNCE 256 // blocks a cached image copies out per write (1MB)
+
+static backend_kind_t blocks_backend_kind = BACKEND_MMAP; // the backend of the next image
+static const backend_t *blocks_backend = NULL;             // the backend of the open image
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static int64_t blocks_size = 0; // the number of bytes currently mapped
+
+// one bit per block changed in the window and not yet written to an
+// unmapped backend, reserved for the largest image
+static uint64_t *blocks_changed = NULL;
+
+static int64_t blocks_cache_bytes = (int64_t) 256 << 20; // the cache cap of the next image
+static int blocks_cache_required = 0; // 1 if the cap was set, so the next image must be cached
+static int blocks_cached = 0; // 1 if the open image's window is cached
+
+static blocks_advice_t blocks_advice = ADVICE_NORMAL; // how the image's pages are used
+static int blocks_hugepages = 0;                       // 1 to ask for huge pages
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // Linux 5.14, missing from older headers
+#endif
+
+static summary_t blocks_summary; // where the free blocks are
+
+// serializes allocation, freeing and growth; block contents are not covered
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a run of blocks written through the mapping and not yet flushed
+typedef struct dirty_range {
+  bnum_t bnum;  // the first block of the run
+  bnum_t count; // the number of blocks in the run
+} dirty_range_t;
+
+// the dirty runs of one owner
+typedef struct dirty_owner {
+  int owner;                // the owner, usually an inum
+  int count;                // the runs in use
+  int cap;                  // the runs allocated
+  dirty_range_t *ranges;    // the runs, in the order they were written
+  struct dirty_owner *next; // the next owner in the same bucket
+} dirty_owner_t;
+
+#define DIRTY_BUCKETS 1024 // the buckets of the dirty owner table
+#define DIRTY_MERGE 1024   // past this many runs, overlapping ones are merged
+
+static dirty_owner_t *dirty_owners[DIRTY_BUCKETS];
+
+// one lock per bucket, so writers to different files rarely meet
+static pthread_mutex_t dirty_locks[DIRTY_BUCKETS] = {
+  [0 ... DIRTY_BUCKETS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
+bnum_t bytes_to_blocks(int64_t bytes) {
+  bnum_t quo = bytes / BLOCK_SIZE;
   int rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
     return quo;
@@ -42,64 +103,766 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Tells the kernel how the mapped bytes at addr are used, with the
+// settings of blocks_set_advice. Mappings made by mmap start out with the
+// defaults, so each new one is advised again.
+static void blocks_advise(void *addr, size_t len) {
+  static const int advice[] = {MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL};
+
+  // failures leave the kernel's defaults, which are always correct
+  if (blocks_advice != ADVICE_NORMAL) {
+    madvise(addr, len, advice[blocks_advice]);
+  }
+  // the cache moves single blocks in and out
+  if (blocks_hugepages && !blocks_cached) {
+    madvise(addr, len, MADV_HUGEPAGE);
+  }
+}
+
+// Backs len bytes of the window at offset: with the same bytes of the
+// image file for a mapped backend, with zeroed memory for the others.
+static void blocks_map(int64_t offset, int64_t len) {
+  void *addr = (char *) blocks_base + offset;
+  void *mapped;
+  if (blocks_backend->mapped) {
+    mapped = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                  blocks_fd, offset);
+  } else {
+    mapped = mmap(addr, len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  }
+  assert(mapped == addr);
+  blocks_advise(addr, len);
+}
+
+// Marks n blocks as changed in the window.
+static void blocks_change(bnum_t bnum, bnum_t n) {
+  for (bnum_t block = bnum; block < bnum + n; block++) {
+    __atomic_fetch_or(&blocks_changed[block / 64], (uint64_t) 1 << (block % 64),
+                      __ATOMIC_RELEASE);
+  }
+}
+
+// Allocates a bounce buffer for blocks_write_window.
+static char *blocks_bounce_alloc() {
+  char *bounce = aligned_alloc(BLOCK_SIZE, (size_t) BLOCKS_BOUNCE * BLOCK_SIZE);
+  assert(bounce != NULL);
+  return bounce;
+}
+
+// Clears the marks of n blocks.
+static void blocks_unchange(bnum_t bnum, bnum_t n) {
+  for (bnum_t block = bnum; block < bnum + n; block++) {
+    __atomic_fetch_and(&blocks_changed[block / 64], ~((uint64_t) 1 << (block % 64)),
+                       __ATOMIC_ACQ_REL);
+  }
+}
+
+// Starts writing n blocks from the window: clears their marks, so a
+// store racing with the write marks its block again. A cached block is
+// pinned until blocks_write_end, or it could be evicted as clean before
+// it was written, and read back from the backend as it was.
+static void blocks_write_begin(bnum_t bnum, bnum_t n) {
+  if (blocks_cached) {
+    cache_pin(bnum, n);
+    cache_clean(bnum, n);
+  } else {
+    blocks_unchange(bnum, n);
+  }
+}
+
+static void blocks_write_end(bnum_t bnum, bnum_t n) {
+  if (blocks_cached) {
+    cache_unpin(bnum, n);
+  }
+}
+
+// Writes n blocks of the window to an unmapped backend, after
+// blocks_write_begin. A cached window is copied to bounce (room for
+// BLOCKS_BOUNCE blocks) and written from there a chunk at a time, as
+// cache.h explains. When careful, gives up at the first chunk that turns
+// out to hold a block of the journal once copied. Returns the first block
+// of that chunk, or -1 once every chunk is written; *failed is set if a
+// write failed.
+static bnum_t blocks_write_window(bnum_t bnum, bnum_t n, char *bounce, int careful, int *failed) {
+  char *data = (char *) blocks_base + (int64_t) BLOCK_SIZE * bnum;
+  if (!blocks_cached) {
+    *failed |= blocks_backend->write(blocks_fd, data, (size_t) n * BLOCK_SIZE,
+                                     (off_t) bnum * BLOCK_SIZE) != 0;
+    return -1;
+  }
+
+  for (bnum_t done = 0; done < n; done += BLOCKS_BOUNCE) {
+    bnum_t chunk = n - done < BLOCKS_BOUNCE ? n - done : BLOCKS_BOUNCE;
+    memcpy(bounce, data + (int64_t) BLOCK_SIZE * done, (size_t) chunk * BLOCK_SIZE);
+
+    // the journal may have taken a block over since it was looked up.
+    // Its stores only come after, so looking again after the copy is
+    // enough to keep them out of the write.
+    if (careful && journal_is_dirty(bnum + done, chunk)) {
+      return bnum + done;
+    }
+
+    *failed |= blocks_backend->write(blocks_fd, bounce, (size_t) chunk * BLOCK_SIZE,
+                                     (off_t) (bnum + done) * BLOCK_SIZE) != 0;
+  }
+  return -1;
+}
+
+// Writes a run of changed blocks to the backend. Blocks the journal holds
+// are left for it to write once their transaction commits, so they stay
+// marked; writing them now would put uncommitted metadata in place.
+static int blocks_write_run(bnum_t bnum, bnum_t n, char *bounce) {
+  if (journal_is_dirty(bnum, n)) {
+    int rv = 0;
+    for (bnum_t block = bnum; block < bnum + n; block++) {
+      if (journal_is_dirty(block, 1)) {
+        blocks_change(block, 1);
+      } else if (blocks_write_run(block, 1, bounce) == -1) {
+        rv = -1;
+      }
+    }
+    return rv;
+  }
+
+  uint64_t start = stats_begin();
+  int failed = 0;
+  blocks_write_begin(bnum, n);
+  bnum_t left = blocks_write_window(bnum, n, bounce, 1, &failed);
+  blocks_write_end(bnum, n);
+  stats_end(STATS_OP_WRITEBACK, start);
+
+  if (failed) {
+    blocks_change(bnum, n); // still to be written
+    return -1;
+  }
+  if (left != -1) {
+    blocks_change(left, bnum + n - left);
+    return blocks_write_run(left, bnum + n - left, bounce);
+  }
+  return 0;
+}
+
+// Writes the changed blocks among the n at bnum to an unmapped backend, in
+// runs.
+static int blocks_write_changed(bnum_t bnum, bnum_t n) {
+  char *bounce = blocks_cached ? blocks_bounce_alloc() : NULL;
+  int rv = 0;
+  bnum_t run = 0; // the first block of the run being gathered
+  bnum_t len = 0; // its length
+
+  for (bnum_t block = bnum; block <= bnum + n; block++) {
+    uint64_t word = 0;
+    if (block < bnum + n) {
+      word = __atomic_load_n(&blocks_changed[block / 64], __ATOMIC_ACQUIRE);
+    }
+
+    // whole words of unchanged blocks are skipped at once
+    if (block % 64 == 0 && block + 64 <= bnum + n && word == 0) {
+      block += 63;
+    } else if ((word >> (block % 64)) & 1) {
+      run = len == 0 ? block : run;
+      len++;
+      continue;
+    }
+
+    if (len > 0 && blocks_write_run(run, len, bounce) == -1) {
+      rv = -1;
+    }
+    len = 0;
+  }
+
+  free(bounce);
+  return rv;
+}
+
+// Select the backend of the images initialized from now on.
+void blocks_set_backend(backend_kind_t kind) {
+  blocks_backend_kind = kind;
+}
+
+// Set the cache cap of the images initialized from now on.
+void blocks_set_cache(int64_t bytes) {
+  blocks_cache_bytes = bytes;
+  blocks_cache_required = bytes > 0;
+}
+
+// Reads n blocks of the image for the cache.
+static int blocks_cache_read(bnum_t bnum, void *buf, bnum_t n) {
+  return blocks_backend->read(blocks_fd, buf, (size_t) n * BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+}
+
+// Writes n blocks of the image for the cache, as it evicts them.
+static int blocks_cache_write(bnum_t bnum, const void *buf, bnum_t n) {
+  return blocks_backend->write(blocks_fd, buf, (size_t) n * BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+}
+
+// Writes back the changed blocks for the cache's background thread. The
+// journal's blocks are skipped, as in blocks_sync.
+static void blocks_cache_flush() {
+  blocks_write_changed(0, blocks_count());
+}
+
+static const cache_io_t blocks_cache_io = {blocks_cache_read, blocks_cache_write,
+                                           blocks_cache_flush};
+
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+int blocks_init(const char *image_path) {
+  // an image that was never freed (as after a simulated crash) is left
+  // as it is, but no longer cached
+  if (blocks_cached) {
+    cache_close();
+    blocks_cached = 0;
+  }
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  blocks_backend = backend_get(blocks_backend_kind);
+
+  int64_t size;
+  int rv = blocks_backend->open(image_path, &blocks_fd, &size);
   assert(rv == 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  // a new image starts out at 1MB, an existing one keeps its size
+  if (size < NUFS_SIZE) {
+    rv = blocks_backend->resize(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+    blocks_size = NUFS_SIZE;
+  } else {
+    blocks_size = size;
+  }
+
+  // reserve the whole address window up front, so growing the image
+  // never moves the blocks we hand out pointers to
+  blocks_base = mmap(0, NUFS_MAX_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
+  // map the image to memory, or cache it, or read it into memory whole
+  // when it cannot be cached (a memory image is never stored, so there is
+  // nothing to cache it from)
+  blocks_map(0, blocks_size);
+  if (!blocks_backend->mapped) {
+    blocks_changed = mmap(0, NUFS_MAX_SIZE / BLOCK_SIZE / 8, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(blocks_changed != MAP_FAILED);
+    int cacheable = blocks_backend_kind != BACKEND_MEMORY && blocks_cache_bytes > 0;
+    blocks_cached = cacheable && cache_open(blocks_base, blocks_size, blocks_cache_bytes,
+                                            blocks_changed, &blocks_cache_io) == 0;
+    if (cacheable && !blocks_cached) {
+      if (blocks_cache_required) {
+        fprintf(stderr, "nufs: userfaultfd is not available to cache the image\n");
+        munmap(blocks_changed, NUFS_MAX_SIZE / BLOCK_SIZE / 8);
+        blocks_changed = NULL;
+        munmap(blocks_base, NUFS_MAX_SIZE);
+        blocks_backend->close(blocks_fd);
+        blocks_fd = -1;
+        return -1;
+      }
+      fprintf(stderr, "nufs: userfaultfd is not available, reading the whole image into memory\n");
+    }
+    if (!blocks_cached && size > 0) {
+      rv = blocks_backend->read(blocks_fd, blocks_base, blocks_size, 0);
+      assert(rv == 0);
+    }
+  }
+
+  // the summary is built on first use, once the image is set up
+  summary_free(&blocks_summary);
+  summary_init(&blocks_summary, get_blocks_bitmap);
+
+  superblock_t *sb = get_superblock();
+  if (sb->magic == NUFS_MAGIC) {
+    assert(sb->block_count * BLOCK_SIZE <= blocks_size);
+    return 0;
+  }
+
+  // formatting does not go through the journal, so every block it may
+  // touch is written out whole
+  blocks_touch(0, blocks_size / BLOCK_SIZE);
+
+  // block 0 stores the superblock and block 1 the bitmap of group 0
+  sb->magic = NUFS_MAGIC;
+  sb->block_size = BLOCK_SIZE;
+  sb->block_count = blocks_size / BLOCK_SIZE;
+
+  void *bbm = get_blocks_bitmap(0);
   bitmap_put(bbm, 0, 1);
+  bitmap_put(bbm, 1, 1);
+
+  return 1;
 }
 
-// Close the disk image.
+// Close the disk image, committing what the journal holds.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  journal_close();
+
+  // what is still only in memory reaches the backend before it goes
+  if (!blocks_backend->mapped) {
+    int rv = blocks_write_changed(0, blocks_size / BLOCK_SIZE);
+    assert(rv == 0);
+    if (blocks_cached) {
+      cache_close();
+      blocks_cached = 0;
+    }
+    munmap(blocks_changed, NUFS_MAX_SIZE / BLOCK_SIZE / 8);
+    blocks_changed = NULL;
+  }
+
+  int rv = munmap(blocks_base, NUFS_MAX_SIZE);
   assert(rv == 0);
+  blocks_backend->close(blocks_fd);
+  blocks_fd = -1;
+
+  blocks_advice = ADVICE_NORMAL;
+  blocks_hugepages = 0;
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(bnum_t bnum) {
+  if (blocks_cached) {
+    cache_reference(bnum, 1);
+  }
+  return (char *) blocks_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+// Get n blocks in a row, returning a pointer to the start of the first.
+void *blocks_get_blocks(bnum_t bnum, bnum_t n) {
+  if (blocks_cached) {
+    cache_reference(bnum, n);
+  }
+  return (char *) blocks_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+// Get the descriptor of the image file, when it is mapped.
+int blocks_get_fd() { return blocks_backend->mapped ? blocks_fd : -1; }
+
+// Return a pointer to the superblock.
+superblock_t *get_superblock() { return (superblock_t *) blocks_get_block(0); }
+
+// Get the number of blocks in the image.
+bnum_t blocks_count() { return get_superblock()->block_count; }
+
+// Return a pointer to the beginning of the bitmap of the given group.
+// Group 0 keeps its bitmap in block 1, after the superblock; every other
+// group keeps it in its own first block.
+void *get_blocks_bitmap(int group) {
+  if (group == 0) {
+    return blocks_get_block(1);
+  }
+
+  return blocks_get_block((bnum_t) group * BLOCKS_PER_GROUP);
+}
+
+// Grow the image to the given number of blocks, with blocks_lock held.
+static int blocks_grow_locked(bnum_t count) {
+  superblock_t *sb = get_superblock();
+  bnum_t old_count = sb->block_count;
+  int64_t new_size = count * BLOCK_SIZE;
+
+  if (count <= old_count) {
+    return 0;
+  }
+  if (new_size > NUFS_MAX_SIZE) {
+    return -1;
+  }
 
-// Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+  // extend the file, then map just the new tail right after the old one.
+  // The file may already be longer, when a crash lost the transaction
+  // that grew it last time.
+  if (new_size > blocks_size) {
+    if (blocks_backend->resize(blocks_fd, new_size) != 0) {
+      return -1;
+    }
+
+    blocks_map(blocks_size, new_size - blocks_size);
+    if (blocks_cached) {
+      cache_grow(new_size);
+    }
+    blocks_size = new_size;
+  }
+
+  // every new group starts with its own (already zeroed) bitmap block
+  int first_group = (old_count + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+  for (bnum_t group = first_group; group * BLOCKS_PER_GROUP < count; group++) {
+    journal_dirty(get_blocks_bitmap(group), BLOCK_SIZE);
+    bitmap_put(get_blocks_bitmap(group), 0, 1);
+  }
+
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->block_count = count;
+  TRACE(BLOCKS_GROW, NULL, NULL, 0, count, new_size);
+  return 0;
+}
+
+// Grow the image to the given number of blocks.
+int blocks_grow(bnum_t count) {
+  pthread_mutex_lock(&blocks_lock);
+  int rv = blocks_grow_locked(count);
+  pthread_mutex_unlock(&blocks_lock);
+  return rv;
+}
+
+// Map the block privately, or back onto the image.
+void blocks_remap(bnum_t bnum, int private) {
+  // an unmapped window is always private. Either way the journal now
+  // writes the block: what it held as a changed block is stale once the
+  // journal takes it over, and written once the journal lets it go. Until
+  // then its only up to date copy is in memory, so the cache keeps it.
+  if (!blocks_backend->mapped) {
+    blocks_unchange(bnum, 1);
+    if (private) {
+      blocks_pin(bnum, 1);
+    } else {
+      blocks_unpin(bnum, 1);
+    }
+    return;
+  }
+
+  void *block = blocks_get_block(bnum);
+  void *mapped = mmap(block, BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                      (private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED, blocks_fd,
+                      (off_t) bnum * BLOCK_SIZE);
+  assert(mapped == block);
+  blocks_advise(block, BLOCK_SIZE);
+}
+
+// Sets the advice for the whole image and applies it to the mapping.
+void blocks_set_advice(blocks_advice_t advice, int hugepages) {
+  pthread_mutex_lock(&blocks_lock);
+  blocks_advice = advice;
+  blocks_hugepages = hugepages;
+  if (advice == ADVICE_NORMAL) {
+    madvise(blocks_base, blocks_size, MADV_NORMAL); // back from earlier advice
+  }
+  blocks_advise(blocks_base, blocks_size);
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+// Faults the blocks in, or starts reading them.
+void blocks_prefetch(bnum_t bnum, bnum_t n, int populate) {
+  char *start = blocks_get_block(bnum);
+  size_t len = (size_t) n * BLOCK_SIZE;
+
+  if (!populate) {
+    madvise(start, len, MADV_WILLNEED);
+    return;
+  }
+
+  // kernels without MADV_POPULATE_READ take a read of every page
+  if (madvise(start, len, MADV_POPULATE_READ) != 0) {
+    for (size_t at = 0; at < len; at += BLOCK_SIZE) {
+      (void) *(volatile char *) (start + at);
+    }
+  }
+}
+
+// Prefetches block 0 and the bitmap of every group.
+void blocks_prefetch_bitmaps(int populate) {
+  bnum_t count = blocks_count();
+
+  blocks_prefetch(0, 2, populate);
+  for (bnum_t group = 1; group * BLOCKS_PER_GROUP < count; group++) {
+    blocks_prefetch(group * BLOCKS_PER_GROUP, 1, populate);
+  }
+}
+
+// Write n blocks to the image.
+void blocks_write(bnum_t bnum, const void *data, bnum_t n) {
+  size_t size = (size_t) n * BLOCK_SIZE;
+
+  // an unmapped window holds the only copy of the image in memory, so it
+  // takes the blocks too, and they are written from there (where they are
+  // aligned, as O_DIRECT needs)
+  if (!blocks_backend->mapped) {
+    void *block = (char *) blocks_base + (int64_t) BLOCK_SIZE * bnum;
+    if (data != block) {
+      memcpy(block, data, size);
+    }
+
+    char *bounce = blocks_cached ? blocks_bounce_alloc() : NULL;
+    int failed = 0;
+    blocks_write_begin(bnum, n);
+    blocks_write_window(bnum, n, bounce, 0, &failed);
+    blocks_write_end(bnum, n);
+    free(bounce);
+    assert(!failed);
+    return;
+  }
+
+  int rv = blocks_backend->write(blocks_fd, data, size, (off_t) bnum * BLOCK_SIZE);
+  assert(rv == 0);
+}
+
+// Flush the image to disk.
+void blocks_sync() {
+  if (!blocks_backend->mapped) {
+    int rv = blocks_write_changed(0, blocks_count());
+    assert(rv == 0);
+  }
+
+  int rv = blocks_backend->sync(blocks_fd);
+  assert(rv == 0);
+}
+
+// Flush the given blocks to disk, along with whatever reached them
+// through blocks_write.
+int blocks_sync_range(bnum_t bnum, bnum_t n) {
+  if (!blocks_backend->mapped) {
+    int rv = blocks_write_changed(bnum, n);
+    if (blocks_cached && cache_read_failed()) {
+      rv = -1;
+    }
+    return blocks_backend->sync(blocks_fd) == 0 ? rv : -1;
+  }
+
+  return msync(blocks_get_block(bnum), (size_t) n * BLOCK_SIZE, MS_SYNC);
+}
+
+// Record blocks changed outside of the journal and of blocks_dirty.
+void blocks_touch(bnum_t bnum, bnum_t n) {
+  if (!blocks_backend->mapped) {
+    blocks_change(bnum, n);
+  }
+}
+
+// Tell whether system calls may be handed pointers into the window.
+int blocks_kernel_access() {
+  return !blocks_cached;
+}
+
+// Keep n blocks in memory.
+void blocks_pin(bnum_t bnum, bnum_t n) {
+  if (blocks_cached) {
+    cache_pin(bnum, n);
+  }
+}
+
+// Let n pinned blocks go.
+void blocks_unpin(bnum_t bnum, bnum_t n) {
+  if (blocks_cached) {
+    cache_unpin(bnum, n);
+  }
+}
+
+// Finds the dirty runs of the owner, with its bucket's lock held. Returns the
+// link pointing at them, which points at NULL if there are none.
+static dirty_owner_t **dirty_find(int owner) {
+  dirty_owner_t **link = &dirty_owners[owner % DIRTY_BUCKETS];
+  while (*link != NULL && (*link)->owner != owner) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Orders runs by their first block, for qsort.
+static int dirty_range_cmp(const void *a, const void *b) {
+  bnum_t x = ((const dirty_range_t *) a)->bnum;
+  bnum_t y = ((const dirty_range_t *) b)->bnum;
+  return (x > y) - (x < y);
+}
+
+// Sorts the owner's runs and merges the ones that overlap or touch.
+static void dirty_merge(dirty_owner_t *dirty) {
+  qsort(dirty->ranges, dirty->count, sizeof(dirty_range_t), dirty_range_cmp);
+
+  int kept = 0;
+  for (int ii = 1; ii < dirty->count; ii++) {
+    dirty_range_t *last = &dirty->ranges[kept];
+    dirty_range_t *next = &dirty->ranges[ii];
+    if (next->bnum <= last->bnum + last->count) {
+      bnum_t end = next->bnum + next->count;
+      if (end > last->bnum + last->count) {
+        last->count = end - last->bnum;
+      }
+    } else {
+      dirty->ranges[++kept] = *next;
+    }
+  }
+  dirty->count = kept + 1;
+}
+
+// Record n blocks the owner wrote through the mapping.
+void blocks_dirty(int owner, bnum_t bnum, bnum_t n) {
+  blocks_touch(bnum, n);
+
+  pthread_mutex_lock(&dirty_locks[owner % DIRTY_BUCKETS]);
+  dirty_owner_t **link = dirty_find(owner);
+  if (*link == NULL) {
+    *link = calloc(1, sizeof(dirty_owner_t));
+    assert(*link != NULL);
+    (*link)->owner = owner;
+  }
+  dirty_owner_t *dirty = *link;
+
+  // sequential writes and rewrites just stretch the last run
+  if (dirty->count > 0) {
+    dirty_range_t *last = &dirty->ranges[dirty->count - 1];
+    if (bnum >= last->bnum && bnum <= last->bnum + last->count) {
+      if (bnum + n > last->bnum + last->count) {
+        last->count = bnum + n - last->bnum;
+      }
+      pthread_mutex_unlock(&dirty_locks[owner % DIRTY_BUCKETS]);
+      return;
+    }
+  }
+
+  if (dirty->count == dirty->cap && dirty->cap >= DIRTY_MERGE) {
+    dirty_merge(dirty);
+  }
+  if (dirty->count == dirty->cap) {
+    dirty->cap = dirty->cap == 0 ? 4 : dirty->cap * 2;
+    dirty->ranges = realloc(dirty->ranges, sizeof(dirty_range_t) * dirty->cap);
+    assert(dirty->ranges != NULL);
+  }
+
+  dirty->ranges[dirty->count].bnum = bnum;
+  dirty->ranges[dirty->count].count = n;
+  dirty->count++;
+  pthread_mutex_unlock(&dirty_locks[owner % DIRTY_BUCKETS]);
+}
+
+// Takes the owner's dirty runs out of the table.
+static dirty_owner_t *dirty_take(int owner) {
+  pthread_mutex_lock(&dirty_locks[owner % DIRTY_BUCKETS]);
+  dirty_owner_t **link = dirty_find(owner);
+  dirty_owner_t *dirty = *link;
+  if (dirty != NULL) {
+    *link = dirty->next;
+  }
+  pthread_mutex_unlock(&dirty_locks[owner % DIRTY_BUCKETS]);
+  return dirty;
+}
+
+// Flush the blocks the owner dirtied to disk.
+int blocks_flush(int owner) {
+  dirty_owner_t *dirty = dirty_take(owner);
+  if (dirty == NULL) {
+    return 0;
+  }
 
-// Return a pointer to the beginning of the inode table bitmap.
-void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  // flushing in block order lets neighbouring runs go out together
+  dirty_merge(dirty);
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+  // each run is flushed with msync, or written out with a single sync
+  // after the last one
+  int rv = 0;
+  for (int ii = 0; ii < dirty->count; ii++) {
+    bnum_t bnum = dirty->ranges[ii].bnum;
+    bnum_t count = dirty->ranges[ii].count;
+    int failed = blocks_backend->mapped ? blocks_sync_range(bnum, count) == -1
+                                        : blocks_write_changed(bnum, count) == -1;
+    if (failed) {
+      rv = -1;
+    }
+  }
+  if (!blocks_backend->mapped && blocks_backend->sync(blocks_fd) != 0) {
+    rv = -1;
+  }
+  if (blocks_cached && cache_read_failed()) {
+    rv = -1;
+  }
+
+  TRACE(BLOCKS_FLUSH, NULL, NULL, rv, owner, dirty->count);
+  free(dirty->ranges);
+  free(dirty);
+  return rv;
+}
+
+// Forget the blocks the owner dirtied.
+void blocks_forget(int owner) {
+  dirty_owner_t *dirty = dirty_take(owner);
+  if (dirty != NULL) {
+    free(dirty->ranges);
+    free(dirty);
+  }
+}
+
+// Brings the free block summary up to date with the size of the image.
+static void blocks_summary_load() {
+  bnum_t count = blocks_count();
+
+  if (blocks_summary.bits != count) {
+    summary_resize(&blocks_summary, count);
+  }
+}
+
+// Find and mark n contiguous free blocks, with blocks_lock held.
+static bnum_t alloc_blocks_locked(bnum_t n) {
+  superblock_t *sb = get_superblock();
+  blocks_summary_load();
+
+  int64_t scanned = blocks_summary.scanned;
+  bnum_t bnum = summary_find(&blocks_summary, sb->block_cursor, n);
+  stats_add(STATS_BITMAP_SCANS, 1);
+  stats_add(STATS_BITMAP_GROUPS, blocks_summary.scanned - scanned);
+  if (bnum == -1) {
+    return -1;
+  }
+
+  void *bbm = get_blocks_bitmap(bnum / BLOCKS_PER_GROUP);
+  journal_dirty(bbm, BLOCK_SIZE);
+  bitmap_put_range(bbm, bnum % BLOCKS_PER_GROUP, n, 1);
+  summary_update(&blocks_summary, bnum, n, 1);
+
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->block_cursor = bnum + n;
+
+  stats_add(STATS_BLOCK_ALLOCS, 1);
+  stats_add(STATS_BLOCKS_ALLOCATED, n);
+  TRACE(ALLOC_BLOCKS, NULL, NULL, bnum, n);
+  return bnum;
+}
+
+// Allocate n contiguous blocks, starting the search at the cursor.
+bnum_t alloc_blocks(bnum_t n) {
+  pthread_mutex_lock(&blocks_lock);
+  bnum_t bnum = alloc_blocks_locked(n);
+  pthread_mutex_unlock(&blocks_lock);
+  return bnum;
 }
 
 // Allocate a new block and return its index.
-int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+bnum_t alloc_block() {
+  pthread_mutex_lock(&blocks_lock);
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  bnum_t bnum;
+  while ((bnum = alloc_blocks_locked(1)) == -1) {
+    // every block is in use, so double the image (up to 1GB at a time)
+    bnum_t count = blocks_count();
+    bnum_t step = count < GROW_MAX_BLOCKS ? count : GROW_MAX_BLOCKS;
+    if (blocks_grow_locked(count + step) == -1) {
+      break;
     }
   }
 
-  return -1;
+  pthread_mutex_unlock(&blocks_lock);
+  return bnum;
 }
 
 // Deallocate the block with the given index.
-void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+void free_block(bnum_t bnum) {
+  free_blocks(bnum, 1);
+}
+
+// Deallocate n contiguous blocks starting at the given index.
+void free_blocks(bnum_t bnum, bnum_t n) {
+  TRACE(FREE_BLOCKS, NULL, NULL, 0, bnum, n);
+  stats_add(STATS_BLOCK_FREES, 1);
+  stats_add(STATS_BLOCKS_FREED, n);
+  pthread_mutex_lock(&blocks_lock);
+  blocks_summary_load();
+
+  // clear the range one group bitmap at a time
+  while (n > 0) {
+    int bit = bnum % BLOCKS_PER_GROUP;
+    bnum_t len = BLOCKS_PER_GROUP - bit < n ? BLOCKS_PER_GROUP - bit : n;
+
+    void *bbm = get_blocks_bitmap(bnum / BLOCKS_PER_GROUP);
+    journal_dirty(bbm, BLOCK_SIZE);
+    bitmap_put_range(bbm, bit, len, 0);
+    summary_update(&blocks_summary, bnum, len, 0);
+    bnum += len;
+    n -= len;
+  }
+
+  pthread_mutex_unlock(&blocks_lock);
 }
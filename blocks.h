@@ -4,18 +4,49 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The disk image lives in a reserved address window, so block data is
+ * accessed using pointers. The image starts small and grows on demand, and
+ * block pointers stay valid across growth. How the window is backed is up
+ * to the image's backend (see backend.h): by default the image file is
+ * mmapped into it. The window of an unmapped backend is kept by the buffer
+ * cache (see cache.h) where userfaultfd is available. Allocating, freeing
+ * and growing are safe to call from several threads.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#include "backend.h"
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+typedef int64_t bnum_t; // a block number, -1 when no block is available
+
+extern const int BLOCK_SIZE;       // default = 4K
+extern const int BLOCKS_PER_GROUP; // blocks tracked by one bitmap block = 32K
+extern const int64_t NUFS_SIZE;     // size of a freshly formatted image = 1MB
+extern const int64_t NUFS_MAX_SIZE; // the largest the image may grow = 1TB
+
+extern const uint32_t NUFS_MAGIC; // marks a formatted image
+
+// how the pages of the image are expected to be used, as told to the
+// kernel with madvise
+typedef enum blocks_advice {
+  ADVICE_NORMAL,     // read around the faulting page (the kernel's default)
+  ADVICE_RANDOM,     // read just the faulting page
+  ADVICE_SEQUENTIAL, // read far ahead of faults and drop pages behind them
+} blocks_advice_t;
+
+// struct stored at the beginning of block 0 describing the image
+typedef struct superblock {
+  uint32_t magic;      // NUFS_MAGIC once the image has been formatted
+  uint32_t block_size; // the size of a block in bytes
+  bnum_t block_count;  // the number of blocks in the image
+  bnum_t block_cursor; // where the next block search starts (next-fit)
+  int inode_cursor;    // where the next inode search starts (next-fit)
+  bnum_t journal_start; // the first block of the journal, 0 if there is none yet
+  int journal_blocks;   // the number of blocks in the journal
+} superblock_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -24,17 +55,41 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+bnum_t bytes_to_blocks(int64_t bytes);
 
 /**
- * Load and initialize the given disk image.
+ * Select the backend images are opened with by blocks_init from now on.
+ * The default is BACKEND_MMAP.
+ *
+ * @param kind The backend.
+ */
+void blocks_set_backend(backend_kind_t kind);
+
+/**
+ * Set how much memory the buffer cache of images opened by blocks_init
+ * from now on may hold, for backends other than mmap and memory. 0 does
+ * without the cache and reads the whole image into memory, as happens
+ * (with a warning) when userfaultfd is not available. The default is
+ * 256MB; an image opened after a cap was set here must be cached, and
+ * fails to open where it cannot be.
+ *
+ * @param bytes The cap in bytes.
+ */
+void blocks_set_cache(int64_t bytes);
+
+/**
+ * Load and initialize the given disk image, formatting it if it is new.
  *
  * @param image_path Path to the disk image file.
+ *
+ * @return 1 if the image was just formatted, 0 if it already existed, -1
+ *         if it had to be cached and could not be.
  */
-void blocks_init(const char *image_path);
+int blocks_init(const char *image_path);
 
 /**
- * Close the disk image.
+ * Close the disk image, committing and checkpointing the journal first.
+ * Whatever an unmapped backend still holds only in memory is written out.
  */
 void blocks_free();
 
@@ -45,36 +100,239 @@ void blocks_free();
  *
  * @return Pointer to the beginning of the block in memory.
  */
-void *blocks_get_block(int bnum);
+void *blocks_get_block(bnum_t bnum);
+
+/**
+ * Get n blocks in a row, returning a pointer to the start of the first.
+ * The same as blocks_get_block, but the cache counts a lookup of each.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ *
+ * @return Pointer to the beginning of the first block in memory.
+ */
+void *blocks_get_blocks(bnum_t bnum, bnum_t n);
+
+/**
+ * Return the file descriptor of the image, so its blocks can be read
+ * from the file (with splice) instead of through the mapping. Block
+ * bnum starts at offset bnum * BLOCK_SIZE. Only a mapped image's file is
+ * kept as current as the mapping.
+ *
+ * @return The descriptor, open for reading and writing, or -1 if the
+ *         image is not mapped.
+ */
+int blocks_get_fd();
+
+/**
+ * Return a pointer to the superblock in block 0.
+ *
+ * @return A pointer to the superblock.
+ */
+superblock_t *get_superblock();
 
 /**
- * Return a pointer to the beginning of the block bitmap.
+ * Get the number of blocks currently in the image.
  *
- * @return A pointer to the beginning of the free blocks bitmap.
+ * @return The number of blocks in the image.
  */
-void *get_blocks_bitmap();
+bnum_t blocks_count();
 
 /**
- * Return a pointer to the beginning of the inode table bitmap.
+ * Return a pointer to the beginning of the bitmap of the given block group.
+ * Group g covers blocks [g * BLOCKS_PER_GROUP, (g + 1) * BLOCKS_PER_GROUP).
+ *
+ * @param group The index of the block group.
+ *
+ * @return A pointer to the beginning of the group's free blocks bitmap.
+ */
+void *get_blocks_bitmap(int group);
+
+/**
+ * Grow the disk image to hold the given number of blocks.
+ * The file is extended and the new range mapped in place.
+ *
+ * @param count The new number of blocks.
  *
- * @return A pointer to the beginning of the free inode bitmap.
+ * @return 0 on success, -1 if the image cannot grow that large.
  */
-void *get_inode_bitmap();
+int blocks_grow(bnum_t count);
+
+/**
+ * Map the given block privately, so stores to it stay in memory, or back
+ * onto the image. A private block must be written with blocks_write
+ * before it is mapped back, or its changes are lost. The window of an
+ * unmapped backend is always private; the block is only kept from being
+ * written with the other changed blocks, and pinned in the cache while
+ * private.
+ *
+ * @param bnum The block number.
+ * @param private 1 to map the block privately, 0 to share it again.
+ */
+void blocks_remap(bnum_t bnum, int private);
+
+/**
+ * Set how the kernel should expect the image's pages to be used, and
+ * whether to back them with transparent huge pages (which only takes
+ * effect when the image's file system supports huge pages in the page
+ * cache, like tmpfs mounted with huge=advise). Both apply to the whole
+ * image and stay in effect as it grows and as the journal remaps blocks:
+ * advice for a single block would be lost with its mapping, and would
+ * keep the kernel from merging its mapping with its neighbours. Huge
+ * pages, once asked for, stay asked for until the image is closed.
+ *
+ * @param advice How the pages are used.
+ * @param hugepages 1 to ask for huge pages, 0 not to.
+ */
+void blocks_set_advice(blocks_advice_t advice, int hugepages);
+
+/**
+ * Read n blocks into memory ahead of their use. Populating maps them in
+ * now, so the first access to each takes no fault; otherwise they are
+ * only read into the page cache in the background, and the first access
+ * takes a minor fault rather than a major one.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ * @param populate 1 to map the blocks in, 0 only to start reading them.
+ */
+void blocks_prefetch(bnum_t bnum, bnum_t n, int populate);
+
+/**
+ * Read the superblock and the bitmap of every block group into memory,
+ * as blocks_prefetch does.
+ *
+ * @param populate 1 to map the blocks in, 0 only to start reading them.
+ */
+void blocks_prefetch_bitmaps(int populate);
+
+/**
+ * Write n blocks to the image file, bypassing the mapping. An unmapped
+ * backend's window takes the blocks as well.
+ *
+ * @param bnum The first block number to write.
+ * @param data The contents of the blocks.
+ * @param n The number of blocks.
+ */
+void blocks_write(bnum_t bnum, const void *data, bnum_t n);
+
+/**
+ * Flush everything written to the image file to disk. An unmapped backend
+ * first writes every changed block, except those the journal holds.
+ */
+void blocks_sync();
+
+/**
+ * Flush n blocks of the image file to disk, however they were written.
+ *
+ * @param bnum The first block number to flush.
+ * @param n The number of blocks.
+ *
+ * @return 0 on success, -1 if the flush failed.
+ */
+int blocks_sync_range(bnum_t bnum, bnum_t n);
+
+/**
+ * Record that n blocks were changed in memory without the journal or
+ * blocks_dirty, as when formatting, so an unmapped backend writes them at
+ * the next flush. Stores through a mapping need no record.
+ *
+ * @param bnum The first block number changed.
+ * @param n The number of blocks.
+ */
+void blocks_touch(bnum_t bnum, bnum_t n);
+
+/**
+ * Tell whether the kernel can reach the window, so that pointers into it
+ * may be handed to system calls. A cached window only serves the faults
+ * the process takes itself (see cache.h), so what a system call reads
+ * from or writes to it must go through a copy.
+ *
+ * @return 1 if system calls may use pointers into the window, 0 if not.
+ */
+int blocks_kernel_access();
+
+/**
+ * Keep n blocks in memory until they are unpinned, when the image is
+ * cached. Pins nest.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void blocks_pin(bnum_t bnum, bnum_t n);
+
+/**
+ * Let go of a pin taken by blocks_pin.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void blocks_unpin(bnum_t bnum, bnum_t n);
+
+/**
+ * Record that n blocks were written through the mapping on behalf of the
+ * given owner (a file), so blocks_flush can find them.
+ *
+ * @param owner The owner of the blocks, usually an inum.
+ * @param bnum The first block number written.
+ * @param n The number of blocks.
+ */
+void blocks_dirty(int owner, bnum_t bnum, bnum_t n);
+
+/**
+ * Flush the blocks recorded for the owner to disk and forget them. Costs
+ * only as much as the owner has dirtied since it was last flushed.
+ *
+ * @param owner The owner of the blocks.
+ *
+ * @return 0 on success, -1 if a flush failed.
+ */
+int blocks_flush(int owner);
+
+/**
+ * Forget the blocks recorded for the owner without flushing them, as when
+ * they are freed.
+ *
+ * @param owner The owner of the blocks.
+ */
+void blocks_forget(int owner);
 
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the previous allocation and marks it
+ * as allocated, growing the image when every block is in use.
+ *
+ * @return The index of the newly allocated block, -1 if the image is full.
+ */
+bnum_t alloc_block();
+
+/**
+ * Allocate n contiguous blocks and return the number of the first one.
+ *
+ * Searches for a run of free blocks starting after the previous
+ * allocation and wrapping around once. Runs never span block groups and
+ * the image is not grown.
+ *
+ * @param n The number of blocks, less than BLOCKS_PER_GROUP.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the first block of the run, -1 if there is none.
  */
-int alloc_block();
+bnum_t alloc_blocks(bnum_t n);
 
 /**
  * Deallocate the block with the given number.
  *
  * @param bnun The block number to deallocate.
  */
-void free_block(int bnum);
+void free_block(bnum_t bnum);
+
+/**
+ * Deallocate n contiguous blocks starting at the given number.
+ *
+ * @param bnum The first block number to deallocate.
+ * @param n The number of blocks.
+ */
+void free_blocks(bnum_t bnum, bnum_t n);
 
 #endif
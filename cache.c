@@ -0,0 +1,677 @@
+/**
+ * @file cache.c
+ *
+ * Implementation of the buffer cache of unmapped images.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "stats.h"
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1 // from Linux 5.11 on
+#endif
+
+// struct holding the state of one block of the image, resident or not
+typedef struct cache_block {
+  uint32_t slot;   // 1 + the index of the block's entry in its shard, 0 if not resident
+  uint32_t ghost;  // the shard's out_seq when the block left A1in, 0 if it never did
+  uint16_t pins;   // the pins keeping the block resident
+  uint8_t ref;     // set by lookups, cleared as the clock passes
+} cache_block_t;
+
+// the queue an entry is in
+enum { CACHE_FREE, CACHE_IN, CACHE_AM };
+
+// struct holding a resident block, linked into one of its shard's queues
+typedef struct cache_entry {
+  bnum_t bnum;   // the block
+  uint32_t prev; // 1 + the index of the newer neighbour, 0 at the head
+  uint32_t next; // 1 + the index of the older neighbour, 0 at the tail
+  int queue;     // CACHE_FREE, CACHE_IN or CACHE_AM
+} cache_entry_t;
+
+// struct holding a queue of entries, newest first
+typedef struct cache_queue {
+  uint32_t head;
+  uint32_t tail;
+  int64_t count;
+} cache_queue_t;
+
+// struct holding one shard of the cache, guarded by its lock
+typedef struct cache_shard {
+  pthread_mutex_t lock;
+  cache_entry_t *entries; // room for every resident block of the shard
+  uint32_t used;          // the entries ever handed out
+  uint32_t allocated;     // the entries there is room for
+  uint32_t free;          // 1 + the first free entry, chained through next
+  int64_t cap;            // the most blocks the shard keeps resident
+  cache_queue_t in;       // A1in, blocks faulted in once
+  cache_queue_t am;       // Am, blocks faulted in again while remembered
+  int64_t in_cap;         // the share of cap A1in may hold before Am is touched
+  uint32_t out_seq;       // the blocks pushed out of A1in so far
+  uint32_t out_cap;       // how many of the latest of those A1out remembers
+} cache_shard_t;
+
+static int cache_fd = -1;      // the userfaultfd, -1 when not caching
+static int cache_stop_fd = -1; // an eventfd that stops the fault thread
+static char *cache_base;       // the window
+static int64_t cache_size;     // the bytes of the window registered
+static uint64_t *cache_changed; // one bit per changed block, shared with blocks.c
+static cache_io_t cache_io;
+static char *cache_buf;         // where blocks are read and written, aligned for O_DIRECT
+static int cache_failed = 0;    // 1 once a read failed, until cache_read_failed reports it
+
+static cache_block_t *cache_blocks; // reserved for every block of the largest image
+static cache_shard_t cache_shards[CACHE_SHARDS] = {
+  [0 ... CACHE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+static pthread_t cache_fault_thread;
+static pthread_t cache_writeback_thread;
+static pthread_mutex_t cache_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_run_cond = PTHREAD_COND_INITIALIZER;
+static int cache_running = 0; // 1 while the write-back thread runs
+static int cache_kicked = 0;  // 1 to write back now rather than at the next interval
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// Returns the shard of the given block. Clusters of blocks share a shard,
+// so a sequential fault reads into a single one.
+static cache_shard_t *cache_shard(bnum_t bnum) {
+  return &cache_shards[(bnum / CACHE_CLUSTER) % CACHE_SHARDS];
+}
+
+// Returns the start of the given block in the window.
+static char *cache_addr(bnum_t bnum) {
+  return cache_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+// Returns the number of blocks in the window.
+static bnum_t cache_count() {
+  return __atomic_load_n(&cache_size, __ATOMIC_RELAXED) / BLOCK_SIZE;
+}
+
+static void cache_mark(bnum_t bnum) {
+  __atomic_fetch_or(&cache_changed[bnum / 64], (uint64_t) 1 << (bnum % 64), __ATOMIC_RELEASE);
+}
+
+static int cache_is_changed(bnum_t bnum) {
+  uint64_t word = __atomic_load_n(&cache_changed[bnum / 64], __ATOMIC_ACQUIRE);
+  return (word >> (bnum % 64)) & 1;
+}
+
+static void cache_unmark(bnum_t bnum) {
+  __atomic_fetch_and(&cache_changed[bnum / 64], ~((uint64_t) 1 << (bnum % 64)), __ATOMIC_ACQ_REL);
+}
+
+static cache_entry_t *cache_entry(cache_shard_t *shard, uint32_t id) {
+  return &shard->entries[id - 1];
+}
+
+// Links the entry in at the head of the queue.
+static void cache_push(cache_shard_t *shard, cache_queue_t *queue, uint32_t id) {
+  cache_entry_t *entry = cache_entry(shard, id);
+  entry->prev = 0;
+  entry->next = queue->head;
+  if (queue->head != 0) {
+    cache_entry(shard, queue->head)->prev = id;
+  } else {
+    queue->tail = id;
+  }
+  queue->head = id;
+  queue->count++;
+}
+
+// Unlinks the entry from the queue.
+static void cache_unlink(cache_shard_t *shard, cache_queue_t *queue, uint32_t id) {
+  cache_entry_t *entry = cache_entry(shard, id);
+  if (entry->prev != 0) {
+    cache_entry(shard, entry->prev)->next = entry->next;
+  } else {
+    queue->head = entry->next;
+  }
+  if (entry->next != 0) {
+    cache_entry(shard, entry->next)->prev = entry->prev;
+  } else {
+    queue->tail = entry->prev;
+  }
+  queue->count--;
+}
+
+// Takes a free entry of the shard, making room for more when there is
+// none. Entries are only touched with the shard's lock held, so they may
+// move.
+static uint32_t cache_entry_alloc(cache_shard_t *shard) {
+  if (shard->free != 0) {
+    uint32_t id = shard->free;
+    shard->free = cache_entry(shard, id)->next;
+    return id;
+  }
+
+  if (shard->used == shard->allocated) {
+    shard->allocated = shard->allocated == 0 ? 1024 : shard->allocated * 2;
+    shard->entries = realloc(shard->entries, sizeof(cache_entry_t) * shard->allocated);
+    assert(shard->entries != NULL);
+  }
+  return ++shard->used;
+}
+
+static void cache_entry_free(cache_shard_t *shard, uint32_t id) {
+  cache_entry(shard, id)->queue = CACHE_FREE;
+  cache_entry(shard, id)->next = shard->free;
+  shard->free = id;
+}
+
+// Wakes the threads waiting on faults in len bytes at addr.
+static void cache_wake(char *addr, size_t len) {
+  struct uffdio_range range = {(uintptr_t) addr, len};
+  int rv = ioctl(cache_fd, UFFDIO_WAKE, &range);
+  assert(rv == 0);
+}
+
+// Write-protects len bytes at addr, or lifts the protection and wakes the
+// stores waiting on it.
+static void cache_protect(char *addr, size_t len, int protect) {
+  struct uffdio_writeprotect wp = {{(uintptr_t) addr, len}, protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0};
+  while (ioctl(cache_fd, UFFDIO_WRITEPROTECT, &wp) == -1) {
+    assert(errno == EAGAIN);
+  }
+}
+
+// Puts len bytes from src into the missing pages at dst without waking
+// anyone, write-protected or not. A page that is there already is kept.
+static void cache_copy(char *dst, const char *src, size_t len, int protect) {
+  size_t done = 0;
+  while (done < len) {
+    struct uffdio_copy copy = {(uintptr_t) (dst + done), (uintptr_t) (src + done), len - done,
+                               UFFDIO_COPY_MODE_DONTWAKE | (protect ? UFFDIO_COPY_MODE_WP : 0), 0};
+    if (ioctl(cache_fd, UFFDIO_COPY, &copy) == 0) {
+      return;
+    }
+    assert(errno == EAGAIN || errno == EEXIST);
+    if (copy.copy > 0) {
+      done += copy.copy;
+    } else if (errno == EEXIST) {
+      done += BLOCK_SIZE;
+    }
+  }
+}
+
+// Wakes the write-back thread early.
+static void cache_kick() {
+  pthread_mutex_lock(&cache_run_lock);
+  cache_kicked = 1;
+  pthread_cond_signal(&cache_run_cond);
+  pthread_mutex_unlock(&cache_run_lock);
+}
+
+// Writes back a changed block about to be evicted, with its shard's lock
+// held. Returns 0, or -1 if the write failed and the block stays.
+static int cache_writeback(bnum_t bnum) {
+  uint64_t start = stats_begin();
+
+  cache_clean(bnum, 1);
+  memcpy(cache_buf, cache_addr(bnum), BLOCK_SIZE);
+  if (cache_io.write(bnum, cache_buf, 1) != 0) {
+    cache_mark(bnum);
+    return -1;
+  }
+
+  stats_end(STATS_OP_WRITEBACK, start);
+  return 0;
+}
+
+// Evicts one block of the queue, with the shard's lock held. Looks at up
+// to limit blocks from the tail; pinned blocks, (in Am) referenced blocks
+// and changed blocks go back to the head instead, unless write is set:
+// then changed blocks are written back and evicted. Returns 0, or -1 if
+// none of them could go.
+static int cache_evict_from(cache_shard_t *shard, cache_queue_t *queue, int64_t limit, int write) {
+  int in = queue == &shard->in;
+
+  for (int64_t ii = 0; ii < limit && queue->count > 0; ii++) {
+    uint32_t id = queue->tail;
+    bnum_t bnum = cache_entry(shard, id)->bnum;
+    cache_block_t *block = &cache_blocks[bnum];
+
+    int passed = block->pins > 0;
+    if (!passed && !in) {
+      passed = __atomic_exchange_n(&block->ref, 0, __ATOMIC_RELAXED);
+    }
+    if (!passed && cache_is_changed(bnum)) {
+      if (!write) {
+        cache_kick(); // the write-back thread cleans it for next time
+      }
+      passed = !write || cache_writeback(bnum) == -1;
+    }
+
+    // stores that fault from now on find the page missing and read it again
+    if (!passed) {
+      passed = madvise(cache_addr(bnum), BLOCK_SIZE, MADV_DONTNEED) != 0;
+    }
+    if (passed) {
+      cache_unlink(shard, queue, id);
+      cache_push(shard, queue, id);
+      continue;
+    }
+
+    cache_unlink(shard, queue, id);
+    cache_entry_free(shard, id);
+    __atomic_store_n(&block->slot, 0, __ATOMIC_RELAXED);
+
+    // A1out only remembers what leaves A1in
+    if (in) {
+      if (++shard->out_seq == 0) {
+        shard->out_seq = 1;
+      }
+      block->ghost = shard->out_seq;
+    }
+
+    stats_add(STATS_CACHE_EVICTIONS, 1);
+    return 0;
+  }
+
+  return -1;
+}
+
+// Evicts one block of the shard, with its lock held: from A1in while it
+// holds more than its share, else from Am, going round its clock twice
+// at most. Changed blocks are left to the write-back thread, and only
+// written back here (stalling the faults on the shard) when every block
+// that could go is changed. Returns -1 if every block is pinned.
+static int cache_evict(cache_shard_t *shard) {
+  for (int write = 0; write <= 1; write++) {
+    if (shard->in.count > shard->in_cap &&
+        cache_evict_from(shard, &shard->in, shard->in.count, write) == 0) {
+      return 0;
+    }
+    if (cache_evict_from(shard, &shard->am, 2 * shard->am.count, write) == 0 ||
+        cache_evict_from(shard, &shard->in, shard->in.count, write) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Makes the block resident in the shard, with its lock held: in Am if
+// A1out remembers it, else in A1in.
+static void cache_insert(cache_shard_t *shard, bnum_t bnum) {
+  cache_block_t *block = &cache_blocks[bnum];
+  int remembered = block->ghost != 0 && shard->out_seq - block->ghost < shard->out_cap;
+
+  uint32_t id = cache_entry_alloc(shard);
+  cache_entry_t *entry = cache_entry(shard, id);
+  entry->bnum = bnum;
+  entry->queue = remembered ? CACHE_AM : CACHE_IN;
+  cache_push(shard, remembered ? &shard->am : &shard->in, id);
+
+  block->ghost = 0;
+  __atomic_store_n(&block->ref, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&block->slot, id, __ATOMIC_RELAXED);
+}
+
+// Reads in the block a thread faulted on, and the rest of its cluster
+// when the block before it is resident (the faults look sequential).
+// Blocks come in write-protected, unless a store faulted: then they are
+// changed already, as the stores will likely go on through the cluster.
+// The faulting thread cannot be failed, so a block that cannot be read
+// comes in as zeros, and the error is kept for cache_read_failed.
+static void cache_fault_missing(bnum_t bnum, int write) {
+  cache_shard_t *shard = cache_shard(bnum);
+  pthread_mutex_lock(&shard->lock);
+
+  if (cache_blocks[bnum].slot == 0) {
+    bnum_t count = cache_count();
+    bnum_t n = 1;
+    if (bnum > 0 && __atomic_load_n(&cache_blocks[bnum - 1].slot, __ATOMIC_RELAXED) != 0) {
+      while (n < CACHE_CLUSTER - bnum % CACHE_CLUSTER && bnum + n < count &&
+             cache_blocks[bnum + n].slot == 0) {
+        n++;
+      }
+    }
+
+    // past the cap only when nothing can go
+    while (shard->in.count + shard->am.count + n > shard->cap && cache_evict(shard) == 0) {
+    }
+
+    int rv = cache_io.read(bnum, cache_buf, n);
+    if (rv != 0 && n > 1) {
+      n = 1; // the rest of the cluster can wait to be faulted on
+      rv = cache_io.read(bnum, cache_buf, n);
+    }
+    if (rv != 0) {
+      memset(cache_buf, 0, BLOCK_SIZE);
+      __atomic_store_n(&cache_failed, 1, __ATOMIC_RELAXED);
+    }
+
+    for (bnum_t ii = 0; ii < n; ii++) {
+      cache_insert(shard, bnum + ii);
+    }
+    for (bnum_t ii = 0; write && ii < n; ii++) {
+      cache_mark(bnum + ii);
+    }
+    cache_copy(cache_addr(bnum), cache_buf, n * BLOCK_SIZE, !write);
+
+    stats_add(STATS_CACHE_MISSES, 1);
+    stats_add(STATS_CACHE_READAHEAD, n - 1);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  cache_wake(cache_addr(bnum), BLOCK_SIZE);
+}
+
+// Lets the first store to a clean block through, marking it changed.
+static void cache_fault_protected(bnum_t bnum) {
+  cache_shard_t *shard = cache_shard(bnum);
+  pthread_mutex_lock(&shard->lock);
+
+  // an evicted block is read in again when the store retries
+  if (cache_blocks[bnum].slot != 0) {
+    cache_mark(bnum);
+  }
+  cache_protect(cache_addr(bnum), BLOCK_SIZE, 0);
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Serves the faults on the window until stopped.
+static void *cache_fault_loop(void *arg) {
+  (void) arg;
+  struct pollfd fds[2] = {{cache_fd, POLLIN, 0}, {cache_stop_fd, POLLIN, 0}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      assert(errno == EINTR);
+      continue;
+    }
+    if (fds[1].revents != 0) {
+      return NULL;
+    }
+
+    struct uffd_msg msgs[16];
+    ssize_t got = read(cache_fd, msgs, sizeof(msgs));
+    if (got == -1) {
+      assert(errno == EAGAIN || errno == EINTR);
+      continue;
+    }
+
+    for (int ii = 0; ii < got / (ssize_t) sizeof(struct uffd_msg); ii++) {
+      if (msgs[ii].event != UFFD_EVENT_PAGEFAULT) {
+        continue;
+      }
+      uint64_t flags = msgs[ii].arg.pagefault.flags;
+      bnum_t bnum = ((char *) (uintptr_t) msgs[ii].arg.pagefault.address - cache_base) / BLOCK_SIZE;
+      if (flags & UFFD_PAGEFAULT_FLAG_WP) {
+        cache_fault_protected(bnum);
+      } else {
+        cache_fault_missing(bnum, (flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0);
+      }
+    }
+  }
+}
+
+// Writes back the changed blocks every CACHE_WRITEBACK_MS, or sooner when
+// kicked, until stopped.
+static void *cache_writeback_loop(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&cache_run_lock);
+  while (cache_running) {
+    if (!cache_kicked) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += CACHE_WRITEBACK_MS / 1000;
+      until.tv_nsec += (long) (CACHE_WRITEBACK_MS % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&cache_run_cond, &cache_run_lock, &until);
+    }
+    if (!cache_running) {
+      break;
+    }
+
+    cache_kicked = 0;
+    pthread_mutex_unlock(&cache_run_lock);
+    cache_io.flush();
+    pthread_mutex_lock(&cache_run_lock);
+  }
+  pthread_mutex_unlock(&cache_run_lock);
+
+  return NULL;
+}
+
+// Registers len bytes of the window at addr with the userfaultfd.
+static int cache_register(char *addr, int64_t len) {
+  struct uffdio_register reg = {{(uintptr_t) addr, len},
+                                UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP, 0};
+  return ioctl(cache_fd, UFFDIO_REGISTER, &reg);
+}
+
+// Opens a userfaultfd over the window and starts the threads serving it.
+// Pages already in the window are write-protected, so they are clean
+// until stored to. Only faults the process takes itself are served, which
+// needs no privilege; kernels before 5.11 serve them all. Returns -1 if
+// userfaultfd is not available.
+static int cache_arm() {
+  cache_fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  if (cache_fd == -1 && errno == EINVAL) {
+    cache_fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  }
+  if (cache_fd == -1) {
+    return -1;
+  }
+
+  struct uffdio_api api = {UFFD_API, UFFD_FEATURE_PAGEFAULT_FLAG_WP, 0};
+  if (ioctl(cache_fd, UFFDIO_API, &api) == -1 || cache_register(cache_base, cache_size) == -1) {
+    close(cache_fd);
+    cache_fd = -1;
+    return -1;
+  }
+  cache_protect(cache_base, cache_size, 1);
+
+  cache_stop_fd = eventfd(0, EFD_CLOEXEC);
+  assert(cache_stop_fd != -1);
+  int rv = pthread_create(&cache_fault_thread, NULL, cache_fault_loop, NULL);
+  assert(rv == 0);
+
+  cache_running = 1;
+  cache_kicked = 0;
+  rv = pthread_create(&cache_writeback_thread, NULL, cache_writeback_loop, NULL);
+  assert(rv == 0);
+  return 0;
+}
+
+// Stops the threads and closes the userfaultfd.
+static void cache_disarm() {
+  pthread_mutex_lock(&cache_run_lock);
+  cache_running = 0;
+  pthread_cond_signal(&cache_run_cond);
+  pthread_mutex_unlock(&cache_run_lock);
+  pthread_join(cache_writeback_thread, NULL);
+
+  uint64_t one = 1;
+  ssize_t rv = write(cache_stop_fd, &one, sizeof(one));
+  assert(rv == sizeof(one));
+  pthread_join(cache_fault_thread, NULL);
+
+  close(cache_stop_fd);
+  close(cache_fd);
+  cache_stop_fd = -1;
+  cache_fd = -1;
+}
+
+// Quiesces the cache before a fork, so no shard is in the middle of a
+// change.
+static void cache_fork_prepare() {
+  if (cache_fd == -1) {
+    return;
+  }
+  for (int ii = 0; ii < CACHE_SHARDS; ii++) {
+    pthread_mutex_lock(&cache_shards[ii].lock);
+  }
+  pthread_mutex_lock(&cache_run_lock);
+}
+
+static void cache_fork_parent() {
+  if (cache_fd == -1) {
+    return;
+  }
+  pthread_mutex_unlock(&cache_run_lock);
+  for (int ii = CACHE_SHARDS - 1; ii >= 0; ii--) {
+    pthread_mutex_unlock(&cache_shards[ii].lock);
+  }
+}
+
+// Sets the cache up again in the child, whose window is not registered
+// with the parent's userfaultfd and has none of its threads.
+static void cache_fork_child() {
+  if (cache_fd == -1) {
+    return;
+  }
+  pthread_cond_init(&cache_run_cond, NULL);
+  pthread_mutex_unlock(&cache_run_lock);
+  for (int ii = CACHE_SHARDS - 1; ii >= 0; ii--) {
+    pthread_mutex_unlock(&cache_shards[ii].lock);
+  }
+
+  close(cache_stop_fd);
+  close(cache_fd);
+  int rv = cache_arm();
+  assert(rv == 0);
+}
+
+// Sets up the fork handlers, once per process.
+static void cache_once_init() {
+  pthread_atfork(cache_fork_prepare, cache_fork_parent, cache_fork_child);
+}
+
+// Start caching the window.
+int cache_open(char *base, int64_t size, int64_t cap, uint64_t *changed, const cache_io_t *io) {
+  pthread_once(&cache_once, cache_once_init);
+  assert(cache_fd == -1);
+
+  cache_base = base;
+  cache_size = size;
+  cache_changed = changed;
+  cache_io = *io;
+  cache_failed = 0;
+
+  cache_blocks = mmap(0, NUFS_MAX_SIZE / BLOCK_SIZE * sizeof(cache_block_t), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(cache_blocks != MAP_FAILED);
+  cache_buf = aligned_alloc(BLOCK_SIZE, (size_t) CACHE_CLUSTER * BLOCK_SIZE);
+  assert(cache_buf != NULL);
+
+  // each shard gets an even share, and room for a cluster or two
+  int64_t share = cap / BLOCK_SIZE / CACHE_SHARDS;
+  if (share < 2 * CACHE_CLUSTER) {
+    share = 2 * CACHE_CLUSTER;
+  }
+  for (int ii = 0; ii < CACHE_SHARDS; ii++) {
+    cache_shard_t *shard = &cache_shards[ii];
+    shard->cap = share;
+    shard->in_cap = share / 4;
+    shard->out_cap = share / 2;
+  }
+
+  if (cache_arm() == -1) {
+    munmap(cache_blocks, NUFS_MAX_SIZE / BLOCK_SIZE * sizeof(cache_block_t));
+    free(cache_buf);
+    return -1;
+  }
+  return 0;
+}
+
+// Stop caching.
+void cache_close() {
+  cache_disarm();
+
+  munmap(cache_blocks, NUFS_MAX_SIZE / BLOCK_SIZE * sizeof(cache_block_t));
+  free(cache_buf);
+  for (int ii = 0; ii < CACHE_SHARDS; ii++) {
+    cache_shard_t *shard = &cache_shards[ii];
+    free(shard->entries);
+    shard->entries = NULL;
+    shard->used = shard->allocated = shard->free = 0;
+    shard->in = shard->am = (cache_queue_t) {0, 0, 0};
+    shard->out_seq = 0;
+  }
+}
+
+// Extend the cache over the grown window.
+void cache_grow(int64_t size) {
+  int rv = cache_register(cache_base + cache_size, size - cache_size);
+  assert(rv == 0);
+  __atomic_store_n(&cache_size, size, __ATOMIC_RELAXED);
+}
+
+// Note a lookup of n blocks.
+void cache_reference(bnum_t bnum, bnum_t n) {
+  bnum_t count = cache_count();
+  int64_t hits = 0;
+
+  for (bnum_t block = bnum; block < bnum + n && block < count; block++) {
+    if (block >= 0 && __atomic_load_n(&cache_blocks[block].slot, __ATOMIC_RELAXED) != 0) {
+      if (__atomic_load_n(&cache_blocks[block].ref, __ATOMIC_RELAXED) == 0) {
+        __atomic_store_n(&cache_blocks[block].ref, 1, __ATOMIC_RELAXED);
+      }
+      hits++;
+    }
+  }
+
+  if (hits > 0) {
+    stats_add(STATS_CACHE_HITS, hits);
+  }
+}
+
+// Keep n blocks in memory.
+void cache_pin(bnum_t bnum, bnum_t n) {
+  for (bnum_t block = bnum; block < bnum + n; block++) {
+    cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->lock);
+    cache_blocks[block].pins++;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+// Let go of n pinned blocks.
+void cache_unpin(bnum_t bnum, bnum_t n) {
+  for (bnum_t block = bnum; block < bnum + n; block++) {
+    cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->lock);
+    assert(cache_blocks[block].pins > 0);
+    cache_blocks[block].pins--;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+// Mark n blocks clean before they are written back. A store between
+// clearing a bit and the protection is missed, but makes it into the
+// write, which copies the blocks after.
+void cache_clean(bnum_t bnum, bnum_t n) {
+  for (bnum_t block = bnum; block < bnum + n; block++) {
+    cache_unmark(block);
+  }
+  cache_protect(cache_addr(bnum), (size_t) n * BLOCK_SIZE, 1);
+}
+
+// Tell whether a read failed since the last call.
+int cache_read_failed() {
+  return __atomic_exchange_n(&cache_failed, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,132 @@
+/**
+ * @file cache.h
+ *
+ * A buffer cache for images whose backend does not map them.
+ *
+ * Callers reach blocks through raw pointers into the address window of
+ * blocks.c, so the cache works underneath the pointers. The window is
+ * registered with userfaultfd: a block is read from the backend the first
+ * time it is touched, and dropped again (MADV_DONTNEED) when the cache
+ * needs the room. Blocks come in write-protected, so the first store to
+ * one faults, marks the block changed and is then let through; every
+ * change is seen without the callers' help. A block is protected again
+ * when it is written back.
+ *
+ * Only faults the process takes itself are served (UFFD_USER_MODE_ONLY,
+ * which needs no privilege), so the kernel must never be handed a pointer
+ * into the window: blocks are read from and written to the backend
+ * through a copy, and so is anything a system call reads or writes. Even
+ * where the kernel's faults are served, a write straight from the window
+ * could fault on it while the kernel holds the image file's locks, which
+ * the thread serving the fault may be waiting for.
+ *
+ * Replacement is 2Q. A block faulted in goes into a FIFO (A1in). Blocks
+ * pushed out of A1in are remembered in a ghost queue (A1out), and a block
+ * faulted in again while remembered goes into the main queue (Am), which
+ * is a CLOCK over the reference bits that lookups set. A scan through a
+ * large file passes through A1in and leaves Am alone.
+ *
+ * The cache is split into shards by cluster of blocks, each with its own
+ * lock, queues and share of the memory cap. Pinned blocks are never
+ * evicted. A background thread writes changed blocks back every
+ * CACHE_WRITEBACK_MS, and at once when eviction passes one over; a fault
+ * only writes a changed block back itself when nothing else can go.
+ *
+ * A block that cannot be read from the backend comes in as zeros, since
+ * the thread that faulted on it cannot be failed, and the error is kept
+ * for the next flush to report.
+ *
+ * The fault handler is a thread of the process, so the cache is set up
+ * again in the child after a fork (as when the file system daemonizes).
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define CACHE_SHARDS 16        // the shards of the cache
+#define CACHE_CLUSTER 16       // blocks read at once on sequential faults, and per shard stripe
+#define CACHE_WRITEBACK_MS 1000 // milliseconds between background write-backs
+
+// struct holding how the cache reaches the backend; each returns 0 on
+// success or -1 on failure
+typedef struct cache_io {
+  int (*read)(bnum_t bnum, void *buf, bnum_t n);        // reads n blocks into buf
+  int (*write)(bnum_t bnum, const void *buf, bnum_t n); // writes n blocks from buf
+  void (*flush)();                                      // writes back every changed block
+} cache_io_t;
+
+/**
+ * Start caching the window at base, whose first size bytes hold the
+ * image. The window must be anonymous memory with nothing in it yet.
+ *
+ * @param base The start of the window.
+ * @param size The bytes of the image.
+ * @param cap The most bytes of blocks to keep in memory.
+ * @param changed One bit per block, set by the cache when a block is
+ *                stored to and cleared when it is written back.
+ * @param io How to read and write the backend.
+ *
+ * @return 0 on success, -1 if userfaultfd is not available.
+ */
+int cache_open(char *base, int64_t size, int64_t cap, uint64_t *changed, const cache_io_t *io);
+
+/**
+ * Stop caching, leaving the window as it is. Changed blocks must have
+ * been written back first.
+ */
+void cache_close();
+
+/**
+ * Extend the cache over the window to the given size, after the image
+ * grew. The new part of the window must have nothing in it yet.
+ *
+ * @param size The new bytes of the image.
+ */
+void cache_grow(int64_t size);
+
+/**
+ * Note a lookup of n blocks, for the replacement policy and the hit rate.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void cache_reference(bnum_t bnum, bnum_t n);
+
+/**
+ * Keep n blocks in memory until they are unpinned, loaded or not.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void cache_pin(bnum_t bnum, bnum_t n);
+
+/**
+ * Let go of a pin taken by cache_pin.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void cache_unpin(bnum_t bnum, bnum_t n);
+
+/**
+ * Mark n blocks clean, before they are copied to be written back: clears
+ * their changed bits and write-protects them, so the next store to each
+ * marks it changed again.
+ *
+ * @param bnum The first block number.
+ * @param n The number of blocks.
+ */
+void cache_clean(bnum_t bnum, bnum_t n);
+
+/**
+ * Tell whether reading a block from the backend failed since the last
+ * call, which then came in as zeros.
+ *
+ * @return 1 if a read failed, 0 if not.
+ */
+int cache_read_failed();
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * @file dcache.c
+ *
+ * Implementation of the directory entry cache.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "stats.h"
+
+#define DCACHE_SETS 16384    // the number of hash sets (a power of two)
+#define DCACHE_WAYS 4        // the entries in each set
+#define DCACHE_NAME_LENGTH 32 // the longest cached name, plus the terminator
+#define DCACHE_GENS 65536     // the generation counters directories hash to (a power of two)
+
+// struct representing a cached directory entry
+typedef struct dcache_entry {
+  uint32_t hash;                  // the hash of (dir_inum, name)
+  int dir_inum;                   // the directory holding the entry, -1 if the slot is empty
+  int inum;                       // the inum the name refers to, -1 if it does not exist
+  uint32_t gen;                   // the generation of dir_inum the entry was cached in
+  char name[DCACHE_NAME_LENGTH];  // the name of the entry
+} dcache_entry_t;
+
+// struct representing one set of the cache
+typedef struct dcache_set {
+  pthread_mutex_t lock;
+  int clock;                           // the next way to replace
+  dcache_entry_t ways[DCACHE_WAYS];
+} dcache_set_t;
+
+static dcache_set_t dcache[DCACHE_SETS] = {
+  [0 ... DCACHE_SETS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+// Purging a directory bumps the generation its inum hashes to, which
+// turns every entry cached under the old generation stale. Directories
+// sharing a counter only lose their entries along with it.
+static uint32_t dcache_gens[DCACHE_GENS];
+
+// Returns the current generation of the directory.
+static uint32_t dcache_gen(int dir_inum) {
+  return __atomic_load_n(&dcache_gens[(uint32_t) dir_inum % DCACHE_GENS], __ATOMIC_ACQUIRE);
+}
+
+// Empties every set of the cache.
+void dcache_clear() {
+  for (int ii = 0; ii < DCACHE_SETS; ii++) {
+    pthread_mutex_lock(&dcache[ii].lock);
+    for (int jj = 0; jj < DCACHE_WAYS; jj++) {
+      dcache[ii].ways[jj].dir_inum = -1;
+    }
+    pthread_mutex_unlock(&dcache[ii].lock);
+  }
+}
+
+// FNV-1a over the directory inum and the name.
+static uint32_t dcache_hash(int dir_inum, const char *name) {
+  uint32_t hash = 2166136261u ^ (uint32_t) dir_inum;
+  hash *= 16777619u;
+
+  for (const char *cc = name; *cc != 0; cc++) {
+    hash = (hash ^ (uint8_t) *cc) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Returns the way of the set holding the given entry of the given
+// generation, -1 if there is none.
+static int dcache_find(dcache_set_t *set, uint32_t hash, int dir_inum, uint32_t gen,
+                       const char *name) {
+  for (int ii = 0; ii < DCACHE_WAYS; ii++) {
+    dcache_entry_t *entry = &set->ways[ii];
+    if (entry->hash == hash && entry->dir_inum == dir_inum && entry->gen == gen &&
+        strcmp(entry->name, name) == 0) {
+      return ii;
+    }
+  }
+
+  return -1;
+}
+
+// Looks up the inum the name refers to in the cache.
+int dcache_lookup(int dir_inum, const char *name, int *inum) {
+  uint32_t hash = dcache_hash(dir_inum, name);
+  dcache_set_t *set = &dcache[hash % DCACHE_SETS];
+
+  pthread_mutex_lock(&set->lock);
+  int way = dcache_find(set, hash, dir_inum, dcache_gen(dir_inum), name);
+  if (way != -1) {
+    *inum = set->ways[way].inum;
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  stats_add(way != -1 ? STATS_DCACHE_HITS : STATS_DCACHE_MISSES, 1);
+  return way != -1;
+}
+
+// Caches the inum the name refers to, evicting the set's entries in turn.
+void dcache_put(int dir_inum, const char *name, int inum) {
+  if (strlen(name) >= DCACHE_NAME_LENGTH) {
+    return;
+  }
+
+  uint32_t hash = dcache_hash(dir_inum, name);
+  uint32_t gen = dcache_gen(dir_inum);
+  dcache_set_t *set = &dcache[hash % DCACHE_SETS];
+
+  pthread_mutex_lock(&set->lock);
+  int way = dcache_find(set, hash, dir_inum, gen, name);
+  if (way == -1) {
+    way = set->clock;
+    set->clock = (set->clock + 1) % DCACHE_WAYS;
+  }
+
+  dcache_entry_t *entry = &set->ways[way];
+  entry->hash = hash;
+  entry->dir_inum = dir_inum;
+  entry->inum = inum;
+  entry->gen = gen;
+  strcpy(entry->name, name);
+  pthread_mutex_unlock(&set->lock);
+}
+
+// Drops every cached entry of the directory by moving it to a new
+// generation; the stale entries are replaced in turn like any other.
+void dcache_purge(int dir_inum) {
+  __atomic_fetch_add(&dcache_gens[(uint32_t) dir_inum % DCACHE_GENS], 1, __ATOMIC_RELEASE);
+}
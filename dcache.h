@@ -0,0 +1,51 @@
+/**
+ * @file dcache.h
+ *
+ * An in-memory cache of directory entries, mapping a (directory inum,
+ * name) pair to the inum the name refers to. Negative entries remember
+ * names that are known not to exist.
+ *
+ * The cache is a fixed-size, 4-way set associative hash table, so it
+ * never grows; each set has its own lock. Entries for a directory are
+ * read and written with the directory's inode lock held (see
+ * directory.h), which keeps them in step with the directory blocks.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+/**
+ * Empties the cache. Must be called each time an image is mounted.
+ */
+void dcache_clear();
+
+/**
+ * Looks up a name in the cache.
+ *
+ * @param dir_inum The inum of the directory holding the entry.
+ * @param name The name of the entry.
+ * @param inum Set to the cached inum, -1 for a negative entry.
+ *
+ * @return 1 if the name was cached, 0 otherwise.
+ */
+int dcache_lookup(int dir_inum, const char *name, int *inum);
+
+/**
+ * Caches the inum a name refers to, replacing any previous entry.
+ * Names too long to cache are ignored.
+ *
+ * @param dir_inum The inum of the directory holding the entry.
+ * @param name The name of the entry.
+ * @param inum The inum the name refers to, -1 if it does not exist.
+ */
+void dcache_put(int dir_inum, const char *name, int inum);
+
+/**
+ * Drops every cached entry of a directory, before its inum is reused.
+ * Takes constant time: the entries are tagged with a generation of the
+ * directory, which this moves past.
+ *
+ * @param dir_inum The inum of the directory.
+ */
+void dcache_purge(int dir_inum);
+
+#endif
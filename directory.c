@@ -5,50 +5,509 @@
  * Implementation of a directory abstraction and related operations.
  */
 #include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
 
 #include "directory.h"
+#include "dcache.h"
+#include "path.h"
 #include "blocks.h"
 #include "inode.h"
 #include "storage.h"
 #include "bitmap.h"
-#include "slist.h"
+#include "journal.h"
+
+#define LEAF_SIZE 4096 // = BLOCK_SIZE, the bytes of entries in a leaf block
+
+// struct heading the root and index blocks of a directory
+typedef struct dx_header {
+  uint16_t levels; // (root only) index levels between the root and the leaves, 0 or 1
+  uint16_t count;  // the number of entries in use
+  uint32_t blocks; // (root only) the number of file blocks in use
+} dx_header_t;
+
+// struct mapping the hashes from its own up to the next entry's to a block
+typedef struct dx_entry {
+  uint32_t hash;   // the lowest hash stored under the block, 0 for the first entry
+  uint32_t fblock; // the file block of the child node or leaf
+} dx_entry_t;
+
+// struct representing the root or an index block of a directory
+typedef struct dx_node {
+  dx_header_t header;
+  dx_entry_t entries[];
+} dx_node_t;
+
+// the number of entries in a root or index block
+#define DX_LIMIT ((4096 - sizeof(dx_header_t)) / sizeof(dx_entry_t))
+
+// struct recording the way from the root down to a leaf
+typedef struct dx_path {
+  dx_node_t *node; // the node pointing at the leaf, the root or an index block
+  int at;          // the leaf's entry in node
+  int root_at;     // the entry in the root that was followed
+} dx_path_t;
+
+// Hashes a directory entry name (32-bit FNV-1a). The hash is stored on
+// disk, so it must never change.
+static uint32_t dirent_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+
+  for (const char *cc = name; *cc != 0; cc++) {
+    hash = (hash ^ (uint8_t) *cc) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Returns the given block of a directory.
+static void *dir_block(inode_t *dir_inode, uint32_t fblock) {
+  return blocks_get_block(inode_get_bnum(dir_inode, fblock));
+}
+
+// Returns the bytes an entry with a name of the given length takes up,
+// keeping entries 4-byte aligned.
+static int dirent_len(int name_len) {
+  return (sizeof(dirent_t) + name_len + 1 + 3) & ~3;
+}
+
+// Returns the entry at the given offset in a leaf.
+static dirent_t *leaf_at(void *leaf, int off) {
+  return (dirent_t *) ((char *) leaf + off);
+}
+
+// Makes the leaf of size bytes a single deleted entry spanning all of it.
+static void leaf_init(void *leaf, int size) {
+  dirent_t *first = leaf_at(leaf, 0);
+  journal_dirty(leaf, size);
+  memset(first, 0, sizeof(dirent_t));
+  first->rec_len = size;
+}
+
+// Lays out an empty directory: a root block pointing at a single leaf.
+static int directory_format(inode_t *dir_inode) {
+  if (grow_inode(dir_inode, 2 * BLOCK_SIZE) != 0) {
+    return -1;
+  }
+
+  dx_node_t *root = dir_block(dir_inode, 0);
+  journal_dirty(root, BLOCK_SIZE);
+  memset(root, 0, BLOCK_SIZE);
+  leaf_init(dir_block(dir_inode, 1), LEAF_SIZE);
+
+  root->header.blocks = 2;
+  root->header.count = 1;
+  root->entries[0] = (dx_entry_t) {0, 1};
+  return 0;
+}
+
+// Lays out an empty directory inside its inode, as a single small leaf.
+static void directory_inline(inode_t *dir_inode) {
+  journal_dirty(dir_inode, sizeof(inode_t));
+  dir_inode->flags = INODE_INLINE;
+  dir_inode->size = INODE_INLINE_SIZE;
+  leaf_init(dir_inode->data, INODE_INLINE_SIZE);
+}
+
+// Adds a zeroed block to the directory and returns its file block number.
+// Blocks are allocated ahead, doubling the directory up to 4MB at a time,
+// so a large directory keeps a short extent map.
+static int64_t dir_add_block(inode_t *dir_inode) {
+  dx_node_t *root = dir_block(dir_inode, 0);
+  uint32_t fblock = root->header.blocks;
+
+  if ((int64_t) (fblock + 1) * BLOCK_SIZE > dir_inode->size) {
+    uint32_t ahead = fblock < 1024 ? fblock : 1024;
+    if (grow_inode(dir_inode, (int64_t) (fblock + ahead) * BLOCK_SIZE) != 0) {
+      return -1;
+    }
+  }
+
+  journal_dirty(dir_block(dir_inode, fblock), BLOCK_SIZE);
+  memset(dir_block(dir_inode, fblock), 0, BLOCK_SIZE);
+  journal_dirty(root, sizeof(dx_header_t));
+  root->header.blocks = fblock + 1;
+  return fblock;
+}
+
+// Binary searches the node for the last entry whose hash is at most the
+// given one.
+static int dx_search(dx_node_t *node, uint32_t hash) {
+  int at = 0; // the first entry covers every hash below the second
+  int lo = 1;
+  int hi = node->header.count - 1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (node->entries[mid].hash <= hash) {
+      at = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return at;
+}
+
+// Inserts an entry into the node at the given position.
+static void dx_insert(dx_node_t *node, int at, uint32_t hash, uint32_t fblock) {
+  journal_dirty(node, BLOCK_SIZE);
+  memmove(&node->entries[at + 1], &node->entries[at],
+          sizeof(dx_entry_t) * (node->header.count - at));
+  node->entries[at] = (dx_entry_t) {hash, fblock};
+  node->header.count += 1;
+}
+
+// Walks the index down to the leaf holding the given hash.
+static void *dx_find_leaf(inode_t *dir_inode, uint32_t hash, dx_path_t *path) {
+  dx_node_t *root = dir_block(dir_inode, 0);
+
+  path->node = root;
+  path->root_at = dx_search(root, hash);
+  path->at = path->root_at;
+
+  if (root->header.levels == 1) {
+    path->node = dir_block(dir_inode, root->entries[path->root_at].fblock);
+    path->at = dx_search(path->node, hash);
+  }
+
+  return dir_block(dir_inode, path->node->entries[path->at].fblock);
+}
+
+// Returns the leaf the hash belongs in, setting size to its bytes: the
+// inode itself for an inline directory, else the leaf the index leads to.
+static void *dir_find_leaf(inode_t *dir_inode, uint32_t hash, dx_path_t *path, int *size) {
+  if (dir_inode->flags & INODE_INLINE) {
+    *size = INODE_INLINE_SIZE;
+    return dir_inode->data;
+  }
+
+  *size = LEAF_SIZE;
+  return dx_find_leaf(dir_inode, hash, path);
+}
+
+// Sets hash to where the leaf after the one path leads to starts,
+// returning 0 if that was the last leaf (or the directory is inline).
+static int dir_next_leaf(inode_t *dir_inode, dx_path_t *path, uint32_t *hash) {
+  if (dir_inode->flags & INODE_INLINE) {
+    return 0;
+  }
+
+  dx_node_t *root = dir_block(dir_inode, 0);
+  if (path->at + 1 < path->node->header.count) {
+    *hash = path->node->entries[path->at + 1].hash;
+  } else if (path->node != root && path->root_at + 1 < root->header.count) {
+    *hash = root->entries[path->root_at + 1].hash;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Returns the entry with the given name in the leaf of size bytes, NULL if
+// there is none. Fingerprints are compared before names. If prev is
+// given, it is set to the entry before the one found, NULL if that is the
+// first.
+static dirent_t *leaf_find(void *leaf, int size, uint32_t hash, const char *name,
+                           dirent_t **prev) {
+  int len = strlen(name);
+  dirent_t *last = NULL;
+
+  for (int off = 0; off < size; off += last->rec_len) {
+    dirent_t *ent = leaf_at(leaf, off);
+
+    if (ent->inum != 0 && ent->hash == hash && ent->name_len == len &&
+        memcmp(ent->name, name, len) == 0) {
+      if (prev != NULL) {
+        *prev = last;
+      }
+      return ent;
+    }
 
-const int DIR_SIZE = 4096;                       // the size of a directory in bytes
-const int DIRENT_SIZE = sizeof(dirent_t);        // the size of a directory entry
-const int DIRENT_COUNT = DIR_SIZE / DIRENT_SIZE; // the number of directory entries that fit in a directory
+    last = ent;
+  }
+
+  return NULL;
+}
+
+// Packs the entries of src whose hashes are within [lo, hi] at the start
+// of leaf, leaving all of the free space in the last entry. Both leaves
+// are size bytes, and they must differ.
+static void leaf_pack(void *leaf, void *src, int size, uint32_t lo, uint32_t hi) {
+  dirent_t *last = NULL;
+  int off = 0;
+
+  leaf_init(leaf, size);
+  for (int soff = 0; soff < size; soff += leaf_at(src, soff)->rec_len) {
+    dirent_t *ent = leaf_at(src, soff);
+    if (ent->inum == 0 || ent->hash < lo || ent->hash > hi) {
+      continue;
+    }
+
+    if (last != NULL) {
+      last->rec_len = dirent_len(last->name_len);
+    }
+
+    last = leaf_at(leaf, off);
+    memcpy(last, ent, dirent_len(ent->name_len));
+    last->rec_len = size - off;
+    off += dirent_len(ent->name_len);
+  }
+}
+
+// Fills in an entry.
+static void dirent_fill(dirent_t *ent, uint32_t hash, const char *name, int inum) {
+  ent->hash = hash;
+  ent->inum = inum;
+  ent->name_len = strlen(name);
+  memcpy(ent->name, name, ent->name_len + 1);
+}
+
+// Adds an entry to the leaf of size bytes, in the first gap big enough
+// for it. When only the gaps together are big enough, the leaf is
+// compacted first. Returns -1 if the leaf is full.
+static int leaf_add(void *leaf, int size, uint32_t hash, const char *name, int inum) {
+  int need = dirent_len(strlen(name));
+  int slack = 0;
+
+  for (int off = 0; off < size; off += leaf_at(leaf, off)->rec_len) {
+    dirent_t *ent = leaf_at(leaf, off);
+    int used = ent->inum != 0 ? dirent_len(ent->name_len) : 0;
+
+    if (ent->rec_len - used >= need) {
+      journal_dirty(leaf, size);
+
+      // a live entry hands the space after its name to the new one
+      if (used != 0) {
+        dirent_t *next = leaf_at(leaf, off + used);
+        next->rec_len = ent->rec_len - used;
+        ent->rec_len = used;
+        ent = next;
+      }
+
+      dirent_fill(ent, hash, name, inum);
+      return 0;
+    }
+
+    slack += ent->rec_len - used;
+  }
+
+  if (slack < need) {
+    return -1;
+  }
+
+  char copy[LEAF_SIZE];
+  memcpy(copy, leaf, size);
+  leaf_pack(leaf, copy, size, 0, UINT32_MAX);
+  return leaf_add(leaf, size, hash, name, inum);
+}
+
+// Removes an entry from the leaf, merging its space into the entry
+// before it. The first entry of a leaf is marked deleted instead.
+static void leaf_remove(dirent_t *ent, dirent_t *prev) {
+  journal_dirty(ent, sizeof(dirent_t));
+  if (prev != NULL) {
+    prev->rec_len += ent->rec_len;
+  } else {
+    ent->inum = 0;
+  }
+}
+
+// Compares two hashes for qsort.
+static int hash_cmp(const void *aa, const void *bb) {
+  uint32_t xx = *(const uint32_t *) aa;
+  uint32_t yy = *(const uint32_t *) bb;
+  return xx < yy ? -1 : xx > yy;
+}
+
+// Picks the hash to split a full leaf at: the boundary between two
+// different hashes closest to the middle, so equal hashes stay together.
+static int leaf_split_hash(void *leaf, uint32_t *split) {
+  uint32_t hashes[LEAF_SIZE / 16]; // entries take at least 16 bytes
+  int count = 0;
+
+  for (int off = 0; off < LEAF_SIZE; off += leaf_at(leaf, off)->rec_len) {
+    dirent_t *ent = leaf_at(leaf, off);
+    if (ent->inum != 0) {
+      hashes[count++] = ent->hash;
+    }
+  }
+  qsort(hashes, count, sizeof(uint32_t), hash_cmp);
+
+  int mid = count / 2;
+  for (int dd = 0; dd < count; dd++) {
+    int up = mid + dd;
+    int down = mid - dd;
+
+    if (up >= 1 && up < count && hashes[up - 1] != hashes[up]) {
+      *split = hashes[up];
+      return 0;
+    }
+    if (down >= 1 && down < count && hashes[down - 1] != hashes[down]) {
+      *split = hashes[down];
+      return 0;
+    }
+  }
+
+  return -1; // every name in the leaf has the same hash
+}
+
+// Makes room for one more leaf under the path: splits the leaf it ends
+// at, or first adds an index level or splits the full index block. The
+// caller walks down again afterwards.
+static int dx_split(inode_t *dir_inode, dx_path_t *path) {
+  dx_node_t *root = dir_block(dir_inode, 0);
+  dx_node_t *node = path->node;
+
+  if (node->header.count == DX_LIMIT) {
+    if (node != root && root->header.count == DX_LIMIT) {
+      return -1; // both index levels are full
+    }
+
+    int64_t fblock = dir_add_block(dir_inode);
+    if (fblock == -1) {
+      return -1;
+    }
+    dx_node_t *added = dir_block(dir_inode, fblock);
+
+    journal_dirty(root, BLOCK_SIZE);
+    journal_dirty(node, BLOCK_SIZE);
+
+    if (node == root) {
+      // move the root's entries into an index block below it
+      memcpy(added, root, BLOCK_SIZE);
+      added->header.levels = 0;
+      added->header.blocks = 0;
+      root->header.levels = 1;
+      root->header.count = 1;
+      root->entries[0] = (dx_entry_t) {0, fblock};
+    } else {
+      // move the upper half of the index block into a new one
+      int keep = node->header.count / 2;
+      added->header.count = node->header.count - keep;
+      memcpy(added->entries, &node->entries[keep], sizeof(dx_entry_t) * added->header.count);
+      node->header.count = keep;
+      dx_insert(root, path->root_at + 1, added->entries[0].hash, fblock);
+    }
+
+    return 0;
+  }
+
+  void *leaf = dir_block(dir_inode, node->entries[path->at].fblock);
+  uint32_t split;
+  if (leaf_split_hash(leaf, &split) == -1) {
+    return -1;
+  }
+
+  int64_t fblock = dir_add_block(dir_inode);
+  if (fblock == -1) {
+    return -1;
+  }
+
+  // keep the entries hashing below the split and move the rest to the new leaf
+  char copy[LEAF_SIZE];
+  memcpy(copy, leaf, LEAF_SIZE);
+  leaf_pack(leaf, copy, LEAF_SIZE, 0, split - 1);
+  leaf_pack(dir_block(dir_inode, fblock), copy, LEAF_SIZE, split, UINT32_MAX);
+
+  dx_insert(node, path->at + 1, split, fblock);
+  return 0;
+}
+
+// Moves the entries of an inline directory out to an index root and a
+// leaf, once they no longer fit in the inode.
+static int directory_spill(inode_t *dir_inode) {
+  char entries[INODE_INLINE_SIZE];
+  memcpy(entries, dir_inode->data, INODE_INLINE_SIZE);
+
+  journal_dirty(dir_inode, sizeof(inode_t));
+  memset(dir_inode->data, 0, INODE_INLINE_SIZE);
+  dir_inode->flags &= ~INODE_INLINE;
+  dir_inode->size = 0;
+
+  if (directory_format(dir_inode) == -1) {
+    shrink_inode(dir_inode, 0);
+    memcpy(dir_inode->data, entries, INODE_INLINE_SIZE);
+    dir_inode->flags |= INODE_INLINE;
+    dir_inode->size = INODE_INLINE_SIZE;
+    return -1;
+  }
+
+  // the entries fit in the first leaf, which covers every hash
+  void *leaf = dir_block(dir_inode, 1);
+  for (int off = 0; off < INODE_INLINE_SIZE; off += leaf_at(entries, off)->rec_len) {
+    dirent_t *ent = leaf_at(entries, off);
+    if (ent->inum != 0) {
+      int rv = leaf_add(leaf, LEAF_SIZE, ent->hash, ent->name, ent->inum);
+      assert(rv == 0);
+    }
+  }
+
+  return 0;
+}
+
+// struct locating a live entry of a leaf while the leaf is listed
+typedef struct leaf_item {
+  off_t cursor; // the entry's position in the directory, see directory_iterate
+  int off;      // the entry's offset in the leaf
+} leaf_item_t;
+
+static __thread void *leaf_sort_base; // the leaf leaf_item_cmp sorts, as qsort takes no argument
+
+// Orders the entries of a leaf by hash, then name.
+static int leaf_item_cmp(const void *aa, const void *bb) {
+  dirent_t *xx = leaf_at(leaf_sort_base, ((const leaf_item_t *) aa)->off);
+  dirent_t *yy = leaf_at(leaf_sort_base, ((const leaf_item_t *) bb)->off);
+
+  if (xx->hash != yy->hash) {
+    return xx->hash < yy->hash ? -1 : 1;
+  }
+  return strcmp(xx->name, yy->name);
+}
 
 // Creates a new directory at the given path with the given mode.
 int directory_init(const char* path, mode_t mode) {
+    // get the parent directory and name of the new directory
+    const char* dir_name;
+    int upper_dir_inum = tree_lookup_parent(path, &dir_name);
+    if (upper_dir_inum < 0) return upper_dir_inum;
+
+    int rv = directory_create(upper_dir_inum, dir_name, mode);
+    return rv < 0 ? rv : 0;
+}
+
+// Creates a new directory with the given name in the given directory.
+int directory_create(int upper_dir_inum, const char* dir_name, mode_t mode) {
+    journal_begin();
+    inode_write_lock(upper_dir_inum);
 
     // if the given directory already exists, then this method does nothing
-    if (tree_lookup(path) != -1) {
-      return -1;
+    if (directory_lookup(upper_dir_inum, dir_name) != -1) {
+      inode_unlock(upper_dir_inum);
+      journal_end();
+      return -EEXIST;
     }
 
-    // allocate an inode for the directory and initialize as directory inode
+    // allocate an inode for the directory and initialize as directory inode;
+    // nobody else can reach it until it is linked into the parent
     int dir_inum = alloc_inode();
-    assert(dir_inum != -1);
+    if (dir_inum == -1) {
+      inode_unlock(upper_dir_inum);
+      journal_end();
+      return -ENOSPC;
+    }
     inode_t* inode = get_inode(dir_inum);
+    journal_dirty(inode, sizeof(inode_t));
     inode->refs = 1;
     inode->mode = mode;
     inode->size = 0;
 
-    int dir_bnum = alloc_block();
-    assert(dir_bnum != -1);
-    inode->block = dir_bnum;
-
-    // get the parent directory and name of the new directory
-    char* upper_dir_path = get_dir_path(path);
-    int upper_dir_inum = tree_lookup(upper_dir_path);
-    if (upper_dir_inum == -1) return -1;
-    char* dir_name = get_file_name(path);
-
-    // create a new directory entry in the directory the new directory is in
-    int res = directory_put(upper_dir_inum, dir_name, dir_inum);
-    assert(res == 0);
+    // a directory starts out with its entries in the inode
+    directory_inline(inode);
 
     // create a new directory entry in the new directory - refers to itself
     int res2 = directory_put(dir_inum, ".", dir_inum);
@@ -58,14 +517,25 @@ int directory_init(const char* path, mode_t mode) {
     int res3 = directory_put(dir_inum, "..", upper_dir_inum);
     assert(res3 == 0);
 
-    return 0; // return 0 on success
+    // create a new directory entry in the directory the new directory is in
+    int res = directory_put(upper_dir_inum, dir_name, dir_inum);
+    inode_unlock(upper_dir_inum);
+
+    if (res < 0) {
+      shrink_inode(inode, 0);
+      free_inode(dir_inum);
+      dir_inum = res;
+    }
+
+    journal_end();
+    return dir_inum; // return the new directory on success, the error otherwise
 }
 
 // Initializes the root directory.
 int root_init() {
     // root has inum 2 and mark bitmap as allocated
     int dir_inum = 2;
-    void* inode_bitmap = get_inode_bitmap();
+    void* inode_bitmap = get_inode_bitmap(0);
     bitmap_put(inode_bitmap, 2, 1);
 
     // initialize inode values
@@ -73,10 +543,9 @@ int root_init() {
     inode->refs = 1;
     inode->mode = 040000;
     inode->size = 0;
-
-    int dir_bnum = alloc_block();
-    assert(dir_bnum != -1);
-    inode->block = dir_bnum;
+    inode->extents_count = 0;
+    inode->extent_block = 0;
+    directory_inline(inode);
 
     // create a new directory entry in the root - refers to itself
     int res2 = directory_put(dir_inum, ".", dir_inum);
@@ -85,132 +554,224 @@ int root_init() {
     return 0;
 }
 
-// Checks if there is a directory entry with the given name in the directory
-// with the given inum.
-int directory_lookup(int inum, const char *name) {
-    // retrieve the first directory entry
+// Searches the index of the directory with the given inum for the entry
+// with the given name. Only the one leaf the name hashes to is scanned.
+static int directory_scan(int inum, const char *name) {
     inode_t* dir_inode = get_inode(inum);
-    int dir_block = dir_inode->block;
-    dirent_t* dir_entry = (dirent_t *) blocks_get_block(dir_block);
-
-    // check if the given file exists
-    for (int i = 0; i < DIRENT_COUNT; i ++) {
-
-        if (dir_entry->name == NULL) {
-	  return -1;
-	}
-
-        if (dir_entry->free == 1 && strcmp(dir_entry->name, name) == 0) {
-	  return dir_entry->inum;                                         // found the entry with the matching name, return the inum
-	}
-
-        dir_entry = dir_entry + 1;
+    uint32_t hash = dirent_hash(name);
+    dx_path_t path;
+    int size;
+
+    void* leaf = dir_find_leaf(dir_inode, hash, &path, &size);
+    dirent_t* dir_entry = leaf_find(leaf, size, hash, name, NULL);
+    if (dir_entry == NULL) {
+      return -1; // return -1 if did not find a directory entry with the given name in the specified directory
     }
 
-    return -1; // return -1 if did not find a directory entry with the given name in the specified directory
+    return dir_entry->inum; // found the entry with the matching name, return the inum
 }
 
-// Returns the inum of the specified directory/file in the given path.
-int tree_lookup(const char *path) {
-
-    if (strcmp(path, "/") == 0) {
-      return 2; // if looking for the root directory then return its inum
+// Checks if there is a directory entry with the given name in the directory
+// with the given inum.
+int directory_lookup(int inum, const char *name) {
+    // answer from the dentry cache when we can
+    int cached;
+    if (dcache_lookup(inum, name, &cached)) {
+      return cached;
     }
 
-    // determine whether every parent has the child set in path
-    slist_t* path_split = s_explode(path, '/');
-    path_split = path_split->next;
+    int found = directory_scan(inum, name);
+    dcache_put(inum, name, found); // remember misses too
+    return found;
+}
 
+// Walks the directories along the given path, returning the inum it leads to.
+static int tree_walk(strview_t path) {
     int current_inum = 2; // always start search from root directory
-    int res = 0;
+    strview_t part;
+    char name[DIR_NAME_LENGTH + 1]; // the component being looked up
+
+    // determine whether every parent has the child set in path
+    while (path_next(&path, &part)) {
+        if (part.len > DIR_NAME_LENGTH) {
+          return -1; // no entry has a name that long
+        }
+        memcpy(name, part.data, part.len);
+        name[part.len] = 0;
 
-    while(path_split != NULL) {
-        res = directory_lookup(current_inum, path_split->data); // search for path split in the current directory
+        // search for the component in the current directory, holding only its lock
+        inode_read_lock(current_inum);
+        int res = directory_lookup(current_inum, name);
+        inode_unlock(current_inum);
 
         if (res == -1) {
-	  return -1;                                             // path_split does not exist, path is invalid, return -1
+	  return -1;                                             // the component does not exist, path is invalid, return -1
 	}
 
         current_inum = res;
-        path_split = path_split->next;
     }
 
     return current_inum; // found the inum of the last directory/file in the path
 }
 
+// Returns the inum of the specified directory/file in the given path.
+int tree_lookup(const char *path) {
+    return tree_walk(strview(path));
+}
+
+// Returns the inum of the directory holding the given path, pointing name
+// at the last component of the path.
+int tree_lookup_parent(const char *path, const char **name) {
+    strview_t parent;
+    strview_t last;
+    path_split(path, &parent, &last);
+
+    *name = last.data;
+    if (last.len > DIR_NAME_LENGTH) {
+      return -ENAMETOOLONG;
+    }
+
+    int inum = last.len == 0 ? -1 : tree_walk(parent);
+    return inum == -1 ? -ENOENT : inum;
+}
+
 // Creates a new directory entry in the directory specified by the given
 // dir_inum with the given name and entry_inum.
 int directory_put(int dir_inum, const char *name, int entry_inum) {
-    // get the directory entries for the directory
+    if (strlen(name) > DIR_NAME_LENGTH) {
+      return -ENAMETOOLONG; // the name is too long for an entry
+    }
+
     inode_t* dir_inode = get_inode(dir_inum);
-    int dir_block = dir_inode->block;
-    dirent_t* dir_entry = (dirent_t *) blocks_get_block(dir_block);
-
-    // iterate through all of the directroy entries in the directory
-    // and check for a free spot and put the entry there
-    for (int i = 0; i < DIRENT_COUNT; i ++) {
-        if (dir_entry->name == NULL || dir_entry->free == 0) {
-            strcpy(dir_entry->name, name);
-            dir_entry->inum = entry_inum;
-            dir_entry->free = 1;
-            return 0;                                          // 0 signals success
+    uint32_t hash = dirent_hash(name);
+
+    for (;;) {
+        // put the entry in the leaf the name hashes to
+        dx_path_t path;
+        int size;
+        void* leaf = dir_find_leaf(dir_inode, hash, &path, &size);
+        if (leaf_add(leaf, size, hash, name, entry_inum) == 0) {
+            dcache_put(dir_inum, name, entry_inum);
+            return 0; // 0 signals success
         }
 
-        dir_entry = dir_entry + 1; // if the current directroy is not free then iterate to next
+        // the leaf is full, so move the entries out of the inode or split
+        // the leaf, and look again
+        int rv = (dir_inode->flags & INODE_INLINE) ? directory_spill(dir_inode)
+                                                   : dx_split(dir_inode, &path);
+        if (rv == -1) {
+            return -ENOSPC; // have not made the entry
+        }
     }
-
-    return -1; // have not made the entry, -1 signals failure
 }
 
 // Delete the directory entry with the given entry_name from the directory
 // specified by the given dir_inum.
 int directory_delete(int dir_inum, const char *entry_name) {
+    inode_t* dir_inode = get_inode(dir_inum);
+    uint32_t hash = dirent_hash(entry_name);
+    dx_path_t path;
+    dirent_t* prev;
+    int size;
+
+    void* leaf = dir_find_leaf(dir_inode, hash, &path, &size);
+    dirent_t* dir_entry = leaf_find(leaf, size, hash, entry_name, &prev);
 
     // the entry we are trying to delete does not exist in the current directory
-    if (directory_lookup(dir_inum, entry_name) == -1) {
+    if (dir_entry == NULL) {
       return -1;
     }
 
-    // get the directory entries of the directory we are deleting from
+    leaf_remove(dir_entry, prev);
+    dcache_put(dir_inum, entry_name, -1);
+    return 0;
+}
+
+// Tells whether the directory holds nothing but its . and .. entries.
+int directory_empty(int dir_inum) {
     inode_t* dir_inode = get_inode(dir_inum);
-    int dir_block = dir_inode->block;
-    dirent_t* dir_entry = (dirent_t *) blocks_get_block(dir_block);
-
-    // iterate through directory entries and delete the given entry_name when found
-    for (int i = 0; i < DIRENT_COUNT; i ++) {
-        if (strcmp(dir_entry->name, entry_name) == 0) {
-            dir_entry->free = 0;
-            int file_num = directory_lookup(dir_inum, entry_name);
-            dir_inode->size -= get_inode(file_num)->size;
-            return 0;
+    uint32_t hash = 0;
+    dx_path_t path;
+    int size;
+
+    do {
+        void* leaf = dir_find_leaf(dir_inode, hash, &path, &size);
+        for (int off = 0; off < size; off += leaf_at(leaf, off)->rec_len) {
+            dirent_t* dir_entry = leaf_at(leaf, off);
+            if (dir_entry->inum != 0 && strcmp(dir_entry->name, ".") != 0 &&
+                strcmp(dir_entry->name, "..") != 0) {
+                return 0;
+            }
         }
+    } while (dir_next_leaf(dir_inode, &path, &hash));
 
-        dir_entry = dir_entry + 1;
-    }
-
-    return -1; // return -1 if entry_name not found
+    return 1;
 }
 
-// Lists the contents of the directory with the given path.
-slist_t *directory_list(const char *path) {
-    int dir_inum = tree_lookup(path);
-    inode_t* dir_inode = get_inode(dir_inum);
+// Collects the live entries of a leaf of size bytes in cursor order,
+// returning how many there are.
+static int leaf_items(void *leaf, int size, leaf_item_t *items) {
+  int count = 0;
 
-    int dir_block = dir_inode->block;
-    dirent_t* dir_entry = (dirent_t*) blocks_get_block(dir_block);
-    assert(dir_entry->name != NULL);
+  for (int off = 0; off < size; off += leaf_at(leaf, off)->rec_len) {
+    if (leaf_at(leaf, off)->inum != 0) {
+      items[count++].off = off;
+    }
+  }
+
+  leaf_sort_base = leaf;
+  qsort(items, count, sizeof(leaf_item_t), leaf_item_cmp);
 
-    slist_t* list = s_cons(dir_entry->name, NULL); // add the name of the first entry to the list
-    dir_entry = dir_entry + 1;
+  // entries sharing a hash are told apart by their rank among them
+  for (int ii = 0; ii < count; ii++) {
+    uint32_t hash = leaf_at(leaf, items[ii].off)->hash;
+    int rank = 0;
+    while (rank < ii && leaf_at(leaf, items[ii - rank - 1].off)->hash == hash) {
+      rank++;
+    }
+    items[ii].cursor = (((off_t) hash << 8) | rank) + 1;
+  }
+
+  return count;
+}
 
-    // iterate through directory entries of the given path and add them to slist
-    for(int i = 0; i < DIRENT_COUNT; i ++) {
-        if (dir_entry->free == 1) {
-            list = s_cons(dir_entry->name, list); // append the name of the entry to the front of the list
+// Streams the entries of the directory to fill, one leaf at a time.
+int directory_iterate(int dir_inum, off_t cursor, directory_filler_t fill, void *arg) {
+    inode_t* dir_inode = get_inode(dir_inum);
+    char leaf[LEAF_SIZE];
+    leaf_item_t items[LEAF_SIZE / 16]; // entries take at least 16 bytes
+    uint32_t hash = cursor > 0 ? (cursor - 1) >> 8 : 0;
+
+    for (;;) {
+        // copy the leaf holding the hash, and find where the next one starts
+        inode_read_lock(dir_inum);
+
+        dx_path_t path;
+        int size;
+        void* found = dir_find_leaf(dir_inode, hash, &path, &size);
+        memcpy(leaf, found, size);
+
+        int more = dir_next_leaf(dir_inode, &path, &hash);
+
+        inode_unlock(dir_inum);
+
+        // hand out the entries past the cursor; the directory is not locked,
+        // so fill may lock the entries' inodes
+        int count = leaf_items(leaf, size, items);
+        for (int ii = 0; ii < count; ii++) {
+            if (items[ii].cursor <= cursor) {
+                continue;
+            }
+
+            dirent_t* dir_entry = leaf_at(leaf, items[ii].off);
+            if (fill(arg, dir_entry->name, dir_entry->inum, items[ii].cursor) != 0) {
+                return 0; // the caller has no room for more
+            }
+            cursor = items[ii].cursor;
         }
 
-        dir_entry = dir_entry + 1;
+        if (!more) {
+            return 0;
+        }
     }
-
-    return list;
 }
@@ -5,43 +5,78 @@
  * A directory abastraction. Contains methods for directory
  * manipulation.
  *
+ * Directories are hashed, in the style of ext3's htree. Block 0 of a
+ * directory is the root of an index sorted by name hash; each index entry
+ * maps a range of hashes to a leaf block of entries (or, once the root
+ * fills up, to an index block one level down). A lookup walks at most two
+ * index blocks and scans one leaf, comparing 32-bit hash fingerprints
+ * before names, so its cost does not depend on the size of the directory.
+ * A full leaf is split in two at a hash boundary, and the directory grows
+ * by adding blocks at its end. A deleted entry's space is merged into the
+ * entry before it, and a leaf whose free space is scattered is compacted
+ * before it is split. A small directory keeps its entries in its inode
+ * instead, as a single leaf of INODE_INLINE_SIZE bytes, and moves them
+ * out to an index root and a leaf once they outgrow it.
+ *
+ * A directory's entries are guarded by its inode lock: callers of
+ * directory_lookup hold it for reading, and callers of directory_put and
+ * directory_delete hold it for writing. The path-based functions take
+ * the locks they need themselves.
+ *
  * Based on cs3650 starter code.
  */
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
+#include <stdint.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "storage.h"
-#include "slist.h"
 
-#define DIR_NAME_LENGTH 10 // the length of the name of a directory entry is at most 10 characters
+#define DIR_NAME_LENGTH 255 // the longest name of a directory entry
 
 /**
  * Represents a directory entry.
- * A directory entry can be a normal file or can be another directory
+ * A directory entry can be a normal file or can be another directory.
+ *
+ * Entries vary in length with their names and are packed back to back in
+ * a leaf block; rec_len leads from each entry to the next, and the
+ * entries of a leaf cover the whole block.
  */
 typedef struct dirents {
-  char name[DIR_NAME_LENGTH]; // the name of the directory entry
-  int inum;                   // the inum of the directory entry
-  int free;                   // 1 if the directory entry is in use, 0 if it has been deleted
-  char reserved[6];           // rounds out the size of the dirents struct
+  uint32_t hash;     // the hash of the name, compared before the name itself
+  int inum;          // the inum of the directory entry, 0 if it was deleted
+  uint16_t rec_len;  // the bytes from this entry to the next one
+  uint8_t name_len;  // the length of the name, not counting the terminator
+  uint8_t reserved;  // rounds out the size of the entry header
+  char name[];       // the name of the directory entry, NUL-terminated
 } dirent_t;
 
-extern const int DIR_SIZE;     // the size of a directory in bytes
-extern const int DIRENT_SIZE;  // the size of a directory entry
-extern const int DIRENT_COUNT; // the number of directory entries that can fit in a directory
-
 /**
  * Create a new directory with the given path and mode.
  *
  * @param path The absolute file path of the new directory.
  * @param mode The mode of the directory - including file type and permissions.
  *
- * @return 0 if the new directory was created successfully and -1 if otherwise.
+ * @return 0 if the new directory was created successfully, otherwise an
+ * 	   error as from tree_lookup_parent or directory_create.
  */
 int directory_init(const char* path, mode_t mode);
 
+/**
+ * Create a new directory with the given name inside the given directory.
+ *
+ * @param upper_dir_inum The inum of the directory the new one goes in.
+ * @param dir_name The name of the new directory.
+ * @param mode The mode of the directory - including file type and permissions.
+ *
+ * @return The inum of the new directory, -EEXIST if the name already exists,
+ *         -ENOSPC if there is no inode or room for it, or -ENAMETOOLONG if the
+ *         name is too long.
+ */
+int directory_create(int upper_dir_inum, const char* dir_name, mode_t mode);
+
 /**
  * Create the root directory.
  *
@@ -72,6 +107,18 @@ int directory_lookup(int inum, const char *name);
  */
 int tree_lookup(const char *path);
 
+/**
+ * Returns the inum of the directory the given path is in, without
+ * copying the path or allocating.
+ *
+ * @param path The absolute path of a directory or file, which need not exist.
+ * @param name Set to the last component of the path, which points into path.
+ *
+ * @return The inum of the parent directory, -ENOENT if it does not exist or
+ * 	   the last component is empty, -ENAMETOOLONG if that is too long.
+ */
+int tree_lookup_parent(const char *path, const char **name);
+
 /**
  * Makes a new directory entry with the given name and entry_inum in the directory
  * with the given dir_inum.
@@ -80,8 +127,9 @@ int tree_lookup(const char *path);
  * @param name The name of the new directory entry.
  * @param entry_inum The inum of the new directory entry.
  *
- * @return 0 if the new entry was made successfully, -1 if there is no room in the
- * 	   given directory for a new entry.
+ * @return 0 if the new entry was made successfully, -ENAMETOOLONG if the name
+ * 	   is too long, or -ENOSPC if there is no room in the given directory
+ * 	   for a new entry.
  */
 int directory_put(int dir_inum, const char *name, int entry_inum);
 
@@ -98,14 +146,41 @@ int directory_put(int dir_inum, const char *name, int entry_inum);
 int directory_delete(int dir_inum, const char *entry_name);
 
 /**
- * List the entry names of the directory entries of the directory at the 
- * given absolute path.
+ * Tells whether the directory with the given dir_inum is empty. The
+ * caller holds its lock.
+ *
+ * @param dir_inum The inum of the directory.
+ *
+ * @return 1 if the directory has no entries but . and .., 0 otherwise.
+ */
+int directory_empty(int dir_inum);
+
+/**
+ * Receives one directory entry from directory_iterate.
+ *
+ * @param arg The argument given to directory_iterate.
+ * @param name The name of the entry.
+ * @param inum The inum of the entry.
+ * @param cursor The position to resume iterating after this entry.
+ *
+ * @return 0 to continue, nonzero to stop.
+ */
+typedef int (*directory_filler_t)(void *arg, const char *name, int inum, off_t cursor);
+
+/**
+ * Streams the entries of a directory, in hash order, without building a
+ * list. Each leaf is copied under the directory's read lock and handed
+ * out after the lock is dropped, so the caller must not hold it.
+ * Cursors are positive and stay valid while entries come and go.
  *
- * @param The absolute path o the directory we are listing the contents of.
+ * @param dir_inum The inum of the directory to list.
+ * @param cursor 0 to start at the beginning, otherwise the cursor of the
+ * 	   last entry already seen.
+ * @param fill Called with each entry after the cursor.
+ * @param arg Passed through to fill.
  *
- * @return A list of strings containing the names of the entries in the given
- * 	   directory.
+ * @return 0 once the entries are exhausted or fill asks to stop.
  */
-slist_t *directory_list(const char *path);
+int directory_iterate(int dir_inum, off_t cursor, directory_filler_t fill, void *arg);
 
 #endif
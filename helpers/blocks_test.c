@@ -9,14 +9,14 @@ int main(int argc, char **argv) {
   blocks_init(TEST_NAME);
 
   printf("Block bitmap at the beginning:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
+  bitmap_print(get_blocks_bitmap(0), blocks_count());
 
-  int block_num = alloc_block();
+  bnum_t block_num = alloc_block();
 
-  printf("Allocated block no. %d\n", block_num);
+  printf("Allocated block no. %ld\n", (long) block_num);
 
   printf("Block bitmap after allocating:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
+  bitmap_print(get_blocks_bitmap(0), blocks_count());
 
   long *block = blocks_get_block(block_num);
 
@@ -24,7 +24,7 @@ int main(int argc, char **argv) {
     block[i] = i + 1;
   }
 
-  printf("Written to block %d:", block_num);
+  printf("Written to block %ld:", (long) block_num);
   for (int i = 0; i < 42; i++) {
     printf(" %ld", block[i]);
   }
@@ -4,58 +4,781 @@
  *
  * Implementation of an inode abstraction and its related methods.
  */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "inode.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "stats.h"
+#include "summary.h"
+#include "trace.h"
 
-const int INODE_COUNT = 250; // 256 total blocks - 1 block for bitmaps - 5 for inode table = 250 data blocks
+static const bnum_t INODE_BITMAP_START = 2; // the first block of the inode bitmap
+static const bnum_t INODE_TABLE_START = 3;  // the first block of the inode table
+static const int INODE_TABLE_BLOCKS = 5;    // the blocks the inode table starts out with
+
+#define INODE_LOCKS 1024 // the number of locks the inodes are striped over
+
+static summary_t inode_summary; // where the free inodes are
+
+// serializes allocating and freeing inodes and growing the table
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// inode i is guarded by inode_locks[i % INODE_LOCKS]
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = {
+  [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
 
 // COME BACK
-void print_inode(inode_t *node) {}
+void print_inode(inode_t *node) { (void) node; }
 
-// Initializes the inode table, reserves blocks 1, 2, 3, 4, 5
-// for the inode table.
+// Initializes the inode table, reserves blocks 2, 3, 4, 5, 6, 7
+// for the inode bitmap and the inode table.
 void inode_table_init() {
-  void *blocks_bitmap = get_blocks_bitmap(); // retrieve blocks bitmap
+  void *blocks_bitmap = get_blocks_bitmap(0); // retrieve blocks bitmap
+
+  for (int ii = 0; ii < 1 + INODE_TABLE_BLOCKS; ii++) {
+    bitmap_put(blocks_bitmap, INODE_BITMAP_START + ii, 1); // indicate that blocks 2-7 are being used
+  }
 
-  bitmap_put(blocks_bitmap, 1, 1);           // indicate that blocks 1-5 are being used
-  bitmap_put(blocks_bitmap, 2, 1);
-  bitmap_put(blocks_bitmap, 3, 1);
-  bitmap_put(blocks_bitmap, 4, 1);
-  bitmap_put(blocks_bitmap, 5, 1);
+  // the table's own inode lives in its first block, so describe both
+  // reserved inodes by hand before anything looks them up
+  inode_t *table = (inode_t *) blocks_get_block(INODE_TABLE_START) + INODE_TABLE_INUM;
+  table->refs = 1;
+  table->mode = 0100600;
+  table->size = (int64_t) INODE_TABLE_BLOCKS * BLOCK_SIZE;
+  table->extents_count = 1;
+  table->extents[0] = (extent_t) {INODE_TABLE_START, 0, INODE_TABLE_BLOCKS};
+
+  inode_t *bitmap = get_inode(INODE_BITMAP_INUM);
+  bitmap->refs = 1;
+  bitmap->mode = 0100600;
+  bitmap->size = BLOCK_SIZE;
+  bitmap->extents_count = 1;
+  bitmap->extents[0] = (extent_t) {INODE_BITMAP_START, 0, 1};
+
+  void *inode_bitmap = get_inode_bitmap(0);
+  bitmap_put(inode_bitmap, INODE_BITMAP_INUM, 1);
+  bitmap_put(inode_bitmap, INODE_TABLE_INUM, 1);
+}
+
+// Loads the inode table of a mounted image. The free inode summary is
+// built on first use.
+void inode_table_load() {
+  summary_free(&inode_summary);
+  summary_init(&inode_summary, get_inode_bitmap);
+}
+
+// Brings the free inode summary up to date with the size of the table.
+static void inode_summary_load() {
+  int count = inode_count();
+
+  if (inode_summary.bits != count) {
+    summary_resize(&inode_summary, count);
+  }
 }
 
 // Returns the inode with the given inum.
 inode_t *get_inode(int inum) {
-  void* start = blocks_get_block(1);   // pointer to beginning of inode table
-  int offset = sizeof(inode_t) * inum; // offset to the inode of interest
+  int per_block = BLOCK_SIZE / sizeof(inode_t);
+  bnum_t bnum = INODE_TABLE_START; // the first block holds the table's own inode
+
+  if (inum >= per_block) {
+    bnum = inode_get_bnum(get_inode(INODE_TABLE_INUM), inum / per_block);
+  }
+
+  return (inode_t *) blocks_get_block(bnum) + inum % per_block; // return the inode of interest
+}
+
+// Returns the inode bitmap block covering the given group of inodes.
+void *get_inode_bitmap(int group) {
+  return blocks_get_block(inode_get_bnum(get_inode(INODE_BITMAP_INUM), group));
+}
+
+// Returns the number of inodes in the inode table.
+int inode_count() {
+  return get_inode(INODE_TABLE_INUM)->size / sizeof(inode_t);
+}
 
-  return (inode_t *) ((char *)start + offset); // return the inode of interest
+// Doubles the number of inodes in the inode table, adding inode bitmap
+// blocks as needed to cover them.
+static int inode_table_grow() {
+  inode_t *table = get_inode(INODE_TABLE_INUM);
+  inode_t *bitmap = get_inode(INODE_BITMAP_INUM);
+
+  int64_t count = (int64_t) inode_count() * 2;
+  if (count > INT32_MAX) {
+    return -1;
+  }
+
+  bnum_t have = bytes_to_blocks(bitmap->size);
+  bnum_t need = (count + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+  if (grow_inode(bitmap, need * BLOCK_SIZE) != 0) {
+    return -1;
+  }
+
+  // new bitmap blocks start out with every inode free
+  for (bnum_t ii = have; ii < need; ii++) {
+    journal_dirty(get_inode_bitmap(ii), BLOCK_SIZE);
+    memset(get_inode_bitmap(ii), 0, BLOCK_SIZE);
+  }
+
+  return grow_inode(table, count * sizeof(inode_t)) == 0 ? 0 : -1;
 }
 
 // Allocates a new inode, reserves the new inode
 // in the inode bitmap.
 int alloc_inode() {
-  void *inode_bitmap = get_inode_bitmap();
+  superblock_t *sb = get_superblock();
+  int64_t inum = -1;
+
+  pthread_mutex_lock(&inode_alloc_lock);
+  for (;;) {
+    inode_summary_load();
 
-  //iterate through the inode bitmap and return the index
-  //of the first inode that is free
-   for (int ii = 0; ii < INODE_COUNT; ii++) {
-     if (!bitmap_get(inode_bitmap, ii)) {
-       bitmap_put(inode_bitmap, ii, 1);
-       printf("+ alloc_inode() -> %d\n", ii);
+    // search the inode bitmap from the cursor and return the index
+    // of the first inode that is free
+    int64_t scanned = inode_summary.scanned;
+    inum = summary_find(&inode_summary, sb->inode_cursor, 1);
+    stats_add(STATS_BITMAP_SCANS, 1);
+    stats_add(STATS_BITMAP_GROUPS, inode_summary.scanned - scanned);
 
-       return ii;
-     }
-   }
+    if (inum != -1) {
+      void *inode_bitmap = get_inode_bitmap(inum / BLOCKS_PER_GROUP);
+      journal_dirty(inode_bitmap, BLOCK_SIZE);
+      bitmap_put(inode_bitmap, inum % BLOCKS_PER_GROUP, 1);
+      summary_update(&inode_summary, inum, 1, 1);
 
-   return -1; // return -1 if did not find any free inode
+      journal_dirty(get_inode(inum), sizeof(inode_t));
+      memset(get_inode(inum), 0, sizeof(inode_t));
+      journal_dirty(sb, sizeof(superblock_t));
+      sb->inode_cursor = inum + 1;
+      stats_add(STATS_INODE_ALLOCS, 1);
+      TRACE(ALLOC_INODE, NULL, NULL, inum, 0);
+      break;
+    }
+
+    // every inode is in use, so make the table bigger
+    if (inode_table_grow() == -1) {
+      break; // return -1 if did not find any free inode
+    }
+  }
+  pthread_mutex_unlock(&inode_alloc_lock);
+
+  return inum;
 }
 
 // Frees the inode with the given inum in the inode bitmap.
 void free_inode(int inum) {
-  void *inode_bitmap = get_inode_bitmap(); // get the inode bitmap
-  bitmap_put(inode_bitmap, inum, 0);       // mark that the given inode is free
+  pthread_mutex_lock(&inode_alloc_lock);
+  inode_summary_load();
+
+  void *inode_bitmap = get_inode_bitmap(inum / BLOCKS_PER_GROUP); // get the inode bitmap
+  journal_dirty(inode_bitmap, BLOCK_SIZE);
+  bitmap_put(inode_bitmap, inum % BLOCKS_PER_GROUP, 0);            // mark that the given inode is free
+  summary_update(&inode_summary, inum, 1, 0);
+  pthread_mutex_unlock(&inode_alloc_lock);
+
+  stats_add(STATS_INODE_FREES, 1);
+  TRACE(FREE_INODE, NULL, NULL, 0, inum);
+}
+
+// Read-locks the inode with the given inum.
+void inode_read_lock(int inum) {
+  pthread_rwlock_rdlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// Write-locks the inode with the given inum.
+void inode_write_lock(int inum) {
+  pthread_rwlock_wrlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// Write-locks the inode with the given inum if no one holds its lock.
+int inode_try_write_lock(int inum) {
+  return pthread_rwlock_trywrlock(&inode_locks[inum % INODE_LOCKS]) == 0 ? 0 : -1;
+}
+
+// Unlocks the inode with the given inum.
+void inode_unlock(int inum) {
+  pthread_rwlock_unlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// Collects the distinct lock stripes of the given inodes in ascending
+// order, skipping -1 entries. Returns the number of stripes.
+static int inode_stripes(const int *inums, int n, int *stripes) {
+  int count = 0;
+
+  assert(n <= INODE_LOCK_MAX);
+  for (int ii = 0; ii < n; ii++) {
+    if (inums[ii] == -1) {
+      continue;
+    }
+
+    // insertion sort, dropping duplicates
+    int stripe = inums[ii] % INODE_LOCKS;
+    int jj = count;
+    while (jj > 0 && stripes[jj - 1] > stripe) {
+      jj--;
+    }
+    if (jj > 0 && stripes[jj - 1] == stripe) {
+      continue;
+    }
+
+    memmove(&stripes[jj + 1], &stripes[jj], sizeof(int) * (count - jj));
+    stripes[jj] = stripe;
+    count++;
+  }
+
+  return count;
+}
+
+// Write-locks all of the given inodes in stripe order.
+void inode_lock_all(const int *inums, int n) {
+  int stripes[INODE_LOCK_MAX];
+  int count = inode_stripes(inums, n, stripes);
+
+  for (int ii = 0; ii < count; ii++) {
+    pthread_rwlock_wrlock(&inode_locks[stripes[ii]]);
+  }
+}
+
+// Unlocks all of the given inodes.
+void inode_unlock_all(const int *inums, int n) {
+  int stripes[INODE_LOCK_MAX];
+  int count = inode_stripes(inums, n, stripes);
+
+  for (int ii = count - 1; ii >= 0; ii--) {
+    pthread_rwlock_unlock(&inode_locks[stripes[ii]]);
+  }
+}
+
+// Returns the extent map of the given inode, which lives either inline or
+// in the inode's extent block.
+static extent_t *inode_extents(inode_t *node) {
+  // the inode table is read without locks while it grows, see inode_add_run
+  bnum_t ebnum = __atomic_load_n(&node->extent_block, __ATOMIC_ACQUIRE);
+  if (ebnum != 0) {
+    return (extent_t *) blocks_get_block(ebnum);
+  }
+
+  return node->extents;
+}
+
+// Returns the number of blocks holding the inode's extent map, 0 while it
+// is in the inode. Maps spilled before they could span more than one
+// block leave the count at 0.
+static bnum_t inode_map_blocks(inode_t *node) {
+  if (node->extent_block == 0) {
+    return 0;
+  }
+  return node->extent_blocks > 0 ? node->extent_blocks : 1;
+}
+
+// Returns the number of file blocks mapped by the given inode.
+static bnum_t inode_block_count(inode_t *node) {
+  if (node->extents_count == 0) {
+    return 0;
+  }
+
+  extent_t *last = &inode_extents(node)[node->extents_count - 1];
+  return (bnum_t) last->start + last->count;
+}
+
+// Returns the disk block holding the given file block.
+bnum_t inode_get_bnum(inode_t *node, bnum_t file_bnum) {
+  return inode_get_run(node, file_bnum, NULL);
+}
+
+// Binary searches the extent map for the extent holding the given file
+// block, returning NULL if it is not mapped.
+static extent_t *inode_find_extent(inode_t *node, bnum_t file_bnum) {
+  // load the count before the map, which was published before the count
+  int count = __atomic_load_n(&node->extents_count, __ATOMIC_ACQUIRE);
+  extent_t *extents = inode_extents(node);
+  int lo = 0;
+  int hi = count - 1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    extent_t *ext = &extents[mid];
+
+    if (file_bnum < ext->start) {
+      hi = mid - 1;
+    } else if (file_bnum >= (bnum_t) ext->start + ext->count) {
+      lo = mid + 1;
+    } else {
+      return ext;
+    }
+  }
+
+  return NULL; // the file block is not mapped
+}
+
+// Returns the disk block of the file block within the extent, and the
+// length of the contiguous run from there.
+static bnum_t extent_run(extent_t *ext, bnum_t file_bnum, int *run) {
+  if (run != NULL) {
+    *run = ext->start + ext->count - file_bnum;
+  }
+  return ext->bnum + (file_bnum - ext->start);
+}
+
+// Binary searches the extent map for the given file block, returning its
+// disk block and the length of the contiguous run from there.
+bnum_t inode_get_run(inode_t *node, bnum_t file_bnum, int *run) {
+  extent_t *ext = inode_find_extent(node, file_bnum);
+  if (ext == NULL) {
+    return -1;
+  }
+
+  return extent_run(ext, file_bnum, run);
+}
+
+// Looks the file block up in the cursor's extent, falling back to the
+// extent map. Extents only ever grow unless the generation changes.
+bnum_t inode_get_run_cursor(inode_t *node, bnum_t file_bnum, int *run, extent_cursor_t *cursor) {
+  extent_t *ext = &cursor->extent;
+
+  if (cursor->generation != node->generation || file_bnum < ext->start ||
+      file_bnum >= (bnum_t) ext->start + ext->count) {
+    extent_t *found = inode_find_extent(node, file_bnum);
+    if (found == NULL) {
+      return -1;
+    }
+
+    *ext = *found;
+    cursor->generation = node->generation;
+  }
+
+  return extent_run(ext, file_bnum, run);
+}
+
+// Returns the index of the first extent ending after the given file
+// block, extents_count if there is none.
+static int inode_extent_after(inode_t *node, bnum_t file_bnum) {
+  extent_t *extents = inode_extents(node);
+  int lo = 0;
+  int hi = node->extents_count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((bnum_t) extents[mid].start + extents[mid].count <= file_bnum) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
 
-  printf("+ free_inode(%d)\n", inum);
+  return lo;
 }
 
+// Returns the first mapped file block at or after the given one.
+bnum_t inode_next_data(inode_t *node, bnum_t file_bnum) {
+  int at = inode_extent_after(node, file_bnum);
+  if (at == node->extents_count) {
+    return -1;
+  }
+
+  extent_t *ext = &inode_extents(node)[at];
+  return file_bnum > ext->start ? file_bnum : ext->start;
+}
+
+// Returns the first unmapped file block at or after the given one.
+bnum_t inode_next_hole(inode_t *node, bnum_t file_bnum) {
+  extent_t *extents = inode_extents(node);
+  int at = inode_extent_after(node, file_bnum);
+
+  // follow the extents that continue one another in the file
+  while (at < node->extents_count && extents[at].start <= file_bnum) {
+    file_bnum = (bnum_t) extents[at].start + extents[at].count;
+    at++;
+  }
+
+  return file_bnum;
+}
+
+// Counts the disk blocks held by the inode.
+bnum_t inode_blocks(inode_t *node) {
+  if (node->flags & INODE_INLINE) {
+    return 0;
+  }
+
+  extent_t *extents = inode_extents(node);
+  bnum_t count = inode_map_blocks(node);
+  for (int ii = 0; ii < node->extents_count; ii++) {
+    count += extents[ii].count;
+  }
+
+  return count;
+}
+
+// Prefetches every block of the reserved inodes, which are small enough
+// to walk at mount.
+void inode_table_prefetch(int populate) {
+  int reserved[] = {INODE_BITMAP_INUM, INODE_TABLE_INUM};
+
+  for (int ii = 0; ii < 2; ii++) {
+    inode_t *node = get_inode(reserved[ii]);
+    extent_t *extents = inode_extents(node);
+
+    if (node->extent_block != 0) {
+      blocks_prefetch(node->extent_block, inode_map_blocks(node), populate);
+    }
+    for (int jj = 0; jj < node->extents_count; jj++) {
+      blocks_prefetch(extents[jj].bnum, extents[jj].count, populate);
+    }
+  }
+}
+
+// Moves the full extent map of the inode into a block of its own, or into
+// a run of blocks twice as long as the one holding it, which is freed.
+// Returns 0, -EFBIG if the map may grow no further, or -ENOSPC if there
+// is no such run.
+static int inode_map_grow(inode_t *node) {
+  bnum_t have = inode_map_blocks(node);
+  bnum_t want = have == 0 ? 1 : 2 * have;
+  if (want > INODE_EXTENT_BLOCKS) {
+    return -EFBIG;
+  }
+
+  // a run may need the image to grow, by enough that one group holds it
+  bnum_t ebnum = want == 1 ? alloc_block() : alloc_blocks(want);
+  if (ebnum == -1 && want > 1 && blocks_grow(blocks_count() + 2 * want + 1) == 0) {
+    ebnum = alloc_blocks(want);
+  }
+  if (ebnum == -1) {
+    return -ENOSPC;
+  }
+
+  size_t used = sizeof(extent_t) * node->extents_count;
+  char *map = blocks_get_blocks(ebnum, want);
+  journal_dirty(map, (size_t) want * BLOCK_SIZE);
+  memcpy(map, inode_extents(node), used);
+  memset(map + used, 0, (size_t) want * BLOCK_SIZE - used);
+
+  journal_dirty(node, sizeof(inode_t));
+  bnum_t old = node->extent_block;
+  node->extent_blocks = want;
+  __atomic_store_n(&node->extent_block, ebnum, __ATOMIC_RELEASE);
+  if (old != 0) {
+    free_blocks(old, have);
+  }
+  return 0;
+}
+
+// Maps count contiguous disk blocks from bnum at file block start, which
+// must be a hole, extending a neighbouring extent when the run is
+// adjacent to it on disk. Lookups in the inode table take no lock, so an
+// extent appended to it (and a spilled map) is filled in before it is
+// published with a release store; the extents of other files only move
+// under the inode's write lock. The inode table's map stays small enough
+// that it is never moved out of a block once there.
+static int inode_add_run(inode_t *node, bnum_t start, bnum_t bnum, bnum_t count) {
+  extent_t *extents = inode_extents(node);
+  int at = inode_extent_after(node, start); // the extent after the hole
+
+  if (at > 0) {
+    extent_t *prev = &extents[at - 1];
+    if ((bnum_t) prev->start + prev->count == start && prev->bnum + prev->count == bnum) {
+      journal_dirty(prev, sizeof(extent_t));
+      prev->count += count;
+      return 0;
+    }
+  }
+
+  if (at < node->extents_count) {
+    extent_t *next = &extents[at];
+    if (start + count == next->start && bnum + count == next->bnum) {
+      journal_dirty(next, sizeof(extent_t));
+      next->start = start;
+      next->bnum = bnum;
+      next->count += count;
+      return 0;
+    }
+  }
+
+  // a full map moves somewhere bigger
+  int64_t capacity = node->extent_block != 0 ? inode_map_blocks(node) * (BLOCK_SIZE / sizeof(extent_t))
+                                             : INODE_EXTENTS;
+  if (node->extents_count == capacity) {
+    int rv = inode_map_grow(node);
+    if (rv != 0) {
+      return rv;
+    }
+    extents = inode_extents(node);
+  }
+
+  extent_t *ext = &extents[at];
+  journal_dirty(ext, sizeof(extent_t) * (node->extents_count - at + 1));
+  memmove(ext + 1, ext, sizeof(extent_t) * (node->extents_count - at));
+  ext->start = start;
+  ext->bnum = bnum;
+  ext->count = count;
+  __atomic_store_n(&node->extents_count, node->extents_count + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+// Allocates disk blocks for the count file blocks from start, which are a
+// hole. Asks for the whole hole as one run, settling for shorter runs and
+// finally single blocks (which grow the image) when the free space is
+// fragmented. The file blocks below zero_end already lie within the
+// file, so they are zeroed as they are mapped, in case a later run fails
+// before they are written.
+static int inode_fill_hole(inode_t *node, bnum_t start, bnum_t count, bnum_t zero_end) {
+  while (count > 0) {
+    bnum_t want = count;
+    if (want > BLOCKS_PER_GROUP / 2) {
+      want = BLOCKS_PER_GROUP / 2;
+    }
+
+    bnum_t bnum = alloc_blocks(want);
+    while (bnum == -1 && want > 1) {
+      want /= 2;
+      bnum = alloc_blocks(want);
+    }
+    if (bnum == -1) {
+      want = 1;
+      bnum = alloc_block();
+    }
+    if (bnum == -1) {
+      return -ENOSPC;
+    }
+
+    int rv = inode_add_run(node, start, bnum, want);
+    if (rv != 0) {
+      free_blocks(bnum, want);
+      return rv;
+    }
+
+    if (start < zero_end) {
+      bnum_t inside = zero_end - start < want ? zero_end - start : want;
+      memset(blocks_get_blocks(bnum, inside), 0, inside * BLOCK_SIZE);
+    }
+
+    start += want;
+    count -= want;
+  }
+
+  return 0;
+}
+
+// Moves the data of an inline inode into a block of its own. The block is
+// journaled with the inode, so the data cannot be lost between the two;
+// an empty inode just stops being inline.
+static int inode_spill(inode_t *node) {
+  if (node->size == 0) {
+    memset(node->data, 0, INODE_INLINE_SIZE);
+    node->flags &= ~INODE_INLINE;
+    return 0;
+  }
+
+  char data[INODE_INLINE_SIZE];
+  memcpy(data, node->data, node->size);
+
+  bnum_t bnum = alloc_block();
+  if (bnum == -1) {
+    return -ENOSPC;
+  }
+
+  char *block = blocks_get_block(bnum);
+  journal_dirty(block, BLOCK_SIZE);
+  memcpy(block, data, node->size);
+  memset(block + node->size, 0, BLOCK_SIZE - node->size);
+
+  memset(node->data, 0, INODE_INLINE_SIZE);
+  node->flags &= ~INODE_INLINE;
+  node->extents_count = 0;
+  return inode_add_run(node, 0, bnum, 1);
+}
+
+// Makes room for size bytes in an inline inode: in place while they fit,
+// the new bytes reading as zeros, else by moving its data to a block.
+// Returns 1 if the inode is still inline, 0 if not and -ENOSPC on failure.
+static int inode_inline_grow(inode_t *node, int64_t size) {
+  journal_dirty(node, sizeof(inode_t));
+
+  if (size > INODE_INLINE_SIZE) {
+    return inode_spill(node);
+  }
+
+  if (size > node->size) {
+    memset(node->data + node->size, 0, size - node->size);
+    node->size = size;
+  }
+  return 1;
+}
+
+// Grows the inode so that its blocks cover size bytes.
+int grow_inode(inode_t *node, int64_t size) {
+  if (node->flags & INODE_INLINE) {
+    int rv = inode_inline_grow(node, size);
+    if (rv != 0) {
+      return rv == 1 ? 0 : rv;
+    }
+  }
+
+  bnum_t have = inode_block_count(node);
+  bnum_t need = bytes_to_blocks(size);
+
+  if (need > INODE_MAX_BLOCKS) {
+    return -EFBIG;
+  }
+
+  if (have < need || size > node->size) {
+    journal_dirty(node, sizeof(inode_t));
+  }
+
+  if (have < need) {
+    int rv = inode_fill_hole(node, have, need - have, bytes_to_blocks(node->size));
+    if (rv != 0) {
+      return rv;
+    }
+  }
+
+  if (size > node->size) {
+    node->size = size;
+  }
+
+  return 0;
+}
+
+// Backs the bytes [offset, offset + size) with blocks, allocating only
+// the holes among them.
+int map_inode(inode_t *node, int64_t offset, int64_t size) {
+  int64_t end = offset + size;
+  if (size == 0) {
+    return 0;
+  }
+
+  if (node->flags & INODE_INLINE) {
+    int rv = inode_inline_grow(node, end);
+    if (rv != 0) {
+      return rv == 1 ? 0 : rv;
+    }
+  }
+
+  bnum_t first = offset / BLOCK_SIZE;
+  bnum_t last = (end - 1) / BLOCK_SIZE;
+  if (last >= INODE_MAX_BLOCKS) {
+    return -EFBIG;
+  }
+
+  journal_dirty(node, sizeof(inode_t));
+  int fresh_first = inode_get_bnum(node, first) == -1;
+  int fresh_last = inode_get_bnum(node, last) == -1;
+
+  for (bnum_t fb = first; fb <= last;) {
+    int run;
+    if (inode_get_run(node, fb, &run) != -1) {
+      fb += run;
+      continue;
+    }
+
+    bnum_t next = inode_next_data(node, fb);
+    bnum_t stop = next == -1 || next > last ? last + 1 : next;
+    int rv = inode_fill_hole(node, fb, stop - fb, bytes_to_blocks(node->size));
+    if (rv != 0) {
+      // what was mapped past the size goes again, so a later extension
+      // cannot bring back its stale contents
+      shrink_inode(node, node->size);
+      return rv;
+    }
+    fb = stop;
+  }
+
+  // new blocks read as zeros outside the range, as holes did
+  if (fresh_first && offset % BLOCK_SIZE != 0) {
+    memset(blocks_get_block(inode_get_bnum(node, first)), 0, offset % BLOCK_SIZE);
+  }
+  if (fresh_last && end % BLOCK_SIZE != 0) {
+    char *block = blocks_get_block(inode_get_bnum(node, last));
+    memset(block + end % BLOCK_SIZE, 0, BLOCK_SIZE - end % BLOCK_SIZE);
+  }
+
+  if (end > node->size) {
+    node->size = end;
+  }
+
+  return 0;
+}
+
+// Sets the size of the inode, freeing the blocks past a smaller size and
+// leaving the bytes up to a larger one as a hole.
+int truncate_inode(inode_t *node, int64_t size) {
+  if (size < node->size) {
+    return shrink_inode(node, size);
+  }
+
+  if (node->flags & INODE_INLINE) {
+    int rv = inode_inline_grow(node, size);
+    if (rv != 0) {
+      return rv == 1 ? 0 : rv;
+    }
+  }
+
+  if (bytes_to_blocks(size) > INODE_MAX_BLOCKS) {
+    return -EFBIG;
+  }
+
+  journal_dirty(node, sizeof(inode_t));
+  node->size = size;
+  return 0;
+}
+
+// Shrinks the inode to size bytes, freeing any blocks past the new end.
+int shrink_inode(inode_t *node, int64_t size) {
+  if (node->flags & INODE_INLINE) {
+    journal_dirty(node, sizeof(inode_t));
+    node->size = size;
+    return 0;
+  }
+
+  bnum_t keep = bytes_to_blocks(size);
+  extent_t *extents = inode_extents(node);
+
+  journal_dirty(node, sizeof(inode_t));
+  journal_dirty(extents, sizeof(extent_t) * node->extents_count);
+
+  // free whole or partial extents from the end of the file
+  while (node->extents_count > 0) {
+    extent_t *last = &extents[node->extents_count - 1];
+    if ((bnum_t) last->start + last->count <= keep) {
+      break;
+    }
+
+    uint32_t first = keep > last->start ? keep - last->start : 0;
+    free_blocks(last->bnum + first, last->count - first);
+    node->generation += 1; // cached copies of this extent are stale now
+
+    if (first == 0) {
+      node->extents_count -= 1;
+    } else {
+      last->count = first;
+    }
+  }
+
+  // move the extent map back into the inode once it fits again
+  if (node->extent_block != 0 && node->extents_count <= INODE_EXTENTS) {
+    bnum_t ebnum = node->extent_block;
+    bnum_t eblocks = inode_map_blocks(node);
+    memcpy(node->extents, extents, sizeof(extent_t) * node->extents_count);
+    node->extent_block = 0;
+    node->extent_blocks = 0;
+    free_blocks(ebnum, eblocks);
+  }
+
+  // an emptied file starts over inline; directories keep their index
+  if (size == 0 && !S_ISDIR(node->mode)) {
+    memset(node->data, 0, INODE_INLINE_SIZE);
+    node->flags |= INODE_INLINE;
+  }
+
+  node->size = size;
+  return 0;
+}
@@ -14,22 +14,79 @@
 
 #include "blocks.h"
 
-// struct representing an inode and its necessary fields
+#define INODE_INLINE_SIZE 216 // the bytes of data an inode holds itself, making it 256 bytes
+#define INODE_EXTENTS 13      // the extents stored directly in an inode, in the same space
+#define INODE_EXTENT_BLOCKS 64 // the most blocks the extent map spills into (16384 extents)
+
+#define INODE_MAX_BLOCKS UINT32_MAX // the most blocks a file spans, as extents address them
+
+#define INODE_INLINE 1 // inode flag: the data lives in the inode rather than in blocks
+
+#define INODE_BITMAP_INUM 0 // the reserved inode whose blocks hold the inode bitmap
+#define INODE_TABLE_INUM 1  // the reserved inode whose blocks hold the inode table
+
+#define INODE_LOCK_MAX 4 // the most inodes inode_lock_all can lock at once
+
+// struct representing a run of contiguous blocks holding part of a file
+typedef struct extent {
+  bnum_t bnum;    // the disk block holding the first file block
+  uint32_t start; // the first file block covered by the extent
+  uint32_t count; // the number of contiguous blocks in the extent
+} extent_t;
+
+// struct caching the extent a file was last accessed through, so that
+// sequential access skips the extent map search
+typedef struct extent_cursor {
+  extent_t extent; // a copy of the extent, with a count of 0 when empty
+  int generation;  // the inode's generation when the extent was copied
+  int lock;        // guards the cursor when several threads share it
+  int64_t ahead;   // the file offset sequential reads were read ahead to
+} extent_cursor_t;
+
+// struct representing an inode and its necessary fields. Small files,
+// symlinks and directories keep their data in the inode itself, in the
+// space the extent map uses once they outgrow it; an inline inode maps no
+// blocks. An extent map outgrowing the inode moves to a block, and then
+// to runs of blocks twice as long, up to INODE_EXTENT_BLOCKS: a file
+// split into more extents than that cannot grow.
 typedef struct inode {
-  int refs;     // the numberof references to a file
-  mode_t mode;  // permission & type of a file
-  int size;     // size in bytes of a file
-  int block;    // the index of the block containing a file's contents
+  int refs;            // the numberof references to a file
+  mode_t mode;         // permission & type of a file
+  int64_t size;        // size in bytes of a file
+  int extents_count;   // the number of extents mapping the file's blocks
+  int generation;      // bumped whenever blocks leave the extent map
+  bnum_t extent_block; // first block holding the extent map once it outgrows the inode, 0 if unused
+  uint32_t flags;      // INODE_INLINE while the data lives in the inode
+  uint32_t extent_blocks; // the contiguous blocks from extent_block the map spans (0 reads as 1)
+  union {
+    extent_t extents[INODE_EXTENTS]; // the inline extent map, sorted by start
+    char data[INODE_INLINE_SIZE];    // the data of an inline inode
+  };
 } inode_t;
 
-extern const int INODE_COUNT; // the number of inodes that fit in one data block
-
 /**
  * Initialize the inode table.
- * Reserves data blocks 1 - 5 to hold only inodes.
+ * Block 2 holds the inode bitmap and blocks 3 - 7 the first inodes. Both
+ * are described by reserved inodes 0 and 1, so the table can grow like
+ * any other file.
  */
 void inode_table_init();
 
+/**
+ * Load the inode table of a mounted image.
+ * Must be called each time an image is mounted, after inode_table_init
+ * for a new image.
+ */
+void inode_table_load();
+
+/**
+ * Read the inode table and the inode bitmap into memory, as
+ * blocks_prefetch does.
+ *
+ * @param populate 1 to map the blocks in, 0 only to start reading them.
+ */
+void inode_table_prefetch(int populate);
+
 /**
  * COME BACK
  */
@@ -44,11 +101,29 @@ void print_inode();
  */
 inode_t* get_inode(int inum);
 
+/**
+ * Return a pointer to the inode bitmap block covering the given inodes.
+ * Group g covers inums [g * BLOCKS_PER_GROUP, (g + 1) * BLOCKS_PER_GROUP).
+ *
+ * @param group The index of the inode bitmap block.
+ *
+ * @return A pointer to the beginning of the bitmap block.
+ */
+void *get_inode_bitmap(int group);
+
+/**
+ * Get the number of inodes the inode table currently holds.
+ *
+ * @return The number of inodes in the table.
+ */
+int inode_count();
+
 /**
  * Allocates a new inode. Searches in the inode
- * bitmap for the first free inode and reserves that inode.
+ * bitmap for the first free inode and reserves that inode,
+ * doubling the inode table when every inode is in use.
  *
- * @return The index of the newly reserved inode.
+ * @return The index of the newly reserved (zeroed) inode, -1 if none is left.
  */
 int alloc_inode();
 
@@ -60,4 +135,184 @@ int alloc_inode();
  */
 void free_inode(int inum);
 
+/**
+ * Read-locks the inode with the given inum. Readers of a file's data or
+ * of a directory's entries hold the lock for reading.
+ * Inodes are striped over a fixed set of locks, so a thread holding one
+ * inode lock must take any further ones through inode_lock_all.
+ *
+ * @param inum The index of the inode to lock.
+ */
+void inode_read_lock(int inum);
+
+/**
+ * Write-locks the inode with the given inum. Anything changing a file's
+ * size, blocks or attributes, or a directory's entries, holds the lock
+ * for writing.
+ *
+ * @param inum The index of the inode to lock.
+ */
+void inode_write_lock(int inum);
+
+/**
+ * Write-locks the inode with the given inum without waiting, so that a
+ * thread holding another inode lock can still try for it.
+ *
+ * @param inum The index of the inode to lock.
+ *
+ * @return 0 if the inode is now locked, -1 if its lock was held (its
+ * stripe may be one the caller holds itself).
+ */
+int inode_try_write_lock(int inum);
+
+/**
+ * Unlocks the inode with the given inum.
+ *
+ * @param inum The index of the inode to unlock.
+ */
+void inode_unlock(int inum);
+
+/**
+ * Write-locks several inodes at once, in a global order that keeps
+ * concurrent callers from deadlocking. Duplicate inums and -1 entries
+ * are allowed.
+ *
+ * @param inums The indexes of the inodes to lock.
+ * @param n The number of inums, at most INODE_LOCK_MAX.
+ */
+void inode_lock_all(const int *inums, int n);
+
+/**
+ * Unlocks inodes locked with inode_lock_all.
+ *
+ * @param inums The indexes of the inodes to unlock.
+ * @param n The number of inums.
+ */
+void inode_unlock_all(const int *inums, int n);
+
+/**
+ * Retrieves the disk block holding the given block of a file.
+ *
+ * @param node The inode of the file.
+ * @param file_bnum The index of the block within the file.
+ *
+ * @return The block number on disk, -1 if the file has no such block.
+ */
+bnum_t inode_get_bnum(inode_t *node, bnum_t file_bnum);
+
+/**
+ * Retrieves the disk block holding the given block of a file along with
+ * the number of blocks after it that are contiguous on disk. Lookups are a
+ * binary search over the inode's extent map.
+ *
+ * @param node The inode of the file.
+ * @param file_bnum The index of the block within the file.
+ * @param run Set to the number of contiguous blocks starting at file_bnum.
+ *
+ * @return The block number on disk, -1 if the file has no such block.
+ */
+bnum_t inode_get_run(inode_t *node, bnum_t file_bnum, int *run);
+
+/**
+ * Retrieves the disk block holding the given block of a file like
+ * inode_get_run, trying the extent in the cursor before searching the
+ * extent map and remembering the extent found there. The caller holds
+ * the inode's lock and keeps the cursor to itself.
+ *
+ * @param node The inode of the file.
+ * @param file_bnum The index of the block within the file.
+ * @param run Set to the number of contiguous blocks starting at file_bnum.
+ * @param cursor The cursor to try and update.
+ *
+ * @return The block number on disk, -1 if the file has no such block.
+ */
+bnum_t inode_get_run_cursor(inode_t *node, bnum_t file_bnum, int *run, extent_cursor_t *cursor);
+
+/**
+ * Finds the first block of a file at or after the given one that is
+ * backed by a disk block, for SEEK_DATA.
+ *
+ * @param node The inode of the file.
+ * @param file_bnum The index of the block within the file to start at.
+ *
+ * @return The index of the mapped block, -1 if none follows.
+ */
+bnum_t inode_next_data(inode_t *node, bnum_t file_bnum);
+
+/**
+ * Finds the first block of a file at or after the given one that is a
+ * hole, for SEEK_HOLE. Blocks past the last extent are all holes.
+ *
+ * @param node The inode of the file.
+ * @param file_bnum The index of the block within the file to start at.
+ *
+ * @return The index of the unmapped block.
+ */
+bnum_t inode_next_hole(inode_t *node, bnum_t file_bnum);
+
+/**
+ * Counts the disk blocks an inode holds, including its extent map.
+ *
+ * @param node The inode to count the blocks of.
+ *
+ * @return The number of blocks, 0 for an inline inode.
+ */
+bnum_t inode_blocks(inode_t *node);
+
+/**
+ * Grows the given inode so that its blocks can hold size bytes.
+ * Blocks are allocated densely after the last extent, extending it
+ * whenever they are adjacent on disk, and the extent map spills into its
+ * own blocks once it no longer fits in the inode. An inline inode stays
+ * inline while size fits in it, the new bytes reading as zeros; past
+ * that, its data moves to a block first.
+ *
+ * @param node The inode to grow.
+ * @param size The new size of the file in bytes.
+ *
+ * @return 0 on success, -ENOSPC if we ran out of blocks, or -EFBIG if size
+ *         is past the largest file or the extent map is full.
+ */
+int grow_inode(inode_t *node, int64_t size);
+
+/**
+ * Backs the given byte range of a file with blocks, ahead of a write to
+ * it. Only the holes in the range get new blocks, sized to the hole; the
+ * parts of the first and last new block outside the range are zeroed,
+ * as they read as zeros before. The file grows to the end of the range
+ * if it was smaller. On failure, the blocks already mapped within the
+ * file's size read as zeros, and those past it are freed again.
+ *
+ * @param node The inode of the file.
+ * @param offset The offset of the range in bytes.
+ * @param size The length of the range in bytes.
+ *
+ * @return 0 on success, -ENOSPC if we ran out of blocks, or -EFBIG if
+ *         the range lies past the largest file or the extent map is full.
+ */
+int map_inode(inode_t *node, int64_t offset, int64_t size);
+
+/**
+ * Sets the size of a file. Shrinking frees the blocks past the new end;
+ * growing allocates nothing, leaving a hole that reads as zeros.
+ *
+ * @param node The inode of the file.
+ * @param size The new size of the file in bytes.
+ *
+ * @return 0 on success, -EFBIG if size is past the largest file, or
+ *         -ENOSPC if an inline inode could not move its data to a block.
+ */
+int truncate_inode(inode_t *node, int64_t size);
+
+/**
+ * Shrinks the given inode to size bytes, freeing the blocks past the end.
+ * A file other than a directory shrunk to nothing is inline again.
+ *
+ * @param node The inode to shrink.
+ * @param size The new size of the file in bytes.
+ *
+ * @return 0 on success.
+ */
+int shrink_inode(inode_t *node, int64_t size);
+
 #endif
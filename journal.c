@@ -0,0 +1,591 @@
+/**
+ * @file journal.c
+ *
+ * Implementation of the metadata journal.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "journal.h"
+#include "blocks.h"
+#include "stats.h"
+#include "trace.h"
+
+#define JOURNAL_BLOCKS 1024     // the blocks of a new journal (4MB), the header included
+#define JOURNAL_TXN_BLOCKS 256  // commit early once this many blocks are dirty
+
+#define JOURNAL_MAGIC 0x4a524e4c        // "JRNL", marks the journal header
+#define JOURNAL_DESC_MAGIC 0x44455343   // "DESC", marks a descriptor block
+#define JOURNAL_COMMIT_MAGIC 0x434d4954 // "CMIT", marks a commit record
+
+// struct stored in the first block of the journal
+typedef struct journal_header {
+  uint32_t magic; // JOURNAL_MAGIC
+  uint32_t pad;
+  uint64_t seq;   // the sequence number of the first transaction to replay
+  int64_t tail;   // the log block that transaction starts at
+} journal_header_t;
+
+// struct heading a descriptor block, which lists where the blocks that
+// follow it belong
+typedef struct journal_desc {
+  uint32_t magic;  // JOURNAL_DESC_MAGIC
+  uint32_t count;  // the number of blocks listed
+  uint64_t seq;    // the transaction the block belongs to
+  bnum_t bnums[];  // where each of the blocks after the descriptor goes
+} journal_desc_t;
+
+// the number of blocks a descriptor can list
+#define JOURNAL_DESC_MAX ((4096 - sizeof(journal_desc_t)) / sizeof(bnum_t))
+
+// struct stored in the block that ends a transaction
+typedef struct journal_commit_rec {
+  uint32_t magic;    // JOURNAL_COMMIT_MAGIC
+  uint32_t blocks;   // the descriptor and logged blocks before the record
+  uint64_t seq;      // the transaction the record ends
+  uint64_t checksum; // journal_checksum of those blocks
+} journal_commit_rec_t;
+
+static int journal_enabled = 0; // set once the journal has been replayed
+static bnum_t journal_log;      // the first block of the log, after the header
+static int64_t journal_size;    // the number of blocks in the log
+static int64_t journal_head;    // the log block the next transaction goes to
+static int64_t journal_used;    // the log blocks written since the last checkpoint
+static uint64_t journal_seq;    // the sequence number of the next transaction
+static int journal_moved;       // set when the next commit goes to a new, larger log
+
+// open transactions hold the barrier for reading and a commit holds it for
+// writing; writers go first, so commits are not starved
+static pthread_rwlock_t journal_barrier = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static __thread int journal_depth = 0; // the transactions the thread has open
+
+// the blocks dirtied since the last commit, as a list and as a hash set
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static bnum_t *dirty_list = NULL;
+static int dirty_count = 0;
+static bnum_t *dirty_set = NULL; // open addressing, -1 for an empty slot
+static int dirty_slots = 0;
+static uint64_t dirty_epoch = 1; // bumped whenever the set is emptied
+
+// the block the thread dirtied last, to skip the lock for repeated stores
+static __thread bnum_t dirty_last = -1;
+static __thread uint64_t dirty_last_epoch = 0;
+
+// the background committer
+static pthread_t journal_thread;
+static pthread_mutex_t journal_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_run_cond = PTHREAD_COND_INITIALIZER;
+static int journal_interval = -1; // milliseconds between commits, -1 when not running
+static int journal_running = 0;
+
+// Sums the words of n blocks (Fletcher-style, so the order of the words
+// counts).
+static uint64_t journal_checksum(const void *data, int64_t n) {
+  const uint64_t *words = (const uint64_t *) data;
+  int64_t count = n * BLOCK_SIZE / sizeof(uint64_t);
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+
+  for (int64_t ii = 0; ii < count; ii++) {
+    lo += words[ii];
+    hi += lo;
+  }
+
+  return lo ^ (hi << 1) ^ (hi >> 63);
+}
+
+// Returns the given block of the log, wrapping around its end.
+static void *journal_block(int64_t pos) {
+  return blocks_get_block(journal_log + pos % journal_size);
+}
+
+// Writes n blocks to the log starting at pos, wrapping around its end.
+static void journal_write(int64_t pos, const char *data, int64_t n) {
+  pos %= journal_size;
+  int64_t first = journal_size - pos < n ? journal_size - pos : n;
+
+  blocks_write(journal_log + pos, data, first);
+  if (first < n) {
+    blocks_write(journal_log, data + first * BLOCK_SIZE, n - first);
+  }
+}
+
+// Flushes n blocks of the log starting at pos, wrapping around its end.
+// Only the log is flushed, not the file data written since the last commit.
+static void journal_sync(int64_t pos, int64_t n) {
+  pos %= journal_size;
+  int64_t first = journal_size - pos < n ? journal_size - pos : n;
+
+  int rv = blocks_sync_range(journal_log + pos, first);
+  if (rv == 0 && first < n) {
+    rv = blocks_sync_range(journal_log, n - first);
+  }
+  assert(rv == 0);
+}
+
+// Records that replay starts at the head of the log. Everything logged
+// so far must already be written in place.
+static void journal_checkpoint() {
+  static char block[4096];
+  journal_header_t *header = (journal_header_t *) block;
+
+  blocks_sync(); // the blocks written in place are on disk before the log is let go
+
+  header->magic = JOURNAL_MAGIC;
+  header->seq = journal_seq;
+  header->tail = journal_head;
+  blocks_write(journal_log - 1, block, 1);
+  int rv = blocks_sync_range(journal_log - 1, 1);
+  assert(rv == 0);
+
+  journal_used = 0;
+}
+
+// Checks the transaction starting at pos. Returns the number of log blocks
+// it takes up, -1 if it was never committed.
+static int64_t journal_scan(int64_t pos, uint64_t seq) {
+  int64_t n = 0;
+  uint64_t checksum = 0;
+
+  // walk the descriptors up to the commit record
+  for (;;) {
+    if (n >= journal_size) {
+      return -1;
+    }
+
+    uint32_t magic = *(uint32_t *) journal_block(pos + n);
+
+    if (magic == JOURNAL_COMMIT_MAGIC) {
+      journal_commit_rec_t *rec = journal_block(pos + n);
+      int valid = rec->seq == seq && rec->blocks == n && rec->checksum == checksum;
+      return valid ? n + 1 : -1;
+    }
+
+    journal_desc_t *desc = journal_block(pos + n);
+    if (magic != JOURNAL_DESC_MAGIC || desc->seq != seq || desc->count > JOURNAL_DESC_MAX) {
+      return -1; // a torn transaction, or one from an earlier pass over the log
+    }
+
+    // fold the descriptor and its blocks into the running checksum
+    for (int64_t ii = 0; ii <= desc->count; ii++) {
+      checksum = checksum * 31 + journal_checksum(journal_block(pos + n + ii), 1);
+    }
+    n += 1 + desc->count;
+  }
+}
+
+// Writes the blocks of the transaction starting at pos in place.
+static void journal_apply(int64_t pos, int64_t n) {
+  int64_t at = 0;
+
+  while (at < n - 1) {
+    journal_desc_t *desc = journal_block(pos + at);
+    for (uint32_t ii = 0; ii < desc->count; ii++) {
+      blocks_write(desc->bnums[ii], journal_block(pos + at + 1 + ii), 1);
+    }
+    at += 1 + desc->count;
+  }
+}
+
+// Allocates the journal of an image that has none.
+static void journal_create() {
+  superblock_t *sb = get_superblock();
+
+  int rv = blocks_grow(blocks_count() + JOURNAL_BLOCKS);
+  assert(rv == 0);
+  bnum_t start = alloc_blocks(JOURNAL_BLOCKS);
+  assert(start != -1);
+
+  journal_log = start + 1;
+  journal_size = JOURNAL_BLOCKS - 1;
+  journal_head = 0;
+  journal_seq = 1;
+  journal_checkpoint(); // writes the header, after flushing the freshly formatted image
+
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->journal_blocks = JOURNAL_BLOCKS;
+  sb->journal_start = start;
+  blocks_sync();
+
+  TRACE(JOURNAL_CREATE, NULL, NULL, 0, start);
+}
+
+// Empties the dirty set. A thread's last dirtied block is only skipped
+// while the set is the one it went into, so the epoch moves on.
+static void dirty_clear() {
+  pthread_mutex_lock(&dirty_lock);
+  __atomic_store_n(&dirty_count, 0, __ATOMIC_RELAXED);
+  if (dirty_set != NULL) {
+    memset(dirty_set, 0xff, sizeof(bnum_t) * dirty_slots);
+  }
+  dirty_epoch += 1;
+  pthread_mutex_unlock(&dirty_lock);
+}
+
+// Replays the journal, creating it if the image has none.
+void journal_open() {
+  superblock_t *sb = get_superblock();
+  journal_enabled = 0; // a remounted image starts over
+  dirty_clear();
+
+  if (sb->journal_start == 0) {
+    journal_create();
+  } else {
+    journal_header_t *header = blocks_get_block(sb->journal_start);
+    assert(header->magic == JOURNAL_MAGIC);
+
+    journal_log = sb->journal_start + 1;
+    journal_size = sb->journal_blocks - 1;
+    journal_head = header->tail;
+    journal_seq = header->seq;
+
+    // redo every committed transaction, in order
+    int replayed = 0;
+    int64_t n;
+    while ((n = journal_scan(journal_head, journal_seq)) != -1) {
+      journal_apply(journal_head, n);
+      journal_head = (journal_head + n) % journal_size;
+      journal_seq += 1;
+      replayed += 1;
+    }
+
+    if (replayed > 0) {
+      journal_checkpoint();
+    }
+    TRACE(JOURNAL_OPEN, NULL, NULL, 0, replayed);
+  }
+
+  journal_used = 0;
+  journal_enabled = 1;
+}
+
+// Adds the block to the dirty set, with dirty_lock held. Returns 1 if it
+// was not in the set yet.
+static int dirty_add(bnum_t bnum) {
+  if (2 * (dirty_count + 1) > dirty_slots) {
+    // rehash into a table twice the size
+    int slots = dirty_slots == 0 ? 1024 : 2 * dirty_slots;
+    free(dirty_set);
+    dirty_set = malloc(sizeof(bnum_t) * slots);
+    dirty_list = realloc(dirty_list, sizeof(bnum_t) * slots / 2);
+    assert(dirty_set != NULL && dirty_list != NULL);
+    memset(dirty_set, 0xff, sizeof(bnum_t) * slots);
+    dirty_slots = slots;
+
+    for (int ii = 0; ii < dirty_count; ii++) {
+      uint64_t at = (uint64_t) dirty_list[ii] * 0x9e3779b97f4a7c15ull >> 20;
+      while (dirty_set[at % slots] != -1) {
+        at++;
+      }
+      dirty_set[at % slots] = dirty_list[ii];
+    }
+  }
+
+  uint64_t at = (uint64_t) bnum * 0x9e3779b97f4a7c15ull >> 20;
+  while (dirty_set[at % dirty_slots] != -1) {
+    if (dirty_set[at % dirty_slots] == bnum) {
+      return 0;
+    }
+    at++;
+  }
+
+  dirty_set[at % dirty_slots] = bnum;
+  dirty_list[dirty_count] = bnum;
+  __atomic_store_n(&dirty_count, dirty_count + 1, __ATOMIC_RELAXED); // journal_end peeks without the lock
+  return 1;
+}
+
+// Maps the blocks under the given bytes privately the first time they
+// are dirtied in a transaction.
+void journal_dirty(const void *ptr, size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  const char *base = blocks_get_block(0);
+  bnum_t first = ((const char *) ptr - base) / BLOCK_SIZE;
+  bnum_t last = ((const char *) ptr + len - 1 - base) / BLOCK_SIZE;
+
+  // until the journal is open, changes go to the image directly
+  if (!journal_enabled) {
+    blocks_touch(first, last - first + 1);
+    return;
+  }
+  assert(journal_depth > 0);
+
+  // commits only happen between transactions, so the set cannot be
+  // emptied while this one is open
+  if (first == last && first == dirty_last && dirty_last_epoch == dirty_epoch) {
+    return;
+  }
+
+  pthread_mutex_lock(&dirty_lock);
+  for (bnum_t bnum = first; bnum <= last; bnum++) {
+    if (dirty_add(bnum)) {
+      blocks_remap(bnum, 1);
+    }
+  }
+  pthread_mutex_unlock(&dirty_lock);
+
+  dirty_last = last;
+  dirty_last_epoch = dirty_epoch;
+}
+
+// Looks the blocks up in the dirty set, or the set up in the blocks when
+// it is the smaller of the two.
+int journal_is_dirty(bnum_t bnum, bnum_t n) {
+  if (!journal_enabled || __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+
+  int dirty = 0;
+  pthread_mutex_lock(&dirty_lock);
+  if (n > dirty_count) {
+    for (int ii = 0; ii < dirty_count && !dirty; ii++) {
+      dirty = dirty_list[ii] >= bnum && dirty_list[ii] < bnum + n;
+    }
+  } else {
+    for (bnum_t block = bnum; block < bnum + n && !dirty; block++) {
+      uint64_t at = (uint64_t) block * 0x9e3779b97f4a7c15ull >> 20;
+      while (dirty_set[at % dirty_slots] != -1 && !dirty) {
+        dirty = dirty_set[at % dirty_slots] == block;
+        at++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&dirty_lock);
+
+  return dirty;
+}
+
+// Writes n dirty blocks in place and shares them again, with the barrier
+// held for writing.
+static void journal_writeback(const bnum_t *list, int64_t n) {
+  for (int64_t ii = 0; ii < n; ii++) {
+    blocks_write(list[ii], blocks_get_block(list[ii]), 1);
+    blocks_remap(list[ii], 0);
+  }
+}
+
+// Returns the most blocks one transaction can log in a log of size
+// blocks: with its descriptors and commit record, they fill the log.
+static int64_t journal_txn_max(int64_t size) {
+  return (size - 1) * (int64_t) JOURNAL_DESC_MAX / (int64_t) (JOURNAL_DESC_MAX + 1);
+}
+
+// Logs count dirty blocks as one transaction and then writes them in
+// place, with the barrier held for writing.
+static void journal_log_txn(const bnum_t *list, int64_t count) {
+  int64_t descs = (count + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+  int64_t n = descs + count + 1;
+  assert(n <= journal_size);
+
+  if (journal_used + n > journal_size) {
+    journal_checkpoint(); // make room by letting go of the whole log
+  }
+
+  // lay out the descriptors, each followed by the blocks it lists
+  char *log = malloc(n * BLOCK_SIZE);
+  assert(log != NULL);
+  memset(log, 0, n * BLOCK_SIZE);
+
+  uint64_t checksum = 0;
+  int64_t at = 0;
+  for (int64_t ii = 0; ii < count; ) {
+    journal_desc_t *desc = (journal_desc_t *) (log + at * BLOCK_SIZE);
+    desc->magic = JOURNAL_DESC_MAGIC;
+    desc->seq = journal_seq;
+    desc->count = count - ii < (int64_t) JOURNAL_DESC_MAX ? count - ii : (int64_t) JOURNAL_DESC_MAX;
+
+    for (uint32_t jj = 0; jj < desc->count; jj++) {
+      desc->bnums[jj] = list[ii + jj];
+      memcpy(log + (at + 1 + jj) * BLOCK_SIZE, blocks_get_block(list[ii + jj]), BLOCK_SIZE);
+    }
+
+    // the same running checksum journal_scan computes
+    for (uint32_t jj = 0; jj <= desc->count; jj++) {
+      checksum = checksum * 31 + journal_checksum(log + (at + jj) * BLOCK_SIZE, 1);
+    }
+
+    ii += desc->count;
+    at += 1 + desc->count;
+  }
+
+  journal_commit_rec_t *rec = (journal_commit_rec_t *) (log + at * BLOCK_SIZE);
+  rec->magic = JOURNAL_COMMIT_MAGIC;
+  rec->blocks = at;
+  rec->seq = journal_seq;
+  rec->checksum = checksum;
+
+  // the transaction is durable once the log is flushed; only then may the
+  // blocks reach their places in the image
+  journal_write(journal_head, log, n);
+  journal_sync(journal_head, n);
+  free(log);
+
+  // a log that just moved is only found through the superblock, which
+  // must point at it before anything else of the transaction is in place
+  if (journal_moved) {
+    blocks_write(0, blocks_get_block(0), 1);
+    int rv = blocks_sync_range(0, 1);
+    assert(rv == 0);
+    journal_moved = 0;
+  }
+
+  stats_add(STATS_JOURNAL_COMMITS, 1);
+  stats_add(STATS_JOURNAL_BLOCKS, n);
+  TRACE(JOURNAL_COMMIT, NULL, NULL, 0, journal_seq, count, n);
+  journal_writeback(list, count);
+
+  journal_head = (journal_head + n) % journal_size;
+  journal_used += n;
+  journal_seq += 1;
+}
+
+// Moves the journal to a new region large enough to log count blocks as
+// one transaction, with the barrier held for writing. The move is part of
+// that transaction: until it commits, a crash replays the old, empty log.
+static void journal_grow(int64_t count) {
+  superblock_t *sb = get_superblock();
+
+  // leave room for the blocks the move itself dirties
+  int64_t blocks = journal_size + 1;
+  while (journal_txn_max(blocks - 1) < count + 16) {
+    blocks *= 2;
+  }
+  if (blocks >= BLOCKS_PER_GROUP) {
+    blocks = BLOCKS_PER_GROUP - 1; // a run fits in one group
+  }
+  assert(journal_txn_max(blocks - 1) >= count + 16);
+
+  // everything logged so far is let go first, so the old log is empty
+  journal_checkpoint();
+
+  journal_depth += 1; // the allocation is journaled like any change
+  bnum_t start = alloc_blocks(blocks);
+  if (start == -1 && blocks_grow(blocks_count() + 2 * blocks + 1) == 0) {
+    start = alloc_blocks(blocks);
+  }
+  assert(start != -1);
+  free_blocks(sb->journal_start, sb->journal_blocks);
+
+  journal_dirty(sb, sizeof(superblock_t));
+  sb->journal_start = start;
+  sb->journal_blocks = blocks;
+  journal_depth -= 1;
+
+  journal_log = start + 1;
+  journal_size = blocks - 1;
+  journal_head = 0;
+  journal_checkpoint(); // writes the header of the new log
+  journal_moved = 1;
+
+  TRACE(JOURNAL_CREATE, NULL, NULL, 0, start);
+}
+
+// Commits the dirty blocks as one transaction, with the barrier held for
+// writing, first moving to a larger log if they do not fit.
+static void journal_commit_locked() {
+  if (dirty_count == 0) {
+    return;
+  }
+
+  if (dirty_count > journal_txn_max(journal_size)) {
+    journal_grow(dirty_count);
+  }
+  journal_log_txn(dirty_list, dirty_count);
+  dirty_clear();
+}
+
+// Commits every transaction that has ended.
+void journal_commit() {
+  if (!journal_enabled) {
+    return;
+  }
+  assert(journal_depth == 0);
+
+  pthread_rwlock_wrlock(&journal_barrier);
+  journal_commit_locked();
+  pthread_rwlock_unlock(&journal_barrier);
+}
+
+// Begins a transaction.
+void journal_begin() {
+  if (journal_depth++ == 0) {
+    pthread_rwlock_rdlock(&journal_barrier);
+  }
+}
+
+// Ends a transaction, committing when it is time to.
+void journal_end() {
+  assert(journal_depth > 0);
+  if (--journal_depth > 0) {
+    return;
+  }
+  pthread_rwlock_unlock(&journal_barrier);
+
+  if (journal_interval == 0 || __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) >= JOURNAL_TXN_BLOCKS) {
+    journal_commit();
+  }
+}
+
+// Commits every journal_interval milliseconds until stopped.
+static void *journal_loop(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&journal_run_lock);
+  while (journal_running) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += journal_interval / 1000;
+    until.tv_nsec += (long) (journal_interval % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&journal_run_cond, &journal_run_lock, &until);
+    pthread_mutex_unlock(&journal_run_lock);
+    journal_commit();
+    pthread_mutex_lock(&journal_run_lock);
+  }
+  pthread_mutex_unlock(&journal_run_lock);
+
+  return NULL;
+}
+
+// Starts committing every interval milliseconds.
+void journal_run(int interval) {
+  assert(interval >= 0 && !journal_running);
+  journal_interval = interval;
+
+  if (interval > 0) {
+    journal_running = 1;
+    int rv = pthread_create(&journal_thread, NULL, journal_loop, NULL);
+    assert(rv == 0);
+  }
+}
+
+// Stops committing in the background and checkpoints the journal.
+void journal_close() {
+  if (journal_running) {
+    pthread_mutex_lock(&journal_run_lock);
+    journal_running = 0;
+    pthread_cond_signal(&journal_run_cond);
+    pthread_mutex_unlock(&journal_run_lock);
+    pthread_join(journal_thread, NULL);
+  }
+
+  journal_commit();
+  if (journal_enabled) {
+    journal_checkpoint();
+  }
+  journal_interval = -1;
+}
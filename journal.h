@@ -0,0 +1,99 @@
+/**
+ * @file journal.h
+ *
+ * A write-ahead journal for metadata: bitmaps, inodes, extent blocks,
+ * the superblock and directory blocks.
+ *
+ * Every change to metadata happens inside a transaction and is announced
+ * with journal_dirty before the first store. That remaps the block
+ * MAP_PRIVATE, so nothing it holds reaches the image until the block has
+ * been written to the journal. A commit gathers every block dirtied since
+ * the last commit (group commit: one flush covers many operations), logs
+ * them with a checksummed commit record, flushes, and only then writes
+ * them back in place and maps them shared again. storage_init replays
+ * committed transactions that were not yet checkpointed.
+ *
+ * The journal is a circular log in a region of the image named by the
+ * superblock. Its first block records where replay starts:
+ *   [header][desc][block]..[desc][block]..[commit][desc]...
+ * Each transaction is one or more descriptor blocks, each followed by the
+ * blocks it lists, and a commit record holding a checksum of all of them.
+ * A commit with more dirty blocks than the log holds first moves the
+ * journal to a larger region, which the superblock names once the commit
+ * is durable, so every commit replays whole or not at all. Transactions
+ * commit early once 256 blocks are dirty, so it takes a single large
+ * operation, or a great many open at once, to get there.
+ *
+ * File data is not journaled; writes to data blocks go straight to the
+ * shared mapping.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+#include "blocks.h"
+
+/**
+ * Replay the journal of the image set up by blocks_init, creating the
+ * journal if the image has none, and start journaling metadata.
+ */
+void journal_open();
+
+/**
+ * Start committing in the background every interval milliseconds. With an
+ * interval of 0 every transaction commits as it ends. Without a call to
+ * journal_run transactions commit only once enough blocks are dirty.
+ *
+ * @param interval The milliseconds between commits.
+ */
+void journal_run(int interval);
+
+/**
+ * Stop the background commits, commit what is left and checkpoint, so the
+ * image is consistent without the journal.
+ */
+void journal_close();
+
+/**
+ * Begin a transaction. Transactions nest; the outermost one must be begun
+ * before taking any other lock, as a commit waits for every open
+ * transaction to end.
+ */
+void journal_begin();
+
+/**
+ * End the transaction begun by the matching journal_begin.
+ */
+void journal_end();
+
+/**
+ * Announce that the given bytes of the mapped image are about to change.
+ * Must be called inside a transaction before the first store. Before the
+ * journal is open, the change is only recorded with blocks_touch.
+ *
+ * @param ptr The first byte that changes.
+ * @param len The number of bytes that change.
+ */
+void journal_dirty(const void *ptr, size_t len);
+
+/**
+ * Tell whether any of the given blocks is dirty, mapped privately until
+ * the next commit, so the image file does not hold what the mapping
+ * shows. A block of file data is dirty only when it was metadata dirtied
+ * earlier in the transaction, then freed and reused.
+ *
+ * @param bnum The first block.
+ * @param n The number of blocks.
+ *
+ * @return 1 if one of the blocks is dirty, 0 otherwise.
+ */
+int journal_is_dirty(bnum_t bnum, bnum_t n);
+
+/**
+ * Commit every transaction that has ended, waiting for open ones to end
+ * first. On return the changes survive a crash.
+ */
+void journal_commit();
+
+#endif
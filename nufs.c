@@ -9,6 +9,9 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -24,12 +27,90 @@
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+// struct holding the command line options of nufs
+typedef struct nufs_opts {
+  int commit_interval; // milliseconds between journal commits, 0 to commit every operation
+  int durability;      // a storage_durability_t
+  char *trace;         // the trace file, NULL not to trace
+  int advice;          // a blocks_advice_t for the whole image
+  int hugepages;       // 1 to back the image with transparent huge pages
+  int prefault;        // a storage_prefault_t, what to fault in at mount
+  int readahead;       // kilobytes read ahead of sequential reads, 0 for none
+  int backend;         // a backend_kind_t, how the image is stored
+  int cache_mb;        // megabytes the buffer cache of an unmapped image holds, -1 for the default
+} nufs_opts_t;
+
+static nufs_opts_t nufs_opts = {5000, DURABILITY_FSYNC, NULL, ADVICE_NORMAL, 0, PREFAULT_NONE, 0,
+                              BACKEND_MMAP, -1};
+
+static const struct fuse_opt nufs_opt_spec[] = {
+  {"commit_interval=%d", offsetof(nufs_opts_t, commit_interval), 0},
+  {"durability=none", offsetof(nufs_opts_t, durability), DURABILITY_NONE},
+  {"durability=fsync-only", offsetof(nufs_opts_t, durability), DURABILITY_FSYNC},
+  {"durability=every-op", offsetof(nufs_opts_t, durability), DURABILITY_EVERY_OP},
+  {"trace=%s", offsetof(nufs_opts_t, trace), 0},
+  {"advice=normal", offsetof(nufs_opts_t, advice), ADVICE_NORMAL},
+  {"advice=random", offsetof(nufs_opts_t, advice), ADVICE_RANDOM},
+  {"advice=sequential", offsetof(nufs_opts_t, advice), ADVICE_SEQUENTIAL},
+  {"hugepages", offsetof(nufs_opts_t, hugepages), 1},
+  {"prefault=none", offsetof(nufs_opts_t, prefault), PREFAULT_NONE},
+  {"prefault=metadata", offsetof(nufs_opts_t, prefault), PREFAULT_METADATA},
+  {"prefault=all", offsetof(nufs_opts_t, prefault), PREFAULT_ALL},
+  {"readahead=%d", offsetof(nufs_opts_t, readahead), 0},
+  {"backend=mmap", offsetof(nufs_opts_t, backend), BACKEND_MMAP},
+  {"backend=pread", offsetof(nufs_opts_t, backend), BACKEND_PREAD},
+  {"backend=direct", offsetof(nufs_opts_t, backend), BACKEND_DIRECT},
+  {"backend=memory", offsetof(nufs_opts_t, backend), BACKEND_MEMORY},
+  {"cache_mb=%d", offsetof(nufs_opts_t, cache_mb), 0},
+  FUSE_OPT_END
+};
+
+#define NUFS_VIRTUAL_DIR "/.nufs"        // the directory of virtual files
+#define NUFS_STATS_PATH "/.nufs/stats"   // the statistics report
+
+// Returns 1 if the path is in the virtual directory, which is served
+// from memory and never touches the image. Operations that would change
+// it fail with EACCES.
+static int nufs_is_virtual(const char *path) {
+  size_t len = strlen(NUFS_VIRTUAL_DIR);
+  return strncmp(path, NUFS_VIRTUAL_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Fills in the stat struct of a virtual file. Returns 0 on success, -1
+// if there is no such virtual file.
+static int nufs_stat_virtual(const char *path, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+
+  if (strcmp(path, NUFS_VIRTUAL_DIR) == 0) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+
+  if (strcmp(path, NUFS_STATS_PATH) == 0) {
+    size_t len;
+    free(stats_report(&len)); // the size is that of a report made now
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = len;
+    return 0;
+  }
+
+  return -1;
+}
 
 // Implementation for: man 2 access
 // Checks if the file with the given path exists.
 int nufs_access(const char *path, int mask) {
+  uint64_t start = stats_begin();
   int rv = 0;
-  int inum = tree_lookup(path); // get the inum of the given directory/file
+  struct stat st;
+  int inum = nufs_is_virtual(path) ? nufs_stat_virtual(path, &st)
+                                   : tree_lookup(path); // get the inum of the given directory/file
 
   if (inum != -1) {
     rv = 0;         // the given directory/file exists
@@ -38,7 +119,8 @@ int nufs_access(const char *path, int mask) {
     rv = -ENOENT;   // the given directory/file does not exist
   }
 
-  printf("access(%s, %04o) -> %d\n", path, mask, inum);
+  stats_end(STATS_OP_ACCESS, start);
+  TRACE(ACCESS, path, NULL, inum, mask);
   return rv;
 }
 
@@ -46,52 +128,59 @@ int nufs_access(const char *path, int mask) {
 // Gets the attributes of the file at the given path (type, permissions, size, etc).
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
-  int rv = 0;
-  int inum = tree_lookup(path); // get the inum of the directory/file
+  uint64_t start = stats_begin();
+  // fill up the stat struct for the given path
+  int rv = nufs_is_virtual(path) ? nufs_stat_virtual(path, st) : storage_stat(path, st);
 
-  if (inum == -1)  {
+  stats_end(STATS_OP_GETATTR, start);
+  if (rv == -1)  {
     rv = -ENOENT; // if the directory/file does not exist then error is returned
+    TRACE(GETATTR, path, NULL, rv, 0);
+  } else {
+    TRACE(GETATTR, path, NULL, rv, st->st_ino, st->st_mode, st->st_size);
   }
-  else {
-    rv = storage_stat(path, st); // fill up the stat struct for the given path
-    assert(rv == 0);
-  } 
 
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, inum, st->st_mode,
-         st->st_size);
   return rv;
 }
 
-// Implementation for: man 2 readdir
-// Lists the contents of the directory with the given path.
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int rv = nufs_getattr(path, &st); // fill up the stat struct for the directory
-  assert(rv == 0);
-
-  slist_t* dir_contents = directory_list(path); // get a list of the contents of the directory
-  assert(dir_contents != NULL);
-
-  while(dir_contents != NULL) {                         // iterate through directory entries
-    char* path_copy = (char*) malloc(strlen(path + 1)); // copy of the directory path to build file path of each entry
-    strcpy(path_copy, path);
-
-    if (strcmp(path_copy, "/") != 0) {
-      strcat(path_copy, "/");
-    }
+// struct carrying readdir's FUSE buffer through directory_iterate
+typedef struct readdir_ctx {
+  void *buf;               // the buffer FUSE is filling
+  fuse_fill_dir_t filler;  // adds an entry to buf
+} readdir_ctx_t;
 
-    char* file_path = strcat(path_copy, dir_contents->data); // absolute file path of each directory entry
-    nufs_getattr(file_path, &st);                            // fill up the stat struct for each directory entry
+// Adds one directory entry, with the attributes of its inode, to the
+// FUSE buffer. Returns nonzero once the buffer is full.
+static int nufs_readdir_fill(void *arg, const char *name, int inum, off_t cursor) {
+  readdir_ctx_t *ctx = (readdir_ctx_t *) arg;
+  struct stat st;
 
-    filler(buf, dir_contents->data, &st, 0);                 // fill the buffer with the current directory entry
+  memset(&st, 0, sizeof(st));
+  storage_stat_inum(inum, &st);
+  return ctx->filler(ctx->buf, name, &st, cursor);
+}
 
-    dir_contents = dir_contents->next;
-    
-    free(path_copy);                                         // free the copy of the file path
+// Implementation for: man 2 readdir
+// Lists the contents of the directory with the given path, streaming
+// them from the given offset until the buffer is full.
+int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+  (void) fi;
+  uint64_t start = stats_begin();
+  int rv = 0;
+  int inum = tree_lookup(path); // get the inum of the directory
+
+  if (strcmp(path, NUFS_VIRTUAL_DIR) == 0) {
+    filler(buf, "stats", NULL, 0);
+  } else if (inum == -1) {
+    rv = -ENOENT;
+  } else {
+    readdir_ctx_t ctx = {buf, filler};
+    directory_iterate(inum, offset, nufs_readdir_fill, &ctx);
   }
 
-  printf("readdir(%s) -> %d\n", path, rv);
+  stats_end(STATS_OP_READDIR, start);
+  TRACE(READDIR, path, NULL, rv, inum, offset);
   return rv;
 }
 
@@ -99,177 +188,478 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // mknod makes a filesystem object like a file or directory
 // Creates a directory or normal file with the given path and mode
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  (void) rdev;
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = 0;
 
   if (S_ISREG(mode)) {	  
     rv = storage_mknod(path, mode);  // create the file
-    assert(rv == 0);
   }
   else if (S_ISDIR(mode)) {
-    printf("GOOD\n");
     rv = directory_init(path, mode); // create the directory
-    assert(rv == 0);
   }
   else {
     rv = -ENOENT;                    // not making file or directory
   }
 
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  stats_end(STATS_OP_MKNOD, start);
+  TRACE(MKNOD, path, NULL, rv, 0, mode);
   return rv;
 }
 
 // another system call; see section 2 of the manual
 // Makes a directory with the given path and mode.
 int nufs_mkdir(const char *path, mode_t mode) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
-  rv = nufs_mknod(path, S_IFDIR | mode, 0); // create the directory
-  assert(rv == 0);
+  rv = directory_init(path, S_IFDIR | mode); // create the directory
 
-  printf("mkdir(%s) -> %d\n", path, rv);
+  stats_end(STATS_OP_MKDIR, start);
+  TRACE(MKDIR, path, NULL, rv, 0, mode);
   return rv;
 }
 
 // Unlinks the given file name from the file.
 int nufs_unlink(const char *path) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
   rv = storage_unlink(path); // unlink the path from the file
-  assert(rv == 0);
 
-  printf("unlink(%s) -> %d\n", path, rv);
+  stats_end(STATS_OP_UNLINK, start);
+  TRACE(UNLINK, path, NULL, rv, 0);
   return rv;
 }
 
 // Adds an alias for the from file.
 int nufs_link(const char *from, const char *to) {
+  if (nufs_is_virtual(from) || nufs_is_virtual(to)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
   rv = storage_link(from, to); // link the files
-  assert(rv == 0);
 
-  printf("link(%s => %s) -> %d\n", from, to, rv);
+  stats_end(STATS_OP_LINK, start);
+  TRACE(LINK, from, to, rv, 0);
+  return rv;
+}
+
+// Makes a symbolic link at path pointing at target.
+int nufs_symlink(const char *target, const char *path) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
+  int rv = storage_symlink(target, path);
+
+  stats_end(STATS_OP_SYMLINK, start);
+  TRACE(SYMLINK, path, target, rv, 0);
+  return rv;
+}
+
+// Reads the target of the symbolic link at path into buf.
+int nufs_readlink(const char *path, char *buf, size_t size) {
+  uint64_t start = stats_begin();
+  int rv = -ENOENT;
+
+  int inum = tree_lookup(path);
+  if (inum != -1) {
+    rv = storage_readlink(inum, buf, size) == -1 ? -EINVAL : 0;
+  }
+
+  stats_end(STATS_OP_READLINK, start);
+  TRACE(READLINK, path, NULL, rv, inum);
   return rv;
 }
 
 // Deletes the directory at the given path.
 int nufs_rmdir(const char *path) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = 0;
 
-  rv = storage_unlink(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
+  rv = storage_rmdir(path);
+  stats_end(STATS_OP_RMDIR, start);
+  TRACE(RMDIR, path, NULL, rv, 0);
   return rv;
 }
 
 // implements: man 2 rename
 // Moves the file to a different path in the file system.
 int nufs_rename(const char *from, const char *to) {
+  if (nufs_is_virtual(from) || nufs_is_virtual(to)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
   rv = storage_rename(from, to); // rename the file
-  assert(rv == 0);
 
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  stats_end(STATS_OP_RENAME, start);
+  TRACE(RENAME, from, to, rv, 0);
   return rv;
 }
 
 // Changes the permissions of the file at the given path.
 int nufs_chmod(const char *path, mode_t mode) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
   int rv = 0;
 
   // get the inode for the file and change its permissions
   int inum = tree_lookup(path);
-  inode_t* inode = get_inode(inum);
-  inode->mode = mode;
+  if (inum == -1) {
+    rv = -ENOENT;
+  } else {
+    storage_chmod(inum, mode);
+  }
 
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  stats_end(STATS_OP_CHMOD, start);
+  TRACE(CHMOD, path, NULL, rv, mode);
   return rv;
 }
 
 //Truncates the given file to the given size.
 int nufs_truncate(const char *path, off_t size) {
-  int rv = -1;
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
+  int rv = 0;
+  struct stat st;
 
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  int inum = tree_lookup(path);
+  if (inum == -1 || storage_stat_inum(inum, &st) == -1) {
+    rv = -ENOENT;
+  } else if (S_ISDIR(st.st_mode)) {
+    rv = -EISDIR;
+  } else {
+    rv = storage_truncate(inum, size);
+  }
+
+  stats_end(STATS_OP_TRUNCATE, start);
+  TRACE(TRUNCATE, path, NULL, rv, size);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Opens the stats file, keeping a snapshot of the report in fi->fh, so
+// every read of one open sees the same report.
+static int nufs_open_virtual(const char *path, struct fuse_file_info *fi) {
+  if (strcmp(path, NUFS_STATS_PATH) != 0) {
+    return -ENOENT;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+
+  size_t len;
+  fi->fh = (uint64_t) (uintptr_t) stats_report(&len);
+  fi->direct_io = 1; // the report's size changes after getattr reported it
+  return 0;
+}
+
+// Opens the file at the given path, keeping a handle that carries its
+// inum in fi->fh so reads and writes skip the path lookup.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = -ENOENT;
+  if (nufs_is_virtual(path)) {
+    return nufs_open_virtual(path, fi);
+  }
+
+  uint64_t start = stats_begin();
+  int rv = 0;
+
+  storage_file_t *file = storage_open(path); // check if the file exists
+  if (file == NULL) {
+    rv = -ENOENT;
+  } else {
+    fi->fh = (uint64_t) (uintptr_t) file;
+  }
+
+  stats_end(STATS_OP_OPEN, start);
+  TRACE(OPEN, path, NULL, rv, file != NULL ? file->inum : 0);
+  return rv;
+}
+
+// Creates and opens a normal file with the given path and mode.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  if (nufs_is_virtual(path)) {
+    return -EACCES;
+  }
+
+  uint64_t start = stats_begin();
+  int rv = storage_mknod(path, mode); // create the file
+
+  if (rv == 0) {
+    storage_file_t *file = storage_open(path);
+    rv = file == NULL ? -ENOENT : 0; // unlinked again before we could open it
+    fi->fh = (uint64_t) (uintptr_t) file;
+  }
+
+  stats_end(STATS_OP_CREATE, start);
+  TRACE(CREATE, path, NULL, rv, 0, mode);
+  return rv;
+}
+
+// Reports a failed flush of the file's buffered appends on each close of
+// the handle.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  if (nufs_is_virtual(path)) {
+    return 0;
+  }
+
+  uint64_t start = stats_begin();
+
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  int rv = storage_flush(file->inum);
+
+  stats_end(STATS_OP_FLUSH, start);
+  TRACE(FLUSH, path, NULL, rv, file->inum);
+  return rv;
+}
+
+// Closes the handle opened by nufs_open or nufs_create.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  if (nufs_is_virtual(path)) {
+    free((char *) (uintptr_t) fi->fh); // the snapshot of the stats file
+    return 0;
+  }
+
+  uint64_t start = stats_begin();
+  int rv = 0;
 
-  rv = nufs_access(path, 0); // check if the file exists 
-  assert(rv == 0);
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  int inum = file->inum;
+  storage_release(file);
 
-  printf("open(%s) -> %d\n", path, rv);
+  stats_end(STATS_OP_RELEASE, start);
+  TRACE(RELEASE, path, NULL, rv, inum);
   return rv;
 }
 
-// Reads size bytes from the file at the given path, starting at the
-// given offset.
+// Reads size bytes from the open file, starting at the given offset.
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
+  if (nufs_is_virtual(path)) {
+    const char *report = (const char *) (uintptr_t) fi->fh;
+    size_t len = strlen(report);
+    if (offset >= (off_t) len) {
+      return 0;
+    }
+    size = offset + size > len ? len - offset : size;
+    memcpy(buf, report + offset, size);
+    return size;
+  }
+
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
-  rv = storage_read(path, buf, size, offset); // read the data
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  rv = storage_read_ino(file->inum, buf, size, offset, &file->cursor); // read the data
   assert(rv != -1);
 
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  stats_end(STATS_OP_READ, start);
+  TRACE(READ, path, NULL, rv, file->inum, size, offset);
   return rv;
 }
 
-// Writes size bytes from the file at the given path, starting at the
-// given offset.
+// Writes size bytes to the open file, starting at the given offset.
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {	
+  uint64_t start = stats_begin();
   int rv = -ENOENT;
 
-  rv = storage_write(path, buf, size, offset); // write the data
-  assert(rv != -1);
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  rv = storage_write_ino(file->inum, buf, size, offset, &file->cursor); // write the data
 
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  stats_end(STATS_OP_WRITE, start);
+  TRACE(WRITE, path, NULL, rv, file->inum, size, offset);
+  return rv;
+}
+
+// struct of a write's data for nufs_fill
+typedef struct nufs_fill_ctx {
+  struct fuse_bufvec *src; // the data, in memory or in the pipe it was spliced to
+} nufs_fill_ctx_t;
+
+// Copies the next len bytes of a write's data to dst, reading them from
+// the pipe when the request was spliced.
+static int nufs_fill(void *arg, char *dst, size_t len) {
+  nufs_fill_ctx_t *ctx = (nufs_fill_ctx_t *) arg;
+  struct fuse_bufvec dst_buf = FUSE_BUFVEC_INIT(len);
+  dst_buf.buf[0].mem = dst;
+
+  if (fuse_buf_copy(&dst_buf, ctx->src, 0) != (ssize_t) len) {
+    return -1;
+  }
+  return 0;
+}
+
+// Writes the request's data to the open file, copying it into the file's
+// blocks from wherever libfuse left it, so a spliced write is not first
+// gathered into a buffer of its own.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  nufs_fill_ctx_t ctx = {buf};
+  size_t size = fuse_buf_size(buf);
+
+  int rv = storage_write_fill(file->inum, nufs_fill, &ctx, size, offset, &file->cursor);
+
+  stats_end(STATS_OP_WRITE, start);
+  TRACE(WRITE, path, NULL, rv, file->inum, size, offset);
+  return rv;
+}
+
+// Flushes what was written to the open file to disk.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (nufs_is_virtual(path)) {
+    return 0;
+  }
+
+  uint64_t start = stats_begin();
+
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  int rv = storage_fsync(file->inum);
+
+  stats_end(STATS_OP_FSYNC, start);
+  TRACE(FSYNC, path, NULL, rv, file->inum, datasync);
+  return rv;
+}
+
+// Flushes the changes to the directory at the given path to disk. There
+// is no opendir, so the directory is found by its path.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  (void) fi;
+  if (nufs_is_virtual(path)) {
+    return 0;
+  }
+
+  uint64_t start = stats_begin();
+  int rv = 0;
+
+  int inum = tree_lookup(path);
+  if (inum == -1) {
+    rv = -ENOENT;
+  } else {
+    rv = storage_fsync(inum);
+  }
+
+  stats_end(STATS_OP_FSYNCDIR, start);
+  TRACE(FSYNCDIR, path, NULL, rv, inum, datasync);
   return rv;
 }
 
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  uint64_t start = stats_begin();
   int rv = 0;
 
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  stats_end(STATS_OP_UTIMENS, start);
+  TRACE(UTIMENS, path, NULL, rv, ts[0].tv_sec, ts[1].tv_sec);
   return rv;
 }
 
-// Extended operations.
+// Extended operations. NUFS_IOC_STATS_RESET on the stats file starts a
+// new interval of statistics.
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = 0;
+  (void) arg;
+  (void) fi;
+  (void) flags;
+  (void) data;
+  uint64_t start = stats_begin();
+  int rv = -ENOTTY; // no other file or command has an ioctl
+
+  if (strcmp(path, NUFS_STATS_PATH) == 0 && cmd == NUFS_IOC_STATS_RESET) {
+    stats_reset();
+    rv = 0;
+  }
 
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  stats_end(STATS_OP_IOCTL, start);
+  TRACE(IOCTL, path, NULL, rv, cmd);
   return rv;
 }
 
+// Starts the journal's background commits once FUSE is up, after it has
+// forked into the background, and sets up the image's mapping, whose
+// page tables the fork left behind. With every-op durability each
+// operation commits as it ends instead. Writes are spliced where the
+// kernel can; reads are not, as libfuse splices what a read_buf returns
+// after the file is unlocked, when its blocks may have been freed.
+void *nufs_init(struct fuse_conn_info *conn) {
+  int every_op = nufs_opts.durability == DURABILITY_EVERY_OP;
+  journal_run(every_op ? 0 : nufs_opts.commit_interval);
+  blocks_set_advice(nufs_opts.advice, nufs_opts.hugepages);
+  storage_prefault(nufs_opts.prefault);
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+  trace_run();
+  TRACE(INIT, NULL, NULL, 0, nufs_opts.commit_interval, nufs_opts.durability);
+  return NULL;
+}
+
+// Flushes the write buffers and commits and checkpoints the journal when
+// the file system is unmounted.
+void nufs_destroy(void *data) {
+  (void) data;
+  storage_flush_buffers();
+  journal_close();
+  TRACE(DESTROY, NULL, NULL, 0, 0);
+  trace_close();
+}
+
 // Initialze fuse operations to nufs implementations.
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
   ops->rmdir = nufs_rmdir;
+  ops->symlink = nufs_symlink;
+  ops->readlink = nufs_readlink;
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->flush = nufs_flush;
+  ops->release = nufs_release;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->write_buf = nufs_write_buf;
+  ops->fsync = nufs_fsync;
+  ops->fsyncdir = nufs_fsyncdir;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
 };
@@ -280,12 +670,29 @@ struct fuse_operations nufs_ops;
 // Initiales fuse operations and intializes 
 // the file system.
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   printf("TODO: mount %s as data file\n", argv[--argc]);
 
-  int rv = storage_init(argv[argc]);                     // initialize the file system
-  assert(rv == 0);
+  // pick out our own options, leaving the rest to FUSE
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &nufs_opts, nufs_opt_spec, NULL) == -1) {
+    return 1;
+  }
+  if (nufs_opts.trace != NULL && trace_open(nufs_opts.trace) == -1) {
+    perror(nufs_opts.trace);
+    return 1;
+  }
+
+  blocks_set_backend(nufs_opts.backend);
+  if (nufs_opts.cache_mb >= 0) {
+    blocks_set_cache((int64_t) nufs_opts.cache_mb << 20);
+  }
+  if (storage_init(argv[argc]) == -1) {                  // initialize the file system
+    return 1;
+  }
   nufs_init_ops(&nufs_ops);                              // set up fuse operations
- 
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  storage_set_durability(nufs_opts.durability);
+  storage_set_readahead((int64_t) nufs_opts.readahead * 1024);
+
+  return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
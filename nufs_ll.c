@@ -0,0 +1,622 @@
+/**
+ * @file nufs_ll.c
+ *
+ * Implementation of the file system on the FUSE low-level API.
+ *
+ * The kernel names files by inode number, which map straight onto our
+ * inums (FUSE_ROOT_ID is our root, inum 2), so no request builds or walks
+ * a path. Every entry handed to the kernel (lookup, mknod, mkdir, create,
+ * link, symlink) pins its inode until the kernel forgets it, so an unlinked file
+ * lives on while the kernel can still name it.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "directory.h"
+#include "storage.h"
+#include "inode.h"
+#include "arena.h"
+#include "journal.h"
+#include "trace.h"
+
+#define ROOT_INUM 2 // the inum of the root directory
+
+// struct holding the command line options of nufs_ll
+typedef struct nufs_ll_opts {
+  double entry_timeout; // seconds the kernel may cache a name
+  double attr_timeout;  // seconds the kernel may cache attributes
+  int commit_interval;  // milliseconds between journal commits, 0 to commit every operation
+  int durability;       // a storage_durability_t
+  char *trace;          // the trace file, NULL not to trace
+  int advice;           // a blocks_advice_t for the whole image
+  int hugepages;        // 1 to back the image with transparent huge pages
+  int prefault;         // a storage_prefault_t, what to fault in at mount
+  int readahead;        // kilobytes read ahead of sequential reads, 0 for none
+  int backend;          // a backend_kind_t, how the image is stored
+  int cache_mb;         // megabytes the buffer cache of an unmapped image holds, -1 for the default
+} nufs_ll_opts_t;
+
+static nufs_ll_opts_t nufs_ll_opts = {1.0, 1.0, 5000, DURABILITY_FSYNC, NULL, ADVICE_NORMAL, 0,
+                                      PREFAULT_NONE, 0, BACKEND_MMAP, -1};
+
+static const struct fuse_opt nufs_ll_opt_spec[] = {
+  {"entry_timeout=%lf", offsetof(nufs_ll_opts_t, entry_timeout), 0},
+  {"attr_timeout=%lf", offsetof(nufs_ll_opts_t, attr_timeout), 0},
+  {"commit_interval=%d", offsetof(nufs_ll_opts_t, commit_interval), 0},
+  {"durability=none", offsetof(nufs_ll_opts_t, durability), DURABILITY_NONE},
+  {"durability=fsync-only", offsetof(nufs_ll_opts_t, durability), DURABILITY_FSYNC},
+  {"durability=every-op", offsetof(nufs_ll_opts_t, durability), DURABILITY_EVERY_OP},
+  {"trace=%s", offsetof(nufs_ll_opts_t, trace), 0},
+  {"advice=normal", offsetof(nufs_ll_opts_t, advice), ADVICE_NORMAL},
+  {"advice=random", offsetof(nufs_ll_opts_t, advice), ADVICE_RANDOM},
+  {"advice=sequential", offsetof(nufs_ll_opts_t, advice), ADVICE_SEQUENTIAL},
+  {"hugepages", offsetof(nufs_ll_opts_t, hugepages), 1},
+  {"prefault=none", offsetof(nufs_ll_opts_t, prefault), PREFAULT_NONE},
+  {"prefault=metadata", offsetof(nufs_ll_opts_t, prefault), PREFAULT_METADATA},
+  {"prefault=all", offsetof(nufs_ll_opts_t, prefault), PREFAULT_ALL},
+  {"readahead=%d", offsetof(nufs_ll_opts_t, readahead), 0},
+  {"backend=mmap", offsetof(nufs_ll_opts_t, backend), BACKEND_MMAP},
+  {"backend=pread", offsetof(nufs_ll_opts_t, backend), BACKEND_PREAD},
+  {"backend=direct", offsetof(nufs_ll_opts_t, backend), BACKEND_DIRECT},
+  {"backend=memory", offsetof(nufs_ll_opts_t, backend), BACKEND_MEMORY},
+  {"cache_mb=%d", offsetof(nufs_ll_opts_t, cache_mb), 0},
+  FUSE_OPT_END
+};
+
+// Converts a FUSE inode number to an inum.
+static int ll_inum(fuse_ino_t ino) {
+  return ino == FUSE_ROOT_ID ? ROOT_INUM : (int) ino;
+}
+
+// Converts an inum to a FUSE inode number.
+static fuse_ino_t ll_ino(int inum) {
+  return inum == ROOT_INUM ? FUSE_ROOT_ID : (fuse_ino_t) inum;
+}
+
+// Fills in the stat struct for the inum, numbered the way the kernel sees it.
+static void ll_stat(int inum, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  storage_stat_inum(inum, st);
+  st->st_ino = ll_ino(inum);
+}
+
+// Looks up the name and replies with its entry, pinning the inode for the
+// kernel. Returns 0 on success, -1 if the name does not exist.
+static int ll_reply_entry(fuse_req_t req, int dir_inum, const char *name,
+                          struct fuse_file_info *fi) {
+  int inum = storage_lookup(dir_inum, name);
+  if (inum == -1) {
+    return -1;
+  }
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = ll_ino(inum);
+  e.attr_timeout = nufs_ll_opts.attr_timeout;
+  e.entry_timeout = nufs_ll_opts.entry_timeout;
+  ll_stat(inum, &e.attr);
+
+  int rv;
+  if (fi != NULL) {
+    storage_file_t *file = storage_open_ino(inum);
+    fi->fh = (uint64_t) (uintptr_t) file;
+    rv = fuse_reply_create(req, &e, fi);
+    if (rv != 0) {
+      storage_release(file);
+    }
+  } else {
+    rv = fuse_reply_entry(req, &e);
+  }
+
+  // the kernel never saw the entry, so it will never forget it
+  if (rv != 0) {
+    storage_unpin(inum, 1);
+  }
+  return 0;
+}
+
+// Starts the journal's background commits once the session is up, or
+// commits every operation with every-op durability, sets up the image's
+// mapping and asks the kernel to splice reads and writes where it can.
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  (void) userdata;
+  int every_op = nufs_ll_opts.durability == DURABILITY_EVERY_OP;
+  journal_run(every_op ? 0 : nufs_ll_opts.commit_interval);
+  blocks_set_advice(nufs_ll_opts.advice, nufs_ll_opts.hugepages);
+  storage_prefault(nufs_ll_opts.prefault);
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+  trace_run();
+  TRACE(INIT, NULL, NULL, 0, nufs_ll_opts.commit_interval, nufs_ll_opts.durability);
+}
+
+// Flushes the write buffers and commits and checkpoints the journal when
+// the file system is unmounted.
+static void nufs_ll_destroy(void *userdata) {
+  (void) userdata;
+  storage_flush_buffers();
+  journal_close();
+  TRACE(DESTROY, NULL, NULL, 0, 0);
+  trace_close();
+}
+
+// Looks up a name in a directory.
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = ll_reply_entry(req, ll_inum(parent), name, NULL);
+
+  // cache the miss too, so the kernel stops asking
+  if (rv == -1) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = nufs_ll_opts.entry_timeout;
+    fuse_reply_entry(req, &e);
+  }
+
+  TRACE(LOOKUP, name, NULL, rv, parent);
+  arena_reset(); // every request ends by freeing its temporaries
+}
+
+// Drops the pins the kernel held through nlookup entries.
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  storage_unpin(ll_inum(ino), nlookup);
+
+  TRACE(FORGET, NULL, NULL, 0, ino, nlookup);
+  fuse_reply_none(req);
+}
+
+// Drops the pins of a batch of forgotten entries.
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++) {
+    storage_unpin(ll_inum(forgets[i].ino), forgets[i].nlookup);
+  }
+
+  TRACE(FORGET_MULTI, NULL, NULL, 0, count);
+  fuse_reply_none(req);
+}
+
+// Gets the attributes of the file.
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  (void) fi;
+  struct stat st;
+  ll_stat(ll_inum(ino), &st);
+  fuse_reply_attr(req, &st, nufs_ll_opts.attr_timeout);
+
+  TRACE(GETATTR, NULL, NULL, 0, ino, st.st_mode, st.st_size);
+}
+
+// Changes the attributes of the file. Only the mode and size can change;
+// times are not kept.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                            struct fuse_file_info *fi) {
+  (void) fi;
+  int inum = ll_inum(ino);
+  int rv = 0;
+  struct stat st;
+
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    ll_stat(inum, &st);
+    if (S_ISDIR(st.st_mode)) {
+      rv = -EISDIR;
+    } else if (st.st_size != attr->st_size) {
+      rv = storage_truncate(inum, attr->st_size);
+    }
+  }
+
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+    storage_chmod(inum, attr->st_mode);
+  }
+
+  if (rv == 0) {
+    ll_stat(inum, &st);
+    fuse_reply_attr(req, &st, nufs_ll_opts.attr_timeout);
+  } else {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(SETATTR, NULL, NULL, rv, ino, to_set, attr->st_mode);
+}
+
+// Creates a normal file in the directory.
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                          dev_t rdev) {
+  (void) rdev;
+  int dir_inum = ll_inum(parent);
+  // only normal files and directories are supported
+  int rv = S_ISREG(mode) ? storage_mknod_at(dir_inum, name, mode) : -EPERM;
+  if (rv >= 0) {
+    rv = ll_reply_entry(req, dir_inum, name, NULL) == -1 ? -ENOENT : 0; // unlinked again before we could reply
+  }
+
+  if (rv != 0) {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(MKNOD, name, NULL, rv, parent, mode);
+  arena_reset();
+}
+
+// Makes a directory in the directory.
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  int dir_inum = ll_inum(parent);
+  int rv = directory_create(dir_inum, name, S_IFDIR | mode);
+  if (rv >= 0) {
+    rv = ll_reply_entry(req, dir_inum, name, NULL) == -1 ? -ENOENT : 0;
+  }
+
+  if (rv != 0) {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(MKDIR, name, NULL, rv, parent, mode);
+  arena_reset();
+}
+
+// Unlinks the name in the directory from its file.
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_unlink_at(ll_inum(parent), name);
+  fuse_reply_err(req, -rv);
+
+  TRACE(UNLINK, name, NULL, rv, parent);
+  arena_reset();
+}
+
+// Removes the empty directory with the name in the directory.
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_rmdir_at(ll_inum(parent), name);
+  fuse_reply_err(req, -rv);
+
+  TRACE(RMDIR, name, NULL, rv, parent);
+  arena_reset();
+}
+
+// Moves the entry to a new name, possibly in another directory.
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  int rv = storage_rename_at(ll_inum(parent), name, ll_inum(newparent), newname);
+  fuse_reply_err(req, -rv);
+
+  TRACE(RENAME, name, newname, rv, parent, newparent);
+  arena_reset();
+}
+
+// Adds an alias for the file in the directory.
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+  int dir_inum = ll_inum(newparent);
+  int rv = storage_link_at(ll_inum(ino), dir_inum, newname);
+  if (rv == 0) {
+    rv = ll_reply_entry(req, dir_inum, newname, NULL) == -1 ? -ENOENT : 0;
+  }
+
+  if (rv != 0) {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(LINK, NULL, newname, rv, ino, newparent);
+  arena_reset();
+}
+
+// Makes a symbolic link to target in the directory.
+static void nufs_ll_symlink(fuse_req_t req, const char *target, fuse_ino_t parent,
+                            const char *name) {
+  int dir_inum = ll_inum(parent);
+  int rv = storage_symlink_at(dir_inum, name, target);
+
+  if (rv >= 0) {
+    rv = ll_reply_entry(req, dir_inum, name, NULL) == -1 ? -ENOENT : 0;
+  }
+
+  if (rv != 0) {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(SYMLINK, name, target, rv, parent);
+  arena_reset();
+}
+
+// Reads the target of the symbolic link.
+static void nufs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char target[PATH_MAX];
+  int rv = storage_readlink(ll_inum(ino), target, sizeof(target)) == -1 ? -EINVAL : 0;
+
+  if (rv == 0) {
+    fuse_reply_readlink(req, target);
+  } else {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(READLINK, NULL, NULL, rv, ino);
+  arena_reset();
+}
+
+// Opens a handle on the file.
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  storage_file_t *file = storage_open_ino(ll_inum(ino));
+  fi->fh = (uint64_t) (uintptr_t) file;
+
+  if (fuse_reply_open(req, fi) != 0) {
+    storage_release(file); // the open was interrupted
+  }
+
+  TRACE(OPEN, NULL, NULL, 0, ino);
+}
+
+// Creates and opens a normal file in the directory.
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                           struct fuse_file_info *fi) {
+  int dir_inum = ll_inum(parent);
+  int rv = storage_mknod_at(dir_inum, name, mode);
+  if (rv >= 0) {
+    rv = ll_reply_entry(req, dir_inum, name, fi) == -1 ? -ENOENT : 0;
+  }
+
+  if (rv != 0) {
+    fuse_reply_err(req, -rv);
+  }
+
+  TRACE(CREATE, name, NULL, rv, parent, mode);
+  arena_reset();
+}
+
+// Reports a failed flush of the file's buffered appends on each close of
+// the handle.
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  (void) fi;
+  int rv = storage_flush(ll_inum(ino));
+  fuse_reply_err(req, -rv);
+
+  TRACE(FLUSH, NULL, NULL, rv, ino);
+}
+
+// Closes the handle opened by nufs_ll_open or nufs_ll_create.
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  storage_release((storage_file_t *) (uintptr_t) fi->fh);
+  fuse_reply_err(req, 0);
+
+  TRACE(RELEASE, NULL, NULL, 0, ino);
+}
+
+// Replies to a read with the segments storage_read_send found, as a
+// buffer vector whose runs of blocks libfuse splices from the image file
+// to /dev/fuse. Returns the bytes sent.
+static int nufs_ll_send(void *arg, const storage_segment_t *segs, int count) {
+  fuse_req_t req = (fuse_req_t) arg;
+  if (count == 0) {
+    fuse_reply_buf(req, NULL, 0);
+    return 0;
+  }
+
+  struct fuse_bufvec *bufv = arena_alloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * count);
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = count;
+
+  for (int ii = 0; ii < count; ii++) {
+    struct fuse_buf *buf = &bufv->buf[ii];
+    buf->size = segs[ii].len;
+    if (segs[ii].mem != NULL) {
+      buf->flags = 0;
+      buf->mem = (void *) segs[ii].mem;
+      buf->fd = -1;
+    } else {
+      buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      buf->mem = NULL;
+      buf->fd = segs[ii].fd;
+      buf->pos = segs[ii].pos;
+    }
+  }
+
+  int size = fuse_buf_size(bufv);
+  fuse_reply_data(req, bufv, 0);
+  return size;
+}
+
+// Reads size bytes from the open file, starting at the given offset. The
+// reply is sent with the file locked, straight from the image.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                         struct fuse_file_info *fi) {
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+
+  int rv = storage_read_send(file->inum, size, offset, &file->cursor, nufs_ll_send, req);
+
+  TRACE(READ, NULL, NULL, rv, ino, size, offset);
+  arena_reset();
+}
+
+// Writes size bytes to the open file, starting at the given offset.
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                          off_t offset, struct fuse_file_info *fi) {
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+
+  int rv = storage_write_ino(file->inum, buf, size, offset, &file->cursor); // write the data
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+
+  TRACE(WRITE, NULL, NULL, rv, ino, size, offset);
+}
+
+// struct of a write's data for nufs_ll_fill
+typedef struct ll_fill_ctx {
+  struct fuse_bufvec *src; // the data, in memory or in the pipe it was spliced to
+} ll_fill_ctx_t;
+
+// Copies the next len bytes of a write's data to dst, reading them from
+// the pipe when the request was spliced.
+static int nufs_ll_fill(void *arg, char *dst, size_t len) {
+  ll_fill_ctx_t *ctx = (ll_fill_ctx_t *) arg;
+  struct fuse_bufvec dst_buf = FUSE_BUFVEC_INIT(len);
+  dst_buf.buf[0].mem = dst;
+
+  if (fuse_buf_copy(&dst_buf, ctx->src, 0) != (ssize_t) len) {
+    return -1;
+  }
+  return 0;
+}
+
+// Writes the request's data to the open file, copying it into the file's
+// blocks from wherever libfuse left it.
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t offset, struct fuse_file_info *fi) {
+  storage_file_t *file = (storage_file_t *) (uintptr_t) fi->fh;
+  ll_fill_ctx_t ctx = {bufv};
+  size_t size = fuse_buf_size(bufv);
+
+  int rv = storage_write_fill(file->inum, nufs_ll_fill, &ctx, size, offset, &file->cursor);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+
+  TRACE(WRITE, NULL, NULL, rv, ino, size, offset);
+}
+
+// Flushes what was written to the file or directory to disk; both go
+// through storage_fsync, which needs only the inode.
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  (void) fi;
+  int rv = storage_fsync(ll_inum(ino));
+  fuse_reply_err(req, -rv);
+
+  TRACE(FSYNC, NULL, NULL, rv, ino, datasync);
+}
+
+// struct carrying a readdir reply buffer through directory_iterate
+typedef struct ll_readdir_ctx {
+  fuse_req_t req; // the request being answered
+  char *buf;      // the reply buffer
+  size_t size;    // the size of the reply buffer
+  size_t used;    // the bytes of the buffer filled so far
+} ll_readdir_ctx_t;
+
+// Adds one directory entry to the reply buffer. Returns nonzero once the
+// entry does not fit, leaving it for the next readdir.
+static int nufs_ll_readdir_fill(void *arg, const char *name, int inum, off_t cursor) {
+  ll_readdir_ctx_t *ctx = (ll_readdir_ctx_t *) arg;
+  struct stat st;
+
+  ll_stat(inum, &st);
+  size_t len = fuse_add_direntry(ctx->req, ctx->buf + ctx->used, ctx->size - ctx->used, name,
+                                 &st, cursor);
+  if (len > ctx->size - ctx->used) {
+    return 1;
+  }
+
+  ctx->used += len;
+  return 0;
+}
+
+// Lists the directory from the given offset, filling as many entries as
+// fit into one reply.
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+  (void) fi;
+  ll_readdir_ctx_t ctx = {req, arena_alloc(size), size, 0};
+
+  directory_iterate(ll_inum(ino), offset, nufs_ll_readdir_fill, &ctx);
+  fuse_reply_buf(req, ctx.buf, ctx.used);
+
+  TRACE(READDIR, NULL, NULL, ctx.used, ino, offset);
+  arena_reset();
+}
+
+// Initialze fuse low-level operations to nufs implementations.
+static void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->destroy = nufs_ll_destroy;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->forget_multi = nufs_ll_forget_multi;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->link = nufs_ll_link;
+  ops->symlink = nufs_ll_symlink;
+  ops->readlink = nufs_ll_readlink;
+  ops->open = nufs_ll_open;
+  ops->create = nufs_ll_create;
+  ops->flush = nufs_ll_flush;
+  ops->release = nufs_ll_release;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->write_buf = nufs_ll_write_buf;
+  ops->fsync = nufs_ll_fsync;
+  ops->readdir = nufs_ll_readdir;
+  ops->fsyncdir = nufs_ll_fsync;
+}
+
+// Struct containing fuse low-level operations to implement.
+static struct fuse_lowlevel_ops nufs_ll_ops;
+
+// Initializes the file system from the image file (the last argument) and
+// serves it at the mount point until unmounted.
+int main(int argc, char *argv[]) {
+  assert(argc > 2);
+  const char *image = argv[--argc];
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+
+  if (fuse_opt_parse(&args, &nufs_ll_opts, nufs_ll_opt_spec, NULL) == -1 ||
+      fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+    return 1;
+  }
+  if (nufs_ll_opts.trace != NULL && trace_open(nufs_ll_opts.trace) == -1) {
+    perror(nufs_ll_opts.trace);
+    return 1;
+  }
+
+  blocks_set_backend(nufs_ll_opts.backend);
+  if (nufs_ll_opts.cache_mb >= 0) {
+    blocks_set_cache((int64_t) nufs_ll_opts.cache_mb << 20);
+  }
+  if (storage_init(image) == -1) {     // initialize the file system
+    return 1;
+  }
+  nufs_ll_init_ops(&nufs_ll_ops);      // set up fuse operations
+  storage_set_durability(nufs_ll_opts.durability);
+  storage_set_readahead((int64_t) nufs_ll_opts.readahead * 1024);
+
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch == NULL) {
+    return 1;
+  }
+
+  int rv = 1;
+  struct fuse_session *se = fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+  if (se != NULL) {
+    if (fuse_set_signal_handlers(se) != -1) {
+      fuse_session_add_chan(se, ch);
+      fuse_daemonize(foreground);
+      rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+      fuse_remove_signal_handlers(se);
+      fuse_session_remove_chan(ch);
+    }
+    fuse_session_destroy(se);
+  }
+
+  fuse_unmount(mountpoint, ch);
+  fuse_opt_free_args(&args);
+  free(mountpoint);
+  return rv == -1 ? 1 : 0;
+}
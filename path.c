@@ -0,0 +1,48 @@
+/**
+ * @file path.c
+ *
+ * Implementation of the in-place path tokenizer.
+ */
+#include <string.h>
+
+#include "path.h"
+
+// Makes a view over the whole string.
+strview_t strview(const char *str) {
+  return (strview_t) {str, strlen(str)};
+}
+
+// Takes the next component off the front of the path.
+int path_next(strview_t *rest, strview_t *part) {
+  // skip the slashes before the component
+  while (rest->len > 0 && rest->data[0] == '/') {
+    rest->data++;
+    rest->len--;
+  }
+
+  if (rest->len == 0) {
+    return 0;
+  }
+
+  const char *slash = memchr(rest->data, '/', rest->len);
+  part->data = rest->data;
+  part->len = slash != NULL ? slash - rest->data : rest->len;
+
+  rest->data += part->len;
+  rest->len -= part->len;
+  return 1;
+}
+
+// Splits the path at its last slash.
+void path_split(const char *path, strview_t *parent, strview_t *name) {
+  const char *slash = strrchr(path, '/');
+
+  if (slash == NULL) {
+    *parent = (strview_t) {path, 0};
+    *name = strview(path);
+    return;
+  }
+
+  *parent = (strview_t) {path, slash == path ? 1 : slash - path};
+  *name = strview(slash + 1);
+}
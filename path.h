@@ -0,0 +1,47 @@
+/**
+ * @file path.h
+ *
+ * In-place path tokenizing. Paths are split into string views that point
+ * into the caller's buffer, so walking a path copies and allocates
+ * nothing.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+// struct representing part of a string, which need not be NUL-terminated
+typedef struct strview {
+  const char *data; // the first character of the view
+  int len;          // the number of characters in the view
+} strview_t;
+
+/**
+ * Make a view over a whole NUL-terminated string.
+ *
+ * @param str The string.
+ *
+ * @return A view over the string.
+ */
+strview_t strview(const char *str);
+
+/**
+ * Take the next component off the front of a path.
+ * Repeated slashes are skipped.
+ *
+ * @param rest The part of the path still to walk, advanced past the component.
+ * @param part Set to the component.
+ *
+ * @return 1 if there was another component, 0 at the end of the path.
+ */
+int path_next(strview_t *rest, strview_t *part);
+
+/**
+ * Split an absolute path into its parent directory and its last component.
+ * The parent of "/a" is "/".
+ *
+ * @param path The absolute path.
+ * @param parent Set to the path of the parent directory.
+ * @param name Set to the last component, which runs to the end of path.
+ */
+void path_split(const char *path, strview_t *parent, strview_t *name);
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * @file stats.c
+ *
+ * Implementation of the per-thread statistics shards.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+// struct of the counts of one thread, or of a sum of them
+typedef struct stats_shard {
+  uint64_t ops[STATS_OP_COUNT];                 // the operations done
+  uint64_t total_ns[STATS_OP_COUNT];            // the time they took, in total
+  uint64_t hist[STATS_OP_COUNT][STATS_BUCKETS]; // how many took each bucket's time
+  int64_t counters[STATS_COUNTER_COUNT];
+  struct stats_shard *next;                     // the next shard of the list
+} stats_shard_t;
+
+static stats_shard_t *stats_shards = NULL; // the shard of every live thread
+static stats_shard_t stats_retired;        // the sums of exited threads
+static stats_shard_t stats_baseline;       // the sums at the last reset
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // guards all three
+
+static __thread stats_shard_t *stats_self = NULL; // the calling thread's shard
+static pthread_key_t stats_key;                   // retires a shard when its thread exits
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Adds n to a count of the calling thread's shard. Only the owner
+// writes it, so a plain load is safe; the store is atomic for readers.
+#define STATS_BUMP(count, n) __atomic_store_n(&(count), (count) + (n), __ATOMIC_RELAXED)
+
+// Adds every count of the shard into the sum, with stats_lock held.
+static void stats_sum(stats_shard_t *sum, stats_shard_t *shard) {
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    sum->ops[op] += __atomic_load_n(&shard->ops[op], __ATOMIC_RELAXED);
+    sum->total_ns[op] += __atomic_load_n(&shard->total_ns[op], __ATOMIC_RELAXED);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      sum->hist[op][b] += __atomic_load_n(&shard->hist[op][b], __ATOMIC_RELAXED);
+    }
+  }
+  for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+    sum->counters[c] += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+  }
+}
+
+// Folds the shard of an exiting thread into stats_retired and frees it.
+static void stats_thread_exit(void *arg) {
+  stats_shard_t *shard = (stats_shard_t *) arg;
+
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(&stats_retired, shard);
+  stats_shard_t **link = &stats_shards;
+  while (*link != shard) {
+    link = &(*link)->next;
+  }
+  *link = shard->next;
+  pthread_mutex_unlock(&stats_lock);
+
+  free(shard);
+}
+
+// Creates the key whose destructor runs stats_thread_exit.
+static void stats_key_init() {
+  int rv = pthread_key_create(&stats_key, stats_thread_exit);
+  assert(rv == 0);
+}
+
+// Returns the calling thread's shard, making it on first use.
+static stats_shard_t *stats_shard() {
+  if (stats_self != NULL) {
+    return stats_self;
+  }
+
+  stats_shard_t *shard = calloc(1, sizeof(stats_shard_t));
+  assert(shard != NULL);
+  pthread_once(&stats_key_once, stats_key_init);
+  pthread_setspecific(stats_key, shard);
+
+  pthread_mutex_lock(&stats_lock);
+  shard->next = stats_shards;
+  stats_shards = shard;
+  pthread_mutex_unlock(&stats_lock);
+
+  stats_self = shard;
+  return shard;
+}
+
+// Returns the histogram bucket of a latency.
+static int stats_bucket(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS) {
+    return ns;
+  }
+
+  int msb = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+  return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) | sub;
+}
+
+// Returns the smallest latency that falls into the bucket.
+static uint64_t stats_bucket_low(int b) {
+  if (b < STATS_SUB_BUCKETS) {
+    return b;
+  }
+
+  int msb = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  return ((uint64_t) 1 << msb) | ((uint64_t) (b & (STATS_SUB_BUCKETS - 1)) << (msb - STATS_SUB_BITS));
+}
+
+// Returns the largest latency that falls into the bucket.
+static uint64_t stats_bucket_high(int b) {
+  return b + 1 < STATS_BUCKETS ? stats_bucket_low(b + 1) - 1 : UINT64_MAX;
+}
+
+// Returns the current time.
+uint64_t stats_begin() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Counts the operation that started at start.
+void stats_end(stats_op_t op, uint64_t start) {
+  uint64_t ns = stats_begin() - start;
+  stats_shard_t *shard = stats_shard();
+
+  STATS_BUMP(shard->ops[op], 1);
+  STATS_BUMP(shard->total_ns[op], ns);
+  STATS_BUMP(shard->hist[op][stats_bucket(ns)], 1);
+}
+
+// Adds n to the counter.
+void stats_add(stats_counter_t counter, int64_t n) {
+  stats_shard_t *shard = stats_shard();
+  STATS_BUMP(shard->counters[counter], n);
+}
+
+// Sums every shard, less the baseline, into the given shard.
+static void stats_collect(stats_shard_t *sum, int with_baseline) {
+  memset(sum, 0, sizeof(stats_shard_t));
+
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(sum, &stats_retired);
+  for (stats_shard_t *shard = stats_shards; shard != NULL; shard = shard->next) {
+    stats_sum(sum, shard);
+  }
+
+  if (with_baseline) {
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+      sum->ops[op] -= stats_baseline.ops[op];
+      sum->total_ns[op] -= stats_baseline.total_ns[op];
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        sum->hist[op][b] -= stats_baseline.hist[op][b];
+      }
+    }
+    for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+      sum->counters[c] -= stats_baseline.counters[c];
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Gets the value of a counter over the interval.
+int64_t stats_counter(stats_counter_t counter) {
+  stats_shard_t *sum = malloc(sizeof(stats_shard_t));
+  assert(sum != NULL);
+  stats_collect(sum, 1);
+
+  int64_t value = sum->counters[counter];
+  free(sum);
+  return value;
+}
+
+// Starts a new interval.
+void stats_reset() {
+  stats_shard_t *sum = malloc(sizeof(stats_shard_t));
+  assert(sum != NULL);
+  stats_collect(sum, 0);
+
+  pthread_mutex_lock(&stats_lock);
+  memcpy(&stats_baseline, sum, sizeof(stats_shard_t));
+  pthread_mutex_unlock(&stats_lock);
+  free(sum);
+}
+
+// Returns the latency under which the given fraction of the operation's
+// calls finished, rounded up to the end of its bucket.
+static uint64_t stats_percentile(stats_shard_t *sum, int op, double fraction) {
+  uint64_t want = (uint64_t) (sum->ops[op] * fraction + 0.999999);
+  uint64_t seen = 0;
+
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += sum->hist[op][b];
+    if (seen >= want && sum->hist[op][b] > 0) {
+      return stats_bucket_high(b);
+    }
+  }
+  return 0;
+}
+
+#define STATS_OP_LABEL(id, label) label,
+#define STATS_COUNTER_LABEL(id, label) label,
+
+static const char *stats_op_labels[] = {STATS_OPS(STATS_OP_LABEL)};
+static const char *stats_counter_labels[] = {STATS_COUNTERS(STATS_COUNTER_LABEL)};
+
+// Writes the report of the interval as text.
+char *stats_report(size_t *len) {
+  stats_shard_t *sum = malloc(sizeof(stats_shard_t));
+  assert(sum != NULL);
+  stats_collect(sum, 1);
+
+  char *report = NULL;
+  FILE *out = open_memstream(&report, len);
+  assert(out != NULL);
+
+  fprintf(out, "# op name count total_ns mean_ns p50_ns p90_ns p99_ns max_ns\n");
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    uint64_t count = sum->ops[op];
+    fprintf(out, "op %s %lu %lu %lu %lu %lu %lu %lu\n", stats_op_labels[op], count,
+            sum->total_ns[op], count > 0 ? sum->total_ns[op] / count : 0,
+            stats_percentile(sum, op, 0.50), stats_percentile(sum, op, 0.90),
+            stats_percentile(sum, op, 0.99), stats_percentile(sum, op, 1.0));
+  }
+
+  fprintf(out, "# counter name value\n");
+  for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+    fprintf(out, "counter %s %ld\n", stats_counter_labels[c], sum->counters[c]);
+  }
+
+  fprintf(out, "# hist op low_ns high_ns count\n");
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      if (sum->hist[op][b] > 0) {
+        fprintf(out, "hist %s %lu %lu %lu\n", stats_op_labels[op], stats_bucket_low(b),
+                stats_bucket_high(b), sum->hist[op][b]);
+      }
+    }
+  }
+
+  fclose(out);
+  free(sum);
+  return report;
+}
@@ -0,0 +1,140 @@
+/**
+ * @file stats.h
+ *
+ * Counters and latency histograms of file system operations.
+ *
+ * Every thread counts into its own shard, with plain stores and no
+ * locks; a report sums the shards. Latencies go into log-linear
+ * histograms: each power of two of nanoseconds is split into
+ * STATS_SUB_BUCKETS equal buckets, so percentiles are accurate to a
+ * quarter of their value.
+ *
+ * A reset does not clear the shards, which would race with the threads
+ * counting into them; it saves the current sums, and later reports
+ * subtract them.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// the timed operations: their names and labels. writeback is a write of
+// changed blocks to an unmapped backend, outside of any operation.
+#define STATS_OPS(X)        \
+  X(ACCESS, "access")       \
+  X(GETATTR, "getattr")     \
+  X(READDIR, "readdir")     \
+  X(MKNOD, "mknod")         \
+  X(MKDIR, "mkdir")         \
+  X(UNLINK, "unlink")       \
+  X(LINK, "link")           \
+  X(SYMLINK, "symlink")     \
+  X(READLINK, "readlink")   \
+  X(RMDIR, "rmdir")         \
+  X(RENAME, "rename")       \
+  X(CHMOD, "chmod")         \
+  X(TRUNCATE, "truncate")   \
+  X(OPEN, "open")           \
+  X(CREATE, "create")       \
+  X(FLUSH, "flush")         \
+  X(RELEASE, "release")     \
+  X(READ, "read")           \
+  X(WRITE, "write")         \
+  X(FSYNC, "fsync")         \
+  X(FSYNCDIR, "fsyncdir")   \
+  X(UTIMENS, "utimens")     \
+  X(IOCTL, "ioctl")         \
+  X(WRITEBACK, "writeback")
+
+// the counters: their names and labels. The *_allocs and *_frees
+// counters count calls, blocks_allocated and blocks_freed the blocks
+// those calls moved, bitmap_groups the groups that bitmap searches had to
+// visit, and wbuf_bytes the bytes that write buffers gathered. The cache_*
+// counters are the buffer cache's: lookups of resident blocks, faults
+// that read blocks in, the blocks read ahead of them, and evictions.
+#define STATS_COUNTERS(X)                 \
+  X(BLOCK_ALLOCS, "block_allocs")         \
+  X(BLOCKS_ALLOCATED, "blocks_allocated") \
+  X(BLOCK_FREES, "block_frees")           \
+  X(BLOCKS_FREED, "blocks_freed")         \
+  X(INODE_ALLOCS, "inode_allocs")         \
+  X(INODE_FREES, "inode_frees")           \
+  X(BITMAP_SCANS, "bitmap_scans")         \
+  X(BITMAP_GROUPS, "bitmap_groups")       \
+  X(DCACHE_HITS, "dcache_hits")           \
+  X(DCACHE_MISSES, "dcache_misses")       \
+  X(JOURNAL_COMMITS, "journal_commits")   \
+  X(JOURNAL_BLOCKS, "journal_blocks")     \
+  X(WBUF_FLUSHES, "wbuf_flushes")         \
+  X(WBUF_BYTES, "wbuf_bytes")             \
+  X(CACHE_HITS, "cache_hits")             \
+  X(CACHE_MISSES, "cache_misses")         \
+  X(CACHE_READAHEAD, "cache_readahead")   \
+  X(CACHE_EVICTIONS, "cache_evictions")
+
+#define STATS_OP_ID(id, label) STATS_OP_##id,
+#define STATS_COUNTER_ID(id, label) STATS_##id,
+
+// the timed operations, numbered in the order of STATS_OPS
+typedef enum stats_op { STATS_OPS(STATS_OP_ID) STATS_OP_COUNT } stats_op_t;
+
+// the counters, numbered in the order of STATS_COUNTERS
+typedef enum stats_counter { STATS_COUNTERS(STATS_COUNTER_ID) STATS_COUNTER_COUNT } stats_counter_t;
+
+#define STATS_SUB_BITS 2                      // log2 of the buckets per power of two
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// ioctl on the stats file that starts a new interval
+#define NUFS_IOC_STATS_RESET _IO('N', 1)
+
+/**
+ * Return the current time, to pass to stats_end.
+ *
+ * @return The monotonic time in nanoseconds.
+ */
+uint64_t stats_begin();
+
+/**
+ * Count one operation and the time it took.
+ *
+ * @param op The operation.
+ * @param start The time stats_begin returned when it started.
+ */
+void stats_end(stats_op_t op, uint64_t start);
+
+/**
+ * Add to a counter.
+ *
+ * @param counter The counter.
+ * @param n The amount to add.
+ */
+void stats_add(stats_counter_t counter, int64_t n);
+
+/**
+ * Get the value of a counter over the interval, summed over every thread.
+ *
+ * @param counter The counter.
+ *
+ * @return The amount added to it since the last reset.
+ */
+int64_t stats_counter(stats_counter_t counter);
+
+/**
+ * Start a new interval: later reports count from now.
+ */
+void stats_reset();
+
+/**
+ * Write a report of every operation and counter since the last reset
+ * as text, one line each, followed by the non-empty histogram buckets.
+ *
+ * @param len Set to the length of the report.
+ *
+ * @return The report, to be freed by the caller.
+ */
+char *stats_report(size_t *len);
+
+#endif
@@ -4,33 +4,74 @@
  *
  * Implementation of a data block abstraction and related methods.
  */
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "storage.h"
 #include "inode.h"
 #include "directory.h"
-#include "slist.h"
+#include "dcache.h"
 #include "blocks.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "wbuf.h"
+#include "stats.h"
+#include "trace.h"
+
+// Lock order: a journal transaction, then rename_lock, then inode locks
+// (several only through inode_lock_all), then the inode and block
+// allocators.
+
+// serializes renames, so a directory cannot be moved while another
+// rename is looking up or relinking its entries
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static storage_durability_t storage_durability = DURABILITY_FSYNC;
+static int64_t storage_readahead = 0; // bytes read ahead of sequential reads, 0 for none
+
+#define STORAGE_ZEROS (1 << 16)        // the bytes of zeros holes are read from
+#define STORAGE_SEGMENTS 64            // the segments storage_read_send keeps on the stack
+#define STORAGE_BOUNCE (1 << 14)       // the bytes a fill copies at a time when it cannot reach the blocks
+static const char storage_zeros[STORAGE_ZEROS];
+
+// struct of the data a write copies into a file: a buffer, or a
+// storage_fill_t copying it from elsewhere
+typedef struct storage_source {
+  const char *buf;     // the data, when fill is NULL, moved past what was copied
+  storage_fill_t fill; // copies the next bytes, or NULL
+  void *arg;           // passed to fill
+  int failed;          // set once fill fails; the rest of the write is zeros
+} storage_source_t;
 
 // Initializes the file system at the given path.
 int storage_init(const char *path) {
 
-    blocks_init(path); // initializes the file system
-
-    if (bitmap_get(get_blocks_bitmap(), 1) == 0) {
-        inode_table_init();                        // initialize the inode table
+    int fresh = blocks_init(path); // initializes the file system
+    if (fresh == -1) {
+      return -1;
     }
 
-    if (bitmap_get(get_inode_bitmap(), 2) == 0) {
-        root_init();                               // initialize the root directory
+    if (fresh) {
+        inode_table_init();        // initialize the inode table
+        root_init();               // initialize the root directory
     }
 
+    journal_open();                // replay what a crash left in the journal
+
+    inode_table_load();            // pick up the inode table
+    dcache_clear();                // forget entries of any earlier image
+    wbuf_clear();                  // and writes buffered for it
+
   return 0; // return 0 on success
 }
 
@@ -42,16 +83,245 @@ int storage_stat(const char *path, struct stat *st) {
     return -1; // the file does not exist
   }
 
+  return storage_stat_inum(file_inum, st);
+}
+
+// Returns the size of the file, counting the appends in its write buffer.
+static int64_t storage_size(inode_t *file_inode, wbuf_t *wbuf) {
+  return wbuf != NULL ? wbuf->offset + (int64_t) wbuf->len : file_inode->size;
+}
+
+// Fills in the stat struct for the file with the given inum.
+int storage_stat_inum(int file_inum, struct stat *st) {
   inode_t* file_inode = get_inode(file_inum); // get the inode for the file
 
+  inode_read_lock(file_inum);
   st->st_ino = file_inum;          // set the fields of the stat structure
   st->st_nlink = file_inode->refs;
   st->st_mode = file_inode->mode;
-  st->st_size = file_inode->size;
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  st->st_size = storage_size(file_inode, wbuf);
+  st->st_blocks = inode_blocks(file_inode) * (BLOCK_SIZE / 512);
+  st->st_blksize = BLOCK_SIZE;
+  inode_unlock(file_inum);
 
   return 0; // return 0 on success
 }
 
+// Copies the next len bytes of the source to dst. A source that failed
+// gives zeros, so a failed write cannot expose what the blocks held. A
+// fill may read from a pipe, so where the kernel cannot reach the blocks
+// it fills a copy on the stack instead.
+static void source_copy(storage_source_t *src, char *dst, size_t len) {
+  if (src->fill == NULL) {
+    memcpy(dst, src->buf, len);
+    src->buf += len;
+    return;
+  }
+
+  char bounce[STORAGE_BOUNCE];
+  int direct = blocks_kernel_access();
+  for (size_t done = 0; done < len; ) {
+    size_t chunk = direct || len - done < STORAGE_BOUNCE ? len - done : STORAGE_BOUNCE;
+    if (src->failed || src->fill(src->arg, direct ? dst + done : bounce, chunk) == -1) {
+      src->failed = 1;
+      memset(dst + done, 0, len - done);
+      return;
+    }
+    if (!direct) {
+      memcpy(dst + done, bounce, chunk);
+    }
+    done += chunk;
+  }
+}
+
+// Returns the bytes of the hole at pos, up to the next mapped block and
+// at most max.
+static size_t storage_hole(inode_t *node, off_t pos, size_t max) {
+  bnum_t next = inode_next_data(node, pos / BLOCK_SIZE);
+  if (next != -1 && next * BLOCK_SIZE - pos < (off_t) max) {
+    return next * BLOCK_SIZE - pos;
+  }
+  return max;
+}
+
+// Copies size bytes of the file starting at offset into the buffer. Each
+// step copies a whole run of contiguous blocks with a single memcpy,
+// going through the cursor's extent when one is given.
+static void storage_copy(int file_inum, char *buf, size_t size, off_t offset,
+                         extent_cursor_t *cursor) {
+  inode_t *node = get_inode(file_inum);
+  size_t done = 0;
+
+  if (node->flags & INODE_INLINE) {
+    assert(offset + size <= INODE_INLINE_SIZE);
+    memcpy(buf, node->data + offset, size);
+    return;
+  }
+
+  while (done < size) {
+    off_t pos = offset + done;
+    int run = 0;
+    bnum_t bnum = cursor != NULL ? inode_get_run_cursor(node, pos / BLOCK_SIZE, &run, cursor)
+                                 : inode_get_run(node, pos / BLOCK_SIZE, &run);
+
+    // a hole reads as zeros, up to the next mapped block
+    if (bnum == -1) {
+      size_t chunk = storage_hole(node, pos, size - done);
+      memset(buf + done, 0, chunk);
+      done += chunk;
+      continue;
+    }
+
+    size_t chunk = (size_t) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    char *data = blocks_get_blocks(bnum, bytes_to_blocks(pos % BLOCK_SIZE + chunk));
+    memcpy(buf + done, data + pos % BLOCK_SIZE, chunk);
+    done += chunk;
+  }
+}
+
+// Copies size bytes from the source into the file starting at offset,
+// which has blocks for all of them. Like storage_copy, a whole run is
+// copied at a time. Blocks written are recorded as dirty, for
+// storage_fsync.
+static void storage_copy_in(int file_inum, storage_source_t *src, size_t size, off_t offset,
+                            extent_cursor_t *cursor) {
+  inode_t *node = get_inode(file_inum);
+  size_t done = 0;
+
+  // an inline file's data is metadata, journaled with its inode
+  if (node->flags & INODE_INLINE) {
+    assert(offset + size <= INODE_INLINE_SIZE);
+    journal_dirty(node->data + offset, size);
+    source_copy(src, node->data + offset, size);
+    return;
+  }
+
+  while (done < size) {
+    off_t pos = offset + done;
+    int run = 0;
+    bnum_t bnum = cursor != NULL ? inode_get_run_cursor(node, pos / BLOCK_SIZE, &run, cursor)
+                                 : inode_get_run(node, pos / BLOCK_SIZE, &run);
+    assert(bnum != -1);
+
+    size_t chunk = (size_t) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    bnum_t blocks = bytes_to_blocks(pos % BLOCK_SIZE + chunk);
+    source_copy(src, (char *) blocks_get_blocks(bnum, blocks) + pos % BLOCK_SIZE, chunk);
+    blocks_dirty(file_inum, bnum, blocks);
+    done += chunk;
+  }
+}
+
+// Describes size bytes of the file starting at offset as segments, which
+// the image file serves wherever it holds what the mapping shows, and
+// returns how many there are.
+static int storage_segments(int file_inum, storage_segment_t *segs, size_t size, off_t offset,
+                            extent_cursor_t *cursor) {
+  inode_t *node = get_inode(file_inum);
+  int fd = blocks_get_fd();
+  size_t done = 0;
+  int count = 0;
+
+  if (node->flags & INODE_INLINE) {
+    assert(offset + size <= INODE_INLINE_SIZE);
+    segs[0] = (storage_segment_t) {node->data + offset, -1, 0, size};
+    return 1;
+  }
+
+  while (done < size) {
+    off_t pos = offset + done;
+    int run = 0;
+    bnum_t bnum = cursor != NULL ? inode_get_run_cursor(node, pos / BLOCK_SIZE, &run, cursor)
+                                 : inode_get_run(node, pos / BLOCK_SIZE, &run);
+
+    if (bnum == -1) {
+      size_t chunk = storage_hole(node, pos, size - done < STORAGE_ZEROS ? size - done : STORAGE_ZEROS);
+      segs[count++] = (storage_segment_t) {storage_zeros, -1, 0, chunk};
+      done += chunk;
+      continue;
+    }
+
+    size_t chunk = (size_t) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    // blocks the journal maps privately differ from the file until the
+    // commit, and an unmapped image's file is never sure to be current
+    bnum_t blocks = bytes_to_blocks(pos % BLOCK_SIZE + chunk);
+    if (fd == -1 || journal_is_dirty(bnum, blocks)) {
+      char *data = blocks_get_blocks(bnum, blocks);
+      segs[count++] = (storage_segment_t) {data + pos % BLOCK_SIZE, -1, 0, chunk};
+    } else {
+      segs[count++] = (storage_segment_t) {NULL, fd, (off_t) bnum * BLOCK_SIZE + pos % BLOCK_SIZE, chunk};
+    }
+    done += chunk;
+  }
+
+  return count;
+}
+
+// Takes a private copy of a shared cursor, or an empty one if another
+// thread is using it (several threads may read through one handle).
+static int cursor_take(extent_cursor_t *shared, extent_cursor_t *local) {
+  memset(local, 0, sizeof(extent_cursor_t));
+  if (shared == NULL || __atomic_exchange_n(&shared->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+    return 0;
+  }
+
+  *local = *shared;
+  local->lock = 0;
+  return 1;
+}
+
+// Gives a cursor taken with cursor_take back, with what it learned.
+static void cursor_give(extent_cursor_t *shared, extent_cursor_t *local, int taken) {
+  if (taken) {
+    shared->extent = local->extent;
+    shared->generation = local->generation;
+    shared->ahead = local->ahead;
+    __atomic_store_n(&shared->lock, 0, __ATOMIC_RELEASE);
+  }
+}
+
+// Starts reading the blocks of the next storage_readahead bytes of the
+// file when a read through the cursor comes close to where the last
+// readahead ended. Other reads only move that point past themselves, so
+// the next read continuing them starts a readahead.
+static void storage_read_ahead(inode_t *node, extent_cursor_t *cursor, off_t offset, size_t size) {
+  int64_t end = offset + size;
+
+  if (offset > cursor->ahead || end <= cursor->ahead - storage_readahead / 2) {
+    if (offset > cursor->ahead) {
+      cursor->ahead = end;
+    }
+    return;
+  }
+
+  bnum_t file_bnum = (end > cursor->ahead ? end : cursor->ahead) / BLOCK_SIZE;
+  bnum_t last = bytes_to_blocks(end + storage_readahead);
+  while (file_bnum < last) {
+    int run;
+    bnum_t bnum = inode_get_run(node, file_bnum, &run);
+    if (bnum == -1) {
+      break; // a hole or the end of the file
+    }
+    if (run > last - file_bnum) {
+      run = last - file_bnum;
+    }
+    blocks_prefetch(bnum, run, 0);
+    file_bnum += run;
+  }
+
+  cursor->ahead = end + storage_readahead;
+}
+
 // Read data from the given file.
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
   int file_inum = tree_lookup(path); // retrieve the inum of the file
@@ -60,203 +330,892 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
     return -1; // if tree_lookup returns -1 the file does not exist
   }
 
+  return storage_read_ino(file_inum, buf, size, offset, NULL);
+}
+
+// Clamps a read of size bytes at offset to the end of the file, counting
+// the appends in its write buffer, and returns how many of those bytes
+// are in the file's blocks rather than the buffer.
+static size_t storage_read_size(inode_t *file_inode, wbuf_t *wbuf, size_t *size, off_t offset) {
+  int64_t file_size = storage_size(file_inode, wbuf);
+
+  // never read past the end of the file
+  if (offset >= file_size) {
+    *size = 0;
+  } else if (offset + (int64_t) *size > file_size) {
+    *size = file_size - offset;
+  }
+
+  if (offset >= file_inode->size) {
+    return 0;
+  }
+  return offset + (int64_t) *size > file_inode->size ? (size_t) (file_inode->size - offset) : *size;
+}
+
+// Read data from the file with the given inum.
+int storage_read_ino(int file_inum, char *buf, size_t size, off_t offset, extent_cursor_t *cursor) {
   inode_t* file_inode = get_inode(file_inum);
-  void* block = blocks_get_block(file_inode->block);
-  void* offset_block = (void*) (((char*) block) + offset); // adjust the pointer by offset
+  inode_read_lock(file_inum); // reads of a file run in parallel
+
+  // appends still in the write buffer lie past the inode's size
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  size_t stored = storage_read_size(file_inode, wbuf, &size, offset);
+
+  if (stored > 0) {
+    extent_cursor_t local;
+    int taken = cursor_take(cursor, &local);
+    if (taken && storage_readahead > 0 && !(file_inode->flags & INODE_INLINE)) {
+      storage_read_ahead(file_inode, &local, offset, stored);
+    }
+    storage_copy(file_inum, buf, stored, offset, &local); // copy the file's blocks into the buffer
+    cursor_give(cursor, &local, taken);
+  }
 
-  memcpy(buf, offset_block, size); // copy the memory from the file into the buffer
+  if (stored < size) {
+    memcpy(buf + stored, wbuf->data + (offset + stored - wbuf->offset), size - stored);
+  }
 
+  inode_unlock(file_inum);
   return size;
 }
 
+// Reads data from the file with the given inum as segments handed to send.
+int storage_read_send(int file_inum, size_t size, off_t offset, extent_cursor_t *cursor,
+                      storage_send_t send, void *arg) {
+  inode_t* file_inode = get_inode(file_inum);
+  inode_read_lock(file_inum); // held until the segments are sent
+
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  size_t stored = storage_read_size(file_inode, wbuf, &size, offset);
+
+  // a segment per block at worst, with holes split into STORAGE_ZEROS
+  // pieces, plus the partial blocks at the ends and the buffered appends
+  size_t max = size / BLOCK_SIZE + size / STORAGE_ZEROS + 4;
+  storage_segment_t stack[STORAGE_SEGMENTS];
+  storage_segment_t *segs = max <= STORAGE_SEGMENTS ? stack : malloc(sizeof(storage_segment_t) * max);
+  assert(segs != NULL);
+  int count = 0;
+  char *copy = NULL; // what was read, when the kernel cannot reach the blocks
+
+  if (stored > 0) {
+    extent_cursor_t local;
+    int taken = cursor_take(cursor, &local);
+    if (taken && storage_readahead > 0 && !(file_inode->flags & INODE_INLINE)) {
+      storage_read_ahead(file_inode, &local, offset, stored);
+    }
+    if (blocks_kernel_access()) {
+      count = storage_segments(file_inum, segs, stored, offset, &local);
+    } else {
+      copy = malloc(stored);
+      assert(copy != NULL);
+      storage_copy(file_inum, copy, stored, offset, &local);
+      segs[count++] = (storage_segment_t) {copy, -1, 0, stored};
+    }
+    cursor_give(cursor, &local, taken);
+  }
+
+  if (stored < size) {
+    const char *data = wbuf->data + (offset + stored - wbuf->offset);
+    segs[count++] = (storage_segment_t) {data, -1, 0, size - stored};
+  }
+
+  int rv = send(arg, segs, count);
+  inode_unlock(file_inum);
+
+  free(copy);
+  if (segs != stack) {
+    free(segs);
+  }
+  return rv;
+}
+
 // Write data to the given file.
 int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-  assert(offset < 4096);
-
   int file_inum = tree_lookup(path);
   if (file_inum == -1) {
-    return -1;    // if tree_lookup returns -1 the file does not exist
+    return -ENOENT; // if tree_lookup returns -1 the file does not exist
   }
 
-  inode_t* file_inode = get_inode(file_inum);
-  void* block = blocks_get_block(file_inode->block);
-  void* offset_block = (void*) (((char*) block) + offset); // adjust the pointer by offset
+  return storage_write_ino(file_inum, buf, size, offset, NULL);
+}
 
-  memcpy(offset_block, buf, size); // copy the memory from buffer into the file
+// Writes the file's buffered appends to blocks, allocated as one run,
+// and grows the inode over them. The buffer stays the file's, empty, or
+// holding its data when there are no blocks for it, with the error kept
+// for the next fsync or close. Returns 0, or map_inode's error.
+static int storage_wbuf_flush(int file_inum, wbuf_t *wbuf) {
+  inode_t *file_inode = get_inode(file_inum);
+  int rv = 0;
 
-  file_inode->size = file_inode->size + size; // update size of file
-  assert(file_inode->size <= 4096);          // cannot write more than spcae of file
+  if (wbuf->len == 0) {
+    return 0;
+  }
 
-  int parent_inode = tree_lookup(get_dir_path(path));
-  get_inode(parent_inode)->size += size;
+  TRACE(WBUF_FLUSH, NULL, NULL, 0, file_inum, wbuf->offset, wbuf->len);
+  stats_add(STATS_WBUF_FLUSHES, 1);
+
+  // a failed map_inode leaves the inode as it was, so the buffer still
+  // continues it
+  journal_begin();
+  rv = map_inode(file_inode, wbuf->offset, wbuf->len);
+  if (rv == 0) {
+    storage_source_t src = {wbuf->data, NULL, NULL, 0};
+    storage_copy_in(file_inum, &src, wbuf->len, wbuf->offset, NULL);
+    wbuf->offset = file_inode->size;
+    wbuf->len = 0;
+  }
+  journal_end();
 
-  return size;
+  wbuf->error = rv;
+  return rv;
 }
 
-// Creates a new file at the given path.
-int storage_mknod(const char *path, int mode) {
+// Flushes and frees the file's write buffer, if it has one. A buffer
+// that could not be flushed is kept.
+static int storage_wbuf_drop(int file_inum) {
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  if (wbuf == NULL) {
+    return 0;
+  }
 
-    //make sure the file does not already exist - if it does then returns -1 to indicate error
-  if (tree_lookup(path) != -1) {
-    return - 1;
+  int rv = storage_wbuf_flush(file_inum, wbuf);
+  if (rv == 0) {
+    wbuf_put(wbuf);
   }
+  return rv;
+}
 
-  int file_inum = alloc_inode(); // allocate an inode for the file
-  assert(file_inum != -1);
+// Takes a write buffer for the file, flushing the least recently written
+// buffer of another file when none is free. That file's lock is only
+// tried, as this thread holds a lock of its own.
+static wbuf_t *storage_wbuf_get(int file_inum, int64_t offset) {
+  wbuf_t *wbuf = wbuf_get(file_inum, offset);
+  if (wbuf != NULL) {
+    return wbuf;
+  }
 
-  // initialize inode fields
-  inode_t* inode = get_inode(file_inum);
-  inode->refs = 1;
-  inode->mode = mode;
-  inode->size = 0;
+  int victim = wbuf_oldest(file_inum);
+  if (victim == -1 || inode_try_write_lock(victim) == -1) {
+    return NULL;
+  }
+  int rv = storage_wbuf_drop(victim); // a failure is the victim's to report
+  inode_unlock(victim);
+
+  return rv == 0 ? wbuf_get(file_inum, offset) : NULL;
+}
+
+// Gathers a small append in the file's write buffer, flushing the buffer
+// first when it is full. Returns 1 if the write was buffered, 0 if it
+// has to go to blocks (with the buffer flushed) and the flush's error on
+// failure.
+static int storage_wbuf_write(int file_inum, storage_source_t *src, size_t size, off_t offset) {
+  inode_t *file_inode = get_inode(file_inum);
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  int64_t end = storage_size(file_inode, wbuf);
+
+  // only appends continuing a file are buffered, not its first write,
+  // which is often its only one. Nothing is buffered when every write
+  // must be on disk as it returns, for an inline file, which needs no
+  // blocks, or for a symlink, whose target is written as it is made.
+  int append = offset == end && offset > 0 && size < WBUF_SIZE && S_ISREG(file_inode->mode);
+  if (!append || storage_durability == DURABILITY_EVERY_OP ||
+      ((file_inode->flags & INODE_INLINE) && offset + size <= INODE_INLINE_SIZE)) {
+    return storage_wbuf_drop(file_inum);
+  }
 
-  int file_bnum = alloc_block();
-  assert(file_bnum != -1);
-  inode->block = file_bnum;
+  if (wbuf != NULL && wbuf->len + size > WBUF_SIZE) {
+    int rv = storage_wbuf_flush(file_inum, wbuf);
+    if (rv != 0) {
+      return rv;
+    }
+  }
+  if (wbuf == NULL && (wbuf = storage_wbuf_get(file_inum, end)) == NULL) {
+    return 0; // every buffer is busy
+  }
 
+  source_copy(src, wbuf->data + wbuf->len, size);
+  wbuf->len += size;
+  wbuf_touch(wbuf);
+  stats_add(STATS_WBUF_BYTES, size);
+  return 1;
+}
 
-  char* dir_path = get_dir_path(path);
-  char* file_name = get_file_name(path);
+// Writes the source's data to the file with the given inum.
+static int storage_write_source(int file_inum, storage_source_t *src, size_t size, off_t offset,
+                                extent_cursor_t *cursor) {
+  inode_t* file_inode = get_inode(file_inum);
+  journal_begin();
+  inode_write_lock(file_inum); // writes may grow the file
+
+  // small appends wait in memory for their blocks
+  int buffered = storage_wbuf_write(file_inum, src, size, offset);
+  if (buffered != 0) {
+    inode_unlock(file_inum);
+    journal_end();
+    return buffered < 0 ? buffered : src->failed ? -EIO : (int) size;
+  }
 
-  int dir_inum = tree_lookup(dir_path);
-  assert(dir_inum != -1);
+  // make sure the file has blocks for the whole write; the rest of a
+  // file's last block is kept zeroed, so growing it needs no zero-fill
+  int rv = map_inode(file_inode, offset, size);
+  if (rv != 0) {
+    inode_unlock(file_inum);
+    journal_end();
+    return rv;
+  }
 
-  // make a new dir entry for the new file in the directory it exists in
-  directory_put(dir_inum, file_name, file_inum);
+  extent_cursor_t local;
+  int taken = cursor_take(cursor, &local);
+  storage_copy_in(file_inum, src, size, offset, &local); // copy the data into the file
+  cursor_give(cursor, &local, taken);
 
-  return 0;
+  inode_unlock(file_inum);
+
+  // the data goes out before the commit that makes the new size durable
+  if (storage_durability == DURABILITY_EVERY_OP) {
+    blocks_flush(file_inum);
+  }
+  journal_end();
+  return src->failed ? -EIO : (int) size;
 }
 
-// Unlinks the given path name from the file.
-int storage_unlink(const char *path) {
-  int file_inum = tree_lookup(path); //retrieve the inum of the file
+// Write data to the file with the given inum.
+int storage_write_ino(int file_inum, const char *buf, size_t size, off_t offset,
+                      extent_cursor_t *cursor) {
+  storage_source_t src = {buf, NULL, NULL, 0};
+  return storage_write_source(file_inum, &src, size, offset, cursor);
+}
 
-  // if tree_lookup returns -1 the file does not exist
-  if (file_inum == -1) {
-    return -1;
+// Write data copied by fill to the file with the given inum.
+int storage_write_fill(int file_inum, storage_fill_t fill, void *arg, size_t size, off_t offset,
+                       extent_cursor_t *cursor) {
+  storage_source_t src = {NULL, fill, arg, 0};
+  return storage_write_source(file_inum, &src, size, offset, cursor);
+}
+
+// Sets the size of the file with the given inum.
+int storage_truncate(int file_inum, off_t size) {
+  inode_t *file_inode = get_inode(file_inum);
+  journal_begin();
+  inode_write_lock(file_inum);
+
+  // buffered appends the new size cuts off need no blocks
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  if (wbuf != NULL && size <= wbuf->offset) {
+    wbuf_put(wbuf);
+  } else {
+    int rv = storage_wbuf_drop(file_inum);
+    if (rv != 0) {
+      inode_unlock(file_inum);
+      journal_end();
+      return rv;
+    }
   }
 
-  inode_t* file_inode = get_inode(file_inum);
-  file_inode->refs = file_inode->refs - 1;    // decrement the number of references to the file
+  // zero the cut-off tail of the new last block, which a later extension
+  // would otherwise bring back
+  off_t tail = size % BLOCK_SIZE;
+  if (size < file_inode->size && tail != 0 && !(file_inode->flags & INODE_INLINE) &&
+      inode_get_bnum(file_inode, size / BLOCK_SIZE) != -1) {
+    off_t end = size - tail + BLOCK_SIZE;
+    if (end > file_inode->size) {
+      end = file_inode->size;
+    }
+    storage_source_t src = {storage_zeros, NULL, NULL, 0};
+    storage_copy_in(file_inum, &src, end - size, size, NULL);
+  }
 
-  // gets the path to the parent and the file name of the path entered
-  char* dir_path = get_dir_path(path);
-  char* file_name = get_file_name(path);
-  int dir_inum = tree_lookup(dir_path);
-  assert(dir_inum != -1);
+  int rv = truncate_inode(file_inode, size);
+  inode_unlock(file_inum);
 
-  // go to the directory the file exists in and delete the entry for the file
-  directory_delete(dir_inum, file_name);
+  if (storage_durability == DURABILITY_EVERY_OP) {
+    blocks_flush(file_inum);
+  }
+  journal_end();
+  return rv;
+}
 
-  // if the file has no references, delete the file and set bitmaps to 0 - freed
-  if (file_inode->refs == 0) {
-    void* blocks_bitmap = get_blocks_bitmap();
-    bitmap_put(blocks_bitmap, file_inode->block, 0);
+// Finds the next data or hole at or after offset in the given file.
+off_t storage_lseek(int file_inum, off_t offset, int whence) {
+  inode_t *file_inode = get_inode(file_inum);
+  off_t rv = -1;
+
+  inode_read_lock(file_inum);
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  int64_t file_size = storage_size(file_inode, wbuf);
+
+  if (offset >= 0 && offset < file_size) {
+    if (offset >= file_inode->size) {
+      rv = whence == SEEK_DATA ? offset : file_size; // in the buffered appends
+    } else if (file_inode->flags & INODE_INLINE) {
+      rv = whence == SEEK_DATA ? offset : file_inode->size;
+    } else if (whence == SEEK_DATA) {
+      bnum_t next = inode_next_data(file_inode, offset / BLOCK_SIZE);
+      if (next != -1 && next * BLOCK_SIZE < file_inode->size) {
+        rv = next * BLOCK_SIZE > offset ? next * BLOCK_SIZE : offset;
+      }
+    } else if (whence == SEEK_HOLE) {
+      off_t hole = inode_next_hole(file_inode, offset / BLOCK_SIZE) * BLOCK_SIZE;
+      rv = hole > offset ? hole : offset;
+      if (rv > file_inode->size) {
+        rv = file_inode->size; // the end of the file counts as a hole
+      }
+    }
 
-    void* inode_bitmap = get_inode_bitmap();
-    bitmap_put(inode_bitmap, file_inum, 0);
+    // the buffered appends continue the data at the end of the blocks
+    if (whence == SEEK_HOLE && rv == file_inode->size) {
+      rv = file_size;
+    } else if (whence == SEEK_DATA && rv == -1 && file_size > file_inode->size) {
+      rv = file_inode->size;
+    }
   }
+  inode_unlock(file_inum);
 
-  return 0; // return 0 on success
+  return rv;
 }
 
-// Creates an alias for the from file.
-int storage_link(const char *from, const char *to) {
-  if (tree_lookup(to) != -1) return -1; // check to make sure the new file name does not already exist -
+// Sets how far sequential reads are read ahead.
+void storage_set_readahead(int64_t bytes) {
+  storage_readahead = bytes;
+}
 
-  int file_inum = tree_lookup(from);
+// Faults the metadata, or the whole image, into the mapping.
+void storage_prefault(storage_prefault_t what) {
+  if (what == PREFAULT_ALL) {
+    blocks_prefetch(0, blocks_count(), 1);
+  } else if (what == PREFAULT_METADATA) {
+    blocks_prefetch_bitmaps(1);
+    inode_table_prefetch(1);
+  }
+}
 
-  if (file_inum == -1) return -1; // check to make sure the file we are making an alias for exists
+// Selects the durability mode.
+void storage_set_durability(storage_durability_t durability) {
+  storage_durability = durability;
+}
 
-  // increment references for from inode
-  inode_t* file_inode = get_inode(file_inum);
-  file_inode->refs = file_inode->refs + 1;
+// Gives the file's buffered appends their blocks, or with failed_only
+// only retries a flush that failed. Returns 0, or the flush's error.
+static int storage_flush_ino(int file_inum, int failed_only) {
+  journal_begin();
+  inode_write_lock(file_inum);
+  wbuf_t *wbuf = wbuf_find(file_inum);
+  int rv = 0;
+  if (wbuf != NULL && (!failed_only || wbuf->error != 0)) {
+    rv = storage_wbuf_flush(file_inum, wbuf);
+  }
+  inode_unlock(file_inum);
+  journal_end();
+  return rv;
+}
 
-  // reconstructs the parent path of to and get the file name
-  char* parent_path = get_dir_path(to);
-  char* file_name = get_file_name(to);
-  int dir_inum = tree_lookup(parent_path);
-  if (dir_inum == -1) return -1; // the given file path does not exist then method does nothing
+// Flushes the file's dirty data, then the journal holding its metadata.
+int storage_fsync(int file_inum) {
+  // buffered appends get their blocks first in every mode, so that
+  // running out of space is reported
+  int rv = storage_flush_ino(file_inum, 0);
+  if (storage_durability == DURABILITY_NONE) {
+    return rv;
+  }
 
-  // make a new entry for the alias in the directory specified
-  directory_put(dir_inum, file_name, file_inum);
+  if (blocks_flush(file_inum) == -1 && rv == 0) {
+    rv = -EIO;
+  }
+  journal_commit();
+  return rv;
+}
 
-  return 0; // return 0 on success
+// Reports a failed flush of the file's buffered appends as it is closed.
+int storage_flush(int file_inum) {
+  return storage_flush_ino(file_inum, 1);
 }
 
-// Moves the file from the from path to the to path.
-int storage_rename(const char *from, const char *to) {
-  int file_inum = tree_lookup(from);
+// Flushes the write buffer of every file. Called with no lock held.
+void storage_flush_buffers() {
+  int inum;
+  while ((inum = wbuf_oldest(-1)) != -1) {
+    journal_begin();
+    inode_write_lock(inum);
+    int rv = storage_wbuf_drop(inum);
+    if (rv != 0) {
+      // there is nowhere left to keep them
+      fprintf(stderr, "nufs: lost buffered writes to inode %d: %s\n", inum, strerror(-rv));
+      wbuf_put(wbuf_find(inum));
+    }
+    inode_unlock(inum);
+    journal_end();
+  }
+}
+
+// struct counting the pins held on an inode
+typedef struct pin_inode {
+  int inum;               // the pinned inode
+  int64_t count;          // the number of pins held on it
+  int orphan;             // 1 once the last link is gone, so the last unpin frees it
+  struct pin_inode *next; // the next pinned inode in the same bucket
+} pin_inode_t;
+
+#define PIN_BUCKETS 1024 // the buckets of the pinned inode table
+
+static pin_inode_t *pin_inodes[PIN_BUCKETS];
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Finds the pinned inode with the given inum, with pin_lock held. Returns
+// the link pointing at it, which points at NULL if it is not pinned.
+static pin_inode_t **pin_find(int inum) {
+  pin_inode_t **link = &pin_inodes[inum % PIN_BUCKETS];
+  while (*link != NULL && (*link)->inum != inum) {
+    link = &(*link)->next;
+  }
+  return link;
+}
 
-  // if the file we are renaming does not exist then this method does nothing
+// Frees the (write-locked) inode and all of its blocks.
+static void storage_free(int inum) {
+  inode_t* inode = get_inode(inum);
+
+  if (S_ISDIR(inode->mode)) {
+    dcache_purge(inum); // the inum may come back as another directory
+  }
+  wbuf_t *wbuf = wbuf_find(inum);
+  if (wbuf != NULL) {
+    wbuf_put(wbuf);       // nor write what is buffered
+  }
+  shrink_inode(inode, 0); // frees every block of the file
+  blocks_forget(inum);    // nothing is left to flush
+  free_inode(inum);
+}
+
+// Adds count pins to the inode.
+void storage_pin(int inum, int64_t count) {
+  pthread_mutex_lock(&pin_lock);
+  pin_inode_t **link = pin_find(inum);
+  if (*link == NULL) {
+    *link = calloc(1, sizeof(pin_inode_t));
+    assert(*link != NULL);
+    (*link)->inum = inum;
+  }
+  (*link)->count += count;
+  pthread_mutex_unlock(&pin_lock);
+}
+
+// Drops count pins from the inode, freeing the file if they were the last
+// thing keeping an unlinked file alive.
+void storage_unpin(int inum, int64_t count) {
+  int orphan = 0;
+
+  pthread_mutex_lock(&pin_lock);
+  pin_inode_t **link = pin_find(inum);
+  pin_inode_t *pin = *link;
+  assert(pin != NULL && pin->count >= count);
+
+  pin->count -= count;
+  if (pin->count == 0) {
+    orphan = pin->orphan;
+    *link = pin->next;
+    free(pin);
+  }
+  pthread_mutex_unlock(&pin_lock);
+
+  if (orphan) {
+    journal_begin();
+    inode_write_lock(inum);
+    storage_free(inum);
+    inode_unlock(inum);
+    journal_end();
+  }
+}
+
+// Looks up the name in the directory, pinning the entry's inode.
+int storage_lookup(int dir_inum, const char *name) {
+  // pin under the directory's lock, so the entry cannot be freed first
+  inode_read_lock(dir_inum);
+  int inum = directory_lookup(dir_inum, name);
+  if (inum != -1) {
+    storage_pin(inum, 1);
+  }
+  inode_unlock(dir_inum);
+
+  return inum;
+}
+
+// Opens a handle on the file at the given path.
+storage_file_t *storage_open(const char *path) {
+  int file_inum = tree_lookup(path);
   if (file_inum == -1) {
-   return -1;
+    return NULL;
   }
 
-  // retrieve the inum for the new name of the file - doesnt have to exist
-  int to_file_inum = tree_lookup(to);
+  return storage_open_ino(file_inum);
+}
+
+// Opens a handle on the file with the given inum.
+storage_file_t *storage_open_ino(int file_inum) {
+  storage_file_t *file = calloc(1, sizeof(storage_file_t));
+  assert(file != NULL);
+  file->inum = file_inum;
+
+  storage_pin(file_inum, 1);
+  return file;
+}
+
+// Closes the handle.
+void storage_release(storage_file_t *file) {
+  storage_unpin(file->inum, 1);
+  free(file);
+}
+
+// Changes the permissions of the file with the given inum.
+int storage_chmod(int file_inum, mode_t mode) {
+  journal_begin();
+  inode_write_lock(file_inum);
+  inode_t* inode = get_inode(file_inum);
+  journal_dirty(inode, sizeof(inode_t));
+  inode->mode = (inode->mode & S_IFMT) | (mode & ~S_IFMT); // the file type never changes
+  inode_unlock(file_inum);
+  journal_end();
+
+  return 0;
+}
+
+// Write-locks the given directories along with the entries with the given
+// names in them, storing each entry's inum (-1 if there is none) in
+// entries. The entries are looked up again once everything is locked, and
+// the whole thing is retried if one changed in between.
+static void storage_lock_entries(int n, const int *dirs, const char **names, int *entries) {
+  int inums[INODE_LOCK_MAX];
+
+  for (;;) {
+    for (int ii = 0; ii < n; ii++) {
+      inode_read_lock(dirs[ii]);
+      entries[ii] = directory_lookup(dirs[ii], names[ii]);
+      inode_unlock(dirs[ii]);
+
+      inums[2 * ii] = dirs[ii];
+      inums[2 * ii + 1] = entries[ii];
+    }
+
+    inode_lock_all(inums, 2 * n);
 
-  // if the new file path already exists
-  if (to_file_inum != -1) {
-    if (file_inum == to_file_inum) {
-      return 0;
+    int stable = 1;
+    for (int ii = 0; ii < n; ii++) {
+      if (directory_lookup(dirs[ii], names[ii]) != entries[ii]) {
+        stable = 0;
+      }
     }
-    
-    int ret = storage_unlink(to); // unlink the new name from whatever file it referred to
-    assert(ret == 0);
+    if (stable) {
+      return;
+    }
+
+    inode_unlock_all(inums, 2 * n);
   }
+}
 
-  char* from_dir_path = get_dir_path(from);
-  int from_dir_inum = tree_lookup(from_dir_path);
-  assert(from_dir_inum != -1);
+// Unlocks what storage_lock_entries locked.
+static void storage_unlock_entries(int n, const int *dirs, const int *entries) {
+  int inums[INODE_LOCK_MAX];
 
-  char* from_file_name = get_file_name(from);
-  directory_delete(from_dir_inum, from_file_name); // delete the entry for old file path
+  for (int ii = 0; ii < n; ii++) {
+    inums[2 * ii] = dirs[ii];
+    inums[2 * ii + 1] = entries[ii];
+  }
+
+  inode_unlock_all(inums, 2 * n);
+}
+
+// Drops one reference to the given (write-locked) inode, freeing the file
+// once nothing refers to it and nothing has it pinned.
+static void storage_drop(int inum) {
+  inode_t* inode = get_inode(inum);
+  journal_dirty(inode, sizeof(inode_t));
+  inode->refs = inode->refs - 1; // decrement the number of references to the file
+
+  if (inode->refs > 0) {
+    return;
+  }
+
+  // a pinned file lives on until its last pin is dropped
+  pthread_mutex_lock(&pin_lock);
+  pin_inode_t *pin = *pin_find(inum);
+  if (pin != NULL) {
+    pin->orphan = 1;
+  }
+  pthread_mutex_unlock(&pin_lock);
+
+  // if the file has no references, delete the file and set bitmaps to 0 - freed
+  if (pin == NULL) {
+    storage_free(inum);
+  }
+}
+
+// Creates a new file at the given path.
+int storage_mknod(const char *path, int mode) {
+  const char* file_name;
+  int dir_inum = tree_lookup_parent(path, &file_name);
+  if (dir_inum < 0) {
+    return dir_inum;
+  }
+
+  int rv = storage_mknod_at(dir_inum, file_name, mode);
+  return rv < 0 ? rv : 0;
+}
 
-  // make a new directory entry for the new name of the file. It should point to the file the old name pointed to
-  char* to_dir_path = get_dir_path(to);
-  int to_dir_inum = tree_lookup(to_dir_path);
+// Creates a new file with the given name in the given directory.
+int storage_mknod_at(int dir_inum, const char *file_name, int mode) {
+  journal_begin();
+  inode_write_lock(dir_inum);
 
-  // if given an invalid file path then this method does nothing
-  if (to_dir_inum == -1) {
+  //make sure the file does not already exist - if it does then returns -EEXIST to indicate error
+  if (directory_lookup(dir_inum, file_name) != -1) {
+    inode_unlock(dir_inum);
+    journal_end();
+    return -EEXIST;
+  }
+
+  int file_inum = alloc_inode(); // allocate an inode for the file
+  if (file_inum == -1) {
+    inode_unlock(dir_inum);
+    journal_end();
+    return -ENOSPC;
+  }
+
+  // initialize inode fields; nobody else can reach the inode before it is linked
+  inode_t* inode = get_inode(file_inum);
+  journal_dirty(inode, sizeof(inode_t));
+  inode->refs = 1;
+  inode->mode = mode;
+  inode->size = 0;
+  inode->flags = INODE_INLINE; // blocks are allocated once the data outgrows the inode
+
+  // make a new dir entry for the new file in the directory it exists in
+  int rv = directory_put(dir_inum, file_name, file_inum);
+  inode_unlock(dir_inum);
+
+  if (rv < 0) {
+    free_inode(file_inum);
+    file_inum = rv;
+  }
+
+  journal_end();
+  return file_inum;
+}
+
+// Creates a symbolic link to target at the given path.
+int storage_symlink(const char *target, const char *path) {
+  const char* file_name;
+  int dir_inum = tree_lookup_parent(path, &file_name);
+  if (dir_inum < 0) {
+    return dir_inum;
+  }
+
+  int rv = storage_symlink_at(dir_inum, file_name, target);
+  return rv < 0 ? rv : 0;
+}
+
+// Creates a symbolic link to target with the given name in the given
+// directory. A short target is kept in the inode.
+int storage_symlink_at(int dir_inum, const char *file_name, const char *target) {
+  journal_begin(); // the link and its target commit together
+  int file_inum = storage_mknod_at(dir_inum, file_name, S_IFLNK | 0777);
+  if (file_inum < 0) {
+    journal_end();
+    return file_inum;
+  }
+
+  // a link without its target is taken back out
+  int rv = storage_write_ino(file_inum, target, strlen(target), 0, NULL);
+  if (rv < 0) {
+    storage_unlink_at(dir_inum, file_name);
+    file_inum = rv;
+  }
+  journal_end();
+
+  return file_inum;
+}
+
+// Reads the target of the symbolic link with the given inum.
+int storage_readlink(int file_inum, char *buf, size_t size) {
+  if (!S_ISLNK(get_inode(file_inum)->mode) || size == 0) {
     return -1;
   }
 
-  char* to_file_name = get_file_name(to);
-  directory_put(to_dir_inum, to_file_name, file_inum);
+  int len = storage_read_ino(file_inum, buf, size - 1, 0, NULL);
+  buf[len] = '\0';
   return 0;
 }
 
-// Retrieve the file path of the directroy the given file exists in (whole path but file name).
-char* get_dir_path(const char* file_path) {
+// Unlinks the given path name from the file.
+int storage_unlink(const char *path) {
+  // gets the path to the parent and the file name of the path entered
+  const char* file_name;
+  int dir_inum = tree_lookup_parent(path, &file_name);
+  if (dir_inum < 0) {
+    return dir_inum;
+  }
 
-  slist_t* path_split = s_explode(file_path, '/'); // split the path around /
-  path_split = path_split->next;                   // go to the first string
-  assert(path_split != NULL);
+  return storage_unlink_at(dir_inum, file_name);
+}
 
-  char* build_path = (char*) malloc(sizeof(char) * 50);
-  strcpy(build_path, "/"); // rebuild the path to include all but the last string (file name)
+// Removes the name in the given directory, which names a directory when
+// is_dir is set and anything else when it is not.
+static int storage_remove_at(int dir_inum, const char *file_name, int is_dir) {
+  int file_inum;
+  journal_begin();
+  storage_lock_entries(1, &dir_inum, &file_name, &file_inum);
 
-  // rebuilds file path up to parent directory of path
-  while (path_split->next != NULL) {
-    char* added_slash = strcat(path_split->data, "/");
-    build_path = strcat(build_path, added_slash);
-    path_split = path_split->next;
-    free(added_slash);
+  int rv = 0;
+  if (file_inum == -1) {
+    rv = -ENOENT; // the file does not exist
+  } else if (S_ISDIR(get_inode(file_inum)->mode) != is_dir) {
+    rv = is_dir ? -ENOTDIR : -EISDIR;
+  } else if (is_dir && !directory_empty(file_inum)) {
+    rv = -ENOTEMPTY;
+  } else {
+    // go to the directory the file exists in and delete the entry for the file
+    directory_delete(dir_inum, file_name);
+    storage_drop(file_inum);
   }
 
-  return build_path;
+  storage_unlock_entries(1, &dir_inum, &file_inum);
+  journal_end();
+  return rv;
 }
 
-//Given compelete file path, return the name of the file (last string).
-char* get_file_name(const char* file_path) {
+// Unlinks the given name in the given directory from its file.
+int storage_unlink_at(int dir_inum, const char *file_name) {
+  return storage_remove_at(dir_inum, file_name, 0);
+}
 
-  slist_t* path_split = s_explode(file_path, '/'); // split the path around / char
-  path_split = path_split->next;                   // go to first string
+// Removes the empty directory at the given path.
+int storage_rmdir(const char *path) {
+  const char* dir_name;
+  int dir_inum = tree_lookup_parent(path, &dir_name);
+  if (dir_inum < 0) {
+    return dir_inum;
+  }
 
-  while (path_split->next != NULL) { // get to the last string in path_split
-    path_split = path_split->next;
+  return storage_rmdir_at(dir_inum, dir_name);
+}
+
+// Removes the empty directory with the given name in the given directory.
+int storage_rmdir_at(int dir_inum, const char *dir_name) {
+  return storage_remove_at(dir_inum, dir_name, 1);
+}
+
+// Creates an alias for the from file.
+int storage_link(const char *from, const char *to) {
+  int file_inum = tree_lookup(from);
+
+  if (file_inum == -1) return -ENOENT; // check to make sure the file we are making an alias for exists
+
+  // reconstructs the parent path of to and get the file name
+  const char* file_name;
+  int dir_inum = tree_lookup_parent(to, &file_name);
+  if (dir_inum < 0) return dir_inum; // the given file path does not exist then method does nothing
+
+  return storage_link_at(file_inum, dir_inum, file_name);
+}
+
+// Creates an entry with the given name in the given directory for the
+// file with the given inum.
+int storage_link_at(int file_inum, int dir_inum, const char *file_name) {
+  int inums[2] = {dir_inum, file_inum};
+  journal_begin();
+  inode_lock_all(inums, 2);
+
+  // check to make sure the new file name does not already exist, and that
+  // the file was not unlinked since we looked it up
+  inode_t* file_inode = get_inode(file_inum);
+  int rv = -ENOENT;
+  if (directory_lookup(dir_inum, file_name) != -1) {
+    rv = -EEXIST;
+  } else if (file_inode->refs > 0) {
+    // make a new entry for the alias in the directory specified
+    rv = directory_put(dir_inum, file_name, file_inum);
+    if (rv == 0) {
+      journal_dirty(file_inode, sizeof(inode_t));
+      file_inode->refs = file_inode->refs + 1; // increment references for from inode
+    }
+  }
+
+  inode_unlock_all(inums, 2);
+  journal_end();
+  return rv; // return 0 on success
+}
+
+// Moves the file from the from path to the to path.
+int storage_rename(const char *from, const char *to) {
+  const char* from_name;
+  const char* to_name;
+
+  // if either parent directory does not exist then this method does nothing
+  int from_dir = tree_lookup_parent(from, &from_name);
+  int to_dir = tree_lookup_parent(to, &to_name);
+  if (from_dir < 0 || to_dir < 0) {
+    return from_dir < 0 ? from_dir : to_dir;
+  }
+
+  return storage_rename_at(from_dir, from_name, to_dir, to_name);
+}
+
+// Moves the entry with the given name from one directory to another.
+int storage_rename_at(int from_dir, const char *from_name, int to_dir, const char *to_name) {
+  int dirs[2] = {from_dir, to_dir};
+  const char* names[2] = {from_name, to_name};
+  int entries[2];
+
+  if (strlen(to_name) > DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  journal_begin();
+  pthread_mutex_lock(&rename_lock);
+
+  storage_lock_entries(2, dirs, names, entries);
+  int file_inum = entries[0];
+  int to_file_inum = entries[1];
+  int rv = 0;
+
+  // a name may only be replaced by the same kind of file, and a directory
+  // only while it is empty
+  int is_dir = file_inum != -1 && S_ISDIR(get_inode(file_inum)->mode);
+  int replaces = to_file_inum != -1 && to_file_inum != file_inum;
+  if (file_inum == -1) {
+    rv = -ENOENT; // the file we are renaming does not exist
+  } else if (replaces && S_ISDIR(get_inode(to_file_inum)->mode) != is_dir) {
+    rv = is_dir ? -ENOTDIR : -EISDIR;
+  } else if (replaces && is_dir && !directory_empty(to_file_inum)) {
+    rv = -ENOTEMPTY;
+  } else if (file_inum != to_file_inum) {
+    // the new name is made before anything is dropped, so a failed put
+    // leaves both names as they were. A replaced name gives up its entry
+    // first, and the same name always fits back in the space it left.
+    if (to_file_inum != -1) {
+      directory_delete(dirs[1], names[1]);
+    }
+    rv = directory_put(dirs[1], names[1], file_inum);
+
+    if (rv < 0) {
+      if (to_file_inum != -1) {
+        directory_put(dirs[1], names[1], to_file_inum);
+      }
+    } else {
+      // the new name took, so whatever it referred to loses a reference
+      if (to_file_inum != -1) {
+        storage_drop(to_file_inum);
+      }
+      directory_delete(dirs[0], names[0]); // delete the entry for old file path
+
+      // a directory moved to a new parent points its .. entry there
+      if (dirs[0] != dirs[1] && is_dir) {
+        directory_delete(file_inum, "..");
+        directory_put(file_inum, "..", dirs[1]);
+      }
+    }
   }
 
-  return path_split->data;
+  storage_unlock_entries(2, dirs, entries);
+  pthread_mutex_unlock(&rename_lock);
+  journal_end();
+  return rv;
 }
@@ -14,7 +14,41 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "slist.h"
+#include "inode.h"
+
+// struct representing an open file, kept in the FUSE file handle
+typedef struct storage_file {
+  int inum;               // the inum of the open file
+  extent_cursor_t cursor; // the extent the last read or write went through
+} storage_file_t;
+
+// how much of a change is on disk when the operation making it returns
+typedef enum storage_durability {
+  DURABILITY_NONE,     // only the periodic journal commits; fsync does nothing
+  DURABILITY_FSYNC,    // fsync flushes the file's data and commits the journal
+  DURABILITY_EVERY_OP, // every operation is flushed before it returns
+} storage_durability_t;
+
+// what of the image is faulted in at mount
+typedef enum storage_prefault {
+  PREFAULT_NONE,     // nothing; every page faults on first use
+  PREFAULT_METADATA, // the superblock, the block bitmaps and the inode table
+  PREFAULT_ALL,      // the whole image
+} storage_prefault_t;
+
+// struct describing where some bytes of a file are, for storage_read_send
+typedef struct storage_segment {
+  const char *mem; // the bytes in memory, or NULL if they are read from the image file
+  int fd;          // the image file, when mem is NULL
+  off_t pos;       // the offset of the bytes in the image file, when mem is NULL
+  size_t len;      // the number of bytes
+} storage_segment_t;
+
+// sends the segments of a read on, returning what storage_read_send returns
+typedef int (*storage_send_t)(void *arg, const storage_segment_t *segs, int count);
+
+// copies the next len bytes of a write's data to dst, returning 0 or -1
+typedef int (*storage_fill_t)(void *arg, char *dst, size_t len);
 
 /**
  * Initialzes a new file system at the given image file path.
@@ -24,7 +58,8 @@
  * @param The absolute path of the image file where we mount the
  * 	  file system.
  *
- * @return 0 on successful file system initialization.
+ * @return 0 on successful file system initialization, -1 if the image
+ *         could not be opened as asked (see blocks_set_cache).
  */
 int storage_init(const char *path);
 
@@ -39,6 +74,17 @@ int storage_init(const char *path);
  */
 int storage_stat(const char *path, struct stat *st);
 
+/**
+ * Fills in the stat struct for the file with the given inum, without
+ * resolving a path.
+ *
+ * @param file_inum The inum of the file.
+ * @param st The stat struct to be filled.
+ *
+ * @return 0 on success.
+ */
+int storage_stat_inum(int file_inum, struct stat *st);
+
 /**
  * Reads data from the file at the given path.
  *
@@ -51,6 +97,39 @@ int storage_stat(const char *path, struct stat *st);
  */
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 
+/**
+ * Reads data from the file with the given inum.
+ *
+ * @param file_inum The inum of the file we are reading data from.
+ * @param buf Read the data from the file to the buffer.
+ * @param size The number of bytes we read from the file.
+ * @param offset The offset we start reading from the file at.
+ * @param cursor The extent cursor of an open handle, or NULL.
+ *
+ * @return The number of bytes read from the file.
+ */
+int storage_read_ino(int file_inum, char *buf, size_t size, off_t offset, extent_cursor_t *cursor);
+
+/**
+ * Reads data from the file with the given inum without copying it. The
+ * bytes are described as segments, in order: runs of blocks as ranges of
+ * the image file, which can be spliced from it, and holes, inline data,
+ * buffered appends and blocks the journal holds privately as memory. The
+ * segments are only valid during the call to send, which is made with
+ * the file locked, and must be used up before it returns.
+ *
+ * @param file_inum The inum of the file we are reading data from.
+ * @param size The number of bytes we read from the file.
+ * @param offset The offset we start reading from the file at.
+ * @param cursor The extent cursor of an open handle, or NULL.
+ * @param send Called once with the segments, none at the end of the file.
+ * @param arg Passed to send.
+ *
+ * @return What send returned.
+ */
+int storage_read_send(int file_inum, size_t size, off_t offset, extent_cursor_t *cursor,
+                      storage_send_t send, void *arg);
+
 /**
  * Writess data to the file at the given path.
  *
@@ -59,66 +138,354 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset);
  * @param size The number of bytes we write to the file at the given path.
  * @param offset The offset we start writing to the file at.
  *
- * @return The number of bytes written to the file, -1 if the file does not exist.
+ * @return The number of bytes written to the file, or a negative errno as
+ *         storage_write_ino returns, -ENOENT if the file does not exist.
  */
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 
+/**
+ * Writes data to the file with the given inum. Small appends gather in
+ * the file's write buffer (see wbuf.h) and get blocks, one contiguous run
+ * for the lot, when the buffer fills, the file is synced or written
+ * elsewhere, or the buffer is needed for another file. Until then they
+ * are only in memory. With DURABILITY_EVERY_OP nothing is buffered.
+ *
+ * @param file_inum The inum of the file we are writing data to.
+ * @param buf Write the data to the file from the buffer.
+ * @param size The number of bytes we write to the file.
+ * @param offset The offset we start writing to the file at.
+ * @param cursor The extent cursor of an open handle, or NULL.
+ *
+ * @return The number of bytes written to the file, -ENOSPC if we ran out
+ *         of space, or -EFBIG if the write goes past the largest file or
+ *         the file is split into more extents than it can map.
+ */
+int storage_write_ino(int file_inum, const char *buf, size_t size, off_t offset,
+                      extent_cursor_t *cursor);
+
+/**
+ * Writes data to the file with the given inum like storage_write_ino,
+ * with fill copying the data straight into the file's blocks or write
+ * buffer, a piece at a time, so it need not be gathered in memory first.
+ *
+ * @param file_inum The inum of the file we are writing data to.
+ * @param fill Copies the next bytes of the data, in order.
+ * @param arg Passed to fill.
+ * @param size The number of bytes we write to the file.
+ * @param offset The offset we start writing to the file at.
+ * @param cursor The extent cursor of an open handle, or NULL.
+ *
+ * @return The number of bytes written to the file, an error as
+ *         storage_write_ino returns, or -EIO if fill failed.
+ */
+int storage_write_fill(int file_inum, storage_fill_t fill, void *arg, size_t size, off_t offset,
+                       extent_cursor_t *cursor);
+
+/**
+ * Sets the size of the file with the given inum. Shrinking frees the
+ * blocks past the new end; growing allocates nothing, the new bytes
+ * reading as zeros until written, so a file of any size costs no space.
+ *
+ * @param file_inum The inum of the file.
+ * @param size The new size of the file in bytes.
+ *
+ * @return 0 on success, -EFBIG if size is past the largest file, or
+ * -ENOSPC if we ran out of space.
+ */
+int storage_truncate(int file_inum, off_t size);
+
+/**
+ * Finds the next data or hole in a file, as lseek does for SEEK_DATA and
+ * SEEK_HOLE. Holes are tracked in whole blocks, and the end of the file
+ * counts as a hole.
+ *
+ * @param file_inum The inum of the file.
+ * @param offset The offset to search from.
+ * @param whence SEEK_DATA or SEEK_HOLE.
+ *
+ * @return The offset of the data or hole, -1 if offset is at or past the
+ * end of the file or no data follows it.
+ */
+off_t storage_lseek(int file_inum, off_t offset, int whence);
+
+/**
+ * Selects how much of a change is on disk when the operation making it
+ * returns. Every operation commits the journal only if the journal is run
+ * with an interval of 0.
+ *
+ * @param durability The durability mode.
+ */
+void storage_set_durability(storage_durability_t durability);
+
+/**
+ * Sets how far ahead of sequential reads through a handle the file's
+ * blocks are read in, in the background; see blocks_prefetch. Reads that
+ * do not continue the last one through the handle read nothing ahead.
+ *
+ * @param bytes The bytes read ahead, 0 to leave readahead to the kernel.
+ */
+void storage_set_readahead(int64_t bytes);
+
+/**
+ * Faults part of the image into memory, so that the first access to it
+ * takes no page fault. Called once the file system is up, as the page
+ * tables do not survive the fork of a daemon.
+ *
+ * @param what The part of the image to fault in.
+ */
+void storage_prefault(storage_prefault_t what);
+
+/**
+ * Flushes the data written to the file to disk and commits the journal,
+ * unless the durability mode is DURABILITY_NONE. Appends still in the
+ * file's write buffer get their blocks first, in every mode, then only
+ * the blocks written since the file was last flushed go out.
+ *
+ * @param file_inum The inum of the file or directory.
+ *
+ * @return 0 on success, -ENOSPC or -EFBIG if the buffered appends got no
+ *         blocks, -EIO if the data could not be written.
+ */
+int storage_fsync(int file_inum);
+
+/**
+ * Called as a handle on the file is closed. Appends whose buffer could
+ * not be flushed earlier, when another file needed the buffer, are kept
+ * in it; their flush is tried again here, so that a failure is reported
+ * to the application before the data is dropped at unmount.
+ *
+ * @param file_inum The inum of the file.
+ *
+ * @return 0 on success, -ENOSPC or -EFBIG if the appends still got no
+ *         blocks.
+ */
+int storage_flush(int file_inum);
+
+/**
+ * Gives every buffered append its blocks and frees the write buffers,
+ * before the file system is unmounted. Nothing may be writing.
+ */
+void storage_flush_buffers();
+
+/**
+ * Pins the inode, keeping the file alive if it is unlinked until the
+ * pins are dropped. Open handles and kernel lookups each hold pins.
+ *
+ * @param inum The inum of the file.
+ * @param count The number of pins to add.
+ */
+void storage_pin(int inum, int64_t count);
+
+/**
+ * Drops pins added by storage_pin. An unlinked file is freed when its
+ * last pin is dropped.
+ *
+ * @param inum The inum of the file.
+ * @param count The number of pins to drop.
+ */
+void storage_unpin(int inum, int64_t count);
+
+/**
+ * Looks up a name in a directory and pins the inode it refers to.
+ *
+ * @param dir_inum The inum of the directory.
+ * @param name The name of the entry.
+ *
+ * @return The pinned inum, -1 if the name does not exist.
+ */
+int storage_lookup(int dir_inum, const char *name);
+
+/**
+ * Opens a handle on the file at the given path. The handle carries the
+ * file's inum, so reads and writes through it do no path lookups, and
+ * keeps the file alive if it is unlinked while open.
+ *
+ * @param path The absolute path of the file.
+ *
+ * @return The new handle, NULL if the file does not exist.
+ */
+storage_file_t *storage_open(const char *path);
+
+/**
+ * Opens a handle on the file with the given inum.
+ *
+ * @param file_inum The inum of the file.
+ *
+ * @return The new handle.
+ */
+storage_file_t *storage_open_ino(int file_inum);
+
+/**
+ * Closes a handle opened with storage_open. An unlinked file is freed
+ * when its last handle is closed.
+ *
+ * @param file The handle to close.
+ */
+void storage_release(storage_file_t *file);
+
+/**
+ * Changes the permissions of the file with the given inum.
+ *
+ * @param file_inum The inum of the file.
+ * @param mode The new mode; the file type bits are ignored.
+ *
+ * @return 0 on success.
+ */
+int storage_chmod(int file_inum, mode_t mode);
+
 /**
  * Creates a new file at the given path with the given mode.
  *
  * @param path The absolute path where we create the new file.
  * @param mode The mode of the new file.
  *
- * @return 0 on success, -1 if the file already exists.
+ * @return 0 on success, or an error as from storage_mknod_at, -ENOENT if
+ * the parent directory does not exist, or -ENAMETOOLONG if the name is
+ * too long.
  */
 int storage_mknod(const char *path, int mode);
 
+/**
+ * Creates a new file with the given name in the given directory.
+ *
+ * @param dir_inum The inum of the directory.
+ * @param file_name The name of the new file.
+ * @param mode The mode of the new file.
+ *
+ * @return The inum of the new file, -EEXIST if the name already exists,
+ *         -ENOSPC if there is no inode or room for it, or -ENAMETOOLONG if
+ *         the name is too long.
+ */
+int storage_mknod_at(int dir_inum, const char *file_name, int mode);
+
+/**
+ * Creates a symbolic link at the given path pointing at target.
+ *
+ * @param target The path the link points at, which need not exist.
+ * @param path The absolute path of the new link.
+ *
+ * @return 0 on success, -ENOENT if the parent directory does not exist,
+ *         or an error as from storage_symlink_at.
+ */
+int storage_symlink(const char *target, const char *path);
+
+/**
+ * Creates a symbolic link with the given name in the given directory.
+ *
+ * @param dir_inum The inum of the directory.
+ * @param file_name The name of the new link.
+ * @param target The path the link points at.
+ *
+ * @return The inum of the new link, an error as from storage_mknod_at, or
+ *         -ENOSPC if there was no room for the target.
+ */
+int storage_symlink_at(int dir_inum, const char *file_name, const char *target);
+
+/**
+ * Reads the target of a symbolic link, truncating it to fit the buffer.
+ *
+ * @param file_inum The inum of the link.
+ * @param buf The buffer the target is copied into, NUL-terminated.
+ * @param size The size of the buffer.
+ *
+ * @return 0 on success, -1 if the file is not a symbolic link.
+ */
+int storage_readlink(int file_inum, char *buf, size_t size);
+
 /**
  * Unlinks the file name at the given path from the file.
  * If the file has 0 references after unlinking the given file name,
  * the file is deleted.
  *
  * @param path The name of the file we are unlinking from its file.
- * @return 0 on success, -1 if the file does not exist.
+ * @return 0 on success, -ENOENT if the file does not exist, -EISDIR if
+ * it is a directory, or -ENAMETOOLONG if its name is too long.
  */
 int storage_unlink(const char *path);
 
+/**
+ * Unlinks the given name in the given directory from its file.
+ *
+ * @param dir_inum The inum of the directory.
+ * @param file_name The name to unlink.
+ *
+ * @return 0 on success, -ENOENT if the name does not exist, or -EISDIR if
+ *         it names a directory.
+ */
+int storage_unlink_at(int dir_inum, const char *file_name);
+
+/**
+ * Removes the directory at the given path, which must be empty.
+ *
+ * @param path The absolute path of the directory.
+ *
+ * @return 0 on success, -ENOENT if it does not exist, -ENOTDIR if it is not
+ * a directory, -ENOTEMPTY if it still has entries, or -ENAMETOOLONG if its
+ * name is too long.
+ */
+int storage_rmdir(const char *path);
+
+/**
+ * Removes the directory with the given name in the given directory, which
+ * must be empty.
+ *
+ * @param dir_inum The inum of the directory it is in.
+ * @param dir_name The name of the directory to remove.
+ *
+ * @return 0 on success, -ENOENT if the name does not exist, -ENOTDIR if it
+ *         does not name a directory, or -ENOTEMPTY if it still has entries.
+ */
+int storage_rmdir_at(int dir_inum, const char *dir_name);
+
 /**
  * Create an alias for the file at from.
  *
  * @param from The file we are making an alias for.
  * @param to The new alias for the file at from.
  *
- * @return 0 on success, -1 if the file at from does not exist.
+ * @return 0 on success, -ENOENT if the file at from or the directory of
+ * to does not exist, or an error as from storage_link_at.
  */
 int storage_link(const char *from, const char *to);
 
 /**
- * Move the file at from to the path at to.
+ * Create an alias for the file with the given inum.
  *
- * @param from The original absolute path of the file.
- * @param to The new absolute path of the file.
+ * @param file_inum The file we are making an alias for.
+ * @param dir_inum The directory the alias goes in.
+ * @param file_name The name of the alias.
  *
- * @return 0 on success, -1 if the file at from does not exist.
+ * @return 0 on success, -EEXIST if the name already exists, -ENOENT if the
+ *         file was unlinked, -ENAMETOOLONG if the name is too long, or
+ *         -ENOSPC if the entry did not fit.
  */
-int storage_rename(const char *from, const char *to);
+int storage_link_at(int file_inum, int dir_inum, const char *file_name);
 
 /**
- * Get the path of the directory the file at the given path exists in.
+ * Move the file at from to the path at to.
  *
- * @param file_path The absolute path of the file.
- * 
- * @return The absolute path of the directory the file is in.
+ * @param from The original absolute path of the file.
+ * @param to The new absolute path of the file.
+ *
+ * @return 0 on success, -ENOENT if the file at from does not exist, or an
+ * error as from storage_rename_at.
  */
-char* get_dir_path(const char* file_path);
+int storage_rename(const char *from, const char *to);
 
 /**
- * Get the name of the file from the given file_path.
+ * Move the entry with the given name from one directory to another.
  *
- * @param file_path The absolute path of the file.
+ * @param from_dir The inum of the directory the entry is in.
+ * @param from_name The name of the entry.
+ * @param to_dir The inum of the directory the entry moves to.
+ * @param to_name The new name of the entry.
  *
- * @return The name of the file.
+ * @return 0 on success, -ENOENT if the entry does not exist, -EISDIR or
+ *         -ENOTDIR if only one of the entry and the name it replaces is a
+ *         directory, -ENOTEMPTY if it would replace a directory that is not
+ *         empty, -ENAMETOOLONG if to_name is too long, or -ENOSPC if the
+ *         new entry did not fit. A failed rename changes nothing.
  */
-char* get_file_name(const char* file_path);
+int storage_rename_at(int from_dir, const char *from_name, int to_dir, const char *to_name);
 
 #endif
@@ -0,0 +1,323 @@
+/**
+ * @file summary.c
+ *
+ * Implementation of the free-space summary over a grouped bitmap.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "summary.h"
+#include "bitmap.h"
+
+#define GROUP_BITS (4096 * 8)         // = BLOCKS_PER_GROUP
+#define GROUP_WORDS (GROUP_BITS / 64) // the 64-bit words in a group's bitmap
+#define MIN_LEVEL 6                   // a level 6 chunk is one whole word
+#define MAX_LEVEL 15                  // a level 15 chunk is the whole group
+
+// Get bit i of the given words.
+static inline int get_bit(const uint64_t *words, int64_t i) {
+  return (words[i / 64] >> (i % 64)) & 1;
+}
+
+// Set bit i of the given words to v.
+static inline void put_bit(uint64_t *words, int64_t i, int v) {
+  if (v) {
+    words[i / 64] |= 1ULL << (i % 64);
+  } else {
+    words[i / 64] &= ~(1ULL << (i % 64));
+  }
+}
+
+// Returns the first set bit in [start, end) of the given words, -1 if none.
+static int64_t next_set(const uint64_t *words, int64_t start, int64_t end) {
+  if (start >= end) {
+    return -1;
+  }
+
+  int64_t w = start / 64;
+  uint64_t word = words[w] & (~0ULL << (start % 64));
+
+  while (word == 0) {
+    if (++w * 64 >= end) {
+      return -1;
+    }
+    word = words[w];
+  }
+
+  int64_t i = w * 64 + __builtin_ctzll(word);
+  return i < end ? i : -1;
+}
+
+// Returns where the bits of the given level start within chunk_free.
+// Level 6 has 512 bits, level 7 has 256, ... and level 15 has one.
+static int level_offset(int level) {
+  return 1024 - (1024 >> (level - MIN_LEVEL));
+}
+
+// Returns the number of bits of group g that are inside the bitmap.
+static int group_size(summary_t *sum, int g) {
+  int64_t left = sum->bits - (int64_t) g * GROUP_BITS;
+  return left < GROUP_BITS ? left : GROUP_BITS;
+}
+
+// Returns word w of the group's bitmap, treating bits past the end of the
+// bitmap as in use.
+static uint64_t load_word(summary_t *sum, int g, const uint64_t *bm, int w) {
+  int valid = group_size(sum, g) - w * 64;
+
+  if (valid <= 0) {
+    return ~0ULL;
+  }
+  if (valid < 64) {
+    return bm[w] | (~0ULL << valid);
+  }
+  return bm[w];
+}
+
+// Recomputes the word and chunk summaries of words [w0, w1] of group g.
+static void refresh_words(summary_t *sum, int g, int w0, int w1) {
+  const uint64_t *bm = (const uint64_t *) sum->bitmap(g);
+  group_summary_t *gs = &sum->group[g];
+
+  for (int w = w0; w <= w1; w++) {
+    uint64_t word = load_word(sum, g, bm, w);
+    put_bit(gs->word_free, w, word != ~0ULL);
+    put_bit(gs->chunk_free, level_offset(MIN_LEVEL) + w, word == 0);
+  }
+
+  // a chunk is free when both of its halves are
+  for (int level = MIN_LEVEL + 1; level <= MAX_LEVEL; level++) {
+    int off = level_offset(level);
+    int child = level_offset(level - 1);
+    w0 /= 2;
+    w1 /= 2;
+
+    for (int j = w0; j <= w1; j++) {
+      int both = get_bit(gs->chunk_free, child + 2 * j) &&
+                 get_bit(gs->chunk_free, child + 2 * j + 1);
+      put_bit(gs->chunk_free, off + j, both);
+    }
+  }
+}
+
+// Summarizes group g from scratch.
+static void rebuild_group(summary_t *sum, int g) {
+  const uint64_t *bm = (const uint64_t *) sum->bitmap(g);
+  int free = 0;
+
+  memset(&sum->group[g], 0, sizeof(group_summary_t));
+  refresh_words(sum, g, 0, GROUP_WORDS - 1);
+
+  for (int w = 0; w < GROUP_WORDS; w++) {
+    free += __builtin_popcountll(~load_word(sum, g, bm, w));
+  }
+
+  sum->free[g] = free;
+  sum->no_run[g] = 0;
+  put_bit(sum->has_free, g, free > 0);
+}
+
+// Initialize an empty summary.
+void summary_init(summary_t *sum, void *(*bitmap)(int group)) {
+  memset(sum, 0, sizeof(summary_t));
+  sum->bitmap = bitmap;
+}
+
+// Release the memory held by the summary.
+void summary_free(summary_t *sum) {
+  free(sum->free);
+  free(sum->no_run);
+  free(sum->has_free);
+  free(sum->group);
+  summary_init(sum, sum->bitmap);
+}
+
+// Track the given number of bits.
+void summary_resize(summary_t *sum, int64_t bits) {
+  int groups = (bits + GROUP_BITS - 1) / GROUP_BITS;
+  assert(bits >= sum->bits);
+
+  if (groups > sum->capacity) {
+    int capacity = sum->capacity * 2 > groups ? sum->capacity * 2 : groups;
+    int old_words = (sum->capacity + 63) / 64;
+    int new_words = (capacity + 63) / 64;
+
+    sum->free = realloc(sum->free, sizeof(int) * capacity);
+    sum->no_run = realloc(sum->no_run, sizeof(int) * capacity);
+    sum->group = realloc(sum->group, sizeof(group_summary_t) * capacity);
+    sum->has_free = realloc(sum->has_free, sizeof(uint64_t) * new_words);
+    assert(sum->free && sum->no_run && sum->group && sum->has_free);
+    memset(sum->has_free + old_words, 0, sizeof(uint64_t) * (new_words - old_words));
+    sum->capacity = capacity;
+  }
+
+  // the old last group may have been partial, so summarize it again
+  int first = sum->groups > 0 ? sum->groups - 1 : 0;
+  sum->bits = bits;
+  sum->groups = groups;
+
+  for (int g = first; g < groups; g++) {
+    rebuild_group(sum, g);
+  }
+}
+
+// Refresh the summary after bits [i, i + n) were set to v.
+void summary_update(summary_t *sum, int64_t i, int64_t n, int v) {
+  while (n > 0) {
+    int g = i / GROUP_BITS;
+    int bit = i % GROUP_BITS;
+    int len = GROUP_BITS - bit < n ? GROUP_BITS - bit : n;
+
+    refresh_words(sum, g, bit / 64, (bit + len - 1) / 64);
+    sum->free[g] += v ? -len : len;
+    put_bit(sum->has_free, g, sum->free[g] > 0);
+
+    // freed bits may join up into longer runs
+    if (!v) {
+      sum->no_run[g] = 0;
+    }
+
+    i += len;
+    n -= len;
+  }
+}
+
+// Returns the first free bit of group g at or after from, -1 if none.
+static int group_find_free(summary_t *sum, int g, int from) {
+  const uint64_t *bm = (const uint64_t *) sum->bitmap(g);
+  int w = from / 64;
+
+  if (from < group_size(sum, g)) {
+    uint64_t word = ~load_word(sum, g, bm, w) & (~0ULL << (from % 64));
+    if (word != 0) {
+      return w * 64 + __builtin_ctzll(word);
+    }
+  }
+
+  // jump straight to the next word with a free bit
+  int64_t next = next_set(sum->group[g].word_free, w + 1, GROUP_WORDS);
+  if (next == -1) {
+    return -1;
+  }
+
+  return next * 64 + __builtin_ctzll(~load_word(sum, g, bm, next));
+}
+
+// Returns the start of a run of n free bits in group g at or after from,
+// -1 if none.
+static int group_find_run(summary_t *sum, int g, int from, int n) {
+  group_summary_t *gs = &sum->group[g];
+
+  // an earlier search already found the group too fragmented
+  if (sum->no_run[g] != 0 && n >= sum->no_run[g]) {
+    return -1;
+  }
+
+  int level = MIN_LEVEL;
+  while ((1 << level) < n) {
+    level++;
+  }
+
+  // the first aligned chunk big enough for the run
+  int off = level_offset(level);
+  int first = (from + (1 << level) - 1) >> level;
+  int64_t j = next_set(gs->chunk_free, off + first, off + (GROUP_BITS >> level));
+  if (j != -1) {
+    return (j - off) << level;
+  }
+
+  // the free space is too fragmented for aligned chunks, so scan
+  int found = -1;
+  int size = group_size(sum, g);
+
+  if (n < 2 * (1 << MIN_LEVEL) - 1) {
+    found = bitmap_find_run(sum->bitmap(g), from, size, n);
+  } else {
+    // a run of n >= 2^(L+1) - 1 bits always covers a free aligned chunk
+    // of 2^L bits, so only look around those
+    level = MIN_LEVEL;
+    while (2 * (1 << (level + 1)) - 1 <= n) {
+      level++;
+    }
+    off = level_offset(level);
+
+    for (j = next_set(gs->chunk_free, off, off + (GROUP_BITS >> level)); j != -1;
+         j = next_set(gs->chunk_free, j + 1, off + (GROUP_BITS >> level))) {
+      int lo = ((j - off) << level) - n + 1;
+      int hi = ((j - off + 1) << level) + n - 1;
+      found = bitmap_find_run(sum->bitmap(g), lo > from ? lo : from, hi < size ? hi : size, n);
+      if (found != -1) {
+        break;
+      }
+    }
+  }
+
+  // remember that nothing this long fits anywhere in the group
+  if (found == -1 && from == 0 && (sum->no_run[g] == 0 || n < sum->no_run[g])) {
+    sum->no_run[g] = n;
+  }
+
+  return found;
+}
+
+// Find a run of n free bits, starting the search at start.
+int64_t summary_find(summary_t *sum, int64_t start, int n) {
+  if (sum->groups == 0) {
+    return -1;
+  }
+  if (start < 0 || start >= sum->bits) {
+    start = 0;
+  }
+
+  int first = start / GROUP_BITS;
+  int bit = start % GROUP_BITS;
+
+  // a run right at the cursor keeps appends to a file contiguous
+  if (n > 1 && sum->free[first] >= n && bit + n <= group_size(sum, first) &&
+      bitmap_find_run(sum->bitmap(first), bit, bit + n, n) == bit) {
+    return start;
+  }
+
+  int g = first;
+  int from = bit;
+  int wrapped = 0;
+
+  for (;;) {
+    sum->scanned++;
+    if (sum->free[g] >= n) {
+      int found = n == 1 ? group_find_free(sum, g, from) : group_find_run(sum, g, from, n);
+      if (found != -1) {
+        return (int64_t) g * GROUP_BITS + found;
+      }
+    }
+
+    // move on to the next group with free bits, wrapping around once to
+    // search the first group again from its start
+    int64_t next = next_set(sum->has_free, g + 1, wrapped ? first + 1 : sum->groups);
+    if (next == -1) {
+      if (wrapped) {
+        return -1;
+      }
+      wrapped = 1;
+      next = next_set(sum->has_free, 0, first + 1);
+      if (next == -1) {
+        return -1;
+      }
+    }
+
+    g = next;
+    from = 0;
+  }
+}
+
+// Get the total number of free bits.
+int64_t summary_free_count(summary_t *sum) {
+  int64_t free = 0;
+
+  for (int g = 0; g < sum->groups; g++) {
+    free += sum->free[g];
+  }
+
+  return free;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file summary.h
+ *
+ * An in-memory summary layered over a bitmap that is split into groups
+ * of BLOCKS_PER_GROUP bits (the block bitmap and the inode bitmap).
+ *
+ * Three levels let a search skip straight to free space:
+ *  - per image: which groups have a free bit, and how many each has,
+ *  - per group: which 64-bit words of the group's bitmap have a free bit,
+ *  - per group: which aligned chunks of 2^6 .. 2^15 bits are entirely free.
+ *
+ * The summary is rebuilt from the on-disk bitmaps when it is loaded and
+ * kept up to date by calling summary_update after every bitmap change.
+ */
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include <stdint.h>
+
+// struct summarizing one group of the bitmap (three cache lines)
+typedef struct group_summary {
+  uint64_t word_free[8];   // bit w set when word w of the bitmap has a free bit
+  uint64_t chunk_free[16]; // for each level k in 6..15, which aligned runs of 2^k bits are free
+} group_summary_t;
+
+// struct summarizing a whole grouped bitmap
+typedef struct summary {
+  void *(*bitmap)(int group); // returns the on-disk bitmap of a group
+  int64_t bits;               // the number of bits tracked
+  int groups;                 // the number of groups tracked
+  int capacity;               // the number of groups there is room for
+  int *free;                  // the number of free bits in each group
+  int *no_run;                // the shortest run known not to fit in each group, 0 if unknown
+  uint64_t *has_free;         // bit g set when group g has a free bit
+  group_summary_t *group;     // the word and chunk summaries of each group
+  int64_t scanned;            // the groups summary_find has searched, in total
+} summary_t;
+
+/**
+ * Initialize an empty summary over the given bitmap.
+ *
+ * @param sum The summary to initialize.
+ * @param bitmap Function returning a pointer to the bitmap of a group.
+ */
+void summary_init(summary_t *sum, void *(*bitmap)(int group));
+
+/**
+ * Release the memory held by a summary.
+ *
+ * @param sum The summary to free.
+ */
+void summary_free(summary_t *sum);
+
+/**
+ * Track the given number of bits, summarizing any group that is new or
+ * changed size from the on-disk bitmap.
+ *
+ * @param sum The summary.
+ * @param bits The number of bits in the bitmap.
+ */
+void summary_resize(summary_t *sum, int64_t bits);
+
+/**
+ * Refresh the summary after bits [i, i + n) of the bitmap were flipped
+ * to the given value.
+ *
+ * @param sum The summary.
+ * @param i The first bit that changed.
+ * @param n The number of bits that changed.
+ * @param v The value the bits were set to (0 or 1).
+ */
+void summary_update(summary_t *sum, int64_t i, int64_t n, int v);
+
+/**
+ * Find a run of n free bits within one group, preferring a run that
+ * starts exactly at start, then the first free bit (n = 1) or aligned
+ * free chunk (n > 1) at or after start, wrapping around once.
+ *
+ * @param sum The summary.
+ * @param start Where the search starts (the next-fit cursor).
+ * @param n The length of the run, at most half a group.
+ *
+ * @return The index of the first bit of the run, -1 if there is none.
+ */
+int64_t summary_find(summary_t *sum, int64_t start, int n);
+
+/**
+ * Get the total number of free bits.
+ *
+ * @param sum The summary.
+ *
+ * @return The number of free bits in the bitmap.
+ */
+int64_t summary_free_count(summary_t *sum);
+
+#endif
@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 95;
 use IO::Handle;
 
 sub mount {
@@ -10,10 +10,29 @@ sub mount {
     sleep 1;
 }
 
+sub mount_with {
+    my ($opts) = @_;
+    system("(make nufs 2>&1) >> test.log");
+    system("mkdir -p mnt; (./nufs -f -o $opts mnt data.nufs 2>&1) >> test.log &");
+    sleep 1;
+}
+
+sub mount_ll {
+    system("(make mount_ll 2>&1) >> test.log &");
+    sleep 1;
+}
+
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# kills the server without letting it close the image, then clears the mount
+sub crash {
+    system("pkill -9 -x nufs");
+    sleep 1;
+    unmount();
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -171,5 +190,398 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Long names and large directories";
+
+my $long_name = "a-name-longer-than-the-thirty-one-characters-that-fit-before.txt";
+write_text($long_name, "long name");
+$files = `ls mnt`;
+ok($files =~ /\Q$long_name\E/, "File with a long name is listed");
+ok(read_text($long_name) eq "long name", "Read back the file with a long name");
+
+# 300 entries with 40-character names take several leaf blocks
+mkdir("mnt/many");
+for my $ii (1..300) {
+    write_text(sprintf("many/entry-with-a-fairly-long-name-%04d.txt", $ii), "entry $ii");
+}
+opendir(my $dh, "mnt/many");
+my @entries = grep { !/^\./ } readdir($dh);
+closedir($dh);
+say "# Entries listed: " . scalar(@entries);
+ok(@entries == 300, "Every entry of a multi-leaf directory is listed");
+my $all_back = 1;
+for my $ii (1..300) {
+    my $name = sprintf("many/entry-with-a-fairly-long-name-%04d.txt", $ii);
+    $all_back &&= read_text($name) eq "entry $ii";
+}
+ok($all_back, "Read back every entry of a multi-leaf directory");
+
+# 255 bytes is the longest name; anything longer is ENAMETOOLONG
+my $max_name = "n" x 255;
+my $over_name = "o" x 256;
+write_text($max_name, "longest name");
+ok((read_text($max_name) eq "longest name" and mkdir("mnt/" . ("d" x 255))),
+   "Create a file and a directory with 255-byte names");
+ok((!mkdir("mnt/$over_name") and $!{ENAMETOOLONG} and !mkdir("mnt/" . ("p" x 1000)) and $!{ENAMETOOLONG}),
+   "mkdir of a 256-byte or longer name fails with ENAMETOOLONG");
+ok((!open(my $over_fh, ">", "mnt/$over_name") and $!{ENAMETOOLONG}),
+   "Create of a 256-byte name fails with ENAMETOOLONG");
+my $over_renamed = !rename("mnt/$max_name", "mnt/$over_name") && $!{ENAMETOOLONG};
+ok(($over_renamed and read_text($max_name) eq "longest name"),
+   "Rename to a 256-byte name fails with ENAMETOOLONG and keeps the file");
+ok((!link("mnt/$max_name", "mnt/$over_name") and $!{ENAMETOOLONG}),
+   "Link to a 256-byte name fails with ENAMETOOLONG");
+write_text("after-long-names.txt", "still mounted");
+ok(read_text("after-long-names.txt") eq "still mounted", "The mount works after refused long names");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# Remount after journaled writes";
+
+mount_with("durability=every-op");
+mkdir("mnt/jdir");
+write_text("journaled.txt", "journaled data");
+rename("mnt/journaled.txt", "mnt/jdir/moved.txt");
+crash();
+
+mount();
+ok(-d "mnt/jdir", "Directory made before a crash is there after remount");
+ok(read_text("jdir/moved.txt") eq "journaled data", "Read back a file renamed before a crash");
+ok(!-e "mnt/journaled.txt", "Old name is gone after a crash");
+unmount();
+
+mount();
+ok(read_text("jdir/moved.txt") eq "journaled data", "Read back the file after a clean remount");
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Truncate and sparse files";
+
+write_text("cut.txt", "hello, truncate");
+truncate("mnt/cut.txt", 5);
+ok(-s "mnt/cut.txt" == 5, "Truncate shrinks the file");
+ok(read_text("cut.txt") eq "hello", "Read back the truncated file");
+truncate("mnt/cut.txt", 8192);
+ok(-s "mnt/cut.txt" == 8192, "Truncate grows the file");
+ok(read_text_slice("cut.txt", 16, 4096) eq "\0" x 16, "Grown bytes read as zeros");
+
+# a byte 1MB in leaves a hole before it that takes no blocks
+open my $sparse, ">", "mnt/sparse.bin";
+seek $sparse, 1 << 20, 0;
+print $sparse "x";
+close $sparse;
+ok(-s "mnt/sparse.bin" == (1 << 20) + 1, "Sparse file has the right size");
+ok(read_text_slice("sparse.bin", 4096, 4096) eq "\0" x 4096, "Hole reads as zeros");
+ok((stat "mnt/sparse.bin")[12] <= 8, "Hole takes no blocks");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Buffered appends";
+
+# many small appends, each its own write, are buffered before they are
+# given blocks; reads must see them all the same
+my $appended = "";
+open my $log, ">>", "mnt/append.log";
+$log->autoflush(1);
+for my $ii (1..2000) {
+    my $line = "line $ii\n";
+    print $log $line;
+    $appended .= $line;
+}
+ok(read_text_slice("append.log", length($appended), 0) eq $appended,
+   "Read back buffered appends while the file is open");
+close $log;
+ok(-s "mnt/append.log" == length($appended), "Appended file has the right size");
+
+unmount();
+mount();
+ok(read_text_slice("append.log", length($appended), 0) eq $appended,
+   "Read back buffered appends after remount");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# Buffer cache";
+
+# a 1MB cache holding 3MB of files has to evict and write back
+mount_with("backend=pread,cache_mb=1");
+my @patterns = ("abcdefgh", "01234567", "ABCDEFGH");
+for my $ii (0..2) {
+    write_text("cached$ii.bin", $patterns[$ii] x (1 << 17));
+}
+my $cached_back = 1;
+for my $ii (0..2) {
+    $cached_back &&= read_text("cached$ii.bin") eq $patterns[$ii] x (1 << 17);
+}
+ok($cached_back, "Read back files larger than the cache");
+unmount();
+
+mount();
+$cached_back = 1;
+for my $ii (0..2) {
+    $cached_back &&= read_text("cached$ii.bin") eq $patterns[$ii] x (1 << 17);
+}
+ok($cached_back, "Files written through the cache are in the image");
+unmount();
+
+mount_with("backend=pread,cache_mb=1");
+ok(read_text_slice("cached2.bin", 8, (8 << 17) - 8) eq "ABCDEFGH",
+   "Read the end of a file back through the cache");
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# Low-level API";
+
+mount_ll();
+write_text("ll.txt", "hello, inodes");
+ok(read_text("ll.txt") eq "hello, inodes", "Read back a file made through nufs_ll");
+ok(mkdir("mnt/lldir"), "Create a directory through nufs_ll");
+ok(rename("mnt/ll.txt", "mnt/lldir/moved.txt"), "Rename a file into a directory through nufs_ll");
+ok((read_text("lldir/moved.txt") eq "hello, inodes" and !-e "mnt/ll.txt"),
+   "Renamed file is only under its new name");
+opendir(my $ll_dh, "mnt/lldir");
+my @ll_entries = grep { !/^\./ } readdir($ll_dh);
+closedir($ll_dh);
+ok("@ll_entries" eq "moved.txt", "Readdir through nufs_ll lists the renamed file");
+
+# the longest name fits; one byte more is refused, keeping the old name
+my $ll_long = "l" x 255;
+ok(rename("mnt/lldir/moved.txt", "mnt/lldir/$ll_long"), "Rename to a 255-byte name through nufs_ll");
+my $ll_refused = !rename("mnt/lldir/$ll_long", "mnt/lldir/" . ("m" x 256)) && $!{ENAMETOOLONG};
+ok(($ll_refused and read_text("lldir/$ll_long") eq "hello, inodes"),
+   "Rename to a 256-byte name fails with ENAMETOOLONG and keeps the file");
+ok((unlink("mnt/lldir/$ll_long") and !-e "mnt/lldir/$ll_long"), "Unlink through nufs_ll");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Concurrent creates and renames";
+
+# children make and rename files in one directory at once, then race to
+# make the same directory; the exit status says how their mkdir went
+my @kids;
+for my $kid (1..8) {
+    my $pid = fork();
+    if ($pid == 0) {
+        for my $ii (1..50) {
+            write_text("c$kid-$ii", "kid $kid file $ii");
+            rename("mnt/c$kid-$ii", "mnt/r$kid-$ii") if $ii % 2 == 0;
+        }
+        exit(mkdir("mnt/race") ? 0 : $!{EEXIST} ? 1 : 2);
+    }
+    push @kids, $pid;
+}
+my @made = (0, 0, 0);
+for my $pid (@kids) {
+    waitpid($pid, 0);
+    $made[$? >> 8] += 1;
+}
+
+opendir(my $race_dh, "mnt");
+my @made_names = sort grep { /^[cr]\d/ } readdir($race_dh);
+closedir($race_dh);
+my @want_names;
+for my $kid (1..8) {
+    push @want_names, map { ($_ % 2 ? "c" : "r") . "$kid-$_" } 1..50;
+}
+@want_names = sort @want_names;
+ok("@made_names" eq "@want_names", "Every file made concurrently is listed under its final name");
+my $race_back = 1;
+for my $kid (1..8) {
+    for my $ii (1..50) {
+        $race_back &&= read_text(($ii % 2 ? "c" : "r") . "$kid-$ii") eq "kid $kid file $ii";
+    }
+}
+ok($race_back, "Read back every file made concurrently");
+ok(($made[0] == 1 and $made[1] == 7), "One of the racing mkdirs succeeds, the others get EEXIST");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Open handles and readdir cursors";
+
+# a handle keeps its file through a rename and an unlink
+write_text("held.txt", "held data");
+open my $held, "+<", "mnt/held.txt";
+rename("mnt/held.txt", "mnt/held-moved.txt");
+my $held_data = "";
+sysread($held, $held_data, 9);
+ok($held_data eq "held data", "Read through a handle after its file is renamed");
+sysseek($held, 0, 0);
+syswrite($held, "HELD");
+ok(read_text("held-moved.txt") eq "HELD data", "Write through a handle lands in the renamed file");
+unlink("mnt/held-moved.txt");
+sysseek($held, 0, 0);
+$held_data = "";
+sysread($held, $held_data, 9);
+ok(($held_data eq "HELD data" and !-e "mnt/held-moved.txt"),
+   "Read through a handle after its file is unlinked");
+close $held;
+
+# entries made while a listing is under way do not make it skip or repeat
+# the ones that were there before; the listing takes several getdents
+mkdir("mnt/cursor");
+my %before;
+for my $ii (1..2000) {
+    my $name = sprintf("before-with-a-name-long-enough-to-fill-%04d", $ii);
+    write_text("cursor/$name", "");
+    $before{$name} = 0;
+}
+opendir(my $cursor_dh, "mnt/cursor");
+my $seen = 0;
+while (defined(my $name = readdir($cursor_dh))) {
+    $before{$name} += 1 if exists $before{$name};
+    if (++$seen == 100) {
+        write_text(sprintf("cursor/after-%04d", $_), "") for 1..500;
+    }
+}
+closedir($cursor_dh);
+ok(!grep({ $_ != 1 } values %before), "Readdir lists every earlier entry once across inserts");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# fsync and durability modes";
+
+# what fsync returned for must survive the server being killed
+mount_with("durability=fsync-only");
+open my $synced, ">", "mnt/synced.txt";
+print $synced "synced data";
+$synced->flush;
+ok($synced->sync, "fsync succeeds with fsync-only durability");
+close $synced;
+mkdir("mnt/synced-dir");
+open my $synced_root, "<", "mnt";
+$synced_root->sync;
+close $synced_root;
+crash();
+
+mount();
+ok(read_text("synced.txt") eq "synced data", "Read back an fsynced file after a crash");
+ok(-d "mnt/synced-dir", "Directory is there after its parent was fsynced and the server crashed");
+unmount();
 
+# with no durability fsync has nothing to wait for, but still succeeds
+mount_with("durability=none");
+open my $unsynced, ">", "mnt/unsynced.txt";
+print $unsynced "unsynced data";
+$unsynced->flush;
+my $unsynced_ok = $unsynced->sync;
+close $unsynced;
+unmount();
+mount();
+ok(($unsynced_ok and read_text("unsynced.txt") eq "unsynced data"),
+   "fsync succeeds with no durability and the data is there after unmount");
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Statistics file";
+
+sub stat_line {
+    my ($kind, $name) = @_;
+    my ($line) = grep { /^$kind $name / } split /\n/, read_text(".nufs/stats");
+    return defined($line) ? (split / /, $line)[2] : -1;
+}
+
+write_text("counted.bin", "x" x (1 << 16));
+ok(stat_line("op", "write") > 0, "Stats file counts writes");
+ok(stat_line("counter", "block_allocs") > 0, "Stats file counts block allocations");
+ok(!open(my $stats_w, ">", "mnt/.nufs/stats"), "Stats file cannot be written");
+
+# NUFS_IOC_STATS_RESET, _IO('N', 1), starts a new interval
+my ($stats_fh, $plain_fh);
+my $reset = open($stats_fh, "<", "mnt/.nufs/stats") && ioctl($stats_fh, 0x4e01, 0);
+$stats_fh and close $stats_fh;
+ok(($reset and stat_line("op", "write") == 0), "Reset ioctl zeroes the counts");
+my $not_tty = open($plain_fh, "<", "mnt/counted.bin") && !ioctl($plain_fh, 0x4e01, 0) && $!{ENOTTY};
+$plain_fh and close $plain_fh;
+ok($not_tty, "ioctl on another file fails with ENOTTY");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Inline tiny files";
+
+# up to 216 bytes live in the inode; more moves the data out to a block
+write_text("tiny.txt", "tiny");
+ok((read_text("tiny.txt") eq "tiny" and (stat "mnt/tiny.txt")[12] == 0),
+   "Tiny file reads back and takes no blocks");
+
+my $grown = "g" x 100;
+write_text("grown.txt", $grown);
+open my $grow_fh, ">>", "mnt/grown.txt";
+print $grow_fh "h" x 300;
+close $grow_fh;
+$grown .= "\n" . "h" x 300;
+ok((read_text("grown.txt") eq $grown and (stat "mnt/grown.txt")[12] > 0),
+   "Tiny file appended past the inode reads back and takes a block");
+
+write_text("widened.txt", "widened");
+truncate("mnt/widened.txt", 8192);
+ok(read_text_slice("widened.txt", 8192, 0) eq "widened\n" . "\0" x 8184,
+   "Tiny file truncated past the inode keeps its data, then zeros");
+
+symlink("tiny.txt", "mnt/tiny-link");
+ok((readlink("mnt/tiny-link") eq "tiny.txt" and read_text("tiny-link") eq "tiny"),
+   "Short symlink reads back");
+
+unmount();
+mount();
+ok((read_text("tiny.txt") eq "tiny" and read_text("grown.txt") eq $grown
+    and read_text_slice("widened.txt", 8, 0) eq "widened\n"),
+   "Tiny and grown files read back after remount");
+unmount();
+
+system("rm -f data.nufs test.log");
+
+say "# Backends";
+
+# a 4MB file written and read through each backend, then read back
+# through the default one; the memory backend never stores the image
+for my $backend ("mmap", "pread", "direct", "memory") {
+    my $big = join(",", map { sprintf("%s-%07d", $backend, $_) } 1..(1 << 18));
+    my $end = length($big) - 100;
+    mount_with("backend=$backend");
+    write_text("$backend.bin", $big);
+    ok((read_text("$backend.bin") eq $big
+        and read_text_slice("$backend.bin", 16, $end) eq substr($big, $end, 16)),
+       "Large file reads back through the $backend backend");
+    unmount();
+
+    mount();
+    if ($backend eq "memory") {
+        ok(!-e "mnt/memory.bin", "The memory backend leaves the image as it was");
+    } else {
+        ok(read_text("$backend.bin") eq $big, "Large file written through the $backend backend is in the image");
+    }
+    unmount();
+}
@@ -0,0 +1,82 @@
+/**
+ * @file trace_decode.c
+ *
+ * Prints a trace file written with -o trace=<file> as text, one record
+ * per line:
+ *
+ *   <seconds since the trace began> [<thread>] <event> <names> <args> -> <result>
+ *
+ * Records are printed in the order the drain thread wrote them, which is
+ * in time order within each thread but not across threads; pipe through
+ * sort -n to interleave them.
+ *
+ * Usage: tools/trace_decode [trace]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+#define TRACE_EVENT_LABEL(id, level, label, a0, a1, a2) label,
+#define TRACE_EVENT_ARGS(id, level, label, a0, a1, a2) {a0, a1, a2},
+
+// the label of each event
+static const char *labels[] = {TRACE_EVENTS(TRACE_EVENT_LABEL)};
+
+// the names of the arguments of each event
+static const char *arg_names[][3] = {TRACE_EVENTS(TRACE_EVENT_ARGS)};
+
+// Prints one record.
+static void print_record(const trace_record_t *rec) {
+  if (rec->event >= TRACE_EVENT_COUNT) {
+    printf("%12.6f [%u] unknown event %u\n", rec->time / 1e9, rec->thread, rec->event);
+    return;
+  }
+
+  printf("%12.6f [%u] %s", rec->time / 1e9, rec->thread, labels[rec->event]);
+  if (rec->name[0] != '\0') {
+    printf(" %.*s", TRACE_NAME_LENGTH, rec->name);
+  }
+  if (rec->name2[0] != '\0') {
+    printf(" => %.*s", TRACE_NAME2_LENGTH, rec->name2);
+  }
+
+  for (int ii = 0; ii < 3; ii++) {
+    const char *arg = arg_names[rec->event][ii];
+    if (arg == NULL) {
+      continue;
+    }
+
+    // modes read best in octal, like ls
+    if (strcmp(arg, "mode") == 0 || strcmp(arg, "mask") == 0) {
+      printf(" %s=%04lo", arg, (long) rec->args[ii]);
+    } else {
+      printf(" %s=%ld", arg, (long) rec->args[ii]);
+    }
+  }
+
+  printf(" -> %ld\n", (long) rec->rv);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+      header.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "not a trace file, or one from another version\n");
+    return 1;
+  }
+
+  trace_record_t rec;
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    print_record(&rec);
+  }
+
+  return 0;
+}
@@ -0,0 +1,267 @@
+/**
+ * @file trace.c
+ *
+ * Implementation of the trace rings and the thread draining them.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_RING 4096     // records per thread, a power of two
+#define TRACE_DRAIN_MS 20   // milliseconds between drains
+
+// struct of one thread's ring. The owning thread only moves head and the
+// drain thread only moves tail, so neither needs a lock.
+typedef struct trace_ring {
+  trace_record_t records[TRACE_RING];
+  uint64_t head __attribute__((aligned(64))); // the next record the thread writes
+  uint64_t dropped;                           // records lost to a full ring
+  uint64_t tail __attribute__((aligned(64))); // the next record the drain thread reads
+  uint64_t reported;                          // dropped records already noted in the file
+  int thread;                                 // the number of the owning thread
+  int done;                                   // set once the owning thread has exited
+  struct trace_ring *next;                    // the next ring of the list
+} trace_ring_t;
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static struct timespec trace_start; // the monotonic time of trace_open
+
+static trace_ring_t *trace_rings = NULL; // every ring not yet freed
+static int trace_threads = 0;            // the rings ever made, for numbering
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread trace_ring_t *trace_self = NULL; // the calling thread's ring
+static pthread_key_t trace_key;                  // marks a ring done when its thread exits
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t trace_thread;
+static pthread_mutex_t trace_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_run_cond = PTHREAD_COND_INITIALIZER;
+static int trace_running = 0;
+
+// Marks the ring of an exiting thread, so the drain thread frees it.
+static void trace_thread_exit(void *arg) {
+  trace_ring_t *ring = (trace_ring_t *) arg;
+  __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+}
+
+// Creates the key whose destructor runs trace_thread_exit.
+static void trace_key_init() {
+  int rv = pthread_key_create(&trace_key, trace_thread_exit);
+  assert(rv == 0);
+}
+
+// Makes a ring for the calling thread and adds it to the list.
+static trace_ring_t *trace_ring_new() {
+  trace_ring_t *ring;
+  int rv = posix_memalign((void **) &ring, 64, sizeof(trace_ring_t));
+  assert(rv == 0);
+  memset(ring, 0, sizeof(trace_ring_t));
+
+  pthread_once(&trace_key_once, trace_key_init);
+  pthread_setspecific(trace_key, ring);
+
+  pthread_mutex_lock(&trace_rings_lock);
+  ring->thread = trace_threads++;
+  ring->next = trace_rings;
+  trace_rings = ring;
+  pthread_mutex_unlock(&trace_rings_lock);
+
+  trace_self = ring;
+  return ring;
+}
+
+// Copies the end of the string into a name field of n bytes.
+static void trace_name(char *field, const char *name, size_t n) {
+  if (name == NULL) {
+    field[0] = '\0';
+    return;
+  }
+
+  size_t len = strlen(name);
+  if (len >= n) {
+    name += len - (n - 1); // the end of a path tells more than its start
+    len = n - 1;
+  }
+  memcpy(field, name, len);
+  field[len] = '\0';
+}
+
+// Returns the nanoseconds since trace_open.
+static uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) (ts.tv_sec - trace_start.tv_sec) * 1000000000 + ts.tv_nsec - trace_start.tv_nsec;
+}
+
+// Records an event in the calling thread's ring.
+void trace_emit(trace_event_t event, const char *name, const char *name2, int64_t rv,
+                const int64_t *args) {
+  trace_ring_t *ring = trace_self != NULL ? trace_self : trace_ring_new();
+
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return; // full; the drain thread is behind
+  }
+
+  trace_record_t *rec = &ring->records[head & (TRACE_RING - 1)];
+  rec->time = trace_now();
+  rec->event = event;
+  rec->thread = ring->thread;
+  rec->rv = rv;
+  rec->args[0] = args[0];
+  rec->args[1] = args[1];
+  rec->args[2] = args[2];
+  trace_name(rec->name, name, TRACE_NAME_LENGTH);
+  trace_name(rec->name2, name2, TRACE_NAME2_LENGTH);
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes n bytes to the trace file.
+static void trace_write(const void *data, size_t n) {
+  while (n > 0) {
+    ssize_t rv = write(trace_fd, data, n);
+    if (rv == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return; // a full disk loses the rest of the trace, not the file system
+    }
+    data = (const char *) data + rv;
+    n -= rv;
+  }
+}
+
+// Writes out what the ring holds. Returns 1 if the ring is done and
+// empty, so it can be freed.
+static int trace_drain_ring(trace_ring_t *ring) {
+  int done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring->tail;
+
+  while (tail != head) {
+    uint64_t at = tail & (TRACE_RING - 1);
+    uint64_t n = head - tail < TRACE_RING - at ? head - tail : TRACE_RING - at;
+    trace_write(&ring->records[at], n * sizeof(trace_record_t));
+    tail += n;
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+  // note the records the ring had to drop
+  uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  if (dropped != ring->reported) {
+    trace_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = trace_now();
+    rec.event = TRACE_DROPPED;
+    rec.thread = ring->thread;
+    rec.args[0] = dropped - ring->reported;
+    trace_write(&rec, sizeof(rec));
+    ring->reported = dropped;
+  }
+
+  return done;
+}
+
+// Drains every ring, freeing the ones whose threads have exited.
+static void trace_drain() {
+  pthread_mutex_lock(&trace_rings_lock);
+  trace_ring_t **link = &trace_rings;
+  while (*link != NULL) {
+    trace_ring_t *ring = *link;
+    if (trace_drain_ring(ring)) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+  pthread_mutex_unlock(&trace_rings_lock);
+}
+
+// Drains the rings every TRACE_DRAIN_MS milliseconds until stopped.
+static void *trace_loop(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&trace_run_lock);
+  while (trace_running) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&trace_run_cond, &trace_run_lock, &until);
+    pthread_mutex_unlock(&trace_run_lock);
+    trace_drain();
+    pthread_mutex_lock(&trace_run_lock);
+  }
+  pthread_mutex_unlock(&trace_run_lock);
+
+  return NULL;
+}
+
+// Opens the trace file and starts recording.
+int trace_open(const char *path) {
+  trace_fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd == -1) {
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  clock_gettime(CLOCK_MONOTONIC, &trace_start);
+
+  trace_header_t header = {TRACE_MAGIC, sizeof(trace_record_t),
+                           (int64_t) now.tv_sec * 1000000000 + now.tv_nsec};
+  trace_write(&header, sizeof(header));
+
+  __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Starts draining the rings in the background.
+void trace_run() {
+  if (trace_fd == -1 || trace_running) {
+    return;
+  }
+
+  trace_running = 1;
+  int rv = pthread_create(&trace_thread, NULL, trace_loop, NULL);
+  assert(rv == 0);
+}
+
+// Stops recording and writes out what is left.
+void trace_close() {
+  if (trace_fd == -1) {
+    return;
+  }
+
+  if (trace_running) {
+    pthread_mutex_lock(&trace_run_lock);
+    trace_running = 0;
+    pthread_cond_signal(&trace_run_cond);
+    pthread_mutex_unlock(&trace_run_lock);
+    pthread_join(trace_thread, NULL);
+  }
+
+  __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+  trace_drain();
+  close(trace_fd);
+  trace_fd = -1;
+}
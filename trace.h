@@ -0,0 +1,154 @@
+/**
+ * @file trace.h
+ *
+ * Binary tracing of file system operations and allocations.
+ *
+ * Each thread writes fixed-size records into its own ring buffer with
+ * no locks; a background thread drains the rings into the trace file,
+ * which tools/trace_decode turns back into text. A ring that fills up
+ * drops records and the drain thread notes how many were lost.
+ *
+ * Events are compiled in up to TRACE_LEVEL (build with -DTRACE_LEVEL=n)
+ * and recorded only once trace_open has been called, so a disabled trace
+ * point costs a single, well predicted branch.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_LEVEL_OPS 1   // FUSE callbacks
+#define TRACE_LEVEL_ALLOC 2 // block and inode allocation
+#define TRACE_LEVEL_DEBUG 3 // image growth, flushes and the journal
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+// Every event: its name, its level, its label and the names of its
+// (up to three) arguments, or NULL for the ones it does not use.
+#define TRACE_EVENTS(X)                                                       \
+  X(DROPPED, 0, "dropped", "records", NULL, NULL)                             \
+  X(INIT, TRACE_LEVEL_OPS, "init", "commit_interval", "durability", NULL)     \
+  X(DESTROY, TRACE_LEVEL_OPS, "destroy", NULL, NULL, NULL)                    \
+  X(ACCESS, TRACE_LEVEL_OPS, "access", "mask", NULL, NULL)                    \
+  X(LOOKUP, TRACE_LEVEL_OPS, "lookup", "parent", NULL, NULL)                  \
+  X(FORGET, TRACE_LEVEL_OPS, "forget", "ino", "nlookup", NULL)                \
+  X(FORGET_MULTI, TRACE_LEVEL_OPS, "forget_multi", "count", NULL, NULL)       \
+  X(GETATTR, TRACE_LEVEL_OPS, "getattr", "ino", "mode", "size")               \
+  X(SETATTR, TRACE_LEVEL_OPS, "setattr", "ino", "to_set", "mode")             \
+  X(READDIR, TRACE_LEVEL_OPS, "readdir", "ino", "offset", NULL)               \
+  X(MKNOD, TRACE_LEVEL_OPS, "mknod", "parent", "mode", NULL)                  \
+  X(MKDIR, TRACE_LEVEL_OPS, "mkdir", "parent", "mode", NULL)                  \
+  X(CREATE, TRACE_LEVEL_OPS, "create", "parent", "mode", NULL)                \
+  X(UNLINK, TRACE_LEVEL_OPS, "unlink", "parent", NULL, NULL)                  \
+  X(RMDIR, TRACE_LEVEL_OPS, "rmdir", "parent", NULL, NULL)                    \
+  X(LINK, TRACE_LEVEL_OPS, "link", "ino", "newparent", NULL)                  \
+  X(SYMLINK, TRACE_LEVEL_OPS, "symlink", "parent", NULL, NULL)                \
+  X(READLINK, TRACE_LEVEL_OPS, "readlink", "ino", NULL, NULL)                 \
+  X(RENAME, TRACE_LEVEL_OPS, "rename", "parent", "newparent", NULL)           \
+  X(CHMOD, TRACE_LEVEL_OPS, "chmod", "mode", NULL, NULL)                      \
+  X(TRUNCATE, TRACE_LEVEL_OPS, "truncate", "size", NULL, NULL)                \
+  X(OPEN, TRACE_LEVEL_OPS, "open", "ino", NULL, NULL)                         \
+  X(FLUSH, TRACE_LEVEL_OPS, "flush", "ino", NULL, NULL)                       \
+  X(RELEASE, TRACE_LEVEL_OPS, "release", "ino", NULL, NULL)                   \
+  X(READ, TRACE_LEVEL_OPS, "read", "ino", "size", "offset")                   \
+  X(WRITE, TRACE_LEVEL_OPS, "write", "ino", "size", "offset")                 \
+  X(FSYNC, TRACE_LEVEL_OPS, "fsync", "ino", "datasync", NULL)                 \
+  X(FSYNCDIR, TRACE_LEVEL_OPS, "fsyncdir", "ino", "datasync", NULL)           \
+  X(UTIMENS, TRACE_LEVEL_OPS, "utimens", "atime", "mtime", NULL)              \
+  X(IOCTL, TRACE_LEVEL_OPS, "ioctl", "cmd", NULL, NULL)                       \
+  X(ALLOC_BLOCKS, TRACE_LEVEL_ALLOC, "alloc_blocks", "count", NULL, NULL)     \
+  X(FREE_BLOCKS, TRACE_LEVEL_ALLOC, "free_blocks", "bnum", "count", NULL)     \
+  X(ALLOC_INODE, TRACE_LEVEL_ALLOC, "alloc_inode", NULL, NULL, NULL)          \
+  X(FREE_INODE, TRACE_LEVEL_ALLOC, "free_inode", "inum", NULL, NULL)          \
+  X(BLOCKS_GROW, TRACE_LEVEL_DEBUG, "blocks_grow", "count", "bytes", NULL)    \
+  X(BLOCKS_FLUSH, TRACE_LEVEL_DEBUG, "blocks_flush", "owner", "runs", NULL)   \
+  X(JOURNAL_CREATE, TRACE_LEVEL_DEBUG, "journal_create", "start", NULL, NULL) \
+  X(JOURNAL_OPEN, TRACE_LEVEL_DEBUG, "journal_open", "replayed", NULL, NULL)  \
+  X(JOURNAL_COMMIT, TRACE_LEVEL_DEBUG, "journal_commit", "seq", "blocks", "logged") \
+  X(WBUF_FLUSH, TRACE_LEVEL_DEBUG, "wbuf_flush", "ino", "offset", "len")
+
+#define TRACE_EVENT_ID(id, level, label, a0, a1, a2) TRACE_##id,
+#define TRACE_EVENT_LEVEL(id, level, label, a0, a1, a2) TRACE_##id##_LEVEL = level,
+
+// the events, numbered in the order of TRACE_EVENTS
+typedef enum trace_event { TRACE_EVENTS(TRACE_EVENT_ID) TRACE_EVENT_COUNT } trace_event_t;
+
+// the level of each event, for TRACE
+enum { TRACE_EVENTS(TRACE_EVENT_LEVEL) };
+
+#define TRACE_NAME_LENGTH 48  // bytes kept of the first name, with its NUL
+#define TRACE_NAME2_LENGTH 32 // bytes kept of the second name, with its NUL
+
+// struct of one trace record, as it is written to the trace file
+typedef struct trace_record {
+  uint64_t time;                  // nanoseconds since trace_open
+  uint16_t event;                 // a trace_event_t
+  uint16_t thread;                // the thread that recorded it, numbered from 0
+  uint32_t pad;                   // unused
+  int64_t rv;                     // the result
+  int64_t args[3];                // the arguments, named in TRACE_EVENTS
+  char name[TRACE_NAME_LENGTH];   // the end of the path or name, if any
+  char name2[TRACE_NAME2_LENGTH]; // the end of the second path or name, if any
+} trace_record_t;
+
+// struct at the start of a trace file
+typedef struct trace_header {
+  uint32_t magic;       // TRACE_MAGIC
+  uint32_t record_size; // sizeof(trace_record_t)
+  int64_t start;        // the wall clock time of trace_open, in nanoseconds
+} trace_header_t;
+
+#define TRACE_MAGIC 0x4e545243 // "NTRC"
+
+// nonzero while a trace file is open
+extern int trace_enabled;
+
+/**
+ * Record an event, if its level is compiled in and tracing is on. Takes
+ * the event name without its TRACE_ prefix, the first and second name
+ * (or NULL), the result and one to three integer arguments.
+ */
+#define TRACE(id, name, name2, rv, ...)                                     \
+  do {                                                                      \
+    if (TRACE_##id##_LEVEL <= TRACE_LEVEL &&                                \
+        __builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) { \
+      int64_t trace_args_[3] = {__VA_ARGS__};                               \
+      trace_emit(TRACE_##id, name, name2, rv, trace_args_);                 \
+    }                                                                       \
+  } while (0)
+
+/**
+ * Open the trace file and start recording. Records pile up in the rings
+ * until trace_run starts draining them.
+ *
+ * @param path The path of the trace file, which is truncated.
+ *
+ * @return 0 on success, -1 if the file could not be opened.
+ */
+int trace_open(const char *path);
+
+/**
+ * Start the thread draining the rings into the trace file.
+ */
+void trace_run();
+
+/**
+ * Stop recording, drain what is left and close the trace file.
+ */
+void trace_close();
+
+/**
+ * Record an event in the calling thread's ring. Use TRACE instead.
+ *
+ * @param event The event.
+ * @param name The first name, or NULL.
+ * @param name2 The second name, or NULL.
+ * @param rv The result.
+ * @param args The three arguments.
+ */
+void trace_emit(trace_event_t event, const char *name, const char *name2, int64_t rv,
+                const int64_t *args);
+
+#endif
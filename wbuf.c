@@ -0,0 +1,100 @@
+/**
+ * @file wbuf.c
+ *
+ * Implementation of the write buffer pool.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "wbuf.h"
+
+static wbuf_t wbufs[WBUF_COUNT] = {
+  [0 ... WBUF_COUNT - 1] = {.inum = -1}
+};
+
+static int wbuf_taken;      // the number of buffers in use, so lookups can skip the pool
+static uint64_t wbuf_clock; // ticks on every write to a buffer
+
+// Frees every buffer of the pool.
+void wbuf_clear() {
+  for (int ii = 0; ii < WBUF_COUNT; ii++) {
+    __atomic_store_n(&wbufs[ii].inum, -1, __ATOMIC_RELAXED);
+    wbufs[ii].len = 0;
+  }
+  __atomic_store_n(&wbuf_taken, 0, __ATOMIC_RELAXED);
+}
+
+// Scans the pool for the inode's buffer. A buffer only becomes or stops
+// being the inode's under its write lock, which the caller excludes.
+wbuf_t *wbuf_find(int inum) {
+  if (__atomic_load_n(&wbuf_taken, __ATOMIC_ACQUIRE) == 0) {
+    return NULL;
+  }
+
+  for (int ii = 0; ii < WBUF_COUNT; ii++) {
+    if (__atomic_load_n(&wbufs[ii].inum, __ATOMIC_ACQUIRE) == inum) {
+      return &wbufs[ii];
+    }
+  }
+
+  return NULL;
+}
+
+// Claims the first free buffer of the pool for the inode.
+wbuf_t *wbuf_get(int inum, int64_t offset) {
+  for (int ii = 0; ii < WBUF_COUNT; ii++) {
+    wbuf_t *buf = &wbufs[ii];
+    int free = -1;
+
+    if (__atomic_load_n(&buf->inum, __ATOMIC_RELAXED) == -1 &&
+        __atomic_compare_exchange_n(&buf->inum, &free, inum, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      // the memory of a buffer is kept once allocated
+      if (buf->data == NULL && (buf->data = malloc(WBUF_SIZE)) == NULL) {
+        __atomic_store_n(&buf->inum, -1, __ATOMIC_RELEASE);
+        return NULL;
+      }
+
+      buf->offset = offset;
+      buf->len = 0;
+      buf->error = 0;
+      wbuf_touch(buf);
+      __atomic_fetch_add(&wbuf_taken, 1, __ATOMIC_RELEASE);
+      return buf;
+    }
+  }
+
+  return NULL;
+}
+
+// Stamps the buffer with the next tick of the clock.
+void wbuf_touch(wbuf_t *buf) {
+  uint64_t now = __atomic_add_fetch(&wbuf_clock, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&buf->used, now, __ATOMIC_RELAXED);
+}
+
+// Returns the buffer to the pool.
+void wbuf_put(wbuf_t *buf) {
+  assert(__atomic_load_n(&buf->inum, __ATOMIC_RELAXED) != -1);
+  buf->len = 0;
+  __atomic_fetch_sub(&wbuf_taken, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&buf->inum, -1, __ATOMIC_RELEASE);
+}
+
+// Picks the buffer with the oldest stamp. The pool changes underneath, so
+// this is only a hint; the caller locks the inode and looks again.
+int wbuf_oldest(int skip) {
+  int oldest = -1;
+  uint64_t oldest_used = UINT64_MAX;
+
+  for (int ii = 0; ii < WBUF_COUNT; ii++) {
+    int inum = __atomic_load_n(&wbufs[ii].inum, __ATOMIC_RELAXED);
+    uint64_t used = __atomic_load_n(&wbufs[ii].used, __ATOMIC_RELAXED);
+
+    if (inum != -1 && inum != skip && used < oldest_used) {
+      oldest = inum;
+      oldest_used = used;
+    }
+  }
+
+  return oldest;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file wbuf.h
+ *
+ * Write buffers gathering appends to a file in memory, so that blocks are
+ * allocated for a whole run of small sequential writes at once when the
+ * buffer is flushed, rather than a block at a time as each write arrives.
+ *
+ * A buffer holds the bytes appended past the inode's size on disk, which
+ * only grows when the buffer is flushed. There is a fixed pool of
+ * WBUF_COUNT buffers, each taken by at most one inode. A buffer is read
+ * and changed with its inode's lock held (see inode.h), for reading or
+ * writing like the inode itself; the pool takes no lock of its own.
+ *
+ * A buffer whose flush fails keeps its data, and the error until the
+ * file's next fsync or close reports it.
+ */
+#ifndef WBUF_H
+#define WBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WBUF_COUNT 32        // the number of buffers in the pool
+#define WBUF_SIZE (1 << 20)  // the bytes each buffer holds
+
+// struct representing the buffered appends to one file
+typedef struct wbuf {
+  int inum;          // the inode buffered, -1 while the buffer is free
+  int64_t offset;    // the file offset of the first buffered byte, the inode's size
+  size_t len;        // the number of bytes buffered
+  uint64_t used;     // when the buffer was last written to, for picking a victim
+  int error;         // the error of a flush the file was not told about, 0 if none
+  char *data;        // WBUF_SIZE bytes of data
+} wbuf_t;
+
+/**
+ * Frees every buffer, dropping what they hold. Must be called each time
+ * an image is mounted.
+ */
+void wbuf_clear();
+
+/**
+ * Finds the buffer of an inode. The caller holds the inode's lock.
+ *
+ * @param inum The inum of the file.
+ *
+ * @return The buffer, NULL if the file has none.
+ */
+wbuf_t *wbuf_find(int inum);
+
+/**
+ * Takes a free buffer for an inode, empty and starting at the given
+ * offset. The caller holds the inode's lock for writing and has checked
+ * that the inode has no buffer yet.
+ *
+ * @param inum The inum of the file.
+ * @param offset The file offset the buffer starts at.
+ *
+ * @return The buffer, NULL if every buffer is in use.
+ */
+wbuf_t *wbuf_get(int inum, int64_t offset);
+
+/**
+ * Marks a buffer as just written to.
+ *
+ * @param buf The buffer.
+ */
+void wbuf_touch(wbuf_t *buf);
+
+/**
+ * Frees a buffer, dropping what it holds. The caller holds the lock of
+ * the buffer's inode for writing.
+ *
+ * @param buf The buffer to free.
+ */
+void wbuf_put(wbuf_t *buf);
+
+/**
+ * Finds the inode whose buffer was least recently written to, as the
+ * one to flush when the pool runs out.
+ *
+ * @param skip An inum to pass over, or -1.
+ *
+ * @return The inum, -1 if no other inode has a buffer.
+ */
+int wbuf_oldest(int skip);
+
+#endif